@@ -42,12 +42,15 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdint.h>
+#include <stdio.h>
 
 struct pidfh;
 
 void	trimdomain(char *, int);
 int	flopen(const char *_path, int _flags, ...);
 void	hexdump(const void *_ptr, int _length, const char *_hdr, int _flags);
+void	fhexdump(FILE *_fp, const void *_ptr, int _length, const char *_hdr,
+	    int _flags);
 int	humanize_unsigned(char *buf, size_t len, uint64_t bytes,
 					const char *suffix, int divisor);
 int	format_bytes(char *buf, size_t len, uint64_t bytes);
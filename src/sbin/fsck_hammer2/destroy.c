@@ -34,7 +34,7 @@
  * SUCH DAMAGE.
  */
 
-// # gcc -Wall -g -I../../sys -I../hammer2 ../../sys/libkern/icrc32.c ../hammer2/subs.c ../hammer2/ondisk.c ./destroy.c -o destroy
+// # gcc -Wall -g -I../../sys -I../hammer2 ../../sys/libkern/icrc32.c ../hammer2/subs.c ../hammer2/ondisk.c ../hammer2/media.c ./destroy.c -o destroy
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -111,48 +111,16 @@ static int
 read_media(const hammer2_blockref_t *bref, hammer2_media_data_t *media,
     size_t *media_bytes)
 {
-	hammer2_off_t io_off, io_base;
-	size_t bytes, io_bytes, boff;
-	ssize_t ret;
-	int fd;
-
-	bytes = (bref->data_off & HAMMER2_OFF_MASK_RADIX);
-	if (bytes)
-		bytes = (size_t)1 << bytes;
-	if (media_bytes)
-		*media_bytes = bytes;
-
-	if (!bytes)
-		return 0;
-
-	io_off = bref->data_off & ~HAMMER2_OFF_MASK_RADIX;
-	io_base = io_off & ~(hammer2_off_t)(HAMMER2_LBUFSIZE - 1);
-	boff = io_off - io_base;
-
-	io_bytes = HAMMER2_LBUFSIZE;
-	while (io_bytes + boff < bytes)
-		io_bytes <<= 1;
-
-	if (io_bytes > sizeof(*media)) {
+	switch (hammer2_media_read(bref, media, media_bytes)) {
+	case -1:
 		fprintf(stderr, "Bad I/O bytes\n");
 		return -1;
-	}
-	fd = hammer2_get_volume_fd(io_off);
-	if (lseek(fd, io_base - hammer2_get_volume_offset(io_base), SEEK_SET)
-	    == -1) {
-		perror("lseek");
-		return -1;
-	}
-	ret = read(fd, media, io_bytes);
-	if (ret == -1) {
-		perror("read");
-		return -1;
-	} else if (ret != (ssize_t)io_bytes) {
+	case -2:
 		fprintf(stderr, "Failed to read media\n");
 		return -1;
+	default:
+		break;
 	}
-	if (boff)
-		memmove(media, (char *)media + boff, bytes);
 
 	return 0;
 }
@@ -39,6 +39,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 #include <errno.h>
 
 #include "fsck_hammer2.h"
@@ -54,6 +55,10 @@ int PrintPFS;
 int NumPFSNames;
 char **PFSNames;
 long BlockrefCacheCount = -1;
+int NThreadsOpt = 1;
+const char *CacheFile;
+uint64_t MinMirrorTid;
+int MmapOpt;
 
 static void
 init_pfs_names(const char *names)
@@ -101,7 +106,8 @@ static void
 usage(void)
 {
 	fprintf(stderr, "fsck_hammer2 [-f] [-v] [-q] [-e] [-b] [-p] [-P] "
-	    "[-l pfs_names] [-c cache_count] special\n");
+	    "[-l pfs_names] [-c cache_count] [-C cache_file] [-j nthreads] "
+	    "[-m mirror_tid] [-M] special\n");
 	exit(1);
 }
 
@@ -110,7 +116,7 @@ main(int ac, char **av)
 {
 	int i, ch;
 
-	while ((ch = getopt(ac, av, "dfvqebpPl:c:")) != -1) {
+	while ((ch = getopt(ac, av, "dfvqebpPl:c:C:j:m:M")) != -1) {
 		switch(ch) {
 		case 'd':
 			DebugOpt++;
@@ -155,6 +161,27 @@ main(int ac, char **av)
 				exit(1);
 			}
 			break;
+		case 'C':
+			CacheFile = optarg;
+			break;
+		case 'j':
+			NThreadsOpt = strtol(optarg, NULL, 10);
+			if (NThreadsOpt < 1) {
+				usage();
+				/* not reached */
+			}
+			break;
+		case 'm':
+			errno = 0;
+			MinMirrorTid = strtoull(optarg, NULL, 16);
+			if (errno) {
+				perror("strtoull");
+				exit(1);
+			}
+			break;
+		case 'M':
+			MmapOpt = 1;
+			break;
 		default:
 			usage();
 			/* not reached */
@@ -168,6 +195,13 @@ main(int ac, char **av)
 		usage();
 		/* not reached */
 	}
+	/* cached deltas only cover blockrefs after MinMirrorTid */
+	if (CacheFile && MinMirrorTid) {
+		fprintf(stderr, "-C can't be used with -m\n");
+		exit(1);
+	}
+	if (CacheFile && BlockrefCacheCount < 0)
+		BlockrefCacheCount = VCACHE_DEFAULT_COUNT;
 
 	for (i = 0; i < ac; i++) {
 		if (ac != 1)
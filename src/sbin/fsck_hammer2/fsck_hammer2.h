@@ -48,6 +48,12 @@ extern int PrintPFS;
 extern int NumPFSNames;
 extern char **PFSNames;
 extern long BlockrefCacheCount;
+extern int NThreadsOpt;
+extern const char *CacheFile;
+extern uint64_t MinMirrorTid;
+extern int MmapOpt;
+
+#define VCACHE_DEFAULT_COUNT	1000	/* default cache_count with -C */
 
 int test_hammer2(const char *);
 
@@ -34,12 +34,16 @@
  * SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE // asprintf
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/tree.h>
 #include <sys/queue.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/mman.h>
+#include <machine/atomic.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -48,11 +52,10 @@
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 
-#ifdef HAMMER2_USE_OPENSSL
-#include <openssl/sha.h>
-#endif
-
+#include <crypto/sha2/sha2.h>
 #include <vfs/hammer2/hammer2_disk.h>
 #include <vfs/hammer2/hammer2_xxhash.h>
 
@@ -127,6 +130,19 @@ typedef struct {
 	long count;
 } delta_stats_t;
 
+/*
+ * Message of a delta cache entry.
+ */
+typedef struct {
+	delta_stats_t ds;
+	hammer2_off_t parent; /* data_off of the parent blockref */
+	int flags;
+} delta_entry_t;
+
+#define DELTA_LIVE	0x0001	/* added or hit in this run */
+#define DELTA_DEAD	0x0002
+#define DELTA_BUSY	0x0004
+
 static void print_blockref_entry(struct blockref_tree *);
 static void init_blockref_stats(blockref_stats_t *, uint8_t);
 static void cleanup_blockref_stats(blockref_stats_t *);
@@ -134,11 +150,8 @@ static void init_delta_root(struct blockref_tree *);
 static void cleanup_delta_root(struct blockref_tree *);
 static void print_blockref_stats(const blockref_stats_t *, bool);
 static int verify_volume_header(const hammer2_volume_data_t *);
-static int read_media(const hammer2_blockref_t *, hammer2_media_data_t *,
-    size_t *);
-static int verify_blockref(const hammer2_volume_data_t *,
-    const hammer2_blockref_t *, bool, blockref_stats_t *,
-    struct blockref_tree *, delta_stats_t *, int, int);
+static int verify_root_blockref(const hammer2_volume_data_t *,
+    const hammer2_blockref_t *, blockref_stats_t *, struct blockref_tree *);
 static void print_pfs(const hammer2_inode_data_t *);
 static char *get_inode_filename(const hammer2_inode_data_t *);
 static int init_pfs_blockref(const hammer2_volume_data_t *,
@@ -148,6 +161,7 @@ static void print_media(FILE *, int, const hammer2_blockref_t *,
     const hammer2_media_data_t *, size_t);
 
 static int best_zone = -1;
+static struct blockref_tree vcache_root; /* entries loaded from CacheFile */
 
 #define TAB 8
 
@@ -206,6 +220,28 @@ init_root_blockref(int i, uint8_t type, hammer2_blockref_t *bref)
 	    off - hammer2_get_root_volume_offset(), SEEK_SET);
 }
 
+/*
+ * Return true if bref was made up by init_root_blockref(), it has no
+ * mirror_tid or check code and is the same in every run.
+ */
+static bool
+is_root_blockref(const hammer2_blockref_t *bref)
+{
+	return bref->type == HAMMER2_BREF_TYPE_VOLUME ||
+	    bref->type == HAMMER2_BREF_TYPE_FREEMAP;
+}
+
+/*
+ * Return true if bref's subtree wasn't modified since MinMirrorTid (-m),
+ * in which case it isn't read at all.
+ */
+static bool
+skip_blockref(const hammer2_blockref_t *bref)
+{
+	return MinMirrorTid && !is_root_blockref(bref) &&
+	    bref->mirror_tid < MinMirrorTid;
+}
+
 static int
 find_best_zone(void)
 {
@@ -309,11 +345,9 @@ test_blockref(uint8_t type)
 		if (ret == HAMMER2_PBUFSIZE) {
 			blockref_stats_t bstats;
 			init_blockref_stats(&bstats, type);
-			delta_stats_t ds;
-			memset(&ds, 0, sizeof(ds));
 			tprintf_zone(0, i, &broot);
-			if (verify_blockref(&voldata, &broot, false, &bstats,
-			    &droot, &ds, 0, 0) == -1)
+			if (verify_root_blockref(&voldata, &broot, &bstats,
+			    &droot) == -1)
 				failed = true;
 			print_blockref_stats(&bstats, true);
 			print_blockref_entry(&bstats.root);
@@ -400,10 +434,8 @@ test_pfs_blockref(void)
 				tfprintf(stdout, 1, "%s\n", f);
 				free(f);
 				init_blockref_stats(&bstats, type);
-				delta_stats_t ds;
-				memset(&ds, 0, sizeof(ds));
-				if (verify_blockref(&voldata, &p->bref, false,
-				    &bstats, &droot, &ds, 0, 0) == -1)
+				if (verify_root_blockref(&voldata, &p->bref,
+				    &bstats, &droot) == -1)
 					failed = true;
 				print_blockref_stats(&bstats, true);
 				print_blockref_entry(&bstats.root);
@@ -512,6 +544,25 @@ add_blockref_entry(struct blockref_tree *root, const hammer2_blockref_t *bref,
 	RB_INSERT(blockref_tree, root, e);
 }
 
+/*
+ * Move all entries of src into dst.
+ */
+static void
+merge_blockref_entry(struct blockref_tree *dst, struct blockref_tree *src)
+{
+	struct blockref_entry *e, *e2;
+
+	while ((e = RB_ROOT(src)) != NULL) {
+		RB_REMOVE(blockref_tree, src, e);
+		e2 = RB_INSERT(blockref_tree, dst, e);
+		if (e2) {
+			TAILQ_CONCAT(&e2->head, &e->head, entry);
+			free(e);
+		}
+	}
+	assert(RB_EMPTY(src));
+}
+
 static void
 __print_blockref(FILE *fp, int tab, const hammer2_blockref_t *bref,
     const char *msg)
@@ -560,7 +611,7 @@ print_blockref_msg(const struct blockref_list *head)
 		if (VerboseOpt > 0) {
 			hammer2_media_data_t media;
 			size_t bytes;
-			if (!read_media(bref, &media, &bytes))
+			if (!hammer2_media_read(bref, &media, &bytes))
 				print_media(stderr, 2, bref, &media, bytes);
 			else
 				tfprintf(stderr, 2, "Failed to read media\n");
@@ -595,11 +646,15 @@ static void
 init_delta_root(struct blockref_tree *droot)
 {
 	RB_INIT(droot);
+	if (CacheFile)
+		merge_blockref_entry(droot, &vcache_root);
 }
 
 static void
 cleanup_delta_root(struct blockref_tree *droot)
 {
+	if (CacheFile)
+		merge_blockref_entry(&vcache_root, droot);
 	cleanup_blockref_entry(droot);
 }
 
@@ -695,45 +750,6 @@ verify_volume_header(const hammer2_volume_data_t *voldata)
 	return 0;
 }
 
-static int
-read_media(const hammer2_blockref_t *bref, hammer2_media_data_t *media,
-    size_t *media_bytes)
-{
-	hammer2_off_t io_off, io_base;
-	size_t bytes, io_bytes, boff;
-	int fd;
-
-	bytes = (bref->data_off & HAMMER2_OFF_MASK_RADIX);
-	if (bytes)
-		bytes = (size_t)1 << bytes;
-	if (media_bytes)
-		*media_bytes = bytes;
-
-	if (!bytes)
-		return 0;
-
-	io_off = bref->data_off & ~HAMMER2_OFF_MASK_RADIX;
-	io_base = io_off & ~(hammer2_off_t)(HAMMER2_LBUFSIZE - 1);
-	boff = io_off - io_base;
-
-	io_bytes = HAMMER2_LBUFSIZE;
-	while (io_bytes + boff < bytes)
-		io_bytes <<= 1;
-
-	if (io_bytes > sizeof(*media))
-		return -1;
-	fd = hammer2_get_volume_fd(io_off);
-	if (lseek(fd, io_base - hammer2_get_volume_offset(io_base), SEEK_SET)
-	    == -1)
-		return -2;
-	if (read(fd, media, io_bytes) != (ssize_t)io_bytes)
-		return -2;
-	if (boff)
-		memmove(media, (char *)media + boff, bytes);
-
-	return 0;
-}
-
 static void
 load_delta_stats(blockref_stats_t *bstats, const delta_stats_t *dstats)
 {
@@ -778,50 +794,103 @@ accumulate_delta_stats(delta_stats_t *dst, const delta_stats_t *src)
 	dst->count += src->count;
 }
 
+static void
+merge_blockref_stats(blockref_stats_t *dst, const blockref_stats_t *src)
+{
+	assert(dst->type == src->type);
+	dst->total_blockref += src->total_blockref;
+	dst->total_empty += src->total_empty;
+	dst->total_bytes += src->total_bytes;
+
+	switch (dst->type) {
+	case HAMMER2_BREF_TYPE_VOLUME:
+		dst->volume.total_inode += src->volume.total_inode;
+		dst->volume.total_indirect += src->volume.total_indirect;
+		dst->volume.total_data += src->volume.total_data;
+		dst->volume.total_dirent += src->volume.total_dirent;
+		break;
+	case HAMMER2_BREF_TYPE_FREEMAP:
+		dst->freemap.total_freemap_node +=
+		    src->freemap.total_freemap_node;
+		dst->freemap.total_freemap_leaf +=
+		    src->freemap.total_freemap_leaf;
+		break;
+	default:
+		assert(0);
+		break;
+	}
+}
+
+static delta_entry_t *
+lookup_delta_entry(struct blockref_tree *droot, const hammer2_blockref_t *bref)
+{
+	struct blockref_entry *e, bref_find;
+	struct blockref_msg *m;
+
+	if (!bref->data_off)
+		return NULL;
+
+	memset(&bref_find, 0, sizeof(bref_find));
+	bref_find.data_off = bref->data_off;
+	e = RB_FIND(blockref_tree, droot, &bref_find);
+	if (!e)
+		return NULL;
+
+	TAILQ_FOREACH(m, &e->head, entry) {
+		if (!memcmp(&m->bref, bref, sizeof(*bref)))
+			return m->msg;
+	}
+
+	return NULL;
+}
+
+static void
+add_delta_entry(struct blockref_tree *droot, const hammer2_blockref_t *bref,
+    hammer2_off_t parent, const delta_stats_t *dstats)
+{
+	delta_entry_t de;
+
+	memset(&de, 0, sizeof(de));
+	de.ds = *dstats;
+	de.parent = parent;
+	de.flags = DELTA_LIVE;
+	add_blockref_entry(droot, bref, &de, sizeof(de));
+}
+
+/*
+ * Mark a cache hit, the entry is now referenced from parent.
+ */
+static void
+touch_delta_entry(delta_entry_t *de, hammer2_off_t parent)
+{
+	de->parent = parent;
+	de->flags |= DELTA_LIVE;
+}
+
+/*
+ * Account and verify a single blockref.  Its media is returned in *mediap
+ * and must be released with hammer2_media_put(*bufp).  check is the result
+ * of a batched verification of the check code by the parent (0 good,
+ * 1 bad), or -1 if it must be verified here.
+ * Returns -1 if the media couldn't be read, otherwise 0 with *failed set
+ * if the blockref failed verification.
+ */
 static int
-verify_blockref(const hammer2_volume_data_t *voldata,
-    const hammer2_blockref_t *bref, bool norecurse, blockref_stats_t *bstats,
-    struct blockref_tree *droot, delta_stats_t *dstats, int depth, int index)
+verify_blockref_media(const hammer2_blockref_t *bref, blockref_stats_t *bstats,
+    delta_stats_t *dstats, const hammer2_media_data_t **mediap,
+    size_t *media_bytes, hammer2_media_buf_t **bufp, bool *failed, int check,
+    int depth, int index)
 {
-	hammer2_media_data_t media;
-	hammer2_blockref_t *bscan;
-	int i, bcount;
-	bool failed = false;
+	const hammer2_media_data_t *media;
 	size_t bytes;
 	uint32_t cv;
 	uint64_t cv64;
 	char msg[256];
-#ifdef HAMMER2_USE_OPENSSL
 	SHA256_CTX hash_ctx;
 	union {
 		uint8_t digest[SHA256_DIGEST_LENGTH];
 		uint64_t digest64[SHA256_DIGEST_LENGTH/8];
 	} u;
-#endif
-	/* only for DebugOpt > 1 */
-	if (DebugOpt > 1)
-		print_blockref_debug(stdout, depth, index, bref, NULL);
-
-	if (bref->data_off) {
-		struct blockref_entry *e, bref_find;
-		memset(&bref_find, 0, sizeof(bref_find));
-		bref_find.data_off = bref->data_off;
-		e = RB_FIND(blockref_tree, droot, &bref_find);
-		if (e) {
-			struct blockref_msg *m;
-			TAILQ_FOREACH(m, &e->head, entry) {
-				delta_stats_t *ds = m->msg;
-				if (!memcmp(&m->bref, bref, sizeof(*bref))) {
-					/* delta contains cached delta */
-					accumulate_delta_stats(dstats, ds);
-					load_delta_stats(bstats, ds);
-					print_blockref_debug(stdout, depth,
-					    index, &m->bref, "cache-hit");
-					return 0;
-				}
-			}
-		}
-	}
 
 	bstats->total_blockref++;
 	dstats->total_blockref++;
@@ -873,11 +942,21 @@ verify_blockref(const hammer2_volume_data_t *voldata,
 		    bref->type);
 		add_blockref_entry(&bstats->root, bref, msg, strlen(msg) + 1);
 		print_blockref_debug(stdout, depth, index, bref, msg);
-		failed = true;
+		*failed = true;
 		break;
 	}
 
-	switch (read_media(bref, &media, &bytes)) {
+	/*
+	 * A data block verified in a batch by the parent was read then, its
+	 * media isn't needed again, only its size.
+	 */
+	if (check >= 0) {
+		media = NULL;
+		*bufp = NULL;
+		bytes = (bref->data_off & HAMMER2_OFF_MASK_RADIX);
+		if (bytes)
+			bytes = (size_t)1 << bytes;
+	} else switch (hammer2_media_get(bref, &media, &bytes, bufp)) {
 	case -1:
 		strlcpy(msg, "Bad I/O bytes", sizeof(msg));
 		add_blockref_entry(&bstats->root, bref, msg, strlen(msg) + 1);
@@ -891,6 +970,8 @@ verify_blockref(const hammer2_volume_data_t *voldata,
 	default:
 		break;
 	}
+	*mediap = media;
+	*media_bytes = bytes;
 
 	if (bref->type != HAMMER2_BREF_TYPE_VOLUME &&
 	    bref->type != HAMMER2_BREF_TYPE_FREEMAP) {
@@ -904,109 +985,236 @@ verify_blockref(const hammer2_volume_data_t *voldata,
 		dstats->total_bytes -= bytes;
 	}
 
-	if (!DebugOpt && QuietOpt <= 0 && (bstats->total_blockref % 100) == 0)
-		print_blockref_stats(bstats, false);
-
 	if (!bytes)
-		goto end;
+		return 0;
 
 	switch (HAMMER2_DEC_CHECK(bref->methods)) {
 	case HAMMER2_CHECK_ISCSI32:
-		cv = hammer2_icrc32(&media, bytes);
+		cv = hammer2_icrc32(media, bytes);
 		if (bref->check.iscsi32.value != cv) {
 			strlcpy(msg, "Bad HAMMER2_CHECK_ISCSI32", sizeof(msg));
 			add_blockref_entry(&bstats->root, bref, msg,
 			    strlen(msg) + 1);
 			print_blockref_debug(stdout, depth, index, bref, msg);
-			failed = true;
+			*failed = true;
 		}
 		break;
 	case HAMMER2_CHECK_XXHASH64:
-		cv64 = XXH64(&media, bytes, XXH_HAMMER2_SEED);
-		if (bref->check.xxhash64.value != cv64) {
+		if (check < 0) {
+			cv64 = XXH64(media, bytes, XXH_HAMMER2_SEED);
+			check = (bref->check.xxhash64.value != cv64);
+		}
+		if (check) {
 			strlcpy(msg, "Bad HAMMER2_CHECK_XXHASH64", sizeof(msg));
 			add_blockref_entry(&bstats->root, bref, msg,
 			    strlen(msg) + 1);
 			print_blockref_debug(stdout, depth, index, bref, msg);
-			failed = true;
+			*failed = true;
 		}
 		break;
 	case HAMMER2_CHECK_SHA192:
-#ifdef HAMMER2_USE_OPENSSL
-		SHA256_Init(&hash_ctx);
-		SHA256_Update(&hash_ctx, &media, bytes);
-		SHA256_Final(u.digest, &hash_ctx);
-		u.digest64[2] ^= u.digest64[3];
-		if (memcmp(u.digest, bref->check.sha192.data,
-		    sizeof(bref->check.sha192.data))) {
+		if (check < 0) {
+			SHA256_Init(&hash_ctx);
+			SHA256_Update(&hash_ctx, (const void *)media, bytes);
+			SHA256_Final(u.digest, &hash_ctx);
+			u.digest64[2] ^= u.digest64[3];
+			check = (memcmp(u.digest, bref->check.sha192.data,
+			    sizeof(bref->check.sha192.data)) != 0);
+		}
+		if (check) {
 			strlcpy(msg, "Bad HAMMER2_CHECK_SHA192", sizeof(msg));
 			add_blockref_entry(&bstats->root, bref, msg,
 			    strlen(msg) + 1);
 			print_blockref_debug(stdout, depth, index, bref, msg);
-			failed = true;
+			*failed = true;
 		}
-#endif
 		break;
 	case HAMMER2_CHECK_FREEMAP:
-		cv = hammer2_icrc32(&media, bytes);
+		cv = hammer2_icrc32(media, bytes);
 		if (bref->check.freemap.icrc32 != cv) {
 			strlcpy(msg, "Bad HAMMER2_CHECK_FREEMAP", sizeof(msg));
 			add_blockref_entry(&bstats->root, bref, msg,
 			    strlen(msg) + 1);
 			print_blockref_debug(stdout, depth, index, bref, msg);
-			failed = true;
+			*failed = true;
 		}
 		break;
 	}
 
+	return 0;
+}
+
+static int
+get_blockref_children(const hammer2_blockref_t *bref,
+    const hammer2_media_data_t *media, size_t bytes,
+    const hammer2_blockref_t **bscan)
+{
+	if (!bytes) {
+		*bscan = NULL;
+		return 0;
+	}
+
 	switch (bref->type) {
 	case HAMMER2_BREF_TYPE_INODE:
-		if (!(media.ipdata.meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA)) {
-			bscan = &media.ipdata.u.blockset.blockref[0];
-			bcount = HAMMER2_SET_COUNT;
-		} else {
-			bscan = NULL;
-			bcount = 0;
+		if (!(media->ipdata.meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA)) {
+			*bscan = &media->ipdata.u.blockset.blockref[0];
+			return HAMMER2_SET_COUNT;
 		}
 		break;
 	case HAMMER2_BREF_TYPE_INDIRECT:
-		bscan = &media.npdata[0];
-		bcount = bytes / sizeof(hammer2_blockref_t);
-		break;
+		*bscan = &media->npdata[0];
+		return bytes / sizeof(hammer2_blockref_t);
 	case HAMMER2_BREF_TYPE_FREEMAP_NODE:
-		bscan = &media.npdata[0];
-		bcount = bytes / sizeof(hammer2_blockref_t);
-		break;
+		*bscan = &media->npdata[0];
+		return bytes / sizeof(hammer2_blockref_t);
 	case HAMMER2_BREF_TYPE_VOLUME:
-		bscan = &media.voldata.sroot_blockset.blockref[0];
-		bcount = HAMMER2_SET_COUNT;
-		break;
+		*bscan = &media->voldata.sroot_blockset.blockref[0];
+		return HAMMER2_SET_COUNT;
 	case HAMMER2_BREF_TYPE_FREEMAP:
-		bscan = &media.voldata.freemap_blockset.blockref[0];
-		bcount = HAMMER2_SET_COUNT;
-		break;
+		*bscan = &media->voldata.freemap_blockset.blockref[0];
+		return HAMMER2_SET_COUNT;
 	default:
-		bscan = NULL;
-		bcount = 0;
 		break;
 	}
+	*bscan = NULL;
+
+	return 0;
+}
+
+/*
+ * Verify the SHA192 check codes of the data blockrefs in bscan with
+ * SHA256_Batch(), setting check[i] like hammer2_media_verify_xxhash64().
+ * Entries of other blockrefs are left alone.
+ */
+#define SHA192_BATCH	64
+
+static void
+verify_sha192_batch(const hammer2_blockref_t *bscan, int bcount,
+    int8_t *check)
+{
+	SHA256_JOB jobs[SHA192_BATCH];
+	hammer2_media_buf_t *bufs[SHA192_BATCH];
+	int index[SHA192_BATCH];
+	const hammer2_media_data_t *media;
+	const hammer2_blockref_t *bref;
+	uint8_t *digest;
+	size_t bytes;
+	int i, j, k, n;
+
+	i = 0;
+	while (i < bcount) {
+		n = 0;
+		for (; i < bcount && n < SHA192_BATCH; ++i) {
+			bref = &bscan[i];
+			if (bref->type != HAMMER2_BREF_TYPE_DATA ||
+			    HAMMER2_DEC_CHECK(bref->methods) !=
+			    HAMMER2_CHECK_SHA192 || skip_blockref(bref))
+				continue;
+			if (hammer2_media_get(bref, &media, &bytes,
+			    &bufs[n]) != 0 || media == NULL) {
+				hammer2_media_put(bufs[n]);
+				continue;
+			}
+			jobs[n].data = (const void *)media;
+			jobs[n].len = bytes;
+			index[n] = i;
+			++n;
+		}
+		SHA256_Batch(jobs, n);
+		for (j = 0; j < n; ++j) {
+			/* fold the last 8 bytes into the first 24 */
+			digest = jobs[j].digest;
+			for (k = 0; k < 8; ++k)
+				digest[16 + k] ^= digest[24 + k];
+			check[index[j]] = (memcmp(digest,
+			    bscan[index[j]].check.sha192.data,
+			    sizeof(bscan[index[j]].check.sha192.data)) != 0);
+			hammer2_media_put(bufs[j]);
+		}
+	}
+}
+
+/*
+ * Verify the check codes of the data children of a blockref in batches,
+ * returns the per-child results passed to verify_blockref_media().
+ */
+static int8_t *
+verify_children_batch(const hammer2_blockref_t *bscan, int bcount)
+{
+	int8_t *check;
+
+	check = malloc(bcount);
+	assert(check);
+	hammer2_media_verify_xxhash64(bscan, bcount, MinMirrorTid, check);
+	verify_sha192_batch(bscan, bcount, check);
+
+	return check;
+}
+
+static int
+verify_blockref(const hammer2_volume_data_t *voldata,
+    const hammer2_blockref_t *bref, hammer2_off_t parent, bool norecurse,
+    blockref_stats_t *bstats, struct blockref_tree *droot,
+    delta_stats_t *dstats, int check, int depth, int index)
+{
+	const hammer2_media_data_t *media;
+	const hammer2_blockref_t *bscan;
+	hammer2_media_buf_t *buf;
+	delta_entry_t *de;
+	delta_stats_t ds;
+	int8_t *bcheck = NULL;
+	int i, bcount;
+	bool failed = false;
+	size_t bytes;
+
+	if (skip_blockref(bref))
+		return 0;
+
+	/* only for DebugOpt > 1 */
+	if (DebugOpt > 1)
+		print_blockref_debug(stdout, depth, index, bref, NULL);
+
+	if ((de = lookup_delta_entry(droot, bref)) != NULL) {
+		/* delta contains cached delta */
+		touch_delta_entry(de, parent);
+		accumulate_delta_stats(dstats, &de->ds);
+		load_delta_stats(bstats, &de->ds);
+		print_blockref_debug(stdout, depth, index, bref, "cache-hit");
+		return 0;
+	}
+
+	if (verify_blockref_media(bref, bstats, dstats, &media, &bytes, &buf,
+	    &failed, check, depth, index) == -1)
+		return -1;
+
+	if (!DebugOpt && QuietOpt <= 0 && (bstats->total_blockref % 100) == 0)
+		print_blockref_stats(bstats, false);
+
+	bcount = get_blockref_children(bref, media, bytes, &bscan);
 
 	if (ForceOpt)
 		norecurse = false;
+	if (norecurse == false && bcount) {
+		hammer2_media_readahead(bscan, bcount, MinMirrorTid);
+		bcheck = verify_children_batch(bscan, bcount);
+	}
 	/*
 	 * If failed, no recurse, but still verify its direct children.
 	 * Beyond that is probably garbage.
 	 */
 	for (i = 0; norecurse == false && i < bcount; ++i) {
-		delta_stats_t ds;
 		memset(&ds, 0, sizeof(ds));
-		if (verify_blockref(voldata, &bscan[i], failed, bstats, droot,
-		    &ds, depth + 1, i) == -1)
+		if (verify_blockref(voldata, &bscan[i], bref->data_off, failed,
+		    bstats, droot, &ds, bcheck[i], depth + 1, i) == -1) {
+			free(bcheck);
+			hammer2_media_put(buf);
 			return -1;
+		}
 		if (!failed)
 			accumulate_delta_stats(dstats, &ds);
 	}
-end:
+	free(bcheck);
+	hammer2_media_put(buf);
 	if (failed)
 		return -1;
 
@@ -1014,13 +1222,426 @@ end:
 	if (bref->data_off && BlockrefCacheCount > 0 &&
 	    dstats->count >= BlockrefCacheCount) {
 		assert(bytes);
-		add_blockref_entry(droot, bref, dstats, sizeof(*dstats));
+		add_delta_entry(droot, bref, parent, dstats);
 		print_blockref_debug(stdout, depth, index, bref, "cache-add");
 	}
 
 	return 0;
 }
 
+/*
+ * Parallel verification (-j).
+ *
+ * Each blockref is a task.  Workers pop tasks from their own queue LIFO
+ * and steal from other workers' queues FIFO, so a worker mostly descends
+ * its own subtree.  A task holds one reference for itself and one per
+ * child.  When the last reference goes away the task's delta is final,
+ * it is added to the parent's delta and the parent's reference is dropped.
+ * Each worker accounts into its own blockref_stats_t including its own
+ * error tree, these are merged once the walk is done.  The delta cache is
+ * shared under a rwlock.
+ *
+ * Unlike the serial walk a failure doesn't abort verification of the
+ * remaining blockrefs, all of them are verified.
+ */
+typedef struct verify_task {
+	hammer2_blockref_t bref;
+	struct verify_task *parent;
+	delta_stats_t ds;
+	volatile u_int refs;
+	volatile u_int flags;
+	int check; /* batched check result from the parent, -1 if none */
+	int depth;
+	int index;
+} verify_task_t;
+
+#define VERIFY_NORECURSE	0x0001
+#define VERIFY_FAILED		0x0002	/* blockref or its subtree failed */
+#define VERIFY_CACHED		0x0004	/* delta came from the cache */
+
+typedef struct {
+	pthread_mutex_t lock;
+	verify_task_t **items;
+	int beg; /* steal from here */
+	int end; /* push and pop here */
+	int size;
+} verify_queue_t;
+
+typedef struct verify_walk verify_walk_t;
+
+typedef struct {
+	verify_walk_t *walk;
+	verify_queue_t queue;
+	blockref_stats_t bstats;
+	blockref_stats_t snap; /* counters at last progress report */
+	pthread_t thread;
+	int index;
+} verify_worker_t;
+
+struct verify_walk {
+	struct blockref_tree *droot;
+	pthread_rwlock_t droot_lock;
+	verify_worker_t *workers;
+	int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	volatile u_int pending; /* queued or running tasks */
+	volatile u_int idle;
+	bool failed;
+};
+
+static verify_task_t *
+alloc_verify_task(const hammer2_blockref_t *bref, verify_task_t *parent,
+    u_int flags, int check, int depth, int index)
+{
+	verify_task_t *task;
+
+	task = calloc(1, sizeof(*task));
+	assert(task);
+	task->bref = *bref;
+	task->parent = parent;
+	task->refs = 1;
+	task->flags = flags;
+	task->check = check;
+	task->depth = depth;
+	task->index = index;
+
+	return task;
+}
+
+static void
+push_verify_task(verify_queue_t *queue, verify_task_t *task)
+{
+	pthread_mutex_lock(&queue->lock);
+	if (queue->end == queue->size) {
+		if (queue->beg > queue->size / 2) {
+			memmove(queue->items, queue->items + queue->beg,
+			    (queue->end - queue->beg) * sizeof(task));
+			queue->end -= queue->beg;
+			queue->beg = 0;
+		} else {
+			queue->size = queue->size ? queue->size * 2 : 64;
+			queue->items = realloc(queue->items,
+			    queue->size * sizeof(task));
+			assert(queue->items);
+		}
+	}
+	queue->items[queue->end++] = task;
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static verify_task_t *
+pop_verify_task(verify_queue_t *queue, bool steal)
+{
+	verify_task_t *task = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->beg < queue->end) {
+		if (steal)
+			task = queue->items[queue->beg++];
+		else
+			task = queue->items[--queue->end];
+		if (queue->beg == queue->end)
+			queue->beg = queue->end = 0;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return task;
+}
+
+static verify_task_t *
+next_verify_task(verify_worker_t *worker)
+{
+	verify_walk_t *walk = worker->walk;
+	verify_task_t *task;
+	struct timespec ts;
+	int i;
+
+	for (;;) {
+		task = pop_verify_task(&worker->queue, false);
+		if (task)
+			return task;
+		for (i = 1; i < walk->nthreads; ++i) {
+			task = pop_verify_task(&walk->workers[
+			    (worker->index + i) % walk->nthreads].queue, true);
+			if (task)
+				return task;
+		}
+
+		/*
+		 * Nothing to do.  The idle count is tested without the lock
+		 * when pushing, so wait with a short timeout.
+		 */
+		pthread_mutex_lock(&walk->lock);
+		if (walk->pending == 0) {
+			pthread_mutex_unlock(&walk->lock);
+			return NULL;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_nsec -= 1000000000;
+			++ts.tv_sec;
+		}
+		++walk->idle;
+		pthread_cond_timedwait(&walk->cond, &walk->lock, &ts);
+		--walk->idle;
+		pthread_mutex_unlock(&walk->lock);
+	}
+}
+
+static void
+add_delta_stats_atomic(delta_stats_t *dst, const delta_stats_t *src)
+{
+	atomic_add_long((volatile u_long *)&dst->total_blockref,
+	    src->total_blockref);
+	atomic_add_long((volatile u_long *)&dst->total_empty,
+	    src->total_empty);
+	atomic_add_long((volatile u_long *)&dst->total_bytes,
+	    src->total_bytes);
+
+	atomic_add_long((volatile u_long *)&dst->volume.total_inode,
+	    src->volume.total_inode);
+	atomic_add_long((volatile u_long *)&dst->volume.total_indirect,
+	    src->volume.total_indirect);
+	atomic_add_long((volatile u_long *)&dst->volume.total_data,
+	    src->volume.total_data);
+	atomic_add_long((volatile u_long *)&dst->volume.total_dirent,
+	    src->volume.total_dirent);
+
+	atomic_add_long((volatile u_long *)&dst->freemap.total_freemap_node,
+	    src->freemap.total_freemap_node);
+	atomic_add_long((volatile u_long *)&dst->freemap.total_freemap_leaf,
+	    src->freemap.total_freemap_leaf);
+
+	atomic_add_long((volatile u_long *)&dst->count, src->count);
+}
+
+/*
+ * Drop a reference, completing the task and possibly its parents.
+ */
+static void
+release_verify_task(verify_walk_t *walk, verify_task_t *task)
+{
+	verify_task_t *parent;
+
+	while (task && atomic_fetchadd_int(&task->refs, -1) == 1) {
+		parent = task->parent;
+		if (task->flags & VERIFY_FAILED) {
+			if (parent)
+				atomic_set_int(&parent->flags, VERIFY_FAILED);
+			else
+				walk->failed = true;
+		} else {
+			if (!(task->flags & VERIFY_CACHED)) {
+				task->ds.count++;
+				if (task->bref.data_off &&
+				    BlockrefCacheCount > 0 &&
+				    task->ds.count >= BlockrefCacheCount) {
+					pthread_rwlock_wrlock(&walk->droot_lock);
+					add_delta_entry(walk->droot,
+					    &task->bref, parent ?
+					    parent->bref.data_off : 0,
+					    &task->ds);
+					pthread_rwlock_unlock(&walk->droot_lock);
+				}
+			}
+			if (parent)
+				add_delta_stats_atomic(&parent->ds, &task->ds);
+		}
+		free(task);
+		task = parent;
+	}
+}
+
+static void
+report_verify_progress(verify_worker_t *worker)
+{
+	verify_walk_t *walk = worker->walk;
+	blockref_stats_t bstats;
+	int i;
+
+	init_blockref_stats(&bstats, worker->bstats.type);
+	pthread_mutex_lock(&walk->lock);
+	init_blockref_stats(&worker->snap, worker->bstats.type);
+	merge_blockref_stats(&worker->snap, &worker->bstats);
+	for (i = 0; i < walk->nthreads; ++i)
+		merge_blockref_stats(&bstats, &walk->workers[i].snap);
+	print_blockref_stats(&bstats, false);
+	pthread_mutex_unlock(&walk->lock);
+}
+
+static void
+run_verify_task(verify_worker_t *worker, verify_task_t *task)
+{
+	verify_walk_t *walk = worker->walk;
+	const hammer2_media_data_t *media;
+	const hammer2_blockref_t *bscan;
+	hammer2_media_buf_t *buf = NULL;
+	verify_task_t *child;
+	delta_entry_t *de;
+	int8_t *bcheck;
+	int i, n, bcount;
+	bool failed = false;
+	size_t bytes;
+
+	pthread_rwlock_rdlock(&walk->droot_lock);
+	de = lookup_delta_entry(walk->droot, &task->bref);
+	if (de)
+		task->ds = de->ds;
+	pthread_rwlock_unlock(&walk->droot_lock);
+	if (de) {
+		pthread_rwlock_wrlock(&walk->droot_lock);
+		touch_delta_entry(de, task->parent ?
+		    task->parent->bref.data_off : 0);
+		pthread_rwlock_unlock(&walk->droot_lock);
+		load_delta_stats(&worker->bstats, &task->ds);
+		atomic_set_int(&task->flags, VERIFY_CACHED);
+		goto done;
+	}
+
+	if (verify_blockref_media(&task->bref, &worker->bstats, &task->ds,
+	    &media, &bytes, &buf, &failed, task->check, task->depth,
+	    task->index) == -1) {
+		atomic_set_int(&task->flags, VERIFY_FAILED);
+		goto done;
+	}
+	if (failed)
+		atomic_set_int(&task->flags, VERIFY_FAILED);
+
+	if (QuietOpt <= 0 && worker->bstats.total_blockref -
+	    worker->snap.total_blockref >= 100)
+		report_verify_progress(worker);
+
+	if (!ForceOpt && (task->flags & VERIFY_NORECURSE))
+		goto done;
+
+	/*
+	 * If failed, no recurse, but still verify its direct children.
+	 * Push rightmost first so that the leftmost child is popped first.
+	 */
+	bcount = get_blockref_children(&task->bref, media, bytes, &bscan);
+	for (i = 0, n = 0; i < bcount; ++i) {
+		if (!skip_blockref(&bscan[i]))
+			++n;
+	}
+	if (n == 0)
+		goto done;
+	hammer2_media_readahead(bscan, bcount, MinMirrorTid);
+	bcheck = verify_children_batch(bscan, bcount);
+	atomic_add_int(&task->refs, n);
+	atomic_add_int(&walk->pending, n);
+	for (i = bcount - 1; i >= 0; --i) {
+		if (skip_blockref(&bscan[i]))
+			continue;
+		child = alloc_verify_task(&bscan[i], task,
+		    failed ? VERIFY_NORECURSE : 0, bcheck[i], task->depth + 1,
+		    i);
+		push_verify_task(&worker->queue, child);
+	}
+	free(bcheck);
+	if (n > 1 && walk->idle)
+		pthread_cond_broadcast(&walk->cond);
+done:
+	hammer2_media_put(buf);
+	release_verify_task(walk, task);
+}
+
+static void *
+verify_worker_thread(void *arg)
+{
+	verify_worker_t *worker = arg;
+	verify_walk_t *walk = worker->walk;
+	verify_task_t *task;
+
+	while ((task = next_verify_task(worker)) != NULL) {
+		run_verify_task(worker, task);
+		if (atomic_fetchadd_int(&walk->pending, -1) == 1) {
+			pthread_mutex_lock(&walk->lock);
+			pthread_cond_broadcast(&walk->cond);
+			pthread_mutex_unlock(&walk->lock);
+		}
+	}
+
+	return NULL;
+}
+
+static int
+verify_blockref_parallel(const hammer2_blockref_t *bref,
+    blockref_stats_t *bstats, struct blockref_tree *droot, int nthreads)
+{
+	verify_walk_t walk;
+	verify_worker_t *worker;
+	int i;
+
+	memset(&walk, 0, sizeof(walk));
+	walk.droot = droot;
+	walk.nthreads = nthreads;
+	walk.workers = calloc(nthreads, sizeof(*walk.workers));
+	assert(walk.workers);
+	pthread_rwlock_init(&walk.droot_lock, NULL);
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+
+	for (i = 0; i < nthreads; ++i) {
+		worker = &walk.workers[i];
+		worker->walk = &walk;
+		worker->index = i;
+		init_blockref_stats(&worker->bstats, bstats->type);
+		init_blockref_stats(&worker->snap, bstats->type);
+		pthread_mutex_init(&worker->queue.lock, NULL);
+	}
+	walk.pending = 1;
+	push_verify_task(&walk.workers[0].queue,
+	    alloc_verify_task(bref, NULL, 0, -1, 0, 0));
+
+	for (i = 0; i < nthreads; ++i) {
+		worker = &walk.workers[i];
+		if (pthread_create(&worker->thread, NULL, verify_worker_thread,
+		    worker)) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(walk.workers[i].thread, NULL);
+	for (i = 0; i < nthreads; ++i) {
+		worker = &walk.workers[i];
+		merge_blockref_stats(bstats, &worker->bstats);
+		merge_blockref_entry(&bstats->root, &worker->bstats.root);
+		pthread_mutex_destroy(&worker->queue.lock);
+		free(worker->queue.items);
+	}
+	assert(walk.pending == 0);
+
+	free(walk.workers);
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+	pthread_rwlock_destroy(&walk.droot_lock);
+
+	return walk.failed ? -1 : 0;
+}
+
+static int
+verify_root_blockref(const hammer2_volume_data_t *voldata,
+    const hammer2_blockref_t *bref, blockref_stats_t *bstats,
+    struct blockref_tree *droot)
+{
+	delta_stats_t ds;
+
+	if (skip_blockref(bref))
+		return 0;
+
+	/* debug output is per blockref in walk order */
+	if (NThreadsOpt > 1 && !DebugOpt)
+		return verify_blockref_parallel(bref, bstats, droot,
+		    NThreadsOpt);
+
+	memset(&ds, 0, sizeof(ds));
+	return verify_blockref(voldata, bref, 0, false, bstats, droot, &ds, -1, 0,
+	    0);
+}
+
 static void
 print_pfs(const hammer2_inode_data_t *ipdata)
 {
@@ -1096,7 +1717,7 @@ init_pfs_blockref(const hammer2_volume_data_t *voldata,
 	int i, bcount;
 	size_t bytes;
 
-	if (read_media(bref, &media, &bytes))
+	if (hammer2_media_read(bref, &media, &bytes))
 		return -1;
 	if (!bytes)
 		return 0;
@@ -1303,17 +1924,297 @@ print_media(FILE *fp, int tab, const hammer2_blockref_t *bref,
 		free(str);
 }
 
+/*
+ * Verification cache file (-C).
+ *
+ * Delta cache entries of verified subtrees are saved to CacheFile and
+ * loaded by the next run, so a subtree whose blockref didn't change since
+ * then is not verified again.  Copy-on-write gives a modified subtree a
+ * new data_off, check code and mirror_tid, so only the blockrefs on the
+ * path to a modification miss the cache.
+ *
+ * Only referenced entries are saved, those hit or added in this run and
+ * those below them, found by following the parent data_off.  The volume
+ * and freemap root blockrefs are made up by init_root_blockref() and
+ * never saved.
+ */
+#define VCACHE_MAGIC		0x48324643	/* "H2FC" */
+#define VCACHE_VERSION		1
+
+struct vcache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count_empty;	/* CountEmpty of the saved run */
+	uint32_t icrc;		/* icrc32 of all records */
+	uint64_t count;		/* number of records */
+	hammer2_uuid_t fsid;
+};
+
+struct vcache_record {
+	hammer2_blockref_t bref;
+	hammer2_off_t parent;
+	uint64_t total_blockref;
+	uint64_t total_empty;
+	uint64_t total_bytes;
+	uint64_t total_inode;
+	uint64_t total_indirect;
+	uint64_t total_data;
+	uint64_t total_dirent;
+	uint64_t total_freemap_node;
+	uint64_t total_freemap_leaf;
+	uint64_t count;
+};
+
+static int
+read_vcache_fsid(hammer2_uuid_t *fsid)
+{
+	hammer2_media_data_t media;
+	hammer2_blockref_t broot;
+
+	if (best_zone == -1)
+		return -1;
+	init_root_blockref(best_zone, HAMMER2_BREF_TYPE_VOLUME, &broot);
+	if (hammer2_media_read(&broot, &media, NULL))
+		return -1;
+	*fsid = media.voldata.fsid;
+
+	return 0;
+}
+
+static int
+load_verify_cache(const char *path)
+{
+	struct vcache_header hdr;
+	struct vcache_record *recs;
+	hammer2_uuid_t fsid;
+	delta_entry_t de;
+	uint64_t i;
+	FILE *fp;
+
+	RB_INIT(&vcache_root);
+	if (read_vcache_fsid(&fsid) == -1)
+		return -1;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return 0; /* first run */
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    hdr.magic != VCACHE_MAGIC ||
+	    hdr.version != VCACHE_VERSION ||
+	    hdr.count > SIZE_MAX / sizeof(*recs)) {
+		fprintf(stderr, "%s: Bad cache file, ignored\n", path);
+		fclose(fp);
+		return 0;
+	}
+	if (hdr.count_empty != (uint32_t)CountEmpty ||
+	    memcmp(&hdr.fsid, &fsid, sizeof(fsid))) {
+		fprintf(stderr, "%s: Cache file doesn't match, ignored\n",
+		    path);
+		fclose(fp);
+		return 0;
+	}
+
+	recs = calloc(hdr.count ? hdr.count : 1, sizeof(*recs));
+	if (recs == NULL) {
+		fclose(fp);
+		return -1;
+	}
+	if (fread(recs, sizeof(*recs), hdr.count, fp) != hdr.count ||
+	    hammer2_icrc32(recs, hdr.count * sizeof(*recs)) != hdr.icrc) {
+		fprintf(stderr, "%s: Bad cache file, ignored\n", path);
+		free(recs);
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+
+	for (i = 0; i < hdr.count; ++i) {
+		if (lookup_delta_entry(&vcache_root, &recs[i].bref))
+			continue;
+		memset(&de, 0, sizeof(de));
+		de.ds.total_blockref = recs[i].total_blockref;
+		de.ds.total_empty = recs[i].total_empty;
+		de.ds.total_bytes = recs[i].total_bytes;
+		de.ds.volume.total_inode = recs[i].total_inode;
+		de.ds.volume.total_indirect = recs[i].total_indirect;
+		de.ds.volume.total_data = recs[i].total_data;
+		de.ds.volume.total_dirent = recs[i].total_dirent;
+		de.ds.freemap.total_freemap_node = recs[i].total_freemap_node;
+		de.ds.freemap.total_freemap_leaf = recs[i].total_freemap_leaf;
+		de.ds.count = recs[i].count;
+		de.parent = recs[i].parent;
+		add_blockref_entry(&vcache_root, &recs[i].bref, &de, sizeof(de));
+	}
+	free(recs);
+
+	if (DebugOpt)
+		printf("%s: %ju cached blockrefs\n", path, (uintmax_t)hdr.count);
+
+	return 0;
+}
+
+/*
+ * Return true if the entry is referenced, i.e. it or one of its ancestors
+ * was hit or added in this run.
+ */
+static bool
+resolve_delta_entry(delta_entry_t *de)
+{
+	struct blockref_entry *e, bref_find;
+	struct blockref_msg *m;
+
+	if (de->flags & DELTA_LIVE)
+		return true;
+	if (de->flags & (DELTA_DEAD | DELTA_BUSY))
+		return false;
+
+	de->flags |= DELTA_BUSY;
+	if (de->parent) {
+		memset(&bref_find, 0, sizeof(bref_find));
+		bref_find.data_off = de->parent;
+		e = RB_FIND(blockref_tree, &vcache_root, &bref_find);
+		if (e) {
+			TAILQ_FOREACH(m, &e->head, entry) {
+				if (is_root_blockref(&m->bref))
+					continue;
+				if (resolve_delta_entry(m->msg)) {
+					de->flags |= DELTA_LIVE;
+					break;
+				}
+			}
+		}
+	}
+	de->flags &= ~DELTA_BUSY;
+	if (!(de->flags & DELTA_LIVE))
+		de->flags |= DELTA_DEAD;
+
+	return (de->flags & DELTA_LIVE) != 0;
+}
+
+/*
+ * Save the cache, dropping unreferenced entries if prune is set.
+ */
+static int
+save_verify_cache(const char *path, bool prune)
+{
+	struct vcache_header hdr;
+	struct vcache_record *recs, *rec;
+	struct blockref_entry *e;
+	struct blockref_msg *m;
+	delta_entry_t *de;
+	char *tmp;
+	size_t n;
+	FILE *fp;
+	int fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (read_vcache_fsid(&hdr.fsid) == -1)
+		return -1;
+
+	n = 0;
+	RB_FOREACH(e, blockref_tree, &vcache_root)
+		TAILQ_FOREACH(m, &e->head, entry)
+			++n;
+	recs = calloc(n ? n : 1, sizeof(*recs));
+	if (recs == NULL)
+		return -1;
+
+	n = 0;
+	RB_FOREACH(e, blockref_tree, &vcache_root) {
+		TAILQ_FOREACH(m, &e->head, entry) {
+			de = m->msg;
+			if (is_root_blockref(&m->bref))
+				continue;
+			if (prune && !resolve_delta_entry(de))
+				continue;
+			rec = &recs[n++];
+			rec->bref = m->bref;
+			rec->parent = de->parent;
+			rec->total_blockref = de->ds.total_blockref;
+			rec->total_empty = de->ds.total_empty;
+			rec->total_bytes = de->ds.total_bytes;
+			rec->total_inode = de->ds.volume.total_inode;
+			rec->total_indirect = de->ds.volume.total_indirect;
+			rec->total_data = de->ds.volume.total_data;
+			rec->total_dirent = de->ds.volume.total_dirent;
+			rec->total_freemap_node =
+			    de->ds.freemap.total_freemap_node;
+			rec->total_freemap_leaf =
+			    de->ds.freemap.total_freemap_leaf;
+			rec->count = de->ds.count;
+		}
+	}
+
+	hdr.magic = VCACHE_MAGIC;
+	hdr.version = VCACHE_VERSION;
+	hdr.count_empty = CountEmpty;
+	hdr.count = n;
+	hdr.icrc = hammer2_icrc32(recs, n * sizeof(*recs));
+
+	/*
+	 * Write a temporary file and rename it, so an interrupted run
+	 * leaves the previous cache file intact.
+	 */
+	if (asprintf(&tmp, "%s.tmp", path) == -1) {
+		free(recs);
+		return -1;
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		perror(tmp);
+		if (fd != -1)
+			close(fd);
+		free(tmp);
+		free(recs);
+		return -1;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(recs, sizeof(*recs), n, fp) != n ||
+	    fflush(fp) || fsync(fileno(fp))) {
+		perror(tmp);
+		fclose(fp);
+		unlink(tmp);
+		free(tmp);
+		free(recs);
+		return -1;
+	}
+	fclose(fp);
+	if (rename(tmp, path) == -1) {
+		perror("rename");
+		unlink(tmp);
+		free(tmp);
+		free(recs);
+		return -1;
+	}
+	free(tmp);
+	free(recs);
+
+	if (DebugOpt)
+		printf("%s: %zu cached blockrefs saved\n", path, n);
+
+	return 0;
+}
+
 int
 test_hammer2(const char *devpath)
 {
 	bool failed = false;
+	bool complete = false;
 
 	hammer2_init_volumes(devpath, 1);
+	hammer2_media_cache_init(HAMMER2_MEDIA_CACHE_BUFS);
+	if (MmapOpt)
+		hammer2_media_mmap_init(HAMMER2_MEDIA_MAP_WINDOWS, MADV_RANDOM);
 
 	best_zone = find_best_zone();
 	if (best_zone == -1)
 		fprintf(stderr, "Failed to find best zone\n");
 
+	if (CacheFile && !PrintPFS && load_verify_cache(CacheFile) == -1) {
+		fprintf(stderr, "%s: Failed to load cache file\n", CacheFile);
+		CacheFile = NULL;
+	}
+
 	if (PrintPFS) {
 		if (test_pfs_blockref() == -1)
 			failed = true;
@@ -1347,7 +2248,16 @@ test_hammer2(const char *devpath)
 				goto end;
 		}
 	}
+	complete = true;
 end:
+	if (CacheFile && !PrintPFS) {
+		/* keep entries of trees which weren't scanned */
+		if (save_verify_cache(CacheFile, complete && !NumPFSNames) == -1)
+			fprintf(stderr, "%s: Failed to save cache file\n",
+			    CacheFile);
+		cleanup_blockref_entry(&vcache_root);
+	}
+	hammer2_media_cache_cleanup();
 	hammer2_cleanup_volumes();
 
 	return failed ? -1 : 0;
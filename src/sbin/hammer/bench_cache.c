@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Replay a buffer cache access trace recorded with the HAMMER_CACHE_TRACE
+ * environment variable against the hammer(8) buffer cache, without doing
+ * any I/O.
+ *
+ * bench_cache [-C cachesize] [-j threads] [-n loops] tracefile
+ *
+ * With more than one thread each thread replays the whole trace, starting
+ * at a different position so the threads do not run in lock step.
+ */
+
+#include "hammer_util.h"
+
+#include <pthread.h>
+
+static hammer_off_t *Trace;
+static size_t TraceCount;
+static int Loops = 1;
+static volatile u_long Hits;
+static volatile u_long Misses;
+
+static void usage(void) __dead2;
+
+static
+void *
+replay(void *arg)
+{
+	buffer_info_t buffer;
+	buffer_info_t found;
+	size_t start = (size_t)arg;
+	size_t i, n;
+	u_long hits = 0;
+	u_long misses = 0;
+	int loop;
+
+	for (loop = 0; loop < Loops; ++loop) {
+		for (n = 0; n < TraceCount; ++n) {
+			i = (start + n) % TraceCount;
+			buffer = hammer_cache_lookup(Trace[i]);
+			if (buffer == NULL) {
+				buffer = calloc(1, sizeof(*buffer));
+				buffer->zone2_offset = Trace[i];
+				buffer->ondisk = calloc(1, HAMMER_BUFSIZE);
+				found = hammer_cache_add(buffer, 0);
+				if (found != buffer) {
+					free(buffer->ondisk);
+					free(buffer);
+				}
+				buffer = found;
+				++misses;
+			} else {
+				++hits;
+			}
+			hammer_cache_flush();
+			rel_buffer(buffer);
+		}
+	}
+	__atomic_add_fetch(&Hits, hits, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&Misses, misses, __ATOMIC_RELAXED);
+
+	return(NULL);
+}
+
+int
+main(int ac, char **av)
+{
+	struct timeval tv1, tv2;
+	pthread_t *threads;
+	FILE *fp;
+	char buf[64];
+	size_t alloc = 0;
+	double secs;
+	int nthreads = 1;
+	int ch;
+	int i;
+
+	while ((ch = getopt(ac, av, "C:j:n:")) != -1) {
+		switch(ch) {
+		case 'C':
+			if (hammer_parse_cache_size(optarg) == -1)
+				usage();
+			break;
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			if (nthreads < 1)
+				usage();
+			break;
+		case 'n':
+			Loops = strtol(optarg, NULL, 0);
+			if (Loops < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	ac -= optind;
+	av += optind;
+	if (ac != 1)
+		usage();
+
+	if ((fp = fopen(av[0], "r")) == NULL)
+		err(1, "%s", av[0]);
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		if (TraceCount == alloc) {
+			alloc = alloc ? alloc * 2 : 4096;
+			Trace = realloc(Trace, alloc * sizeof(*Trace));
+		}
+		Trace[TraceCount++] = strtoull(buf, NULL, 16) &
+				      ~HAMMER_BUFMASK64;
+	}
+	fclose(fp);
+	if (TraceCount == 0)
+		errx(1, "%s: Empty trace", av[0]);
+
+	threads = calloc(nthreads, sizeof(*threads));
+	if (threads == NULL) {
+		err(1, "calloc");
+		/* not reached */
+	}
+	gettimeofday(&tv1, NULL);
+	for (i = 0; i < nthreads; ++i) {
+		if (pthread_create(&threads[i], NULL, replay,
+				   (void *)(TraceCount / nthreads * i))) {
+			err(1, "pthread_create");
+			/* not reached */
+		}
+	}
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+	gettimeofday(&tv2, NULL);
+
+	secs = (tv2.tv_sec - tv1.tv_sec) +
+	       (tv2.tv_usec - tv1.tv_usec) / 1000000.0;
+	printf("%zu accesses x %d loops x %d threads in %.3f sec\n",
+		TraceCount, Loops, nthreads, secs);
+	printf("%.0f accesses/sec, hit ratio %.2f%%\n",
+		(Hits + Misses) / secs,
+		(Hits + Misses) ? 100.0 * Hits / (Hits + Misses) : 0.0);
+
+	return(0);
+}
+
+static
+void
+usage(void)
+{
+	fprintf(stderr,
+		"bench_cache [-C cachesize] [-j threads] [-n loops] tracefile\n");
+	exit(1);
+}
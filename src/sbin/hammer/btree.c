@@ -0,0 +1,638 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hammer.h"
+
+#include <pthread.h>
+#include <machine/atomic.h>
+
+/*
+ * Parallel B-Tree walker.
+ *
+ * The caller supplies a function which is called once for each B-Tree
+ * node, and which calls btree_walk_child() for each child node to be
+ * visited.  With a single thread this is a plain recursive depth-first
+ * walk.  With more than one thread child nodes are queued on the
+ * worker's own queue and idle workers steal from the other end of other
+ * workers' queues.  Owners pop the leftmost child first so each worker
+ * still does a depth-first walk of its part of the tree, while thieves
+ * take the oldest and thus largest subtrees.
+ *
+ * Output written to btree_walk_node->fp is buffered per node and written
+ * to stdout in depth-first order, so the output is identical to that of
+ * the single threaded walk.  A node's segment is followed by the segments
+ * of its children, which are linked in when the node has been processed.
+ */
+typedef struct btree_walk_seg {
+	struct btree_walk_seg	*next;
+	char			*buf;
+	size_t			len;
+	int			done;
+} *btree_walk_seg_t;
+
+typedef struct btree_walk_queue {
+	pthread_mutex_t		lock;
+	btree_walk_node_t	*items;
+	int			beg;		/* steal from here */
+	int			end;		/* push and pop here */
+	int			size;
+} *btree_walk_queue_t;
+
+typedef struct btree_walk_worker {
+	struct btree_walk	*walk;
+	struct btree_walk_queue	queue;
+	pthread_t		thread;
+	void			*arg;
+	int			index;
+} *btree_walk_worker_t;
+
+typedef struct btree_walk {
+	btree_walk_func_t	func;
+	void			*arg;		/* single threaded walk */
+	int			nthreads;
+	btree_walk_worker_t	workers;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	volatile u_int		pending;	/* queued or running nodes */
+	volatile u_int		idle;
+	btree_walk_seg_t	head;		/* next segment to output */
+} *btree_walk_t;
+
+static void btree_walk_queue_push(btree_walk_queue_t queue,
+	btree_walk_node_t node);
+
+static
+btree_walk_node_t
+btree_walk_node_alloc(btree_walk_t walk, hammer_off_t node_offset,
+	hammer_tid_t mirror_tid, int depth, hammer_btree_elm_t elm)
+{
+	btree_walk_node_t node;
+
+	node = calloc(1, sizeof(*node));
+	if (node == NULL) {
+		err(1, "btree_walk_node_alloc");
+		/* not reached */
+	}
+	node->node_offset = node_offset;
+	node->mirror_tid = mirror_tid;
+	node->depth = depth;
+	if (elm) {
+		node->elms[0] = elm[0];
+		node->elms[1] = elm[1];
+		node->lbe = &node->elms[0];
+	}
+	node->walk = walk;
+	return(node);
+}
+
+/*
+ * Called by the walk function for each child node to visit, in order.
+ * elm is the parent's element pointing to the child, the element which
+ * follows it is the right boundary.  Both are copied, so the parent's
+ * buffer need not stay referenced.
+ */
+void
+btree_walk_child(btree_walk_node_t parent, hammer_btree_elm_t elm)
+{
+	btree_walk_t walk = parent->walk;
+	struct btree_walk_node node;
+	btree_walk_node_t child;
+
+	if (walk->nthreads <= 1) {
+		bzero(&node, sizeof(node));
+		node.node_offset = elm->internal.subtree_offset;
+		node.mirror_tid = elm->internal.mirror_tid;
+		node.depth = parent->depth + 1;
+		node.lbe = elm;
+		node.fp = parent->fp;
+		node.walk = walk;
+		walk->func(&node, walk->arg);
+		return;
+	}
+
+	child = btree_walk_node_alloc(walk, elm->internal.subtree_offset,
+				      elm->internal.mirror_tid,
+				      parent->depth + 1, elm);
+	if (parent->nchildren == parent->maxchildren) {
+		parent->maxchildren = parent->maxchildren ?
+				      parent->maxchildren * 2 : 16;
+		parent->children = realloc(parent->children,
+			parent->maxchildren * sizeof(*parent->children));
+	}
+	parent->children[parent->nchildren++] = child;
+}
+
+static
+void
+btree_walk_queue_push(btree_walk_queue_t queue, btree_walk_node_t node)
+{
+	pthread_mutex_lock(&queue->lock);
+	if (queue->end == queue->size) {
+		if (queue->beg > queue->size / 2) {
+			bcopy(queue->items + queue->beg, queue->items,
+			      (queue->end - queue->beg) * sizeof(node));
+			queue->end -= queue->beg;
+			queue->beg = 0;
+		} else {
+			queue->size = queue->size ? queue->size * 2 : 64;
+			queue->items = realloc(queue->items,
+				queue->size * sizeof(node));
+		}
+	}
+	queue->items[queue->end++] = node;
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static
+btree_walk_node_t
+btree_walk_queue_pop(btree_walk_queue_t queue, int steal)
+{
+	btree_walk_node_t node = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->beg < queue->end) {
+		if (steal)
+			node = queue->items[queue->beg++];
+		else
+			node = queue->items[--queue->end];
+		if (queue->beg == queue->end)
+			queue->beg = queue->end = 0;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return(node);
+}
+
+static
+btree_walk_node_t
+btree_walk_next(btree_walk_worker_t worker)
+{
+	btree_walk_t walk = worker->walk;
+	btree_walk_node_t node;
+	struct timespec ts;
+	int i;
+
+	for (;;) {
+		node = btree_walk_queue_pop(&worker->queue, 0);
+		if (node)
+			return(node);
+		for (i = 1; i < walk->nthreads; ++i) {
+			node = btree_walk_queue_pop(&walk->workers[
+				(worker->index + i) % walk->nthreads].queue, 1);
+			if (node)
+				return(node);
+		}
+
+		/*
+		 * Nothing to do.  Wakeups from pushes are not reliable since
+		 * the idle count is tested without the lock, so wait with a
+		 * short timeout.
+		 */
+		pthread_mutex_lock(&walk->lock);
+		if (walk->pending == 0) {
+			pthread_mutex_unlock(&walk->lock);
+			return(NULL);
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_nsec -= 1000000000;
+			++ts.tv_sec;
+		}
+		++walk->idle;
+		pthread_cond_timedwait(&walk->cond, &walk->lock, &ts);
+		--walk->idle;
+		pthread_mutex_unlock(&walk->lock);
+	}
+}
+
+/*
+ * Output all completed segments at the head of the segment list.
+ * Called with walk->lock held.
+ */
+static
+void
+btree_walk_output(btree_walk_t walk)
+{
+	btree_walk_seg_t seg;
+
+	while ((seg = walk->head) != NULL && seg->done) {
+		if (seg->len)
+			fwrite(seg->buf, 1, seg->len, stdout);
+		walk->head = seg->next;
+		free(seg->buf);
+		free(seg);
+	}
+}
+
+static
+void
+btree_walk_done(btree_walk_worker_t worker, btree_walk_node_t node)
+{
+	btree_walk_t walk = worker->walk;
+	btree_walk_seg_t prev;
+	btree_walk_node_t child;
+	int i;
+
+	fclose(node->fp);
+
+	/*
+	 * Link in the children's output segments after ours and queue
+	 * them, rightmost first so that the leftmost child is popped
+	 * first.
+	 */
+	atomic_add_int(&walk->pending, node->nchildren);
+
+	pthread_mutex_lock(&walk->lock);
+	prev = node->seg;
+	for (i = 0; i < node->nchildren; ++i) {
+		child = node->children[i];
+		child->seg = calloc(1, sizeof(*child->seg));
+		child->seg->next = prev->next;
+		prev->next = child->seg;
+		prev = child->seg;
+	}
+	node->seg->done = 1;
+	btree_walk_output(walk);
+	pthread_mutex_unlock(&walk->lock);
+
+	for (i = node->nchildren - 1; i >= 0; --i)
+		btree_walk_queue_push(&worker->queue, node->children[i]);
+	if (node->nchildren > 1 && walk->idle)
+		pthread_cond_broadcast(&walk->cond);
+
+	free(node->children);
+	free(node);
+
+	if (atomic_fetchadd_int(&walk->pending, -1) == 1) {
+		pthread_mutex_lock(&walk->lock);
+		pthread_cond_broadcast(&walk->cond);
+		pthread_mutex_unlock(&walk->lock);
+	}
+}
+
+static
+void *
+btree_walk_thread(void *arg)
+{
+	btree_walk_worker_t worker = arg;
+	btree_walk_t walk = worker->walk;
+	btree_walk_node_t node;
+	btree_walk_seg_t seg;
+
+	while ((node = btree_walk_next(worker)) != NULL) {
+		seg = node->seg;
+		node->fp = open_memstream(&seg->buf, &seg->len);
+		if (node->fp == NULL) {
+			err(1, "open_memstream");
+			/* not reached */
+		}
+		walk->func(node, worker->arg);
+		btree_walk_done(worker, node);
+	}
+	return(NULL);
+}
+
+/*
+ * Walk the B-Tree starting at node_offset with nthreads threads.
+ * args[i] is passed to func when called from the i'th thread.
+ */
+void
+btree_walk(hammer_off_t node_offset, btree_walk_func_t func, void **args,
+	int nthreads)
+{
+	struct btree_walk walk;
+	struct btree_walk_node node;
+	btree_walk_node_t root;
+	btree_walk_worker_t worker;
+	int i;
+
+	bzero(&walk, sizeof(walk));
+	walk.func = func;
+	walk.nthreads = nthreads;
+
+	if (nthreads <= 1) {
+		bzero(&node, sizeof(node));
+		node.node_offset = node_offset;
+		node.mirror_tid = HAMMER_MAX_TID;
+		node.fp = stdout;
+		node.walk = &walk;
+		walk.arg = args[0];
+		func(&node, walk.arg);
+		return;
+	}
+
+	fflush(stdout);
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+	walk.workers = calloc(nthreads, sizeof(*walk.workers));
+
+	root = btree_walk_node_alloc(&walk, node_offset, HAMMER_MAX_TID, 0,
+				     NULL);
+	root->seg = calloc(1, sizeof(*root->seg));
+	walk.head = root->seg;
+	walk.pending = 1;
+
+	for (i = 0; i < nthreads; ++i) {
+		worker = &walk.workers[i];
+		worker->walk = &walk;
+		worker->index = i;
+		worker->arg = args[i];
+		pthread_mutex_init(&worker->queue.lock, NULL);
+	}
+	btree_walk_queue_push(&walk.workers[0].queue, root);
+
+	for (i = 0; i < nthreads; ++i) {
+		worker = &walk.workers[i];
+		if (pthread_create(&worker->thread, NULL, btree_walk_thread,
+				   worker)) {
+			err(1, "pthread_create");
+			/* not reached */
+		}
+	}
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(walk.workers[i].thread, NULL);
+
+	/*
+	 * Idle workers keep stealing from the other queues until the
+	 * last one exits, only tear the queues down after joining them all.
+	 */
+	for (i = 0; i < nthreads; ++i) {
+		worker = &walk.workers[i];
+		pthread_mutex_destroy(&worker->queue.lock);
+		free(worker->queue.items);
+	}
+	assert(walk.head == NULL);
+	assert(walk.pending == 0);
+	fflush(stdout);
+
+	free(walk.workers);
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+}
+
+/*
+ * Taken from /usr/src/sys/vfs/hammer/hammer_btree.c.
+ */
+int
+hammer_btree_cmp(hammer_base_elm_t key1, hammer_base_elm_t key2)
+{
+	if (key1->localization < key2->localization)
+		return(-5);
+	if (key1->localization > key2->localization)
+		return(5);
+
+	if (key1->obj_id < key2->obj_id)
+		return(-4);
+	if (key1->obj_id > key2->obj_id)
+		return(4);
+
+	if (key1->rec_type < key2->rec_type)
+		return(-3);
+	if (key1->rec_type > key2->rec_type)
+		return(3);
+
+	if (key1->key < key2->key)
+		return(-2);
+	if (key1->key > key2->key)
+		return(2);
+
+	if (key1->create_tid == 0) {
+		if (key2->create_tid == 0)
+			return(0);
+		return(1);
+	}
+	if (key2->create_tid == 0)
+		return(-1);
+	if (key1->create_tid < key2->create_tid)
+		return(-1);
+	if (key1->create_tid > key2->create_tid)
+		return(1);
+	return(0);
+}
+
+/*
+ * Copy a B-Tree node into *node and check its CRC and header.
+ * Returns 0 or EIO.
+ */
+int
+btree_get_node(hammer_off_t node_offset, hammer_node_ondisk_t node)
+{
+	buffer_info_t buffer = NULL;
+	void *data;
+
+	if (hammer_is_zone_btree(node_offset) == 0 ||
+	    (node_offset & (sizeof(*node) - 1))) {
+		fprintf(stderr, "B-Tree node %016jx: bad offset\n",
+			(intmax_t)node_offset);
+		return(EIO);
+	}
+	data = get_buffer_data(node_offset, &buffer, 0);
+	if (data == NULL) {
+		fprintf(stderr, "B-Tree node %016jx: not allocated\n",
+			(intmax_t)node_offset);
+		return(EIO);
+	}
+	bcopy(data, node, sizeof(*node));
+	rel_buffer(buffer);
+
+	if (hammer_crc_test_btree(HammerVersion, node) == 0 ||
+	    node->count < 0 ||
+	    node->count > hammer_node_max_elements(node->type)) {
+		fprintf(stderr, "B-Tree node %016jx: bad CRC or header\n",
+			(intmax_t)node_offset);
+		return(EIO);
+	}
+	return(0);
+}
+
+/*
+ * Binary search a node for the first element which may contain key.
+ * For an internal node that is the first element whose right boundary,
+ * the element which follows it, is beyond key.  For a leaf it is the
+ * first element not below key.
+ */
+static
+int
+btree_search_index(hammer_node_ondisk_t node, hammer_base_elm_t key)
+{
+	int b = 0;
+	int e = node->count;
+	int i;
+
+	while (b < e) {
+		i = (b + e) / 2;
+		if (node->type == HAMMER_BTREE_TYPE_INTERNAL) {
+			if (hammer_btree_cmp(&node->elms[i + 1].base, key) <= 0)
+				b = i + 1;
+			else
+				e = i;
+		} else {
+			if (hammer_btree_cmp(&node->elms[i].base, key) < 0)
+				b = i + 1;
+			else
+				e = i;
+		}
+	}
+	return(b);
+}
+
+/*
+ * Nothing below elm changed since search->mirror_tid.  Report the
+ * range it covers, clipped to the search range, as the kernel does for
+ * a mirror-filtered cursor.  The right boundary is the next element.
+ */
+static
+int
+btree_search_skip(hammer_btree_elm_t elm, btree_search_t search)
+{
+	struct hammer_base_elm skip_beg = elm[0].base;
+	struct hammer_base_elm skip_end = elm[1].base;
+
+	if (hammer_btree_cmp(&skip_beg, &search->key_beg) < 0)
+		skip_beg = search->key_beg;
+	if (hammer_btree_cmp(&skip_end, &search->key_end) > 0)
+		skip_end = search->key_end;
+	return(search->skip(&skip_beg, &skip_end, search->arg));
+}
+
+static
+int
+btree_search_node(hammer_off_t node_offset, btree_search_t search,
+	int depth)
+{
+	struct hammer_node_ondisk node;
+	hammer_btree_elm_t elm;
+	hammer_base_elm_t base;
+	int error;
+	int i;
+
+	if (depth > BTREE_SEARCH_MAXDEPTH) {
+		fprintf(stderr, "B-Tree node %016jx: too deep\n",
+			(intmax_t)node_offset);
+		return(EIO);
+	}
+	if (search->get_node)
+		error = search->get_node(node_offset, &node);
+	else
+		error = btree_get_node(node_offset, &node);
+	if (error)
+		return(error);
+	++search->nodes;
+
+	for (i = btree_search_index(&node, &search->key_beg);
+	     i < node.count; ++i) {
+		elm = &node.elms[i];
+		base = &elm->base;
+		if (hammer_btree_cmp(base, &search->key_end) > 0)
+			return(BTREE_SEARCH_STOP);
+		if (node.type == HAMMER_BTREE_TYPE_INTERNAL) {
+			if (search->skip &&
+			    elm->internal.mirror_tid < search->mirror_tid) {
+				error = btree_search_skip(elm, search);
+			} else {
+				error = btree_search_node(
+						elm->internal.subtree_offset,
+						search, depth + 1);
+			}
+		} else {
+			if (base->btype != HAMMER_BTREE_TYPE_RECORD)
+				continue;
+			if (search->asof &&
+			    (base->create_tid > search->asof ||
+			     (base->delete_tid &&
+			      base->delete_tid <= search->asof))) {
+				continue;
+			}
+			error = search->func(&elm->leaf, search->arg);
+		}
+		if (error)
+			return(error);
+	}
+	return(0);
+}
+
+/*
+ * Call search->func for each record between search->key_beg and
+ * search->key_end inclusive which is visible as of search->asof, in
+ * B-Tree order.  An asof of 0 matches all records.  Only the nodes whose
+ * boundaries overlap the range are read, so a point lookup reads one node
+ * per level.
+ *
+ * Returns 0 or an errno value.  func stops the search early by
+ * returning BTREE_SEARCH_STOP, or an errno value which is returned.
+ */
+int
+btree_search(hammer_off_t node_offset, btree_search_t search)
+{
+	int error;
+
+	search->nodes = 0;
+	error = btree_search_node(node_offset, search, 0);
+	if (error == BTREE_SEARCH_STOP)
+		error = 0;
+	return(error);
+}
+
+static
+int
+btree_lookup_callback(hammer_btree_leaf_elm_t leaf, void *arg)
+{
+	bcopy(leaf, arg, sizeof(*leaf));
+	return(BTREE_SEARCH_STOP);
+}
+
+/*
+ * Look up the record matching key, ignoring its create_tid, which is
+ * visible as of asof.  Returns 0, ENOENT or EIO.
+ */
+int
+btree_lookup(hammer_off_t node_offset, hammer_base_elm_t key,
+	hammer_tid_t asof, hammer_btree_leaf_elm_t leaf)
+{
+	struct btree_search search;
+	int error;
+
+	bzero(&search, sizeof(search));
+	search.key_beg = *key;
+	search.key_beg.create_tid = 1;
+	search.key_end = *key;
+	search.key_end.create_tid = 0;	/* infinity */
+	search.asof = asof;
+	search.func = btree_lookup_callback;
+	search.arg = leaf;
+
+	leaf->base.btype = 0;
+	error = btree_search(node_offset, &search);
+	if (error == 0 && leaf->base.btype != HAMMER_BTREE_TYPE_RECORD)
+		error = ENOENT;
+	return(error);
+}
@@ -36,9 +36,40 @@
 
 #include "hammer_util.h"
 
-static int CacheUse;
-static int CacheMax = HAMMER_BUFSIZE * 1024;
-static TAILQ_HEAD(, cache_info) CacheList = TAILQ_HEAD_INITIALIZER(CacheList);
+#include <pthread.h>
+#include <machine/atomic.h>
+
+/*
+ * The buffer cache is split into HAMMER_CACHE_SHARDS shards, each of which
+ * is an open-addressing (linear probing) hash table of buffer pointers
+ * protected by a rwlock.  Lookups only take the shared lock, so concurrent
+ * readers of the same shard do not serialize.  Buffer refs are atomic and
+ * may only be acquired with a shard lock held, which makes it safe for
+ * the eviction code to free a buffer with zero refs under the exclusive
+ * lock.
+ *
+ * Eviction uses the CLOCK algorithm.  Each shard has a hand which sweeps
+ * the slots of the hash table, clearing the used bit of recently accessed
+ * buffers and evicting unreferenced buffers whose used bit is already
+ * clear.  This avoids moving buffers around a global LRU list on every
+ * access.
+ */
+typedef struct cache_shard {
+	pthread_rwlock_t	lock;
+	buffer_info_t		*table;		/* open-addressing slots */
+	int			size;		/* number of slots, power of 2 */
+	int			bits;		/* log2(size) */
+	int			count;		/* number of buffers */
+	int			hand;		/* CLOCK hand */
+} *cache_shard_t;
+
+static volatile u_long CacheUse;
+static volatile u_long CacheMax = HAMMER_BUFSIZE * 1024;
+static volatile u_int CacheFlushShard;
+static struct cache_shard CacheShards[HAMMER_CACHE_SHARDS];
+static pthread_once_t CacheOnce = PTHREAD_ONCE_INIT;
+static FILE *CacheTrace;
+static pthread_mutex_t CacheTraceLock = PTHREAD_MUTEX_INITIALIZER;
 
 int
 hammer_parse_cache_size(const char *arg)
@@ -81,58 +112,326 @@ hammer_parse_cache_size(const char *arg)
 	return(0);
 }
 
+/*
+ * Buffers are distributed round-robin over the shards by their buffer
+ * number, so a sequential scan spreads evenly.  The slot index within
+ * a shard is the top bits of a Fibonacci hash of the buffer number.
+ */
+static __inline
+cache_shard_t
+cache_shard(hammer_off_t zone2_offset)
+{
+	uint64_t n = zone2_offset / HAMMER_BUFSIZE;
+
+	return(&CacheShards[n & HAMMER_CACHE_SHARDMASK]);
+}
+
+static __inline
+int
+cache_slot(const cache_shard_t shard, hammer_off_t zone2_offset)
+{
+	uint64_t n = zone2_offset / HAMMER_BUFSIZE;
+
+	return((int)((n * 0x9E3779B97F4A7C15ULL) >> (64 - shard->bits)));
+}
+
+static
 void
-hammer_cache_add(cache_info_t cache)
+cache_shard_alloc(cache_shard_t shard, int bits)
 {
-	TAILQ_INSERT_HEAD(&CacheList, cache, entry);
-	CacheUse += HAMMER_BUFSIZE;
+	shard->bits = bits;
+	shard->size = 1 << bits;
+	shard->table = calloc(shard->size, sizeof(*shard->table));
+	if (shard->table == NULL) {
+		err(1, "cache_shard_alloc");
+		/* not reached */
+	}
+	shard->hand = 0;
 }
 
+/*
+ * Size the shards so that CacheMax worth of buffers fills each table to
+ * at most 50%.
+ */
+static
 void
-hammer_cache_del(cache_info_t cache)
+cache_init(void)
 {
-	TAILQ_REMOVE(&CacheList, cache, entry);
-	CacheUse -= HAMMER_BUFSIZE;
+	cache_shard_t shard;
+	const char *path;
+	u_long nbufs;
+	int bits = 6;
+	int i;
+
+	nbufs = CacheMax / HAMMER_BUFSIZE / HAMMER_CACHE_SHARDS * 2;
+	while ((1UL << bits) < nbufs)
+		++bits;
+
+	for (i = 0; i < HAMMER_CACHE_SHARDS; ++i) {
+		shard = &CacheShards[i];
+		pthread_rwlock_init(&shard->lock, NULL);
+		cache_shard_alloc(shard, bits);
+	}
+
+	if ((path = getenv("HAMMER_CACHE_TRACE")) != NULL) {
+		CacheTrace = fopen(path, "a");
+		if (CacheTrace == NULL) {
+			err(1, "Failed to open %s", path);
+			/* not reached */
+		}
+	}
 }
 
+static __inline
 void
-hammer_cache_used(cache_info_t cache)
+cache_trace(hammer_off_t zone2_offset)
 {
-	TAILQ_REMOVE(&CacheList, cache, entry);
-	TAILQ_INSERT_TAIL(&CacheList, cache, entry);
+	if (CacheTrace) {
+		pthread_mutex_lock(&CacheTraceLock);
+		fprintf(CacheTrace, "%016jx\n", (uintmax_t)zone2_offset);
+		pthread_mutex_unlock(&CacheTraceLock);
+	}
 }
 
+/*
+ * Place buffer in the first free slot of its probe sequence.
+ * The shard must be exclusively locked and must not be full.
+ */
+static
 void
-hammer_cache_flush(void)
+cache_shard_place(cache_shard_t shard, buffer_info_t buffer)
 {
-	cache_info_t cache;
-	cache_info_t first = NULL;
-	int count = 0;
-
-	if (CacheUse >= CacheMax) {
-		while ((cache = TAILQ_FIRST(&CacheList)) != NULL) {
-			if (cache == first)
-				break; /* seen this ref'd before */
-
-			if (cache->refs) {
-				if (first == NULL)
-					first = cache;
-				hammer_cache_used(cache);
-				count++;
+	int mask = shard->size - 1;
+	int i;
+
+	i = cache_slot(shard, buffer->zone2_offset);
+	while (shard->table[i] != NULL)
+		i = (i + 1) & mask;
+	shard->table[i] = buffer;
+}
+
+static
+void
+cache_shard_grow(cache_shard_t shard)
+{
+	buffer_info_t *table = shard->table;
+	int size = shard->size;
+	int i;
+
+	cache_shard_alloc(shard, shard->bits + 1);
+	for (i = 0; i < size; ++i) {
+		if (table[i])
+			cache_shard_place(shard, table[i]);
+	}
+	free(table);
+}
+
+/*
+ * Remove the buffer in slot i using backward shift deletion, so that
+ * no tombstones are required for subsequent lookups.
+ */
+static
+void
+cache_shard_remove(cache_shard_t shard, int i)
+{
+	buffer_info_t buffer;
+	int mask = shard->size - 1;
+	int j = i;
+	int k;
+
+	shard->table[i] = NULL;
+	for (;;) {
+		j = (j + 1) & mask;
+		if ((buffer = shard->table[j]) == NULL)
+			break;
+		k = cache_slot(shard, buffer->zone2_offset);
+		if (i <= j) {
+			if (i < k && k <= j)
+				continue;
+		} else {
+			if (i < k || k <= j)
 				continue;
-			}
-			if (count >= (CacheUse / HAMMER_BUFSIZE)) {
-				CacheMax += HAMMER_BUFSIZE * 512;
-				count = 0;
-			}
-
-			cache->refs = 1;
-			cache->delete = 1;
-			rel_buffer((buffer_info_t)cache);
-
-			if (CacheUse < CacheMax / 2)
-				break;
 		}
+		shard->table[i] = buffer;
+		shard->table[j] = NULL;
+		i = j;
 	}
+	--shard->count;
 }
 
+/*
+ * Lookup a cached buffer.  If found the buffer is returned referenced.
+ */
+buffer_info_t
+hammer_cache_lookup(hammer_off_t zone2_offset)
+{
+	cache_shard_t shard;
+	buffer_info_t buffer;
+	int mask;
+	int i;
+
+	pthread_once(&CacheOnce, cache_init);
+	cache_trace(zone2_offset);
+	shard = cache_shard(zone2_offset);
+
+	pthread_rwlock_rdlock(&shard->lock);
+	mask = shard->size - 1;
+	i = cache_slot(shard, zone2_offset);
+	while ((buffer = shard->table[i]) != NULL) {
+		if (buffer->zone2_offset == zone2_offset) {
+			atomic_add_int(&buffer->cache.refs, 1);
+			buffer->cache.used = 1;
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	pthread_rwlock_unlock(&shard->lock);
+
+	return(buffer);
+}
+
+/*
+ * Add a newly allocated buffer to the cache and return it referenced.
+ * If another thread has added a buffer for the same offset in the
+ * meantime, the existing buffer is referenced and returned instead
+ * and the caller is responsible for disposing of its own copy.
+ *
+ * Buffers added by readahead start with a clear used bit so that they
+ * are the first to be evicted if nobody ends up accessing them.
+ */
+buffer_info_t
+hammer_cache_add(buffer_info_t buffer, int readahead)
+{
+	cache_shard_t shard;
+	buffer_info_t scan;
+	int mask;
+	int i;
+
+	pthread_once(&CacheOnce, cache_init);
+	shard = cache_shard(buffer->zone2_offset);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	mask = shard->size - 1;
+	i = cache_slot(shard, buffer->zone2_offset);
+	while ((scan = shard->table[i]) != NULL) {
+		if (scan->zone2_offset == buffer->zone2_offset) {
+			atomic_add_int(&scan->cache.refs, 1);
+			scan->cache.used = 1;
+			pthread_rwlock_unlock(&shard->lock);
+			return(scan);
+		}
+		i = (i + 1) & mask;
+	}
+
+	if ((shard->count + 1) * 2 > shard->size)
+		cache_shard_grow(shard);
+	buffer->cache.refs = 1;
+	buffer->cache.used = !readahead;
+	cache_shard_place(shard, buffer);
+	++shard->count;
+	atomic_add_long(&CacheUse, HAMMER_BUFSIZE);
+	pthread_rwlock_unlock(&shard->lock);
+
+	return(buffer);
+}
+
+void
+hammer_cache_used(cache_info_t cache)
+{
+	cache->used = 1;
+}
+
+/*
+ * Call func on every cached buffer which belongs to volume.
+ */
+void
+hammer_cache_scan(volume_info_t volume, void (*func)(buffer_info_t))
+{
+	cache_shard_t shard;
+	buffer_info_t buffer;
+	int i, j;
+
+	pthread_once(&CacheOnce, cache_init);
+
+	for (i = 0; i < HAMMER_CACHE_SHARDS; ++i) {
+		shard = &CacheShards[i];
+		pthread_rwlock_rdlock(&shard->lock);
+		for (j = 0; j < shard->size; ++j) {
+			buffer = shard->table[j];
+			if (buffer && buffer->volume == volume)
+				func(buffer);
+		}
+		pthread_rwlock_unlock(&shard->lock);
+	}
+}
+
+/*
+ * Run the CLOCK hand of an exclusively locked shard until the shard is
+ * down to target buffers or the hand has gone around twice.  Modified
+ * buffers are written out before they are freed.
+ */
+static
+void
+cache_shard_clock(cache_shard_t shard, int target)
+{
+	buffer_info_t buffer;
+	int n;
+
+	for (n = shard->size * 2; n > 0 && shard->count > target; --n) {
+		buffer = shard->table[shard->hand];
+		if (buffer == NULL || buffer->cache.refs) {
+			shard->hand = (shard->hand + 1) & (shard->size - 1);
+			continue;
+		}
+		if (buffer->cache.used) {
+			buffer->cache.used = 0;
+			shard->hand = (shard->hand + 1) & (shard->size - 1);
+			continue;
+		}
+
+		/*
+		 * Removal may shift another buffer into the current slot,
+		 * so the hand stays where it is.
+		 */
+		cache_shard_remove(shard, shard->hand);
+		atomic_subtract_long(&CacheUse, HAMMER_BUFSIZE);
+		if (buffer->cache.modified)
+			flush_buffer(buffer);
+		free(buffer->ondisk);
+		free(buffer);
+	}
+}
+
+void
+hammer_cache_flush(void)
+{
+	cache_shard_t shard;
+	u_int start;
+	int target;
+	int i;
+
+	if (CacheUse < CacheMax)
+		return;
+
+	/*
+	 * Bring the cache down to half of CacheMax.  Start at a different
+	 * shard each time so that concurrent flushers do not pile up on
+	 * the same lock.
+	 */
+	target = CacheMax / 2 / HAMMER_BUFSIZE / HAMMER_CACHE_SHARDS;
+	start = atomic_fetchadd_int(&CacheFlushShard, 1);
+	for (i = 0; i < HAMMER_CACHE_SHARDS; ++i) {
+		if (CacheUse < CacheMax / 2)
+			break;
+		shard = &CacheShards[(start + i) & HAMMER_CACHE_SHARDMASK];
+		pthread_rwlock_wrlock(&shard->lock);
+		cache_shard_clock(shard, target);
+		pthread_rwlock_unlock(&shard->lock);
+	}
+
+	/*
+	 * Everything is referenced, grow the cache.
+	 */
+	if (CacheUse >= CacheMax)
+		atomic_add_long(&CacheMax, HAMMER_BUFSIZE * 512);
+}
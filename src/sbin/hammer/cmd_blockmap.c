@@ -35,6 +35,7 @@
 #include "hammer.h"
 
 #include <sys/tree.h>
+#include <machine/atomic.h>
 
 /*
  * Each collect covers 1<<(19+23) bytes address space of layer 1.
@@ -67,26 +68,34 @@ RB_GENERATE2(collect_rb_tree, collect, entry, collect_compare, hammer_off_t,
 
 static void dump_blockmap(int zone);
 static void check_freemap(hammer_blockmap_t freemap);
-static void check_btree_node(hammer_off_t node_offset, int depth);
+static void check_btree(hammer_off_t node_offset);
+static void check_btree_node(btree_walk_node_t wn, void *arg);
 static void check_undo(hammer_blockmap_t undomap);
-static __inline void collect_btree_root(hammer_off_t node_offset);
-static __inline void collect_btree_internal(hammer_btree_elm_t elm);
-static __inline void collect_btree_leaf(hammer_btree_elm_t elm);
+static __inline void collect_btree_root(struct collect_rb_tree *tree,
+	hammer_off_t node_offset);
+static __inline void collect_btree_internal(struct collect_rb_tree *tree,
+	hammer_btree_elm_t elm);
+static __inline void collect_btree_leaf(struct collect_rb_tree *tree,
+	hammer_btree_elm_t elm);
 static __inline void collect_freemap_layer1(hammer_blockmap_t freemap);
 static __inline void collect_freemap_layer2(hammer_blockmap_layer1_t layer1);
 static __inline void collect_undo(hammer_off_t scan_offset,
 	hammer_fifo_head_t head);
-static void collect_blockmap(hammer_off_t offset, int32_t length, int zone);
+static void collect_blockmap(struct collect_rb_tree *tree,
+	hammer_off_t offset, int32_t length, int zone);
 static hammer_blockmap_layer2_t collect_get_track(
 	collect_t collect, hammer_off_t offset, int zone,
 	hammer_blockmap_layer2_t layer2);
-static collect_t collect_get(hammer_off_t phys_offset);
+static collect_t collect_get(struct collect_rb_tree *tree,
+	hammer_off_t phys_offset);
+static void collect_merge(struct collect_rb_tree *tree,
+	struct collect_rb_tree *from);
 static void dump_collect_table(void);
 static void dump_collect(collect_t collect, zone_stat_t stats);
 
 static int num_bad_layer1 = 0;
 static int num_bad_layer2 = 0;
-static int num_bad_node = 0;
+static volatile u_int num_bad_node = 0;
 
 void
 hammer_cmd_blockmap(void)
@@ -240,7 +249,7 @@ hammer_cmd_checkmap(void)
 
 	printf("Collecting allocation info from B-Tree: ");
 	fflush(stdout);
-	check_btree_node(node_offset, 0);
+	check_btree(node_offset);
 	printf("done\n");
 
 	printf("Collecting allocation info from UNDO: ");
@@ -271,19 +280,53 @@ check_freemap(hammer_blockmap_t freemap)
 	rel_buffer(buffer1);
 }
 
+/*
+ * With more than one thread each thread collects into its own tree,
+ * which are merged into CollectTree when the walk is done.
+ */
 static
 void
-check_btree_node(hammer_off_t node_offset, int depth)
+check_btree(hammer_off_t node_offset)
 {
+	struct collect_rb_tree *trees;
+	void **args;
+	int i;
+
+	args = calloc(NThreadsOpt, sizeof(*args));
+	if (NThreadsOpt <= 1) {
+		args[0] = &CollectTree;
+		btree_walk(node_offset, check_btree_node, args, NThreadsOpt);
+		free(args);
+		return;
+	}
+
+	trees = calloc(NThreadsOpt, sizeof(*trees));
+	for (i = 0; i < NThreadsOpt; ++i) {
+		RB_INIT(&trees[i]);
+		args[i] = &trees[i];
+	}
+	btree_walk(node_offset, check_btree_node, args, NThreadsOpt);
+	for (i = 0; i < NThreadsOpt; ++i)
+		collect_merge(&CollectTree, &trees[i]);
+	free(trees);
+	free(args);
+}
+
+static
+void
+check_btree_node(btree_walk_node_t wn, void *arg)
+{
+	struct collect_rb_tree *tree = arg;
 	buffer_info_t buffer = NULL;
 	hammer_node_ondisk_t node;
 	hammer_btree_elm_t elm;
+	hammer_off_t node_offset = wn->node_offset;
 	int i;
 	char badc = ' ';  /* good */
 	char badm = ' ';  /* good */
 
-	if (depth == 0)
-		collect_btree_root(node_offset);
+	if (wn->depth == 0)
+		collect_btree_root(tree, node_offset);
 	node = get_buffer_data(node_offset, &buffer, 0);
 
 	if (node == NULL) {
@@ -294,19 +337,19 @@ check_btree_node(hammer_off_t node_offset, int depth)
 	}
 
 	if (badm != ' ' || badc != ' ') {  /* not good */
-		++num_bad_node;
-		printf("%c%c   NODE %016jx ",
+		atomic_add_int(&num_bad_node, 1);
+		fprintf(wn->fp, "%c%c   NODE %016jx ",
 			badc, badm, (uintmax_t)node_offset);
 		if (node == NULL) {
-			printf("(IO ERROR)\n");
+			fprintf(wn->fp, "(IO ERROR)\n");
 			rel_buffer(buffer);
 			return;
 		} else {
-			printf("cnt=%02d p=%016jx type=%c depth=%d mirror=%016jx\n",
+			fprintf(wn->fp, "cnt=%02d p=%016jx type=%c depth=%d mirror=%016jx\n",
 			       node->count,
 			       (uintmax_t)node->parent,
 			       (node->type ? node->type : '?'),
-			       depth,
+			       wn->depth,
 			       (uintmax_t)node->mirror_tid);
 		}
 	}
@@ -317,14 +360,13 @@ check_btree_node(hammer_off_t node_offset, int depth)
 		switch(node->type) {
 		case HAMMER_BTREE_TYPE_INTERNAL:
 			if (elm->internal.subtree_offset) {
-				collect_btree_internal(elm);
-				check_btree_node(elm->internal.subtree_offset,
-						 depth + 1);
+				collect_btree_internal(tree, elm);
+				btree_walk_child(wn, elm);
 			}
 			break;
 		case HAMMER_BTREE_TYPE_LEAF:
 			if (elm->leaf.data_offset)
-				collect_btree_leaf(elm);
+				collect_btree_leaf(tree, elm);
 			break;
 		default:
 			assert(!DebugOpt);
@@ -379,7 +421,7 @@ collect_freemap_layer1(hammer_blockmap_t freemap)
 	 */
 	hammer_off_t zone4_offset = hammer_xlate_to_zoneX(
 		HAMMER_ZONE_FREEMAP_INDEX, freemap->phys_offset);
-	collect_blockmap(zone4_offset, HAMMER_BIGBLOCK_SIZE,
+	collect_blockmap(&CollectTree, zone4_offset, HAMMER_BIGBLOCK_SIZE,
 		HAMMER_ZONE_FREEMAP_INDEX);
 }
 
@@ -393,31 +435,31 @@ collect_freemap_layer2(hammer_blockmap_layer1_t layer1)
 	 */
 	hammer_off_t zone4_offset = hammer_xlate_to_zoneX(
 		HAMMER_ZONE_FREEMAP_INDEX, layer1->phys_offset);
-	collect_blockmap(zone4_offset, HAMMER_BIGBLOCK_SIZE,
+	collect_blockmap(&CollectTree, zone4_offset, HAMMER_BIGBLOCK_SIZE,
 		HAMMER_ZONE_FREEMAP_INDEX);
 }
 
 static __inline
 void
-collect_btree_root(hammer_off_t node_offset)
+collect_btree_root(struct collect_rb_tree *tree, hammer_off_t node_offset)
 {
-	collect_blockmap(node_offset,
+	collect_blockmap(tree, node_offset,
 		sizeof(struct hammer_node_ondisk),  /* 4KB */
 		HAMMER_ZONE_BTREE_INDEX);
 }
 
 static __inline
 void
-collect_btree_internal(hammer_btree_elm_t elm)
+collect_btree_internal(struct collect_rb_tree *tree, hammer_btree_elm_t elm)
 {
-	collect_blockmap(elm->internal.subtree_offset,
+	collect_blockmap(tree, elm->internal.subtree_offset,
 		sizeof(struct hammer_node_ondisk),  /* 4KB */
 		HAMMER_ZONE_BTREE_INDEX);
 }
 
 static __inline
 void
-collect_btree_leaf(hammer_btree_elm_t elm)
+collect_btree_leaf(struct collect_rb_tree *tree, hammer_btree_elm_t elm)
 {
 	int zone;
 
@@ -439,7 +481,7 @@ collect_btree_leaf(hammer_btree_elm_t elm)
 		zone = HAMMER_ZONE_UNAVAIL_INDEX;
 		break;
 	}
-	collect_blockmap(elm->leaf.data_offset,
+	collect_blockmap(tree, elm->leaf.data_offset,
 		HAMMER_DATA_DOALIGN(elm->leaf.data_len), zone);
 }
 
@@ -447,13 +489,14 @@ static __inline
 void
 collect_undo(hammer_off_t scan_offset, hammer_fifo_head_t head)
 {
-	collect_blockmap(scan_offset, head->hdr_size,
+	collect_blockmap(&CollectTree, scan_offset, head->hdr_size,
 		HAMMER_ZONE_UNDO_INDEX);
 }
 
 static
 void
-collect_blockmap(hammer_off_t offset, int32_t length, int zone)
+collect_blockmap(struct collect_rb_tree *tree, hammer_off_t offset,
+	int32_t length, int zone)
 {
 	struct hammer_blockmap_layer1 layer1;
 	struct hammer_blockmap_layer2 layer2;
@@ -468,18 +511,18 @@ collect_blockmap(hammer_off_t offset, int32_t length, int zone)
 		assert(hammer_is_zone_raw_buffer(result_offset));
 		assert(error == 0);
 	}
-	collect = collect_get(layer1.phys_offset); /* layer2 address */
+	collect = collect_get(tree, layer1.phys_offset); /* layer2 address */
 	track2 = collect_get_track(collect, result_offset, zone, &layer2);
 	track2->bytes_free -= length;
 }
 
 static
 collect_t
-collect_get(hammer_off_t phys_offset)
+collect_get(struct collect_rb_tree *tree, hammer_off_t phys_offset)
 {
 	collect_t collect;
 
-	collect = RB_LOOKUP(collect_rb_tree, &CollectTree, phys_offset);
+	collect = RB_LOOKUP(collect_rb_tree, tree, phys_offset);
 	if (collect)
 		return(collect);
 
@@ -488,7 +531,7 @@ collect_get(hammer_off_t phys_offset)
 	collect->layer2 = calloc(1, HAMMER_BIGBLOCK_SIZE);  /* 1<<23 bytes */
 	collect->offsets = calloc(HAMMER_BLOCKMAP_RADIX2, sizeof(hammer_off_t));
 	collect->phys_offset = phys_offset;
-	RB_INSERT(collect_rb_tree, &CollectTree, collect);
+	RB_INSERT(collect_rb_tree, tree, collect);
 
 	return (collect);
 }
@@ -503,6 +546,34 @@ collect_rel(collect_t collect)
 	free(collect);
 }
 
+/*
+ * Merge and free the collects of a per-thread tree.  Tracks are summed
+ * up as deltas from HAMMER_BIGBLOCK_SIZE.
+ */
+static
+void
+collect_merge(struct collect_rb_tree *tree, struct collect_rb_tree *from)
+{
+	collect_t collect;
+	collect_t dst;
+	hammer_blockmap_layer2_t track2;
+	int i;
+
+	while ((collect = RB_ROOT(from)) != NULL) {
+		RB_REMOVE(collect_rb_tree, from, collect);
+		dst = collect_get(tree, collect->phys_offset);
+		for (i = 0; i < HAMMER_BLOCKMAP_RADIX2; ++i) {
+			if (collect->track2[i].entry_crc == 0)
+				continue;
+			track2 = collect_get_track(dst, collect->offsets[i],
+				collect->track2[i].zone, &collect->layer2[i]);
+			track2->bytes_free += collect->track2[i].bytes_free -
+					      HAMMER_BIGBLOCK_SIZE;
+		}
+		collect_rel(collect);
+	}
+}
+
 static
 hammer_blockmap_layer2_t
 collect_get_track(collect_t collect, hammer_off_t offset, int zone,
@@ -551,7 +622,7 @@ dump_collect_table(void)
 	}
 
 	if (num_bad_node || VerboseOpt)
-		printf("%d bad nodes\n", num_bad_node);
+		printf("%u bad nodes\n", num_bad_node);
 	if (error || VerboseOpt)
 		printf("%d errors\n", error);
 }
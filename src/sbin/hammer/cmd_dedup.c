@@ -34,60 +34,99 @@
 
 #include "hammer.h"
 
-#include <sys/tree.h>
 #include <libutil.h>
+#include <pthread.h>
+#include <machine/atomic.h>
 #include <crypto/sha2/sha2.h>
 
 #define DEDUP_BUF (64 * 1024)
 
-/* Sorted list of block CRCs - light version for dedup-simulate */
-struct sim_dedup_entry_rb_tree;
-static RB_HEAD(sim_dedup_entry_rb_tree, sim_dedup_entry) sim_dedup_tree =
-					RB_INITIALIZER(&sim_dedup_tree);
-RB_PROTOTYPE2(sim_dedup_entry_rb_tree, sim_dedup_entry, rb_entry,
-		rb_sim_dedup_entry_compare, hammer_crc_t);
+/*
+ * Dedup candidates are kept in a packed index.  Entries are stored in
+ * fixed size slabs and addressed by a 1-based index, and the
+ * open-addressing CRC table keeps the CRC next to the index so probing
+ * does not have to touch the entries.  An entry begins with its CRC.
+ */
+#define DEDUP_SLAB_SHIFT	12
+#define DEDUP_SLAB_COUNT	(1 << DEDUP_SLAB_SHIFT)
+#define DEDUP_SLAB_MASK		(DEDUP_SLAB_COUNT - 1)
+#define DEDUP_SLOTS_MIN		1024
+
+struct dedup_slab {
+	char		**slabs;
+	uint32_t	nslabs;
+	uint32_t	count;		/* entries 1..count allocated */
+	uint32_t	free;		/* free list, linked through entries */
+	size_t		esize;
+};
+
+typedef struct dedup_slab *dedup_slab_t;
+
+struct dedup_slot {
+	hammer_crc_t	crc;
+	uint32_t	idx;		/* 0 if the slot is empty */
+};
+
+struct dedup_index {
+	struct dedup_slab	entries;
+	struct dedup_slot	*slots;
+	uint32_t		mask;
+	uint32_t		used;
+};
+
+typedef struct dedup_index *dedup_index_t;
 
+#define DEDUP_INDEX_INITIALIZER(type)	{ .entries = { .esize = sizeof(type) } }
+
+/*
+ * The leaf fields needed to issue the dedup and get-data ioctls and to
+ * validate a dedup pair.  The record is always a DATA record.
+ */
+struct dedup_leaf {
+	int64_t		obj_id;
+	int64_t		key;
+	hammer_tid_t	create_tid;
+	hammer_off_t	data_offset;
+	uint32_t	localization;
+	int32_t		data_len;
+};
+
+/* Block CRCs - light version for dedup-simulate */
 struct sim_dedup_entry {
 	hammer_crc_t	crc;
 	uint64_t	ref_blks; /* number of blocks referenced */
 	uint64_t	ref_size; /* size of data referenced */
-	RB_ENTRY(sim_dedup_entry) rb_entry;
 };
 
+/*
+ * All blocks of a dedup set have the same data_len so the referenced
+ * size is ref_blks * data_len.  A CRC entry which had a collision is
+ * fictitious, its blocks are accounted in its chain of SHA entries.
+ */
 struct dedup_entry {
-	struct hammer_btree_leaf_elm leaf;
+	hammer_crc_t	data_crc;
+	uint32_t	ref_blks;	/* 0 if fictitious */
 	union {
-		struct {
-			uint64_t ref_blks;
-			uint64_t ref_size;
-		} de;
-		RB_HEAD(sha_dedup_entry_rb_tree, sha_dedup_entry) fict_root;
+		struct dedup_leaf leaf;
+		uint32_t	sha_head;
 	} u;
-	uint8_t flags;
-	RB_ENTRY(dedup_entry) rb_entry;
 };
 
-#define HAMMER_DEDUP_ENTRY_FICTITIOUS	0x0001
+#define DEDUP_ENTRY_FICTITIOUS(de)	((de)->ref_blks == 0)
 
 struct sha_dedup_entry {
-	struct hammer_btree_leaf_elm	leaf;
-	uint64_t			ref_blks;
-	uint64_t			ref_size;
-	uint8_t				sha_hash[SHA256_DIGEST_LENGTH];
-	RB_ENTRY(sha_dedup_entry)	fict_entry;
+	uint32_t	next;		/* must be first (free list) */
+	uint32_t	ref_blks;
+	struct dedup_leaf leaf;
+	uint8_t		sha_hash[SHA256_DIGEST_LENGTH];
 };
 
-/* Sorted list of HAMMER B-Tree keys */
-struct dedup_entry_rb_tree;
-struct sha_dedup_entry_rb_tree;
-
-static RB_HEAD(dedup_entry_rb_tree, dedup_entry) dedup_tree =
-					RB_INITIALIZER(&dedup_tree);
-RB_PROTOTYPE2(dedup_entry_rb_tree, dedup_entry, rb_entry,
-		rb_dedup_entry_compare, hammer_crc_t);
-
-RB_PROTOTYPE(sha_dedup_entry_rb_tree, sha_dedup_entry, fict_entry,
-		rb_sha_dedup_entry_compare);
+static struct dedup_index sim_dedup_index =
+			DEDUP_INDEX_INITIALIZER(struct sim_dedup_entry);
+static struct dedup_index dedup_index =
+			DEDUP_INDEX_INITIALIZER(struct dedup_entry);
+static struct dedup_slab sha_dedup_slab = { .esize =
+			sizeof(struct sha_dedup_entry) };
 
 /*
  * Pass2 list - contains entries that were not dedup'ed because ioctl failed
@@ -129,12 +168,6 @@ static uint64_t dedup_underflows;
 static uint64_t dedup_successes_count;
 static uint64_t dedup_successes_bytes;
 
-static int rb_sim_dedup_entry_compare(struct sim_dedup_entry *sim_de1,
-				struct sim_dedup_entry *sim_de2);
-static int rb_dedup_entry_compare(struct dedup_entry *de1,
-				struct dedup_entry *de2);
-static int rb_sha_dedup_entry_compare(struct sha_dedup_entry *sha_de1,
-				struct sha_dedup_entry *sha_de2);
 typedef int (*scan_pfs_cb_t)(hammer_btree_leaf_elm_t scan_leaf, int flags);
 static void scan_pfs(char *filesystem, scan_pfs_cb_t func, const char *id);
 static int collect_btree_elm(hammer_btree_leaf_elm_t scan_leaf, int flags);
@@ -145,57 +178,311 @@ static void dump_simulated_dedup(void);
 static void dump_real_dedup(void);
 static void dedup_usage(int code);
 
-RB_GENERATE2(sim_dedup_entry_rb_tree, sim_dedup_entry, rb_entry,
-		rb_sim_dedup_entry_compare, hammer_crc_t, crc);
-RB_GENERATE2(dedup_entry_rb_tree, dedup_entry, rb_entry,
-		rb_dedup_entry_compare, hammer_crc_t, leaf.data_crc);
-RB_GENERATE(sha_dedup_entry_rb_tree, sha_dedup_entry, fict_entry,
-		rb_sha_dedup_entry_compare);
+static
+void *
+dedup_slab_entry(dedup_slab_t ds, uint32_t idx)
+{
+	--idx;
+	return(ds->slabs[idx >> DEDUP_SLAB_SHIFT] +
+	       (size_t)(idx & DEDUP_SLAB_MASK) * ds->esize);
+}
 
 static
-int
-rb_sim_dedup_entry_compare(struct sim_dedup_entry *sim_de1,
-			struct sim_dedup_entry *sim_de2)
+uint32_t
+dedup_slab_alloc(dedup_slab_t ds)
 {
-	if (sim_de1->crc < sim_de2->crc)
-		return (-1);
-	if (sim_de1->crc > sim_de2->crc)
-		return (1);
+	void *entry;
+	uint32_t idx;
 
-	return (0);
+	if (ds->free) {
+		idx = ds->free;
+		entry = dedup_slab_entry(ds, idx);
+		ds->free = *(uint32_t *)entry;
+	} else {
+		if (ds->count == UINT32_MAX) {
+			errx(1, "Too many dedup entries");
+			/* not reached */
+		}
+		if (ds->count == ds->nslabs << DEDUP_SLAB_SHIFT) {
+			ds->slabs = realloc(ds->slabs,
+				(ds->nslabs + 1) * sizeof(*ds->slabs));
+			ds->slabs[ds->nslabs] =
+				malloc(DEDUP_SLAB_COUNT * ds->esize);
+			if (ds->slabs[ds->nslabs] == NULL) {
+				err(1, "dedup slab");
+				/* not reached */
+			}
+			++ds->nslabs;
+		}
+		idx = ++ds->count;
+		entry = dedup_slab_entry(ds, idx);
+	}
+	bzero(entry, ds->esize);
+	MemoryUse += ds->esize;
+	return(idx);
 }
 
 static
-int
-rb_dedup_entry_compare(struct dedup_entry *de1, struct dedup_entry *de2)
+void
+dedup_slab_free(dedup_slab_t ds, uint32_t idx)
 {
-	if (de1->leaf.data_crc < de2->leaf.data_crc)
-		return (-1);
-	if (de1->leaf.data_crc > de2->leaf.data_crc)
-		return (1);
+	*(uint32_t *)dedup_slab_entry(ds, idx) = ds->free;
+	ds->free = idx;
+	MemoryUse -= ds->esize;
+}
 
-	return (0);
+/*
+ * Release the entries past count, the slab must not have a free list.
+ */
+static
+void
+dedup_slab_truncate(dedup_slab_t ds, uint32_t count)
+{
+	uint32_t nslabs = (count + DEDUP_SLAB_MASK) >> DEDUP_SLAB_SHIFT;
+
+	assert(ds->free == 0);
+	MemoryUse -= (uint64_t)(ds->count - count) * ds->esize;
+	ds->count = count;
+	while (ds->nslabs > nslabs)
+		free(ds->slabs[--ds->nslabs]);
 }
 
+/*
+ * Free all the entries, MemoryUse is reset by the caller.
+ */
 static
-int
-rb_sha_dedup_entry_compare(struct sha_dedup_entry *sha_de1,
-			struct sha_dedup_entry *sha_de2)
+void
+dedup_slab_destroy(dedup_slab_t ds)
 {
-	unsigned long *h1 = (unsigned long *)&sha_de1->sha_hash;
-	unsigned long *h2 = (unsigned long *)&sha_de2->sha_hash;
-	int i;
+	while (ds->nslabs)
+		free(ds->slabs[--ds->nslabs]);
+	free(ds->slabs);
+	ds->slabs = NULL;
+	ds->count = 0;
+	ds->free = 0;
+}
 
-	for (i = 0; i < SHA256_DIGEST_LENGTH / (int)sizeof(unsigned long); ++i) {
-		if (h1[i] < h2[i])
-			return (-1);
-		if (h1[i] > h2[i])
-			return (1);
+static __inline
+void *
+dedup_index_entry(dedup_index_t ix, uint32_t idx)
+{
+	return(dedup_slab_entry(&ix->entries, idx));
+}
+
+static
+void
+dedup_index_rehash(dedup_index_t ix, uint32_t nslots)
+{
+	uint32_t i;
+	uint32_t h;
+	hammer_crc_t crc;
+
+	if (ix->slots) {
+		MemoryUse -= (uint64_t)(ix->mask + 1) * sizeof(*ix->slots);
+		free(ix->slots);
+	}
+	ix->slots = calloc(nslots, sizeof(*ix->slots));
+	if (ix->slots == NULL) {
+		err(1, "dedup index");
+		/* not reached */
 	}
+	ix->mask = nslots - 1;
+	MemoryUse += (uint64_t)nslots * sizeof(*ix->slots);
+
+	for (i = 1; i <= ix->entries.count; ++i) {
+		crc = *(hammer_crc_t *)dedup_index_entry(ix, i);
+		h = crc & ix->mask;
+		while (ix->slots[h].idx)
+			h = (h + 1) & ix->mask;
+		ix->slots[h].crc = crc;
+		ix->slots[h].idx = i;
+	}
+	ix->used = ix->entries.count;
+}
 
-	return (0);
+static
+void *
+dedup_index_lookup(dedup_index_t ix, hammer_crc_t crc)
+{
+	uint32_t h;
+
+	if (ix->slots == NULL)
+		return(NULL);
+	for (h = crc & ix->mask; ix->slots[h].idx; h = (h + 1) & ix->mask) {
+		if (ix->slots[h].crc == crc)
+			return(dedup_index_entry(ix, ix->slots[h].idx));
+	}
+	return(NULL);
+}
+
+/*
+ * Add a zero-filled entry for crc, which must not be in the index yet.
+ * The table is grown to keep its load factor below 3/4.
+ */
+static
+void *
+dedup_index_insert(dedup_index_t ix, hammer_crc_t crc)
+{
+	void *entry;
+	uint32_t idx;
+	uint32_t h;
+
+	if (ix->slots == NULL) {
+		dedup_index_rehash(ix, DEDUP_SLOTS_MIN);
+	} else if ((uint64_t)(ix->used + 1) * 4 >
+		   (uint64_t)(ix->mask + 1) * 3) {
+		dedup_index_rehash(ix, (ix->mask + 1) * 2);
+	}
+	h = crc & ix->mask;
+	while (ix->slots[h].idx)
+		h = (h + 1) & ix->mask;
+
+	idx = dedup_slab_alloc(&ix->entries);
+	entry = dedup_index_entry(ix, idx);
+	*(hammer_crc_t *)entry = crc;
+	ix->slots[h].crc = crc;
+	ix->slots[h].idx = idx;
+	++ix->used;
+	return(entry);
+}
+
+/*
+ * Drop the entries with a CRC at or above crc_end, calling func on
+ * each one first.  The remaining entries are compacted and the table
+ * is rebuilt for them.
+ */
+static
+void
+dedup_index_trim(dedup_index_t ix, hammer_crc_t crc_end,
+		 void (*func)(void *entry))
+{
+	void *entry;
+	uint32_t nslots;
+	uint32_t i;
+	uint32_t j = 0;
+
+	for (i = 1; i <= ix->entries.count; ++i) {
+		entry = dedup_index_entry(ix, i);
+		if (*(hammer_crc_t *)entry >= crc_end) {
+			if (func)
+				func(entry);
+			continue;
+		}
+		if (++j != i) {
+			memcpy(dedup_index_entry(ix, j), entry,
+			       ix->entries.esize);
+		}
+	}
+	dedup_slab_truncate(&ix->entries, j);
+
+	nslots = DEDUP_SLOTS_MIN;
+	while ((uint64_t)nslots < (uint64_t)j * 2)
+		nslots <<= 1;
+	dedup_index_rehash(ix, nslots);
+}
+
+static
+void
+dedup_index_destroy(dedup_index_t ix)
+{
+	free(ix->slots);
+	ix->slots = NULL;
+	ix->mask = 0;
+	ix->used = 0;
+	dedup_slab_destroy(&ix->entries);
+}
+
+static __inline
+struct sha_dedup_entry *
+sha_dedup_get(uint32_t idx)
+{
+	return(dedup_slab_entry(&sha_dedup_slab, idx));
+}
+
+static
+void
+dedup_leaf_set(struct dedup_leaf *dl, hammer_btree_leaf_elm_t leaf)
+{
+	dl->obj_id = leaf->base.obj_id;
+	dl->key = leaf->base.key;
+	dl->create_tid = leaf->base.create_tid;
+	dl->data_offset = leaf->data_offset;
+	dl->localization = leaf->base.localization;
+	dl->data_len = leaf->data_len;
 }
 
+/*
+ * Rebuild a B-Tree leaf sufficient for the ioctls from a dedup leaf
+ */
+static
+void
+dedup_leaf_get(struct dedup_leaf *dl, hammer_crc_t crc,
+	       hammer_btree_leaf_elm_t leaf)
+{
+	bzero(leaf, sizeof(*leaf));
+	leaf->base.obj_id = dl->obj_id;
+	leaf->base.key = dl->key;
+	leaf->base.create_tid = dl->create_tid;
+	leaf->base.localization = dl->localization;
+	leaf->base.rec_type = HAMMER_RECTYPE_DATA;
+	leaf->base.btype = HAMMER_BTREE_TYPE_RECORD;
+	leaf->data_offset = dl->data_offset;
+	leaf->data_len = dl->data_len;
+	leaf->data_crc = crc;
+}
+
+/*
+ * Release the SHA entries of a fictitious dedup entry
+ */
+static
+void
+dedup_entry_free_sha(void *entry)
+{
+	struct dedup_entry *de = entry;
+	uint32_t idx;
+	uint32_t next;
+
+	if (!DEDUP_ENTRY_FICTITIOUS(de))
+		return;
+	for (idx = de->u.sha_head; idx; idx = next) {
+		next = sha_dedup_get(idx)->next;
+		dedup_slab_free(&sha_dedup_slab, idx);
+	}
+}
+
+static
+struct sha_dedup_entry *
+sha_dedup_find(struct dedup_entry *de, uint8_t *sha_hash)
+{
+	struct sha_dedup_entry *sha_de;
+	uint32_t idx;
+
+	for (idx = de->u.sha_head; idx; idx = sha_de->next) {
+		sha_de = sha_dedup_get(idx);
+		if (bcmp(sha_de->sha_hash, sha_hash,
+			 SHA256_DIGEST_LENGTH) == 0) {
+			return(sha_de);
+		}
+	}
+	return(NULL);
+}
+
+static
+struct sha_dedup_entry *
+sha_dedup_insert(struct dedup_entry *de, hammer_btree_leaf_elm_t leaf,
+		 uint8_t *sha_hash)
+{
+	struct sha_dedup_entry *sha_de;
+	uint32_t idx;
+
+	idx = dedup_slab_alloc(&sha_dedup_slab);
+	sha_de = sha_dedup_get(idx);
+	dedup_leaf_set(&sha_de->leaf, leaf);
+	memcpy(sha_de->sha_hash, sha_hash, SHA256_DIGEST_LENGTH);
+	sha_de->next = de->u.sha_head;
+	de->u.sha_head = idx;
+	return(sha_de);
+}
 /*
  * dedup-simulate <filesystem>
  */
@@ -203,6 +490,7 @@ void
 hammer_cmd_dedup_simulate(char **av, int ac)
 {
 	struct sim_dedup_entry *sim_de;
+	uint32_t i;
 
 	if (ac != 1) {
 		dedup_usage(1);
@@ -231,16 +519,15 @@ hammer_cmd_dedup_simulate(char **av, int ac)
 			dump_simulated_dedup();
 
 		/*
-		 * Calculate simulated dedup ratio and get rid of the tree
+		 * Calculate simulated dedup ratio and get rid of the index
 		 */
-		while ((sim_de = RB_ROOT(&sim_dedup_tree)) != NULL) {
+		for (i = 1; i <= sim_dedup_index.entries.count; ++i) {
+			sim_de = dedup_index_entry(&sim_dedup_index, i);
 			assert(sim_de->ref_blks != 0);
 			dedup_ref_size += sim_de->ref_size;
 			dedup_alloc_size += sim_de->ref_size / sim_de->ref_blks;
-
-			RB_REMOVE(sim_dedup_entry_rb_tree, &sim_dedup_tree, sim_de);
-			free(sim_de);
 		}
+		dedup_index_destroy(&sim_dedup_index);
 		if (DedupCrcEnd && VerboseOpt == 0)
 			printf(".");
 	} while (DedupCrcEnd);
@@ -265,6 +552,8 @@ hammer_cmd_dedup(char **av, int ac)
 	char *tmp;
 	char buf[8];
 	int needfree = 0;
+	uint32_t idx;
+	uint32_t i;
 
 	if (TimeoutOpt > 0)
 		alarm(TimeoutOpt);
@@ -331,30 +620,29 @@ hammer_cmd_dedup(char **av, int ac)
 			dump_real_dedup();
 
 		/*
-		 * Calculate dedup ratio and get rid of the trees
+		 * Calculate dedup ratio and get rid of the index
 		 */
-		while ((de = RB_ROOT(&dedup_tree)) != NULL) {
-			if (de->flags & HAMMER_DEDUP_ENTRY_FICTITIOUS) {
-				while ((sha_de = RB_ROOT(&de->u.fict_root)) != NULL) {
+		for (i = 1; i <= dedup_index.entries.count; ++i) {
+			de = dedup_index_entry(&dedup_index, i);
+			if (DEDUP_ENTRY_FICTITIOUS(de)) {
+				for (idx = de->u.sha_head; idx;
+				     idx = sha_de->next) {
+					sha_de = sha_dedup_get(idx);
 					assert(sha_de->ref_blks != 0);
-					dedup_ref_size += sha_de->ref_size;
-					dedup_alloc_size += sha_de->ref_size / sha_de->ref_blks;
-
-					RB_REMOVE(sha_dedup_entry_rb_tree,
-							&de->u.fict_root, sha_de);
-					free(sha_de);
+					dedup_ref_size += (uint64_t)
+						sha_de->ref_blks *
+						sha_de->leaf.data_len;
+					dedup_alloc_size +=
+						sha_de->leaf.data_len;
 				}
-				assert(RB_EMPTY(&de->u.fict_root));
 			} else {
-				assert(de->u.de.ref_blks != 0);
-				dedup_ref_size += de->u.de.ref_size;
-				dedup_alloc_size += de->u.de.ref_size / de->u.de.ref_blks;
+				dedup_ref_size += (uint64_t)de->ref_blks *
+						  de->u.leaf.data_len;
+				dedup_alloc_size += de->u.leaf.data_len;
 			}
-
-			RB_REMOVE(dedup_entry_rb_tree, &dedup_tree, de);
-			free(de);
 		}
-		assert(RB_EMPTY(&dedup_tree));
+		dedup_index_destroy(&dedup_index);
+		dedup_slab_destroy(&sha_dedup_slab);
 		if (DedupCrcEnd && VerboseOpt == 0)
 			printf(".");
 	} while (DedupCrcEnd);
@@ -421,32 +709,18 @@ collect_btree_elm(hammer_btree_leaf_elm_t scan_leaf, int flags __unused)
 				DedupCrcStart, DedupCrcEnd);
 			fflush(stdout);
 		}
-		for (;;) {
-			sim_de = RB_MAX(sim_dedup_entry_rb_tree,
-					&sim_dedup_tree);
-			if (sim_de == NULL || sim_de->crc < DedupCrcEnd)
-				break;
-			RB_REMOVE(sim_dedup_entry_rb_tree,
-				  &sim_dedup_tree, sim_de);
-			MemoryUse -= sizeof(*sim_de);
-			free(sim_de);
-		}
+		dedup_index_trim(&sim_dedup_index, DedupCrcEnd, NULL);
 	}
 
 	/*
 	 * Collect statistics based on the CRC only, do not try to read
 	 * any data blocks or run SHA hashes.
 	 */
-	sim_de = RB_LOOKUP(sim_dedup_entry_rb_tree, &sim_dedup_tree,
-			   scan_leaf->data_crc);
-
+	sim_de = dedup_index_lookup(&sim_dedup_index, scan_leaf->data_crc);
 	if (sim_de == NULL) {
-		sim_de = calloc(1, sizeof(*sim_de));
-		sim_de->crc = scan_leaf->data_crc;
-		RB_INSERT(sim_dedup_entry_rb_tree, &sim_dedup_tree, sim_de);
-		MemoryUse += sizeof(*sim_de);
+		sim_de = dedup_index_insert(&sim_dedup_index,
+					    scan_leaf->data_crc);
 	}
-
 	sim_de->ref_blks += 1;
 	sim_de->ref_size += scan_leaf->data_len;
 	return (1);
@@ -511,8 +785,12 @@ int
 process_btree_elm(hammer_btree_leaf_elm_t scan_leaf, int flags)
 {
 	struct dedup_entry *de;
-	struct sha_dedup_entry *sha_de, temp;
+	struct sha_dedup_entry *sha_de;
 	struct pass2_dedup_entry *pass2_de;
+	struct hammer_btree_leaf_elm leaf;
+	uint8_t sha_hash[SHA256_DIGEST_LENGTH];
+	uint32_t ref_blks;
+	uint32_t idx;
 	int error;
 
 	/*
@@ -528,45 +806,27 @@ process_btree_elm(hammer_btree_leaf_elm_t scan_leaf, int flags)
 				DedupCrcStart, DedupCrcEnd);
 			fflush(stdout);
 		}
-
-		for (;;) {
-			de = RB_MAX(dedup_entry_rb_tree, &dedup_tree);
-			if (de == NULL || de->leaf.data_crc < DedupCrcEnd)
-				break;
-			if (de->flags & HAMMER_DEDUP_ENTRY_FICTITIOUS) {
-				while ((sha_de = RB_ROOT(&de->u.fict_root)) !=
-				       NULL) {
-					RB_REMOVE(sha_dedup_entry_rb_tree,
-						  &de->u.fict_root, sha_de);
-					MemoryUse -= sizeof(*sha_de);
-					free(sha_de);
-				}
-			}
-			RB_REMOVE(dedup_entry_rb_tree, &dedup_tree, de);
-			MemoryUse -= sizeof(*de);
-			free(de);
-		}
+		dedup_index_trim(&dedup_index, DedupCrcEnd,
+				 dedup_entry_free_sha);
 	}
 
 	/*
 	 * Collect statistics based on the CRC.  Colliding CRCs usually
-	 * cause a SHA sub-tree to be created under the de.
+	 * cause a chain of SHA entries to be created under the de.
 	 *
 	 * Trivial case if de not found.
 	 */
-	de = RB_LOOKUP(dedup_entry_rb_tree, &dedup_tree, scan_leaf->data_crc);
+	de = dedup_index_lookup(&dedup_index, scan_leaf->data_crc);
 	if (de == NULL) {
-		de = calloc(1, sizeof(*de));
-		de->leaf = *scan_leaf;
-		RB_INSERT(dedup_entry_rb_tree, &dedup_tree, de);
-		MemoryUse += sizeof(*de);
+		de = dedup_index_insert(&dedup_index, scan_leaf->data_crc);
+		dedup_leaf_set(&de->u.leaf, scan_leaf);
 		goto upgrade_stats;
 	}
 
 	/*
-	 * Found entry in CRC tree
+	 * Found entry in CRC index
 	 */
-	if (de->flags & HAMMER_DEDUP_ENTRY_FICTITIOUS) {
+	if (DEDUP_ENTRY_FICTITIOUS(de)) {
 		/*
 		 * Optimize the case where a CRC failure results in multiple
 		 * SHA entries.  If we unconditionally issue a data-read a
@@ -578,52 +838,48 @@ process_btree_elm(hammer_btree_leaf_elm_t scan_leaf, int flags)
 		 * data_offset/data_len in the SHA elements we already have
 		 * before reading the data block and generating a new SHA.
 		 */
-		RB_FOREACH(sha_de, sha_dedup_entry_rb_tree, &de->u.fict_root) {
+		for (idx = de->u.sha_head; idx; idx = sha_de->next) {
+			sha_de = sha_dedup_get(idx);
 			if (sha_de->leaf.data_offset ==
 						scan_leaf->data_offset &&
 			    sha_de->leaf.data_len == scan_leaf->data_len) {
-				memcpy(temp.sha_hash, sha_de->sha_hash,
+				memcpy(sha_hash, sha_de->sha_hash,
 					SHA256_DIGEST_LENGTH);
 				break;
 			}
 		}
 
 		/*
-		 * Entry in CRC tree is fictitious, so we already had problems
-		 * with this CRC. Upgrade (compute SHA) the candidate and
-		 * dive into SHA subtree. If upgrade fails insert the candidate
-		 * into Pass2 list (it will be processed later).
+		 * Entry in CRC index is fictitious, so we already had
+		 * problems with this CRC. Upgrade (compute SHA) the
+		 * candidate and search the SHA entries. If upgrade fails
+		 * insert the candidate into Pass2 list (it will be
+		 * processed later).
 		 */
-		if (sha_de == NULL) {
-			if (upgrade_chksum(scan_leaf, temp.sha_hash))
+		if (idx == 0) {
+			if (upgrade_chksum(scan_leaf, sha_hash))
 				goto pass2_insert;
 
-			sha_de = RB_FIND(sha_dedup_entry_rb_tree,
-					 &de->u.fict_root, &temp);
+			sha_de = sha_dedup_find(de, sha_hash);
 		}
 
 		/*
-		 * Nothing in SHA subtree so far, so this is a new
-		 * 'dataset'. Insert new entry into SHA subtree.
+		 * No such SHA so far, so this is a new 'dataset'.
+		 * Insert new SHA entry.
 		 */
 		if (sha_de == NULL) {
-			sha_de = calloc(1, sizeof(*sha_de));
-			sha_de->leaf = *scan_leaf;
-			memcpy(sha_de->sha_hash, temp.sha_hash,
-			       SHA256_DIGEST_LENGTH);
-			RB_INSERT(sha_dedup_entry_rb_tree, &de->u.fict_root,
-				  sha_de);
-			MemoryUse += sizeof(*sha_de);
+			sha_de = sha_dedup_insert(de, scan_leaf, sha_hash);
 			goto upgrade_stats_sha;
 		}
 
 		/*
-		 * Found entry in SHA subtree, it means we have a potential
-		 * dedup pair. Validate it (zones have to match and data_len
-		 * field have to be the same too. If validation fails, treat
-		 * it as a SHA collision (jump to sha256_failure).
+		 * Found SHA entry, it means we have a potential dedup pair.
+		 * Validate it (zones have to match and data_len field have
+		 * to be the same too. If validation fails, treat it as a SHA
+		 * collision (jump to sha256_failure).
 		 */
-		if (validate_dedup_pair(&sha_de->leaf, scan_leaf))
+		dedup_leaf_get(&sha_de->leaf, de->data_crc, &leaf);
+		if (validate_dedup_pair(&leaf, scan_leaf))
 			goto sha256_failure;
 
 		/*
@@ -641,7 +897,7 @@ process_btree_elm(hammer_btree_leaf_elm_t scan_leaf, int flags)
 		 * If ioctl fails because of big-block underflow replace the
 		 * leaf node that found dedup entry represents with scan_leaf.
 		 */
-		error = deduplicate(&sha_de->leaf, scan_leaf);
+		error = deduplicate(&leaf, scan_leaf);
 		switch(error) {
 		case 0:
 			goto upgrade_stats_sha;
@@ -653,8 +909,8 @@ process_btree_elm(hammer_btree_leaf_elm_t scan_leaf, int flags)
 			goto terminate_early;
 		case DEDUP_UNDERFLOW:
 			++dedup_underflows;
-			sha_de->leaf = *scan_leaf;
-			memcpy(sha_de->sha_hash, temp.sha_hash,
+			dedup_leaf_set(&sha_de->leaf, scan_leaf);
+			memcpy(sha_de->sha_hash, sha_hash,
 				SHA256_DIGEST_LENGTH);
 			goto upgrade_stats_sha;
 		case DEDUP_VERS_FAILURE:
@@ -676,16 +932,17 @@ sha256_failure:
 	} else {
 		/*
 		 * Candidate CRC is good for now (we found an entry in CRC
-		 * tree and it's not fictitious). This means we have a
+		 * index and it's not fictitious). This means we have a
 		 * potential dedup pair.
 		 */
-		if (validate_dedup_pair(&de->leaf, scan_leaf))
+		dedup_leaf_get(&de->u.leaf, de->data_crc, &leaf);
+		if (validate_dedup_pair(&leaf, scan_leaf))
 			goto crc_failure;
 
 		/*
 		 * We have a valid dedup pair (CRC match, validated)
 		 */
-		error = deduplicate(&de->leaf, scan_leaf);
+		error = deduplicate(&leaf, scan_leaf);
 		switch(error) {
 		case 0:
 			goto upgrade_stats;
@@ -697,7 +954,7 @@ sha256_failure:
 			goto terminate_early;
 		case DEDUP_UNDERFLOW:
 			++dedup_underflows;
-			de->leaf = *scan_leaf;
+			dedup_leaf_set(&de->u.leaf, scan_leaf);
 			goto upgrade_stats;
 		case DEDUP_VERS_FAILURE:
 			errx(1, "HAMMER filesystem must be at least "
@@ -713,10 +970,10 @@ crc_failure:
 		 * We got a CRC collision - either ioctl failed because of
 		 * the comparison failure or validation of the potential
 		 * dedup pair went bad. In all cases insert both blocks
-		 * into SHA subtree (this requires checksum upgrade) and mark
-		 * entry that corresponds to this CRC in the CRC tree
+		 * as SHA entries (this requires checksum upgrade) and mark
+		 * entry that corresponds to this CRC in the CRC index
 		 * fictitious, so that all futher operations with this CRC go
-		 * through SHA subtree.
+		 * through the SHA entries.
 		 */
 		++dedup_crc_failures;
 
@@ -724,43 +981,32 @@ crc_failure:
 		 * Insert block that was represented by now fictitious dedup
 		 * entry (create a new SHA entry and preserve stats of the
 		 * old CRC one). If checksum upgrade fails insert the
-		 * candidate into Pass2 list and return - keep both trees
+		 * candidate into Pass2 list and return - keep the index
 		 * unmodified.
 		 */
-		sha_de = calloc(1, sizeof(*sha_de));
-		sha_de->leaf = de->leaf;
-		sha_de->ref_blks = de->u.de.ref_blks;
-		sha_de->ref_size = de->u.de.ref_size;
-		if (upgrade_chksum(&sha_de->leaf, sha_de->sha_hash)) {
-			free(sha_de);
+		if (upgrade_chksum(&leaf, sha_hash))
 			goto pass2_insert;
-		}
-		MemoryUse += sizeof(*sha_de);
 
-		RB_INIT(&de->u.fict_root);
 		/*
-		 * Here we can insert without prior checking because the tree
-		 * is empty at this point
+		 * Mark entry in CRC index fictitious, the leaf it held
+		 * moves to its first SHA entry.
 		 */
-		RB_INSERT(sha_dedup_entry_rb_tree, &de->u.fict_root, sha_de);
+		ref_blks = de->ref_blks;
+		de->ref_blks = 0;
+		de->u.sha_head = 0;
+		sha_de = sha_dedup_insert(de, &leaf, sha_hash);
+		sha_de->ref_blks = ref_blks;
 
 		/*
-		 * Mark entry in CRC tree fictitious
-		 */
-		de->flags |= HAMMER_DEDUP_ENTRY_FICTITIOUS;
-
-		/*
-		 * Upgrade checksum of the candidate and insert it into
-		 * SHA subtree. If upgrade fails insert the candidate into
+		 * Upgrade checksum of the candidate and insert it as a
+		 * SHA entry. If upgrade fails insert the candidate into
 		 * Pass2 list.
 		 */
-		if (upgrade_chksum(scan_leaf, temp.sha_hash))
+		if (upgrade_chksum(scan_leaf, sha_hash))
 			goto pass2_insert;
-		sha_de = RB_FIND(sha_dedup_entry_rb_tree, &de->u.fict_root,
-				 &temp);
-		if (sha_de != NULL) {
-			/* There is an entry with this SHA already, but the only
-			 * RB-tree element at this point is that entry we just
+		if (sha_dedup_find(de, sha_hash) != NULL) {
+			/* There is an entry with this SHA already, but the
+			 * only SHA entry at this point is that entry we just
 			 * added. We know for sure these blocks are different
 			 * (this is crc_failure branch) so treat it as SHA
 			 * collision.
@@ -768,22 +1014,16 @@ crc_failure:
 			goto sha256_failure;
 		}
 
-		sha_de = calloc(1, sizeof(*sha_de));
-		sha_de->leaf = *scan_leaf;
-		memcpy(sha_de->sha_hash, temp.sha_hash, SHA256_DIGEST_LENGTH);
-		RB_INSERT(sha_dedup_entry_rb_tree, &de->u.fict_root, sha_de);
-		MemoryUse += sizeof(*sha_de);
+		sha_de = sha_dedup_insert(de, scan_leaf, sha_hash);
 		goto upgrade_stats_sha;
 	}
 
 upgrade_stats:
-	de->u.de.ref_blks += 1;
-	de->u.de.ref_size += scan_leaf->data_len;
+	de->ref_blks += 1;
 	return (1);
 
 upgrade_stats_sha:
 	sha_de->ref_blks += 1;
-	sha_de->ref_size += scan_leaf->data_len;
 	return (1);
 
 pass2_insert:
@@ -1017,9 +1257,11 @@ void
 dump_simulated_dedup(void)
 {
 	struct sim_dedup_entry *sim_de;
+	uint32_t i;
 
 	printf("=== Dumping simulated dedup entries:\n");
-	RB_FOREACH(sim_de, sim_dedup_entry_rb_tree, &sim_dedup_tree) {
+	for (i = 1; i <= sim_dedup_index.entries.count; ++i) {
+		sim_de = dedup_index_entry(&sim_dedup_index, i);
 		printf("\tcrc=%08x cnt=%ju size=%ju\n",
 			sim_de->crc,
 			(uintmax_t)sim_de->ref_blks,
@@ -1034,39 +1276,592 @@ dump_real_dedup(void)
 {
 	struct dedup_entry *de;
 	struct sha_dedup_entry *sha_de;
-	int i;
+	uint32_t idx;
+	uint32_t i;
+	int j;
 
 	printf("=== Dumping dedup entries:\n");
-	RB_FOREACH(de, dedup_entry_rb_tree, &dedup_tree) {
-		if (de->flags & HAMMER_DEDUP_ENTRY_FICTITIOUS) {
-			printf("\tcrc=%08x fictitious\n", de->leaf.data_crc);
+	for (i = 1; i <= dedup_index.entries.count; ++i) {
+		de = dedup_index_entry(&dedup_index, i);
+		if (DEDUP_ENTRY_FICTITIOUS(de)) {
+			printf("\tcrc=%08x fictitious\n", de->data_crc);
 
-			RB_FOREACH(sha_de, sha_dedup_entry_rb_tree, &de->u.fict_root) {
+			for (idx = de->u.sha_head; idx; idx = sha_de->next) {
+				sha_de = sha_dedup_get(idx);
 				printf("\t\tcrc=%08x cnt=%ju size=%ju\n\t"
 				       "\t\tsha=",
-				       sha_de->leaf.data_crc,
+				       de->data_crc,
 				       (uintmax_t)sha_de->ref_blks,
-				       (uintmax_t)sha_de->ref_size);
-				for (i = 0; i < SHA256_DIGEST_LENGTH; ++i)
-					printf("%02x", sha_de->sha_hash[i]);
+				       (uintmax_t)sha_de->ref_blks *
+						sha_de->leaf.data_len);
+				for (j = 0; j < SHA256_DIGEST_LENGTH; ++j)
+					printf("%02x", sha_de->sha_hash[j]);
 				printf("\n");
 			}
 		} else {
 			printf("\tcrc=%08x cnt=%ju size=%ju\n",
-			       de->leaf.data_crc,
-			       (uintmax_t)de->u.de.ref_blks,
-			       (uintmax_t)de->u.de.ref_size);
+			       de->data_crc,
+			       (uintmax_t)de->ref_blks,
+			       (uintmax_t)de->ref_blks * de->u.leaf.data_len);
 		}
 	}
 	printf("end of dump ===\n");
 }
 
+/*
+ * Offline dedup-simulate.
+ *
+ * The data records are collected from the image's B-Tree by the walker
+ * threads, each appending to its own array per shard.  Records are
+ * sharded by the top bits of their CRC so that a shard holds all the
+ * candidates for its CRCs.  The shards are then resolved in parallel:
+ * an open-addressing table groups the candidates of each PFS by CRC,
+ * and groups with several data blocks of the same size are resolved by
+ * SHA-256 of the data.
+ *
+ * If the candidates exceed the -m memory limit the upper half of the
+ * shards is dropped and collected by another walk, like the memory
+ * limited passes of the online dedup.
+ */
+#define DEDUP_SHARDS		256
+#define DEDUP_SHARD(crc)	((crc) >> 24)
+
+typedef struct dedup_cand {
+	hammer_off_t	data_offset;
+	hammer_crc_t	crc;
+	uint32_t	data_len;
+	uint32_t	pfs_id;
+	int32_t		next;		/* next in the same table slot */
+} *dedup_cand_t;
+
+typedef struct dedup_shard {
+	dedup_cand_t	cands;
+	int		count;
+	int		max;
+} *dedup_shard_t;
+
+typedef struct dedup_collect {
+	struct dedup_shard shards[DEDUP_SHARDS];
+	u_int		shard_end;	/* shards above were dropped */
+} *dedup_collect_t;
+
+typedef struct dedup_image_stats {
+	uint64_t	ref_blks;
+	uint64_t	ref_size;	/* referenced by records */
+	uint64_t	alloc_size;	/* distinct data blocks */
+	uint64_t	dedup_size;	/* distinct data */
+	uint64_t	crc_failures;
+	uint64_t	data_reads;
+} *dedup_image_stats_t;
+
+typedef struct dedup_resolve {
+	pthread_t	thread;
+	dedup_collect_t	*collects;
+	int		ncollects;
+	dedup_image_stats_t stats;	/* indexed by PFS id */
+	dedup_cand_t	*group;
+	int		maxgroup;
+	uint8_t		(*hashes)[SHA256_DIGEST_LENGTH];
+	int		maxhashes;
+} *dedup_resolve_t;
+
+static int DedupImagePfs;
+static volatile u_int DedupShardStart;
+static volatile u_int DedupShardEnd;
+static volatile u_int DedupShardNext;
+static volatile u_long DedupImageMemory;
+
+static
+void
+dedup_image_limit(void)
+{
+	u_int end;
+	u_int nend;
+
+	do {
+		end = DedupShardEnd;
+		if (end - DedupShardStart <= 1)
+			return;
+		nend = DedupShardStart + (end - DedupShardStart) / 2;
+	} while (atomic_cmpset_int(&DedupShardEnd, end, nend) == 0);
+
+	if (VerboseOpt) {
+		printf("memory limit  crc-range %08x-%08x\n",
+			DedupShardStart << 24, nend << 24);
+		fflush(stdout);
+	}
+}
+
+/*
+ * Drop this thread's shards which are no longer collected.
+ */
+static
+void
+dedup_collect_trim(dedup_collect_t dc)
+{
+	dedup_shard_t ds;
+	u_int end = DedupShardEnd;
+	u_int i;
+
+	for (i = end; i < dc->shard_end; ++i) {
+		ds = &dc->shards[i];
+		atomic_subtract_long(&DedupImageMemory,
+				     ds->max * sizeof(*ds->cands));
+		free(ds->cands);
+		bzero(ds, sizeof(*ds));
+	}
+	dc->shard_end = end;
+}
+
+static
+void
+dedup_image_leaf(dedup_collect_t dc, hammer_btree_leaf_elm_t leaf)
+{
+	dedup_shard_t ds;
+	dedup_cand_t cand;
+	u_int shard;
+	int pfs_id;
+	int max;
+
+	if (leaf->base.btype != HAMMER_BTREE_TYPE_RECORD ||
+	    leaf->base.rec_type != HAMMER_RECTYPE_DATA ||
+	    leaf->data_offset == 0 || leaf->data_len == 0) {
+		return;
+	}
+	pfs_id = lo_to_pfs(leaf->base.localization);
+	if (DedupImagePfs >= 0 && pfs_id != DedupImagePfs)
+		return;
+
+	shard = DEDUP_SHARD(leaf->data_crc);
+	if (dc->shard_end != DedupShardEnd)
+		dedup_collect_trim(dc);
+	if (shard < DedupShardStart || shard >= dc->shard_end)
+		return;
+
+	ds = &dc->shards[shard];
+	if (ds->count == ds->max) {
+		max = ds->max ? ds->max * 2 : 64;
+		ds->cands = realloc(ds->cands, max * sizeof(*ds->cands));
+		if (ds->cands == NULL) {
+			err(1, "dedup-simulate");
+			/* not reached */
+		}
+		atomic_add_long(&DedupImageMemory,
+				(max - ds->max) * sizeof(*ds->cands));
+		ds->max = max;
+		if (DedupImageMemory > MemoryLimit) {
+			dedup_image_limit();
+			dedup_collect_trim(dc);
+			if (shard >= dc->shard_end)
+				return;
+		}
+	}
+	cand = &ds->cands[ds->count++];
+	cand->data_offset = leaf->data_offset;
+	cand->crc = leaf->data_crc;
+	cand->data_len = leaf->data_len;
+	cand->pfs_id = pfs_id;
+	cand->next = -1;
+}
+
+static
+void
+dedup_image_node(btree_walk_node_t wn, void *arg)
+{
+	buffer_info_t buffer = NULL;
+	hammer_node_ondisk_t node;
+	hammer_btree_elm_t elm;
+	int i;
+
+	node = get_buffer_data(wn->node_offset, &buffer, 0);
+	if (node == NULL || !hammer_crc_test_btree(HammerVersion, node)) {
+		fprintf(stderr, "dedup-simulate: skipping bad B-Tree node "
+			"%016jx\n", (uintmax_t)wn->node_offset);
+		rel_buffer(buffer);
+		return;
+	}
+
+	for (i = 0; i < node->count; ++i) {
+		elm = &node->elms[i];
+
+		switch(node->type) {
+		case HAMMER_BTREE_TYPE_INTERNAL:
+			if (elm->internal.subtree_offset)
+				btree_walk_child(wn, elm);
+			break;
+		case HAMMER_BTREE_TYPE_LEAF:
+			dedup_image_leaf(arg, &elm->leaf);
+			break;
+		}
+	}
+	rel_buffer(buffer);
+}
+
+/*
+ * SHA-256 of a data block, which may span several buffers.
+ */
+static
+int
+dedup_image_sha(hammer_off_t data_offset, int data_len, uint8_t *sha_hash)
+{
+	buffer_info_t buffer = NULL;
+	SHA256_CTX ctx;
+	char *ptr;
+	int n;
+
+	SHA256_Init(&ctx);
+	while (data_len) {
+		ptr = get_buffer_data(data_offset, &buffer, 0);
+		if (ptr == NULL) {
+			rel_buffer(buffer);
+			return(-1);
+		}
+		n = HAMMER_BUFSIZE - ((int)data_offset & HAMMER_BUFMASK);
+		if (n > data_len)
+			n = data_len;
+		SHA256_Update(&ctx, (void *)ptr, n);
+		data_offset += n;
+		data_len -= n;
+	}
+	SHA256_Final(sha_hash, &ctx);
+	rel_buffer(buffer);
+	return(0);
+}
+
+static
+int
+dedup_cand_cmp(const void *p1, const void *p2)
+{
+	dedup_cand_t c1 = *(dedup_cand_t const *)p1;
+	dedup_cand_t c2 = *(dedup_cand_t const *)p2;
+
+	if (c1->data_len != c2->data_len)
+		return(c1->data_len < c2->data_len ? -1 : 1);
+	if (c1->data_offset != c2->data_offset)
+		return(c1->data_offset < c2->data_offset ? -1 : 1);
+	return(0);
+}
+
+static
+int
+dedup_sha_cmp(const void *p1, const void *p2)
+{
+	return(memcmp(p1, p2, SHA256_DIGEST_LENGTH));
+}
+
+/*
+ * Account for the candidates of one PFS sharing a CRC.  Records which
+ * already share a data block are allocated once, distinct blocks of the
+ * same size are compared by SHA-256.
+ */
+static
+void
+dedup_image_group(dedup_resolve_t dr, dedup_cand_t cands, int32_t head)
+{
+	dedup_image_stats_t st = &dr->stats[cands[head].pfs_id];
+	dedup_cand_t cand;
+	int count = 0;
+	int nhashes;
+	int i, j, k;
+
+	if (cands[head].next < 0) {
+		cand = &cands[head];
+		st->ref_blks += 1;
+		st->ref_size += cand->data_len;
+		st->alloc_size += cand->data_len;
+		st->dedup_size += cand->data_len;
+		return;
+	}
+
+	for (i = head; i >= 0; i = cands[i].next) {
+		if (count == dr->maxgroup) {
+			dr->maxgroup = dr->maxgroup ? dr->maxgroup * 2 : 64;
+			dr->group = realloc(dr->group,
+					    dr->maxgroup * sizeof(*dr->group));
+		}
+		dr->group[count++] = &cands[i];
+	}
+	qsort(dr->group, count, sizeof(*dr->group), dedup_cand_cmp);
+
+	/*
+	 * Runs of the same size, each distinct data_offset is hashed if
+	 * there is more than one.
+	 */
+	for (i = 0; i < count; i = j) {
+		nhashes = 0;
+		for (j = i; j < count &&
+		     dr->group[j]->data_len == dr->group[i]->data_len; ++j) {
+			cand = dr->group[j];
+			st->ref_blks += 1;
+			st->ref_size += cand->data_len;
+			if (j != i &&
+			    cand->data_offset == dr->group[j-1]->data_offset) {
+				continue;
+			}
+			st->alloc_size += cand->data_len;
+			if (nhashes == dr->maxhashes) {
+				dr->maxhashes = dr->maxhashes ?
+						dr->maxhashes * 2 : 16;
+				dr->hashes = realloc(dr->hashes,
+					dr->maxhashes * sizeof(*dr->hashes));
+			}
+			if (dedup_image_sha(cand->data_offset, cand->data_len,
+					    dr->hashes[nhashes])) {
+				/* unreadable, count it as distinct */
+				memset(dr->hashes[nhashes], 0xff,
+				       SHA256_DIGEST_LENGTH);
+				bcopy(&cand->data_offset, dr->hashes[nhashes],
+				      sizeof(cand->data_offset));
+			}
+			++nhashes;
+		}
+		if (nhashes == 1) {
+			st->dedup_size += dr->group[i]->data_len;
+			continue;
+		}
+		st->data_reads += (uint64_t)nhashes * dr->group[i]->data_len;
+		qsort(dr->hashes, nhashes, sizeof(*dr->hashes), dedup_sha_cmp);
+		for (k = 0; k < nhashes; ++k) {
+			if (k == 0 || bcmp(dr->hashes[k], dr->hashes[k-1],
+					   SHA256_DIGEST_LENGTH)) {
+				st->dedup_size += dr->group[i]->data_len;
+				if (k)
+					++st->crc_failures;
+			}
+		}
+	}
+}
+
+/*
+ * Index a shard's candidates by PFS and CRC, then resolve each group.
+ * The table only holds the index of the group's first candidate, the
+ * others are chained through the candidates.
+ */
+static
+void
+dedup_image_shard(dedup_resolve_t dr, u_int shard)
+{
+	dedup_shard_t ds;
+	dedup_cand_t cands;
+	dedup_cand_t cand;
+	int32_t *table;
+	uint32_t mask;
+	uint32_t h;
+	int count = 0;
+	int i, n;
+
+	for (i = 0; i < dr->ncollects; ++i)
+		count += dr->collects[i]->shards[shard].count;
+	if (count == 0)
+		return;
+
+	cands = malloc(count * sizeof(*cands));
+	for (i = n = 0; i < dr->ncollects; ++i) {
+		ds = &dr->collects[i]->shards[shard];
+		bcopy(ds->cands, cands + n, ds->count * sizeof(*cands));
+		n += ds->count;
+	}
+
+	for (mask = 1; mask < (uint32_t)count * 2; mask <<= 1)
+		;
+	table = malloc(mask * sizeof(*table));
+	memset(table, 0xff, mask * sizeof(*table));
+	--mask;
+
+	for (i = 0; i < count; ++i) {
+		cand = &cands[i];
+		h = (cand->crc ^ (cand->pfs_id * 0x9e3779b1U)) & mask;
+		while (table[h] >= 0) {
+			if (cands[table[h]].crc == cand->crc &&
+			    cands[table[h]].pfs_id == cand->pfs_id) {
+				break;
+			}
+			h = (h + 1) & mask;
+		}
+		if (table[h] < 0) {
+			table[h] = i;
+		} else {
+			cand->next = cands[table[h]].next;
+			cands[table[h]].next = i;
+		}
+	}
+	for (h = 0; h <= mask; ++h) {
+		if (table[h] >= 0)
+			dedup_image_group(dr, cands, table[h]);
+	}
+	free(table);
+	free(cands);
+}
+
+static
+void *
+dedup_resolve_thread(void *arg)
+{
+	dedup_resolve_t dr = arg;
+	u_int shard;
+
+	while ((shard = atomic_fetchadd_int(&DedupShardNext, 1)) <
+	       DedupShardEnd) {
+		dedup_image_shard(dr, shard);
+	}
+	return(NULL);
+}
+
+/*
+ * hammer -f blkdevs dedup-simulate [pfs_id]
+ */
+void
+hammer_cmd_dedup_simulate_image(char **av, int ac)
+{
+	struct dedup_image_stats total;
+	dedup_image_stats_t st;
+	dedup_collect_t *collects;
+	dedup_resolve_t drs;
+	volume_info_t volume;
+	void **args;
+	char buf1[8], buf2[8], buf3[8];
+	char *ptr;
+	int nthreads = NThreadsOpt;
+	u_int start;
+	int i, pfs_id;
+
+	if (ac > 1) {
+		dedup_usage(1);
+		/* not reached */
+	}
+	DedupImagePfs = -1;
+	if (ac) {
+		ptr = strrchr(av[0], ':');
+		DedupImagePfs = strtol(ptr ? ptr + 1 : av[0], &ptr, 10);
+		if (*ptr || DedupImagePfs < 0 ||
+		    DedupImagePfs > HAMMER_MAX_PFSID) {
+			errx(1, "Dedup-simulate: bad PFS id %s", av[0]);
+			/* not reached */
+		}
+	}
+	volume = get_root_volume();
+
+	collects = calloc(nthreads, sizeof(*collects));
+	args = calloc(nthreads, sizeof(*args));
+	drs = calloc(nthreads, sizeof(*drs));
+	for (i = 0; i < nthreads; ++i) {
+		drs[i].collects = collects;
+		drs[i].ncollects = nthreads;
+		drs[i].stats = calloc(HAMMER_MAX_PFS, sizeof(*drs[i].stats));
+	}
+
+	/*
+	 * Collection passes (memory limited)
+	 */
+	printf("Dedup-simulate running\n");
+	start = 0;
+	do {
+		DedupShardStart = start;
+		DedupShardEnd = DEDUP_SHARDS;
+		DedupImageMemory = 0;
+
+		if (VerboseOpt) {
+			printf("B-Tree pass  crc-range %08x-max\n",
+				DedupShardStart << 24);
+			fflush(stdout);
+		}
+		for (i = 0; i < nthreads; ++i) {
+			collects[i] = calloc(1, sizeof(*collects[i]));
+			collects[i]->shard_end = DEDUP_SHARDS;
+			args[i] = collects[i];
+		}
+		btree_walk(volume->ondisk->vol0_btree_root, dedup_image_node,
+			   args, nthreads);
+		for (i = 0; i < nthreads; ++i)
+			dedup_collect_trim(collects[i]);
+
+		DedupShardNext = start;
+		if (nthreads <= 1) {
+			dedup_resolve_thread(&drs[0]);
+		} else {
+			for (i = 0; i < nthreads; ++i) {
+				if (pthread_create(&drs[i].thread, NULL,
+						   dedup_resolve_thread,
+						   &drs[i])) {
+					err(1, "pthread_create");
+					/* not reached */
+				}
+			}
+			for (i = 0; i < nthreads; ++i)
+				pthread_join(drs[i].thread, NULL);
+		}
+
+		/*
+		 * Continue with the shards dropped by the memory limit
+		 */
+		start = DedupShardEnd;
+		DedupShardEnd = 0;
+		for (i = 0; i < nthreads; ++i) {
+			dedup_collect_trim(collects[i]);
+			free(collects[i]);
+		}
+		if (start < DEDUP_SHARDS && VerboseOpt == 0)
+			printf(".");
+	} while (start < DEDUP_SHARDS);
+	printf("Dedup-simulate succeeded\n");
+
+	/*
+	 * Report projected savings per PFS
+	 */
+	bzero(&total, sizeof(total));
+	for (pfs_id = 0; pfs_id < HAMMER_MAX_PFS; ++pfs_id) {
+		st = &drs[0].stats[pfs_id];
+		for (i = 1; i < nthreads; ++i) {
+			st->ref_blks += drs[i].stats[pfs_id].ref_blks;
+			st->ref_size += drs[i].stats[pfs_id].ref_size;
+			st->alloc_size += drs[i].stats[pfs_id].alloc_size;
+			st->dedup_size += drs[i].stats[pfs_id].dedup_size;
+			st->crc_failures += drs[i].stats[pfs_id].crc_failures;
+			st->data_reads += drs[i].stats[pfs_id].data_reads;
+		}
+		if (st->ref_blks == 0)
+			continue;
+		humanize_unsigned(buf1, sizeof(buf1), st->ref_size, "B", 1024);
+		humanize_unsigned(buf2, sizeof(buf2), st->alloc_size, "B", 1024);
+		humanize_unsigned(buf3, sizeof(buf3),
+				  st->alloc_size - st->dedup_size, "B", 1024);
+		printf("PFS#%-5d %8s referenced %8s allocated %8s saved "
+		       "ratio %.2f\n",
+		       pfs_id, buf1, buf2, buf3,
+		       (double)st->ref_size / st->dedup_size);
+		if (VerboseOpt) {
+			humanize_unsigned(buf1, sizeof(buf1), st->data_reads,
+					  "B", 1024);
+			printf("          %8jd records %8s read for SHA "
+			       "%jd CRC collisions\n",
+			       (intmax_t)st->ref_blks, buf1,
+			       (intmax_t)st->crc_failures);
+		}
+		total.ref_size += st->ref_size;
+		total.dedup_size += st->dedup_size;
+	}
+
+	printf("Simulated dedup ratio = %.2f\n",
+	    (total.dedup_size != 0) ?
+		(double)total.ref_size / total.dedup_size : 0);
+
+	for (i = 0; i < nthreads; ++i) {
+		free(drs[i].stats);
+		free(drs[i].group);
+		free(drs[i].hashes);
+	}
+	free(drs);
+	free(args);
+	free(collects);
+}
+
 static
 void
 dedup_usage(int code)
 {
 	fprintf(stderr,
 		"hammer dedup-simulate <filesystem>\n"
+		"hammer -f blkdevs [-j threads] dedup-simulate [pfs_id]\n"
 		"hammer dedup <filesystem>\n"
 	);
 	exit(code);
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hammer.h"
+
+static int lookup_callback(hammer_btree_leaf_elm_t leaf, void *arg);
+static void print_leaf(hammer_btree_leaf_elm_t leaf);
+static void print_leaf_data(hammer_btree_leaf_elm_t leaf);
+
+/*
+ * hammer -f blkdevs lookup lo:objid[:rt[:key]] [<transid>]
+ *
+ * Search the B-Tree for the records matching the given fields and
+ * print those visible as of transid, the most recent ones by default.
+ * Unlike show, only the nodes on the path to the records are read.
+ */
+void
+hammer_cmd_lookup(char **av, int ac)
+{
+	struct btree_search search;
+	volume_info_t volume;
+	hammer_base_elm_t beg = &search.key_beg;
+	hammer_base_elm_t end = &search.key_end;
+	char *s, *p, *dup;
+	int count = 0;
+	int error;
+	int i = 0;
+
+	if (ac < 1 || ac > 2) {
+		errx(1, "lookup: expected lo:objid[:rt[:key]] [<transid>]");
+		/* not reached */
+	}
+
+	bzero(&search, sizeof(search));
+	beg->obj_id = HAMMER_MIN_OBJID;
+	beg->rec_type = HAMMER_MIN_RECTYPE;
+	beg->key = HAMMER_MIN_KEY;
+	beg->create_tid = 1;
+	end->obj_id = HAMMER_MAX_OBJID;
+	end->rec_type = HAMMER_MAX_RECTYPE;
+	end->key = HAMMER_MAX_KEY;
+	end->create_tid = 0;		/* infinity */
+
+	dup = s = strdup(av[0]);
+	while ((p = strsep(&s, ":")) != NULL) {
+		switch(++i) {
+		case 1:
+			beg->localization = strtoul(p, NULL, 16);
+			end->localization = beg->localization;
+			break;
+		case 2:
+			beg->obj_id = strtoull(p, NULL, 16);
+			end->obj_id = beg->obj_id;
+			break;
+		case 3:
+			beg->rec_type = strtoul(p, NULL, 16);
+			end->rec_type = beg->rec_type;
+			break;
+		case 4:
+			beg->key = strtoull(p, NULL, 16);
+			end->key = beg->key;
+			break;
+		default:
+			errx(1, "lookup: too many fields in %s", av[0]);
+			/* not reached */
+		}
+	}
+	free(dup);
+	if (i < 2) {
+		errx(1, "lookup: expected lo:objid[:rt[:key]]");
+		/* not reached */
+	}
+
+	if (ac > 1)
+		search.asof = strtoull(av[1], NULL, 16);
+	else
+		search.asof = HAMMER_MAX_TID;
+	search.func = lookup_callback;
+	search.arg = &count;
+
+	volume = get_root_volume();
+	error = btree_search(volume->ondisk->vol0_btree_root, &search);
+	if (error) {
+		errx(1, "lookup: %s", strerror(error));
+		/* not reached */
+	}
+	if (VerboseOpt) {
+		printf("%d records, %d B-Tree nodes read\n",
+			count, search.nodes);
+	}
+	if (count == 0) {
+		errx(1, "lookup: no records found");
+		/* not reached */
+	}
+}
+
+static
+int
+lookup_callback(hammer_btree_leaf_elm_t leaf, void *arg)
+{
+	int *countp = arg;
+
+	print_leaf(leaf);
+	++*countp;
+	return(0);
+}
+
+static
+void
+print_leaf(hammer_btree_leaf_elm_t leaf)
+{
+	printf("lo=%08x objid=%016jx rt=%02x key=%016jx tid=%016jx\n",
+		leaf->base.localization,
+		(uintmax_t)leaf->base.obj_id,
+		leaf->base.rec_type,
+		(uintmax_t)leaf->base.key,
+		(uintmax_t)leaf->base.create_tid);
+	printf("    del=%016jx ot=%02x dataoff=%016jx/%d crc=%08x\n",
+		(uintmax_t)leaf->base.delete_tid,
+		leaf->base.obj_type,
+		(uintmax_t)leaf->data_offset,
+		leaf->data_len,
+		leaf->data_crc);
+	if (leaf->data_offset && leaf->data_len && QuietOpt == 0)
+		print_leaf_data(leaf);
+}
+
+static
+void
+print_leaf_data(hammer_btree_leaf_elm_t leaf)
+{
+	buffer_info_t data_buffer = NULL;
+	hammer_data_ondisk_t data;
+	int data_len = leaf->data_len;
+
+	data = get_buffer_data(leaf->data_offset, &data_buffer, 0);
+	if (data == NULL)
+		return;
+
+	switch(leaf->base.rec_type) {
+	case HAMMER_RECTYPE_INODE:
+		printf("    inode size=%jd nlinks=%jd mode=%05o"
+		       " caps=%02x pobjid=%016jx\n",
+		       (intmax_t)data->inode.size,
+		       (intmax_t)data->inode.nlinks,
+		       data->inode.mode,
+		       data->inode.cap_flags,
+		       (uintmax_t)data->inode.parent_obj_id);
+		break;
+	case HAMMER_RECTYPE_DIRENTRY:
+		data_len -= HAMMER_ENTRY_NAME_OFF;
+		printf("    dir-entry objid=%016jx lo=%08x name=\"%*.*s\"\n",
+		       (uintmax_t)data->entry.obj_id,
+		       data->entry.localization,
+		       data_len, data_len, data->entry.name);
+		break;
+	case HAMMER_RECTYPE_FIX:
+		if (leaf->base.key == HAMMER_FIXKEY_SYMLINK) {
+			data_len -= HAMMER_SYMLINK_NAME_OFF;
+			printf("    fix-symlink name=\"%*.*s\"\n",
+			       data_len, data_len, data->symlink.name);
+		}
+		break;
+	}
+	rel_buffer(data_buffer);
+}
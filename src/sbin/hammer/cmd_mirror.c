@@ -34,6 +34,8 @@
 
 #include "hammer.h"
 
+#include <pthread.h>
+
 #define LINE1	0,20
 #define LINE2	20,78
 #define LINE3	90,70
@@ -45,27 +47,93 @@ typedef struct histogram {
 	uint64_t	bytes;
 } *histogram_t;
 
+/*
+ * Input stream, see mirror_stream_open().
+ */
+#define MIRROR_STREAM_NBUFS	2
+#define MIRROR_STREAM_BUFSIZE	(4 * 1024 * 1024)
+#define MIRROR_STREAM_HEADROOM	(2 * HAMMER_XBUFSIZE)
+#define MIRROR_STREAM_MAXREC	\
+	(sizeof(union hammer_ioc_mrecord_any) + HAMMER_XBUFSIZE)
+
+typedef struct mirror_stream_buf {
+	char		*base;		/* headroom, then data */
+	char		*data;
+	size_t		fill;		/* bytes read into data */
+} *mirror_stream_buf_t;
+
+typedef struct mirror_stream {
+	int		fd;
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	struct mirror_stream_buf bufs[MIRROR_STREAM_NBUFS];
+	u_int		rseq;		/* buffer being read into */
+	u_int		pseq;		/* buffer being parsed */
+	int		eof;		/* reader hit EOF or an error */
+	int		error;
+	char		*ptr;		/* next record */
+	frame_codec_t	fc;		/* framed stream decoder */
+	size_t		minroom;	/* least room to read into */
+} *mirror_stream_t;
+
+/*
+ * Token bucket for the -b bandwidth limit.
+ */
+typedef struct mirror_bw {
+	uint64_t	tokens;
+	struct timeval	tv;
+} *mirror_bw_t;
+
+/*
+ * Output stream, see mirror_writer_open().
+ */
+typedef struct mirror_writer {
+	int		fd;
+	struct mirror_bw bw;
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	struct iovec	*iov;		/* pending batch */
+	int		niov;
+	void		(*done)(void *arg);
+	void		*arg;
+	int		busy;
+	int		exiting;
+} *mirror_writer_t;
+
 const char *ScoreBoardFile;
 const char *RestrictTarget;
 
-static int read_mrecords(int fd, char *buf, u_int size,
-			 struct hammer_ioc_mrecord_head *pickup);
+static mirror_stream_t mirror_stream_open(int fd);
+static ssize_t mirror_stream_detect(mirror_stream_t ms, char *data);
+static void mirror_stream_close(mirror_stream_t ms);
+static int read_mrecords(mirror_stream_t ms, char **bufp, u_int size);
 static int generate_histogram(int fd, const char *filesystem,
 			 histogram_t *histogram_ary,
 			 struct hammer_ioc_mirror_rw *mirror_base,
 			 int *repeatp);
-static hammer_ioc_mrecord_any_t read_mrecord(int fdin, int *errorp,
-			 struct hammer_ioc_mrecord_head *pickup);
+static hammer_ioc_mrecord_any_t read_mrecord(mirror_stream_t ms,
+			 int *errorp);
 static void write_mrecord(int fdout, uint32_t type,
 			 hammer_ioc_mrecord_any_t mrec, int bytes);
 static void generate_mrec_header(int fd, int pfs_id,
 			 union hammer_ioc_mrecord_any *mrec_tmp);
-static int validate_mrec_header(int fd, int fdin, int is_target, int pfs_id,
-			 struct hammer_ioc_mrecord_head *pickup,
+static int validate_mrec_header(int fd, mirror_stream_t ms, int is_target,
+			 int pfs_id,
+			 hammer_tid_t *tid_begp, hammer_tid_t *tid_endp);
+static int __validate_mrec_header(mirror_stream_t ms, int is_target,
+			 hammer_pseudofs_data_t pfsd, uint32_t version,
 			 hammer_tid_t *tid_begp, hammer_tid_t *tid_endp);
 static void update_pfs_snapshot(int fd, hammer_tid_t snapshot_tid, int pfs_id);
-static ssize_t writebw(int fd, const void *buf, size_t nbytes,
-			uint64_t *bwcount, struct timeval *tv1);
+static mirror_writer_t mirror_writer_open(int fd);
+static void mirror_writer_submit(mirror_writer_t w, struct iovec *iov,
+			 int niov, void (*done)(void *arg), void *arg);
+static void mirror_writer_wait(mirror_writer_t w);
+static void mirror_writer_close(mirror_writer_t w);
+static int mirror_writev(int fd, struct iovec *iov, int niov, mirror_bw_t bw);
+static int __mirror_writev(int fd, struct iovec *iov, int niov,
+			 mirror_bw_t bw);
 static int getyntty(void);
 static void score_printf(size_t i, size_t w, const char *ctl, ...);
 static void hammer_check_restrict(const char *filesystem);
@@ -88,12 +156,15 @@ hammer_cmd_mirror_read(char **av, int ac, int streaming)
 	struct hammer_ioc_mirror_rw mirror;
 	struct hammer_ioc_pseudofs_rw pfs;
 	union hammer_ioc_mrecord_any mrec_tmp;
-	struct hammer_ioc_mrecord_head pickup;
 	hammer_ioc_mrecord_any_t mrec;
 	hammer_tid_t sync_tid;
 	histogram_t histogram_ary;
+	mirror_stream_t ms = NULL;
+	mirror_writer_t w;
+	struct iovec iov[2];
 	const char *filesystem;
-	char *buf = malloc(SERIALBUF_SIZE);
+	char *bufs[2];
+	int bi = 0;
 	int interrupted = 0;
 	int error;
 	int fd;
@@ -106,8 +177,6 @@ hammer_cmd_mirror_read(char **av, int ac, int streaming)
 	int sameline;
 	int64_t total_bytes;
 	time_t base_t = time(NULL);
-	struct timeval bwtv;
-	uint64_t bwcount;
 	uint64_t estbytes;
 
 	if (ac == 0 || ac > 2) {
@@ -117,8 +186,15 @@ hammer_cmd_mirror_read(char **av, int ac, int streaming)
 	filesystem = av[0];
 	hammer_check_restrict(filesystem);
 
-	pickup.signature = 0;
-	pickup.type = 0;
+	/*
+	 * The ioctl fills one buffer while the other is being written.
+	 */
+	bufs[0] = malloc(SERIALBUF_SIZE);
+	bufs[1] = malloc(SERIALBUF_SIZE);
+	w = mirror_writer_open(1);
+	if (TwoWayPipeOpt)
+		ms = mirror_stream_open(0);
+
 	histogram = 0;
 	histindex = 0;
 	histmax = 0;
@@ -142,8 +218,6 @@ again:
 	}
 	sameline = 1;
 	total_bytes = 0;
-	gettimeofday(&bwtv, NULL);
-	bwcount = 0;
 
 	/*
 	 * Send initial header for the purpose of determining the
@@ -160,11 +234,14 @@ again:
 	 */
 	if (TwoWayPipeOpt) {
 		mirror.tid_beg = 0;
-		n = validate_mrec_header(fd, 0, 0, pfs.pfs_id, &pickup,
+		n = validate_mrec_header(fd, ms, 0, pfs.pfs_id,
 					 NULL, &mirror.tid_beg);
 		if (n < 0) {	/* got TERM record */
 			relpfs(fd, &pfs);
-			free(buf);
+			mirror_writer_close(w);
+			mirror_stream_close(ms);
+			free(bufs[0]);
+			free(bufs[1]);
 			free(histogram_ary);
 			return;
 		}
@@ -184,7 +261,7 @@ again:
 	if (mirror.tid_beg < mrec_tmp.pfs.pfsd.sync_beg_tid)
 		mirror.tid_beg = mrec_tmp.pfs.pfsd.sync_beg_tid;
 	mirror.tid_end = mrec_tmp.pfs.pfsd.sync_end_tid;
-	mirror.ubuf = buf;
+	mirror.ubuf = bufs[bi];
 	mirror.size = SERIALBUF_SIZE;
 	mirror.pfs_id = pfs.pfs_id;
 	mirror.shared_uuid = pfs.ondisk->shared_uuid;
@@ -281,10 +358,10 @@ again:
 	/*
 	 * Write out bulk records
 	 */
-	mirror.ubuf = buf;
 	mirror.size = SERIALBUF_SIZE;
 
 	do {
+		mirror.ubuf = bufs[bi];
 		mirror.count = 0;
 		mirror.pfs_id = pfs.pfs_id;
 		mirror.shared_uuid = pfs.ondisk->shared_uuid;
@@ -302,21 +379,10 @@ again:
 			/* not reached */
 		}
 		if (mirror.count) {
-			if (BandwidthOpt) {
-				n = writebw(1, mirror.ubuf, mirror.count,
-					    &bwcount, &bwtv);
-			} else {
-				n = write(1, mirror.ubuf, mirror.count);
-			}
-			if (n != mirror.count) {
-				score_printf(LINE3,
-					     "Mirror-read %s failed: "
-					     "short write",
-					     filesystem);
-				errx(1, "Mirror-read %s failed: short write",
-					filesystem);
-				/* not reached */
-			}
+			iov[bi].iov_base = mirror.ubuf;
+			iov[bi].iov_len = mirror.count;
+			mirror_writer_submit(w, &iov[bi], 1, NULL, NULL);
+			bi ^= 1;
 		}
 		total_bytes += mirror.count;
 		if (streaming && VerboseOpt) {
@@ -357,6 +423,7 @@ again:
 			break;
 		}
 	} while (mirror.count != 0);
+	mirror_writer_wait(w);
 
 done:
 	if (streaming && VerboseOpt && sameline == 0) {
@@ -384,7 +451,7 @@ done:
 	 * the target.
 	 */
 	if (TwoWayPipeOpt) {
-		mrec = read_mrecord(0, &error, &pickup);
+		mrec = read_mrecord(ms, &error);
 		if (mrec == NULL ||
 		    mrec->head.type != HAMMER_MREC_TYPE_UPDATE ||
 		    mrec->head.rec_size != sizeof(mrec->update)) {
@@ -477,11 +544,498 @@ done:
 	write_mrecord(1, HAMMER_MREC_TYPE_TERM,
 		      &mrec_tmp, sizeof(mrec_tmp.sync));
 	relpfs(fd, &pfs);
-	free(buf);
+	mirror_writer_close(w);
+	mirror_stream_close(ms);
+	free(bufs[0]);
+	free(bufs[1]);
 	free(histogram_ary);
 	fprintf(stderr, "Mirror-read %s succeeded\n", filesystem);
 }
 
+/*
+ * Offline mirror-read state.  The stream is gathered into batches of
+ * iovecs which are handed to the writer thread, the next batch being
+ * built while the previous one is written.  mrecord headers are built
+ * in the batch's hdr[] and record data is referenced directly in the
+ * buffer cache, its buffers are held in bufs[] until the batch has been
+ * written.
+ */
+#define MIRROR_IMAGE_IOVS	1024
+#define MIRROR_IMAGE_HDRSIZE	\
+	(MIRROR_IMAGE_IOVS * sizeof(struct hammer_ioc_mrecord_skip))
+
+typedef struct mirror_image_batch {
+	struct iovec		iov[MIRROR_IMAGE_IOVS];
+	int			niov;
+	buffer_info_t		bufs[MIRROR_IMAGE_IOVS];
+	int			nbufs;
+	char			*hdr;
+	size_t			hdr_bytes;
+	size_t			bytes;		/* bytes in iov[] */
+} *mirror_image_batch_t;
+
+typedef struct mirror_image {
+	hammer_tid_t		tid_beg;
+	hammer_tid_t		tid_end;
+	mirror_writer_t		writer;
+	struct mirror_image_batch batches[2];
+	mirror_image_batch_t	cur;
+	int64_t			total_bytes;
+	int64_t			recs;
+	int64_t			passes;
+	int64_t			skips;
+} *mirror_image_t;
+
+static char mirror_image_zbuf[HAMMER_HEAD_ALIGN];
+
+/*
+ * Called by the writer thread once a batch has been written.
+ */
+static
+void
+mirror_image_done(void *arg)
+{
+	mirror_image_batch_t b = arg;
+	int i;
+
+	for (i = 0; i < b->nbufs; ++i)
+		rel_buffer(b->bufs[i]);
+}
+
+/*
+ * Hand the current batch to the writer and switch to the other one,
+ * which the writer is done with once mirror_writer_submit() returns.
+ */
+static
+void
+mirror_image_flush(mirror_image_t mi)
+{
+	mirror_image_batch_t b = mi->cur;
+
+	if (b->niov == 0)
+		return;
+	mi->total_bytes += b->bytes;
+	mirror_writer_submit(mi->writer, b->iov, b->niov,
+			     mirror_image_done, b);
+
+	if (b == &mi->batches[0])
+		b = &mi->batches[1];
+	else
+		b = &mi->batches[0];
+	b->niov = 0;
+	b->nbufs = 0;
+	b->hdr_bytes = 0;
+	b->bytes = 0;
+	mi->cur = b;
+}
+
+/*
+ * Allocate a zeroed mrecord header of the given size and queue it,
+ * leaving room for niov more iovecs for the record data.
+ */
+static
+void *
+mirror_image_header(mirror_image_t mi, int bytes, int niov)
+{
+	mirror_image_batch_t b = mi->cur;
+	void *hdr;
+
+	assert(bytes == HAMMER_HEAD_DOALIGN(bytes));
+	if (b->niov + 1 + niov > MIRROR_IMAGE_IOVS) {
+		mirror_image_flush(mi);
+		b = mi->cur;
+	}
+	assert(b->hdr_bytes + bytes <= MIRROR_IMAGE_HDRSIZE);
+
+	hdr = b->hdr + b->hdr_bytes;
+	b->hdr_bytes += bytes;
+	bzero(hdr, bytes);
+	b->iov[b->niov].iov_base = hdr;
+	b->iov[b->niov].iov_len = bytes;
+	++b->niov;
+	b->bytes += bytes;
+	return(hdr);
+}
+
+/*
+ * Check the CRC of record data which spans several buffers, the
+ * equivalent of hammer_crc_test_leaf().  Inode data never does.
+ */
+static
+int
+mirror_image_datacrc(hammer_btree_leaf_elm_t leaf, struct iovec *iov,
+	int niov)
+{
+	uint32_t version = HammerVersion;
+	hammer_crc_t crc;
+	int i;
+
+	if (niov == 1)
+		return(hammer_crc_test_leaf(version, iov->iov_base, leaf));
+
+	for (;;) {
+		crc = 0;
+		for (i = 0; i < niov; ++i) {
+			if (version >= HAMMER_VOL_VERSION_SEVEN) {
+				crc = iscsi_crc32_ext(iov[i].iov_base,
+						      iov[i].iov_len, crc);
+			} else {
+				crc = crc32_ext(iov[i].iov_base,
+						iov[i].iov_len, crc);
+			}
+		}
+		if (crc == leaf->data_crc)
+			return(1);
+		if (version < HAMMER_VOL_VERSION_SEVEN)
+			return(0);
+		version = HAMMER_VOL_VERSION_SIX;
+	}
+}
+
+/*
+ * Generate the mrecord for a leaf the way HAMMERIOC_MIRROR_READ does.
+ * Records created after tid_end are ignored, records created before
+ * tid_beg are passed without their data.
+ */
+static
+int
+mirror_image_leaf(hammer_btree_leaf_elm_t leaf, void *arg)
+{
+	mirror_image_t mi = arg;
+	struct hammer_ioc_mrecord_rec *mrec;
+	mirror_image_batch_t b;
+	buffer_info_t buffer;
+	struct iovec *iov;
+	hammer_off_t data_offset;
+	hammer_crc_t crc;
+	uint32_t type;
+	int data_len;
+	int resid;
+	int niov;
+	int n;
+
+	if (leaf->base.create_tid > mi->tid_end)
+		return(0);
+
+	if (leaf->base.create_tid < mi->tid_beg) {
+		mrec = mirror_image_header(mi, sizeof(*mrec), 0);
+		mrec->head.signature = HAMMER_IOC_MIRROR_SIGNATURE;
+		mrec->head.type = HAMMER_MREC_TYPE_PASS;
+		mrec->head.rec_size = sizeof(*mrec);
+		mrec->leaf = *leaf;
+		hammer_crc_set_mrec_head(&mrec->head, sizeof(*mrec));
+		++mi->passes;
+		return(0);
+	}
+
+	data_len = leaf->data_offset ? leaf->data_len : 0;
+	if (data_len < 0 || data_len > HAMMER_XBUFSIZE) {
+		errx(1, "Mirror-read: bad data length %d at %016jx",
+			data_len, (uintmax_t)leaf->data_offset);
+		/* not reached */
+	}
+
+	/*
+	 * Queue the data pieces in each buffer followed by the padding.
+	 */
+	mrec = mirror_image_header(mi, sizeof(*mrec),
+				   data_len / HAMMER_BUFSIZE + 3);
+	b = mi->cur;
+	iov = &b->iov[b->niov];
+	niov = 0;
+	data_offset = leaf->data_offset;
+	resid = data_len;
+	while (resid) {
+		n = HAMMER_BUFSIZE - (int)(data_offset & HAMMER_BUFMASK);
+		if (n > resid)
+			n = resid;
+		buffer = NULL;
+		iov[niov].iov_base = get_buffer_data(data_offset, &buffer, 0);
+		if (iov[niov].iov_base == NULL) {
+			errx(1, "Mirror-read: cannot read data at %016jx",
+				(uintmax_t)data_offset);
+			/* not reached */
+		}
+		iov[niov].iov_len = n;
+		b->bufs[b->nbufs++] = buffer;
+		++niov;
+		data_offset += n;
+		resid -= n;
+	}
+
+	type = HAMMER_MREC_TYPE_REC;
+	if (data_len && mirror_image_datacrc(leaf, iov, niov) == 0) {
+		fprintf(stderr, "Mirror-read: data CRC error at %016jx "
+			"(ignoring)\n", (uintmax_t)leaf->data_offset);
+		type |= HAMMER_MRECF_CRC_ERROR | HAMMER_MRECF_DATA_CRC_BAD;
+	}
+
+	mrec->head.signature = HAMMER_IOC_MIRROR_SIGNATURE;
+	mrec->head.type = type;
+	mrec->head.rec_size = sizeof(*mrec) + data_len;
+	mrec->leaf = *leaf;
+	if (leaf->base.delete_tid > mi->tid_end)
+		mrec->leaf.base.delete_tid = 0;
+
+	/*
+	 * The header CRC covers the data, which is not contiguous.
+	 */
+	crc = crc32(&mrec->head.rec_size, sizeof(*mrec) - HAMMER_MREC_CRCOFF);
+	for (n = 0; n < niov; ++n)
+		crc = crc32_ext(iov[n].iov_base, iov[n].iov_len, crc);
+	mrec->head.rec_crc = crc;
+
+	n = HAMMER_HEAD_DOALIGN(data_len) - data_len;
+	if (n) {
+		iov[niov].iov_base = mirror_image_zbuf;
+		iov[niov].iov_len = n;
+		++niov;
+	}
+	b->niov += niov;
+	b->bytes += HAMMER_HEAD_DOALIGN(data_len);
+	++mi->recs;
+
+	if (b->bytes >= SERIALBUF_SIZE)
+		mirror_image_flush(mi);
+	return(0);
+}
+
+/*
+ * Nothing below a B-Tree element changed since tid_beg.
+ */
+static
+int
+mirror_image_skip(hammer_base_elm_t skip_beg, hammer_base_elm_t skip_end,
+	void *arg)
+{
+	mirror_image_t mi = arg;
+	struct hammer_ioc_mrecord_skip *mrec;
+
+	mrec = mirror_image_header(mi, sizeof(*mrec), 0);
+	mrec->head.signature = HAMMER_IOC_MIRROR_SIGNATURE;
+	mrec->head.type = HAMMER_MREC_TYPE_SKIP;
+	mrec->head.rec_size = sizeof(*mrec);
+	mrec->skip_beg = *skip_beg;
+	mrec->skip_end = *skip_end;
+	hammer_crc_set_mrec_head(&mrec->head, sizeof(*mrec));
+	++mi->skips;
+	return(0);
+}
+
+/*
+ * Generate the mirroring header of a PFS as HAMMERIOC_GET_PSEUDOFS
+ * would.  A PFS without a PFS record gets the kernel's defaults.
+ * The sync_end_tid of a master is the next TID of the filesystem
+ * since an image has nothing in flight.
+ */
+static
+void
+mirror_image_pfsd(int pfs_id, union hammer_ioc_mrecord_any *mrec_tmp)
+{
+	volume_info_t volume = get_root_volume();
+	hammer_off_t root = volume->ondisk->vol0_btree_root;
+	hammer_pseudofs_data_t pfsd = &mrec_tmp->pfs.pfsd;
+	struct hammer_btree_leaf_elm leaf;
+	struct hammer_base_elm key;
+	buffer_info_t buffer = NULL;
+	void *data;
+	int error;
+
+	bzero(mrec_tmp, sizeof(*mrec_tmp));
+	mrec_tmp->pfs.version = HAMMER_IOC_PSEUDOFS_VERSION;
+
+	/*
+	 * The PFS must have a root inode.
+	 */
+	bzero(&key, sizeof(key));
+	key.localization = pfs_to_lo(pfs_id) | HAMMER_LOCALIZE_INODE;
+	key.obj_id = HAMMER_OBJID_ROOT;
+	key.rec_type = HAMMER_RECTYPE_INODE;
+	error = btree_lookup(root, &key, HAMMER_MAX_TID, &leaf);
+	if (error == ENOENT) {
+		errx(1, "Mirror-read: PFS#%d does not exist", pfs_id);
+		/* not reached */
+	}
+
+	if (error == 0) {
+		bzero(&key, sizeof(key));
+		key.localization = HAMMER_DEF_LOCALIZATION |
+				   HAMMER_LOCALIZE_MISC;
+		key.obj_id = HAMMER_OBJID_ROOT;
+		key.rec_type = HAMMER_RECTYPE_PFS;
+		key.key = pfs_to_lo(pfs_id);
+		error = btree_lookup(root, &key, HAMMER_MAX_TID, &leaf);
+	}
+	if (error == 0) {
+		data = NULL;
+		if (leaf.data_len >= (int)sizeof(*pfsd))
+			data = get_buffer_data(leaf.data_offset, &buffer, 0);
+		if (data)
+			bcopy(data, pfsd, sizeof(*pfsd));
+		else
+			error = EIO;
+		rel_buffer(buffer);
+	} else if (error == ENOENT) {
+		pfsd->shared_uuid = volume->ondisk->vol_fsid;
+		pfsd->unique_uuid = volume->ondisk->vol_fsid;
+		pfsd->sync_beg_tid = 1;
+		error = 0;
+	}
+	if (error) {
+		errx(1, "Mirror-read: cannot read PFS#%d: %s",
+			pfs_id, strerror(error));
+		/* not reached */
+	}
+	if (hammer_is_pfs_master(pfsd))
+		pfsd->sync_end_tid = volume->ondisk->vol0_next_tid;
+}
+
+/*
+ * hammer -f blkdevs mirror-read <pfs_id> [<begin-tid> [<end-tid>]]
+ *
+ * Generate the same mirroring stream as mirror-read from the B-Tree of
+ * an unmounted filesystem image, without the HAMMER VFS.
+ */
+void
+hammer_cmd_mirror_read_image(char **av, int ac)
+{
+	struct mirror_image *mi;
+	struct btree_search search;
+	union hammer_ioc_mrecord_any mrec_tmp;
+	hammer_ioc_mrecord_any_t mrec;
+	mirror_stream_t ms = NULL;
+	volume_info_t volume;
+	hammer_tid_t tid_beg;
+	hammer_tid_t tid_end;
+	char *ptr;
+	int pfs_id;
+	int error;
+
+	if (ac == 0 || ac > 3) {
+		mirror_usage(1);
+		/* not reached */
+	}
+	ptr = strrchr(av[0], ':');
+	pfs_id = strtol(ptr ? ptr + 1 : av[0], &ptr, 10);
+	if (*ptr || pfs_id < 0 || pfs_id > HAMMER_MAX_PFSID) {
+		errx(1, "Mirror-read: bad PFS id %s", av[0]);
+		/* not reached */
+	}
+	volume = get_root_volume();
+
+	/*
+	 * Send initial header for the purpose of determining the
+	 * shared-uuid.
+	 */
+	mirror_image_pfsd(pfs_id, &mrec_tmp);
+	write_mrecord(1, HAMMER_MREC_TYPE_PFSD,
+		      &mrec_tmp, sizeof(mrec_tmp.pfs));
+
+	/*
+	 * In 2-way mode the target will send us a PFS info packet
+	 * first.  Use the target's current snapshot TID as our default
+	 * begin TID.
+	 */
+	tid_beg = 0;
+	if (TwoWayPipeOpt) {
+		ms = mirror_stream_open(0);
+		if (__validate_mrec_header(ms, 0, &mrec_tmp.pfs.pfsd,
+					   mrec_tmp.pfs.version,
+					   NULL, &tid_beg) < 0) {
+			mirror_stream_close(ms);
+			return;		/* got TERM record */
+		}
+		++tid_beg;
+	}
+	if (tid_beg < mrec_tmp.pfs.pfsd.sync_beg_tid)
+		tid_beg = mrec_tmp.pfs.pfsd.sync_beg_tid;
+	tid_end = mrec_tmp.pfs.pfsd.sync_end_tid;
+	if (ac > 1)
+		tid_beg = strtoull(av[1], NULL, 0);
+	if (ac > 2) {
+		tid_end = strtoull(av[2], NULL, 0);
+		mrec_tmp.pfs.pfsd.sync_end_tid = tid_end;
+	}
+	write_mrecord(1, HAMMER_MREC_TYPE_PFSD,
+		      &mrec_tmp, sizeof(mrec_tmp.pfs));
+
+	fprintf(stderr, "Mirror-read: Mirror %016jx to %016jx\n",
+		(uintmax_t)tid_beg, (uintmax_t)tid_end);
+
+	if (tid_beg >= tid_end) {
+		fprintf(stderr, "Mirror-read: No work to do\n");
+		write_mrecord(1, HAMMER_MREC_TYPE_IDLE,
+			      &mrec_tmp, sizeof(mrec_tmp.sync));
+	} else {
+		/*
+		 * Write out bulk records.  Subtrees whose mirror_tid is
+		 * older than tid_beg are skipped like the kernel does.
+		 */
+		mi = calloc(1, sizeof(*mi));
+		mi->batches[0].hdr = malloc(MIRROR_IMAGE_HDRSIZE);
+		mi->batches[1].hdr = malloc(MIRROR_IMAGE_HDRSIZE);
+		mi->cur = &mi->batches[0];
+		mi->writer = mirror_writer_open(1);
+		mi->tid_beg = tid_beg;
+		mi->tid_end = tid_end;
+
+		bzero(&search, sizeof(search));
+		hammer_key_beg_init(&search.key_beg);
+		hammer_key_end_init(&search.key_end);
+		search.key_beg.localization &= HAMMER_LOCALIZE_MASK;
+		search.key_beg.localization |= pfs_to_lo(pfs_id);
+		search.key_end.localization &= HAMMER_LOCALIZE_MASK;
+		search.key_end.localization |= pfs_to_lo(pfs_id);
+		search.func = mirror_image_leaf;
+		search.skip = mirror_image_skip;
+		search.mirror_tid = tid_beg;
+		search.arg = mi;
+
+		error = btree_search(volume->ondisk->vol0_btree_root, &search);
+		if (error) {
+			errx(1, "Mirror-read PFS#%d failed: %s",
+				pfs_id, strerror(error));
+			/* not reached */
+		}
+		mirror_image_flush(mi);
+		mirror_writer_close(mi->writer);
+		write_mrecord(1, HAMMER_MREC_TYPE_SYNC,
+			      &mrec_tmp, sizeof(mrec_tmp.sync));
+
+		if (VerboseOpt) {
+			fprintf(stderr,
+				"Mirror-read: %jd records, %jd passed, "
+				"%jd skipped, %jd bytes, %d B-Tree nodes read\n",
+				(intmax_t)mi->recs, (intmax_t)mi->passes,
+				(intmax_t)mi->skips, (intmax_t)mi->total_bytes,
+				search.nodes);
+		}
+		free(mi->batches[0].hdr);
+		free(mi->batches[1].hdr);
+		free(mi);
+	}
+
+	/*
+	 * If the -2 option was given a two-way pipe is assumed and we
+	 * expect a response mrec from the target.
+	 */
+	if (TwoWayPipeOpt) {
+		mrec = read_mrecord(ms, &error);
+		if (mrec == NULL ||
+		    mrec->head.type != HAMMER_MREC_TYPE_UPDATE ||
+		    mrec->head.rec_size != sizeof(mrec->update)) {
+			errx(1, "mirror_read: Did not get final "
+				"acknowledgement packet from target");
+			/* not reached */
+		}
+		free(mrec);
+		mirror_stream_close(ms);
+	}
+	write_mrecord(1, HAMMER_MREC_TYPE_TERM,
+		      &mrec_tmp, sizeof(mrec_tmp.sync));
+	fprintf(stderr, "Mirror-read PFS#%d succeeded\n", pfs_id);
+}
+
 /*
  * What we are trying to do here is figure out how much data is
  * going to be sent for the TID range and to break the TID range
@@ -763,13 +1317,13 @@ hammer_cmd_mirror_write(char **av, int ac)
 {
 	struct hammer_ioc_mirror_rw mirror;
 	const char *filesystem;
-	char *buf = malloc(SERIALBUF_SIZE);
+	char *buf;
 	struct hammer_ioc_pseudofs_rw pfs;
-	struct hammer_ioc_mrecord_head pickup;
 	struct hammer_ioc_synctid synctid;
 	union hammer_ioc_mrecord_any mrec_tmp;
 	hammer_ioc_mrecord_any_t mrec;
 	struct stat st;
+	mirror_stream_t ms;
 	int error;
 	int fd;
 	int n;
@@ -781,8 +1335,7 @@ hammer_cmd_mirror_write(char **av, int ac)
 	filesystem = av[0];
 	hammer_check_restrict(filesystem);
 
-	pickup.signature = 0;
-	pickup.type = 0;
+	ms = mirror_stream_open(0);
 
 again:
 	bzero(&mirror, sizeof(mirror));
@@ -793,7 +1346,7 @@ again:
 	/*
 	 * Read initial packet
 	 */
-	mrec = read_mrecord(0, &error, &pickup);
+	mrec = read_mrecord(ms, &error);
 	if (mrec == NULL) {
 		if (error == 0) {
 			errx(1, "validate_mrec_header: short read");
@@ -805,7 +1358,8 @@ again:
 	 * Validate packet
 	 */
 	if (mrec->head.type == HAMMER_MREC_TYPE_TERM) {
-		free(buf);
+		free(mrec);
+		mirror_stream_close(ms);
 		return;
 	}
 	if (mrec->head.type != HAMMER_MREC_TYPE_PFSD) {
@@ -847,19 +1401,17 @@ again:
 	 * Read and process the PFS header.  The source informs us of
 	 * the TID range the stream represents.
 	 */
-	n = validate_mrec_header(fd, 0, 1, pfs.pfs_id, &pickup,
+	n = validate_mrec_header(fd, ms, 1, pfs.pfs_id,
 				 &mirror.tid_beg, &mirror.tid_end);
 	if (n < 0) {	/* got TERM record */
 		relpfs(fd, &pfs);
-		free(buf);
+		mirror_stream_close(ms);
 		return;
 	}
 
-	mirror.ubuf = buf;
-	mirror.size = SERIALBUF_SIZE;
-
 	/*
 	 * Read and process bulk records (REC, PASS, and SKIP types).
+	 * The ioctl is handed the records in place in the stream buffer.
 	 *
 	 * On your life, do NOT mess with mirror.key_cur or your mirror
 	 * target may become history.
@@ -868,9 +1420,10 @@ again:
 		mirror.count = 0;
 		mirror.pfs_id = pfs.pfs_id;
 		mirror.shared_uuid = pfs.ondisk->shared_uuid;
-		mirror.size = read_mrecords(0, buf, SERIALBUF_SIZE, &pickup);
+		mirror.size = read_mrecords(ms, &buf, SERIALBUF_SIZE);
 		if (mirror.size <= 0)
 			break;
+		mirror.ubuf = buf;
 		if (ioctl(fd, HAMMERIOC_MIRROR_WRITE, &mirror) < 0) {
 			err(1, "Mirror-write %s failed", filesystem);
 			/* not reached */
@@ -894,13 +1447,13 @@ again:
 	/*
 	 * Read and process the termination sync record.
 	 */
-	mrec = read_mrecord(0, &error, &pickup);
+	mrec = read_mrecord(ms, &error);
 
 	if (mrec && mrec->head.type == HAMMER_MREC_TYPE_TERM) {
 		fprintf(stderr, "Mirror-write: received termination request\n");
 		relpfs(fd, &pfs);
 		free(mrec);
-		free(buf);
+		mirror_stream_close(ms);
 		return;
 	}
 
@@ -952,9 +1505,9 @@ again:
 void
 hammer_cmd_mirror_dump(char **av, int ac)
 {
-	char *buf = malloc(SERIALBUF_SIZE);
-	struct hammer_ioc_mrecord_head pickup;
+	char *buf;
 	hammer_ioc_mrecord_any_t mrec;
+	mirror_stream_t ms;
 	int error;
 	int size;
 	int offset;
@@ -971,10 +1524,8 @@ hammer_cmd_mirror_dump(char **av, int ac)
 	/*
 	 * Read and process the PFS header
 	 */
-	pickup.signature = 0;
-	pickup.type = 0;
-
-	mrec = read_mrecord(0, &error, &pickup);
+	ms = mirror_stream_open(0);
+	mrec = read_mrecord(ms, &error);
 
 	/*
 	 * Dump the PFS header. mirror-dump takes its input from the output
@@ -984,7 +1535,7 @@ hammer_cmd_mirror_dump(char **av, int ac)
 	if (header_only && mrec != NULL) {
 		dump_pfsd(&mrec->pfs.pfsd, -1);
 		free(mrec);
-		free(buf);
+		mirror_stream_close(ms);
 		return;
 	}
 	free(mrec);
@@ -994,7 +1545,7 @@ again:
 	 * Read and process bulk records
 	 */
 	for (;;) {
-		size = read_mrecords(0, buf, SERIALBUF_SIZE, &pickup);
+		size = read_mrecords(ms, &buf, SERIALBUF_SIZE);
 		if (size <= 0)
 			break;
 		offset = 0;
@@ -1060,7 +1611,7 @@ again:
 	/*
 	 * Read and process the termination sync record.
 	 */
-	mrec = read_mrecord(0, &error, &pickup);
+	mrec = read_mrecord(ms, &error);
 	if (mrec == NULL ||
 	    (mrec->head.type != HAMMER_MREC_TYPE_SYNC &&
 	     mrec->head.type != HAMMER_MREC_TYPE_IDLE)) {
@@ -1072,12 +1623,12 @@ again:
 	/*
 	 * Continue with more batches until EOF.
 	 */
-	mrec = read_mrecord(0, &error, &pickup);
+	mrec = read_mrecord(ms, &error);
 	if (mrec) {
 		free(mrec);
 		goto again;
 	}
-	free(buf);
+	mirror_stream_close(ms);
 }
 
 void
@@ -1088,6 +1639,7 @@ hammer_cmd_mirror_copy(char **av, int ac, int streaming)
 	int fds[2];
 	const char *xav[32];
 	char tbuf[16];
+	char jbuf[16];
 	char *sh, *user, *host, *rfs;
 	int xac;
 
@@ -1160,6 +1712,13 @@ again:
 			}
 			if (ForceYesOpt)
 				xav[xac++] = "-y";
+			if (FrameOpt)
+				xav[xac++] = "-z";
+			if (NThreadsOpt > 1) {
+				snprintf(jbuf, sizeof(jbuf), "%d", NThreadsOpt);
+				xav[xac++] = "-j";
+				xav[xac++] = jbuf;
+			}
 			xav[xac++] = "-2";
 			if (TimeoutOpt) {
 				snprintf(tbuf, sizeof(tbuf), "%d", TimeoutOpt);
@@ -1239,6 +1798,13 @@ again:
 			}
 			if (ForceYesOpt)
 				xav[xac++] = "-y";
+			if (FrameOpt)
+				xav[xac++] = "-z";
+			if (NThreadsOpt > 1) {
+				snprintf(jbuf, sizeof(jbuf), "%d", NThreadsOpt);
+				xav[xac++] = "-j";
+				xav[xac++] = jbuf;
+			}
 			xav[xac++] = "-2";
 			xav[xac++] = "mirror-write";
 			xav[xac++] = rfs;
@@ -1274,47 +1840,276 @@ again:
 }
 
 /*
- * Read and return multiple mrecords
+ * Open an input stream of mrecords on fd.
+ *
+ * A reader thread fills MIRROR_STREAM_NBUFS large buffers in turn with
+ * as few read()s as possible while the records are parsed in place, so
+ * bulk records are handed out as views into the buffers.  A record
+ * which straddles two buffers is completed by copying its head into the
+ * headroom in front of the next buffer, which is the only copy made.
+ * The data is placed in each buffer at the alignment it has in the
+ * stream so that the records stay HAMMER_HEAD_ALIGN aligned.
+ *
+ * A framed stream (see frame.c) is recognized by its first bytes and
+ * decoded into the buffers in place of read().
+ */
+static
+void
+mirror_stream_unlock(void *arg)
+{
+	pthread_mutex_unlock(arg);
+}
+
+/*
+ * Read the start of the stream into data and look for a framed stream,
+ * whose frames are then decoded into data instead.
+ */
+static
+ssize_t
+mirror_stream_detect(mirror_stream_t ms, char *data)
+{
+	uint32_t signature;
+	size_t fill = 0;
+	ssize_t n;
+
+	ms->minroom = 1;
+	while (fill < sizeof(signature)) {
+		n = read(ms->fd, data + fill, MIRROR_STREAM_BUFSIZE - fill);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return(fill ? (ssize_t)fill : n);
+		fill += n;
+	}
+	bcopy(data, &signature, sizeof(signature));
+	if (signature != FRAME_SIGNATURE)
+		return(fill);
+
+	ms->fc = frame_codec_open(NThreadsOpt);
+	ms->minroom = FRAME_BUFSIZE;
+	frame_decode_prefix(ms->fc, data, fill);
+	return(frame_decode(ms->fc, ms->fd, data, MIRROR_STREAM_BUFSIZE));
+}
+
+static
+void *
+mirror_stream_thread(void *arg)
+{
+	mirror_stream_t ms = arg;
+	mirror_stream_buf_t buf;
+	uint64_t offset = 0;
+	ssize_t n;
+
+	buf = &ms->bufs[0];
+	for (;;) {
+		if (MIRROR_STREAM_BUFSIZE - buf->fill < ms->minroom) {
+			/*
+			 * Move on to the next buffer once the parser is
+			 * done with it.  The buffer is reset before the
+			 * current one is marked complete, so the parser
+			 * never carries a record over into a stale buffer.
+			 */
+			pthread_mutex_lock(&ms->lock);
+			pthread_cleanup_push(mirror_stream_unlock, &ms->lock);
+			while (ms->rseq + 1 - ms->pseq >= MIRROR_STREAM_NBUFS)
+				pthread_cond_wait(&ms->cond, &ms->lock);
+			buf = &ms->bufs[(ms->rseq + 1) % MIRROR_STREAM_NBUFS];
+			buf->data = buf->base + MIRROR_STREAM_HEADROOM +
+				    (offset & HAMMER_HEAD_ALIGN_MASK);
+			buf->fill = 0;
+			++ms->rseq;
+			pthread_cond_broadcast(&ms->cond);
+			pthread_cleanup_pop(1);
+		}
+		if (ms->minroom == 0) {
+			n = mirror_stream_detect(ms, buf->data);
+		} else if (ms->fc) {
+			n = frame_decode(ms->fc, ms->fd, buf->data + buf->fill,
+					 MIRROR_STREAM_BUFSIZE - buf->fill);
+		} else {
+			n = read(ms->fd, buf->data + buf->fill,
+				 MIRROR_STREAM_BUFSIZE - buf->fill);
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		pthread_mutex_lock(&ms->lock);
+		if (n <= 0) {
+			ms->error = (n < 0) ? errno : 0;
+			ms->eof = 1;
+		} else {
+			buf->fill += n;
+			offset += n;
+		}
+		pthread_cond_broadcast(&ms->cond);
+		pthread_mutex_unlock(&ms->lock);
+		if (n <= 0)
+			break;
+	}
+	return(NULL);
+}
+
+static
+mirror_stream_t
+mirror_stream_open(int fd)
+{
+	mirror_stream_t ms;
+	mirror_stream_buf_t buf;
+	int i;
+
+	ms = calloc(1, sizeof(*ms));
+	ms->fd = fd;
+	for (i = 0; i < MIRROR_STREAM_NBUFS; ++i) {
+		buf = &ms->bufs[i];
+		if (posix_memalign((void **)&buf->base, getpagesize(),
+				   MIRROR_STREAM_HEADROOM +
+				   MIRROR_STREAM_BUFSIZE +
+				   HAMMER_HEAD_ALIGN) != 0) {
+			errx(1, "mirror_stream_open: out of memory");
+			/* not reached */
+		}
+	}
+	buf = &ms->bufs[0];
+	buf->data = buf->base + MIRROR_STREAM_HEADROOM;
+	ms->ptr = buf->data;
+
+	pthread_mutex_init(&ms->lock, NULL);
+	pthread_cond_init(&ms->cond, NULL);
+	if (pthread_create(&ms->thread, NULL, mirror_stream_thread, ms)) {
+		errx(1, "mirror_stream_open: cannot create thread");
+		/* not reached */
+	}
+	return(ms);
+}
+
+/*
+ * Close the stream.  The reader is cancelled if it has not reached
+ * EOF, e.g. when only the header of the stream was wanted.
+ */
+static
+void
+mirror_stream_close(mirror_stream_t ms)
+{
+	int i;
+
+	if (ms == NULL)
+		return;
+	pthread_mutex_lock(&ms->lock);
+	if (ms->eof == 0)
+		pthread_cancel(ms->thread);
+	pthread_mutex_unlock(&ms->lock);
+	pthread_join(ms->thread, NULL);
+	frame_codec_close(ms->fc);
+
+	pthread_cond_destroy(&ms->cond);
+	pthread_mutex_destroy(&ms->lock);
+	for (i = 0; i < MIRROR_STREAM_NBUFS; ++i)
+		free(ms->bufs[i].base);
+	free(ms);
+}
+
+/*
+ * Return a pointer to the next bytes bytes of the stream, which stay
+ * valid until the stream moves on to the next buffer.  If they are not
+ * all in the current buffer they are moved to the next one, unless
+ * move is 0 in which case NULL is returned.  NULL is also returned at
+ * EOF, *availp is set to the number of bytes which were left.
+ *
+ * stdout is flushed before waiting on the reader, so the output of
+ * mirror-dump keeps up with its input.
+ */
+static
+char *
+mirror_stream_peek(mirror_stream_t ms, size_t bytes, int move,
+	size_t *availp)
+{
+	mirror_stream_buf_t buf;
+	mirror_stream_buf_t next;
+	size_t avail;
+	int done;
+
+	assert(bytes <= MIRROR_STREAM_MAXREC);
+	for (;;) {
+		buf = &ms->bufs[ms->pseq % MIRROR_STREAM_NBUFS];
+		pthread_mutex_lock(&ms->lock);
+		avail = buf->data + buf->fill - ms->ptr;
+		if (avail < bytes && ms->rseq == ms->pseq && ms->eof == 0) {
+			pthread_mutex_unlock(&ms->lock);
+			fflush(stdout);
+			pthread_mutex_lock(&ms->lock);
+			for (;;) {
+				avail = buf->data + buf->fill - ms->ptr;
+				if (avail >= bytes || ms->rseq != ms->pseq ||
+				    ms->eof) {
+					break;
+				}
+				pthread_cond_wait(&ms->cond, &ms->lock);
+			}
+		}
+		done = (ms->rseq != ms->pseq);
+		pthread_mutex_unlock(&ms->lock);
+
+		if (avail >= bytes)
+			return(ms->ptr);
+		if (done == 0 || move == 0) {
+			*availp = avail;
+			return(NULL);
+		}
+
+		/*
+		 * Carry the remainder over to the next buffer, which the
+		 * reader has already set up, then let the reader have this
+		 * one back.
+		 */
+		next = &ms->bufs[(ms->pseq + 1) % MIRROR_STREAM_NBUFS];
+		bcopy(ms->ptr, next->data - avail, avail);
+		ms->ptr = next->data - avail;
+		pthread_mutex_lock(&ms->lock);
+		++ms->pseq;
+		pthread_cond_broadcast(&ms->cond);
+		pthread_mutex_unlock(&ms->lock);
+	}
+}
+
+/*
+ * Read and return multiple mrecords.  *bufp is set to the records in
+ * place in the stream buffer, which are valid until the next read from
+ * the stream.
  */
 static
 int
-read_mrecords(int fd, char *buf, u_int size, struct hammer_ioc_mrecord_head *pickup)
+read_mrecords(mirror_stream_t ms, char **bufp, u_int size)
 {
+	struct hammer_ioc_mrecord_head *head;
 	hammer_ioc_mrecord_any_t mrec;
 	u_int count;
-	size_t n;
-	size_t i;
+	size_t avail;
 	size_t bytes;
 	int type;
 
 	count = 0;
+	*bufp = NULL;
 	while (size - count >= HAMMER_MREC_HEADSIZE) {
 		/*
-		 * Cached the record header in case we run out of buffer
-		 * space.
+		 * Records are returned contiguously, so stop at the end
+		 * of the buffer if we already have some.
 		 */
-		fflush(stdout);
-		if (pickup->signature == 0) {
-			for (n = 0; n < HAMMER_MREC_HEADSIZE; n += i) {
-				i = read(fd, (char *)pickup + n,
-					 HAMMER_MREC_HEADSIZE - n);
-				if (i <= 0)
-					break;
-			}
-			if (n == 0)
-				break;
-			if (n != HAMMER_MREC_HEADSIZE) {
+		head = (void *)mirror_stream_peek(ms, HAMMER_MREC_HEADSIZE,
+						  count == 0, &avail);
+		if (head == NULL) {
+			if (count == 0 && avail) {
 				errx(1, "read_mrecords: short read on pipe");
 				/* not reached */
 			}
-			if (pickup->signature != HAMMER_IOC_MIRROR_SIGNATURE) {
-				errx(1, "read_mrecords: malformed record on pipe, "
-					"bad signature");
-				/* not reached */
-			}
+			break;
+		}
+		if (head->signature != HAMMER_IOC_MIRROR_SIGNATURE) {
+			errx(1, "read_mrecords: malformed record on pipe, "
+				"bad signature");
+			/* not reached */
 		}
-		if (pickup->rec_size < HAMMER_MREC_HEADSIZE ||
-		    pickup->rec_size > sizeof(*mrec) + HAMMER_XBUFSIZE) {
+		if (head->rec_size < HAMMER_MREC_HEADSIZE ||
+		    head->rec_size > sizeof(*mrec) + HAMMER_XBUFSIZE) {
 			errx(1, "read_mrecords: malformed record on pipe, "
 				"illegal rec_size");
 			/* not reached */
@@ -1323,7 +2118,7 @@ read_mrecords(int fd, char *buf, u_int size, struct hammer_ioc_mrecord_head *pic
 		/*
 		 * Stop if we have insufficient space for the record and data.
 		 */
-		bytes = HAMMER_HEAD_DOALIGN(pickup->rec_size);
+		bytes = HAMMER_HEAD_DOALIGN(head->rec_size);
 		if (size - count < bytes)
 			break;
 
@@ -1334,7 +2129,7 @@ read_mrecords(int fd, char *buf, u_int size, struct hammer_ioc_mrecord_head *pic
 		 *
 		 * Ignore all flags.
 		 */
-		type = pickup->type & HAMMER_MRECF_TYPE_LOMASK;
+		type = head->type & HAMMER_MRECF_TYPE_LOMASK;
 		if (type != HAMMER_MREC_TYPE_PFSD &&
 		    type != HAMMER_MREC_TYPE_REC &&
 		    type != HAMMER_MREC_TYPE_SKIP &&
@@ -1342,23 +2137,17 @@ read_mrecords(int fd, char *buf, u_int size, struct hammer_ioc_mrecord_head *pic
 			break;
 		}
 
-		/*
-		 * Read the remainder and clear the pickup signature.
-		 */
-		for (n = HAMMER_MREC_HEADSIZE; n < bytes; n += i) {
-			i = read(fd, buf + count + n, bytes - n);
-			if (i <= 0)
-				break;
-		}
-		if (n != bytes) {
-			errx(1, "read_mrecords: short read on pipe");
-			/* not reached */
+		mrec = (void *)mirror_stream_peek(ms, bytes, count == 0,
+						  &avail);
+		if (mrec == NULL) {
+			if (count == 0) {
+				errx(1, "read_mrecords: short read on pipe");
+				/* not reached */
+			}
+			break;
 		}
-
-		bcopy(pickup, buf + count, HAMMER_MREC_HEADSIZE);
-		pickup->signature = 0;
-		pickup->type = 0;
-		mrec = (void *)(buf + count);
+		if (count == 0)
+			*bufp = (char *)mrec;
 
 		/*
 		 * Validate the completed record
@@ -1395,6 +2184,7 @@ read_mrecords(int fd, char *buf, u_int size, struct hammer_ioc_mrecord_head *pic
 					"continuing, but there are problems\n");
 			}
 		}
+		ms->ptr += bytes;
 		count += bytes;
 	}
 	return(count);
@@ -1405,59 +2195,48 @@ read_mrecords(int fd, char *buf, u_int size, struct hammer_ioc_mrecord_head *pic
  */
 static
 hammer_ioc_mrecord_any_t
-read_mrecord(int fdin, int *errorp, struct hammer_ioc_mrecord_head *pickup)
+read_mrecord(mirror_stream_t ms, int *errorp)
 {
+	struct hammer_ioc_mrecord_head *head;
 	hammer_ioc_mrecord_any_t mrec;
-	struct hammer_ioc_mrecord_head mrechd;
+	size_t avail;
 	size_t bytes;
-	size_t n;
-	size_t i;
 
-	if (pickup && pickup->type != 0) {
-		mrechd = *pickup;
-		pickup->signature = 0;
-		pickup->type = 0;
-		n = HAMMER_MREC_HEADSIZE;
-	} else {
-		/*
-		 * Read in the PFSD header from the sender.
-		 */
-		for (n = 0; n < HAMMER_MREC_HEADSIZE; n += i) {
-			i = read(fdin, (char *)&mrechd + n, HAMMER_MREC_HEADSIZE - n);
-			if (i <= 0)
-				break;
-		}
-		if (n == 0) {
-			*errorp = 0;	/* EOF */
-			return(NULL);
-		}
-		if (n != HAMMER_MREC_HEADSIZE) {
-			fprintf(stderr, "short read of mrecord header\n");
-			*errorp = EPIPE;
+	/*
+	 * Read in the PFSD header from the sender.
+	 */
+	head = (void *)mirror_stream_peek(ms, HAMMER_MREC_HEADSIZE, 1, &avail);
+	if (head == NULL) {
+		if (avail == 0) {
+			*errorp = ms->error;	/* EOF */
 			return(NULL);
 		}
+		fprintf(stderr, "short read of mrecord header\n");
+		*errorp = EPIPE;
+		return(NULL);
 	}
-	if (mrechd.signature != HAMMER_IOC_MIRROR_SIGNATURE) {
+	if (head->signature != HAMMER_IOC_MIRROR_SIGNATURE) {
 		fprintf(stderr, "read_mrecord: bad signature\n");
 		*errorp = EINVAL;
 		return(NULL);
 	}
-	bytes = HAMMER_HEAD_DOALIGN(mrechd.rec_size);
-	assert(bytes >= sizeof(mrechd));
-	mrec = malloc(bytes);
-	mrec->head = mrechd;
-
-	while (n < bytes) {
-		i = read(fdin, (char *)mrec + n, bytes - n);
-		if (i <= 0)
-			break;
-		n += i;
+	bytes = HAMMER_HEAD_DOALIGN(head->rec_size);
+	if (bytes < sizeof(*head) || bytes > MIRROR_STREAM_MAXREC) {
+		fprintf(stderr, "read_mrecord: illegal rec_size\n");
+		*errorp = EINVAL;
+		return(NULL);
 	}
-	if (n != bytes) {
+
+	head = (void *)mirror_stream_peek(ms, bytes, 1, &avail);
+	if (head == NULL) {
 		fprintf(stderr, "read_mrecord: short read on payload\n");
 		*errorp = EPIPE;
 		return(NULL);
 	}
+	mrec = malloc(bytes);
+	bcopy(head, mrec, bytes);
+	ms->ptr += bytes;
+
 	if (!hammer_crc_test_mrec_head(&mrec->head, mrec->head.rec_size)) {
 		fprintf(stderr, "read_mrecord: bad CRC\n");
 		*errorp = EINVAL;
@@ -1473,9 +2252,7 @@ write_mrecord(int fdout, uint32_t type, hammer_ioc_mrecord_any_t mrec,
 	      int bytes)
 {
 	char zbuf[HAMMER_HEAD_ALIGN];
-	int pad;
-
-	pad = HAMMER_HEAD_DOALIGN(bytes) - bytes;
+	struct iovec iov[2];
 
 	assert(bytes >= (int)sizeof(mrec->head));
 	bzero(&mrec->head, sizeof(mrec->head));
@@ -1483,17 +2260,16 @@ write_mrecord(int fdout, uint32_t type, hammer_ioc_mrecord_any_t mrec,
 	mrec->head.type = type;
 	mrec->head.rec_size = bytes;
 	hammer_crc_set_mrec_head(&mrec->head, bytes);
-	if (write(fdout, mrec, bytes) != bytes) {
+
+	bzero(zbuf, sizeof(zbuf));
+	iov[0].iov_base = mrec;
+	iov[0].iov_len = bytes;
+	iov[1].iov_base = zbuf;
+	iov[1].iov_len = HAMMER_HEAD_DOALIGN(bytes) - bytes;
+	if (mirror_writev(fdout, iov, iov[1].iov_len ? 2 : 1, NULL) < 0) {
 		err(1, "write_mrecord");
 		/* not reached */
 	}
-	if (pad) {
-		bzero(zbuf, pad);
-		if (write(fdout, zbuf, pad) != pad) {
-			err(1, "write_mrecord");
-			/* not reached */
-		}
-	}
 }
 
 /*
@@ -1529,14 +2305,11 @@ generate_mrec_header(int fd, int pfs_id,
  */
 static
 int
-validate_mrec_header(int fd, int fdin, int is_target, int pfs_id,
-		     struct hammer_ioc_mrecord_head *pickup,
+validate_mrec_header(int fd, mirror_stream_t ms, int is_target, int pfs_id,
 		     hammer_tid_t *tid_begp, hammer_tid_t *tid_endp)
 {
 	struct hammer_ioc_pseudofs_rw pfs;
 	struct hammer_pseudofs_data pfsd;
-	hammer_ioc_mrecord_any_t mrec;
-	int error;
 
 	/*
 	 * Get the PFSD info from the target filesystem.
@@ -1550,8 +2323,23 @@ validate_mrec_header(int fd, int fdin, int is_target, int pfs_id,
 		errx(1, "mirror-write: HAMMER PFS version mismatch!");
 		/* not reached */
 	}
+	return(__validate_mrec_header(ms, is_target, &pfsd, pfs.version,
+				      tid_begp, tid_endp));
+}
 
-	mrec = read_mrecord(fdin, &error, pickup);
+/*
+ * Validate the pfs information read from ms against pfsd.
+ */
+static
+int
+__validate_mrec_header(mirror_stream_t ms, int is_target,
+		       hammer_pseudofs_data_t pfsd, uint32_t version,
+		       hammer_tid_t *tid_begp, hammer_tid_t *tid_endp)
+{
+	hammer_ioc_mrecord_any_t mrec;
+	int error;
+
+	mrec = read_mrecord(ms, &error);
 	if (mrec == NULL) {
 		if (error == 0) {
 			errx(1, "validate_mrec_header: short read");
@@ -1573,7 +2361,7 @@ validate_mrec_header(int fd, int fdin, int is_target, int pfs_id,
 		errx(1, "validate_mrec_header: unexpected payload size");
 		/* not reached */
 	}
-	if (mrec->pfs.version != pfs.version) {
+	if (mrec->pfs.version != version) {
 		errx(1, "validate_mrec_header: Version mismatch");
 		/* not reached */
 	}
@@ -1581,12 +2369,12 @@ validate_mrec_header(int fd, int fdin, int is_target, int pfs_id,
 	/*
 	 * Whew.  Ok, is the read PFS info compatible with the target?
 	 */
-	if (hammer_uuid_compare(&mrec->pfs.pfsd.shared_uuid, &pfsd.shared_uuid)) {
+	if (hammer_uuid_compare(&mrec->pfs.pfsd.shared_uuid, &pfsd->shared_uuid)) {
 		errx(1, "mirror-write: source and target have "
 			"different shared-uuid's!");
 		/* not reached */
 	}
-	if (is_target && hammer_is_pfs_master(&pfsd)) {
+	if (is_target && hammer_is_pfs_master(pfsd)) {
 		errx(1, "mirror-write: target must be in slave mode");
 		/* not reached */
 	}
@@ -1628,47 +2416,238 @@ update_pfs_snapshot(int fd, hammer_tid_t snapshot_tid, int pfs_id)
 }
 
 /*
- * Bandwidth-limited write in chunks
+ * Write out the iovecs, as frames if -z was given.  The frames are
+ * encoded by a single codec shared by all writers to the stream, which
+ * write in turn.
  */
+typedef struct mirror_output {
+	int		fd;
+	mirror_bw_t	bw;
+} *mirror_output_t;
+
+static frame_codec_t MirrorFrames;
+static pthread_once_t MirrorFramesOnce = PTHREAD_ONCE_INIT;
+
 static
-ssize_t
-writebw(int fd, const void *buf, size_t nbytes,
-	uint64_t *bwcount, struct timeval *tv1)
+void
+mirror_frames_init(void)
 {
-	struct timeval tv2;
-	size_t n;
+	MirrorFrames = frame_codec_open(NThreadsOpt);
+}
+
+static
+int
+mirror_frame_output(struct iovec *iov, int niov, void *arg)
+{
+	mirror_output_t out = arg;
+
+	return(__mirror_writev(out->fd, iov, niov, out->bw));
+}
+
+static
+int
+mirror_writev(int fd, struct iovec *iov, int niov, mirror_bw_t bw)
+{
+	struct mirror_output out;
+
+	if (FrameOpt == 0)
+		return(__mirror_writev(fd, iov, niov, bw));
+
+	pthread_once(&MirrorFramesOnce, mirror_frames_init);
+	out.fd = fd;
+	out.bw = bw;
+	return(frame_encode(MirrorFrames, iov, niov, mirror_frame_output, &out));
+}
+
+/*
+ * Write out the iovecs, bandwidth-limited with a token bucket if bw is
+ * non-NULL and -b was given.  The bucket holds up to a tenth of a
+ * second worth of bytes, so the output is smoothed rather than sent in
+ * one burst per second.
+ */
+static
+int
+__mirror_writev(int fd, struct iovec *iov, int niov, mirror_bw_t bw)
+{
+	struct iovec tmp[64];
+	struct timeval tv;
+	uint64_t burst;
+	uint64_t want;
+	int64_t usec;
+	size_t limit;
 	ssize_t r;
-	ssize_t a;
-	int usec;
-
-	a = 0;
-	r = 0;
-	while (nbytes) {
-		if (*bwcount + nbytes > BandwidthOpt)
-			n = BandwidthOpt - *bwcount;
-		else
-			n = nbytes;
-		if (n)
-			r = write(fd, buf, n);
-		if (r >= 0) {
-			a += r;
-			nbytes -= r;
-			buf = (const char *)buf + r;
+	int n;
+
+	while (niov && iov->iov_len == 0) {
+		++iov;
+		--niov;
+	}
+	while (niov) {
+		if (bw && BandwidthOpt) {
+			burst = BandwidthOpt / 10;
+			if (burst == 0)
+				burst = 1;
+			for (;;) {
+				gettimeofday(&tv, NULL);
+				usec = (int64_t)(tv.tv_sec - bw->tv.tv_sec) *
+				       1000000 + (tv.tv_usec - bw->tv.tv_usec);
+				if (usec < 0)
+					usec = 0;
+				if (usec > 1000000)
+					usec = 1000000;
+				bw->tokens += usec * BandwidthOpt / 1000000;
+				if (bw->tokens > burst)
+					bw->tokens = burst;
+				bw->tv = tv;
+				if (bw->tokens)
+					break;
+
+				/*
+				 * Sleep until a reasonable amount can be
+				 * written, rather than a byte at a time.
+				 */
+				want = (burst < HAMMER_XBUFSIZE) ?
+				       burst : HAMMER_XBUFSIZE;
+				usleep(want * 1000000 / BandwidthOpt);
+			}
+			limit = bw->tokens;
+		} else {
+			limit = SSIZE_MAX;
 		}
-		if ((size_t)r != n)
+
+		/*
+		 * Write at most limit bytes worth of the iovecs.
+		 */
+		for (n = 0; n < niov && n < (int)(sizeof(tmp) / sizeof(tmp[0])) && limit; ++n) {
+			tmp[n] = iov[n];
+			if (tmp[n].iov_len > limit)
+				tmp[n].iov_len = limit;
+			limit -= tmp[n].iov_len;
+		}
+		r = writev(fd, tmp, n);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return(-1);
+		}
+		if (bw && BandwidthOpt)
+			bw->tokens -= r;
+
+		while (niov && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			++iov;
+			--niov;
+		}
+		if (niov) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return(0);
+}
+
+/*
+ * The writer thread writes out batches of iovecs to fd so the producer
+ * can generate the next batch in the meantime.  done is called with
+ * arg once a batch has been written.
+ */
+static
+void *
+mirror_writer_thread(void *arg)
+{
+	mirror_writer_t w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->busy == 0 && w->exiting == 0)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->busy == 0)
 			break;
-		*bwcount += n;
-		if (*bwcount >= BandwidthOpt) {
-			gettimeofday(&tv2, NULL);
-			usec = (int)(tv2.tv_sec - tv1->tv_sec) * 1000000 +
-				(int)(tv2.tv_usec - tv1->tv_usec);
-			if (usec >= 0 && usec < 1000000)
-				usleep(1000000 - usec);
-			gettimeofday(tv1, NULL);
-			*bwcount -= BandwidthOpt;
+		pthread_mutex_unlock(&w->lock);
+
+		if (mirror_writev(w->fd, w->iov, w->niov, &w->bw) < 0) {
+			err(1, "Mirror-read failed");
+			/* not reached */
 		}
+		if (w->done)
+			w->done(w->arg);
+
+		pthread_mutex_lock(&w->lock);
+		w->busy = 0;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return(NULL);
+}
+
+static
+mirror_writer_t
+mirror_writer_open(int fd)
+{
+	mirror_writer_t w;
+
+	w = calloc(1, sizeof(*w));
+	w->fd = fd;
+	gettimeofday(&w->bw.tv, NULL);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, mirror_writer_thread, w)) {
+		errx(1, "mirror_writer_open: cannot create thread");
+		/* not reached */
 	}
-	return(a ? a : r);
+	return(w);
+}
+
+/*
+ * Queue a batch, waiting for the previous one to be written out.  The
+ * iovecs and the data they point to must remain valid until then.
+ */
+static
+void
+mirror_writer_submit(mirror_writer_t w, struct iovec *iov, int niov,
+		     void (*done)(void *arg), void *arg)
+{
+	pthread_mutex_lock(&w->lock);
+	while (w->busy)
+		pthread_cond_wait(&w->cond, &w->lock);
+	w->iov = iov;
+	w->niov = niov;
+	w->done = done;
+	w->arg = arg;
+	w->busy = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Wait for the queued batch to be written out.
+ */
+static
+void
+mirror_writer_wait(mirror_writer_t w)
+{
+	pthread_mutex_lock(&w->lock);
+	while (w->busy)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static
+void
+mirror_writer_close(mirror_writer_t w)
+{
+	if (w == NULL)
+		return;
+	mirror_writer_wait(w);
+	pthread_mutex_lock(&w->lock);
+	w->exiting = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
 }
 
 /*
@@ -1779,6 +2758,7 @@ mirror_usage(int code)
 {
 	fprintf(stderr,
 		"hammer mirror-read <filesystem> [begin-tid]\n"
+		"hammer -f blkdevs mirror-read <pfs_id> [begin-tid [end-tid]]\n"
 		"hammer mirror-read-stream <filesystem> [begin-tid]\n"
 		"hammer mirror-write <filesystem>\n"
 		"hammer mirror-dump [header]\n"
@@ -35,6 +35,8 @@
 #include "hammer.h"
 
 #include <sys/tree.h>
+#include <pthread.h>
+#include <machine/atomic.h>
 
 struct recover_dict {
 	struct recover_dict *next;
@@ -45,6 +47,7 @@ struct recover_dict {
 	uint16_t pfs_id;
 	int64_t	size;
 	char	*name;
+	volatile u_int pending;	/* queued file writes */
 };
 
 #define DICTF_MADEDIR	0x01
@@ -52,6 +55,86 @@ struct recover_dict {
 #define DICTF_PARENT	0x04	/* parent attached for real */
 #define DICTF_TRAVERSED	0x80
 
+/*
+ * hammer recover runs as a pipeline of three stages.
+ *
+ * Scanner threads read each volume a big-block at a time into a ring of
+ * HAMMER_BIGBLOCK_SIZE buffers, bypassing the buffer cache, and test
+ * the CRC of every node in the buffer.  The main thread walks the ring
+ * in order and runs recover_top() on the nodes found, which maintains
+ * the dictionary and creates and renames directories and files.  Since
+ * the resulting namespace depends on the order in which records are
+ * found this stage is not parallelized.  File data is written by a pool
+ * of writer threads.  All writes of an inode are queued to the same
+ * writer so they are done in order.
+ *
+ * With -j 1 there is a single scanner thread and file data is written
+ * by the main thread.
+ */
+#define SCAN_VOLUME	1	/* starting a volume */
+#define SCAN_DATA	2	/* buf contains len bytes at off */
+#define SCAN_LIMIT	3	/* reached raw_limit or zone_limit at off */
+#define SCAN_END	4	/* scanned all volumes */
+
+#define SCAN_NODE_SIZE	((int)sizeof(struct hammer_node_ondisk))
+#define SCAN_NODES	(HAMMER_BIGBLOCK_SIZE / SCAN_NODE_SIZE)
+#define SCAN_RING_MAX	16	/* extents in the ring, whatever -j is */
+
+typedef struct scan_extent {
+	int		type;
+	int		ready;		/* read and CRC tested */
+	volume_info_t	volume;
+	hammer_off_t	off;
+	int		len;
+	char		*buf;
+	char		*isnode;	/* CRC of each node is good */
+} *scan_extent_t;
+
+typedef struct scan_ring {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	scan_extent_t	extents;
+	int		size;
+	int		beg;		/* next extent to parse */
+	int		end;		/* next extent to fill */
+	int		finished;	/* no more extents */
+	hammer_off_t	raw_limit;
+	hammer_off_t	zone_limit;
+
+	/* position of the scan */
+	int		vol_no;
+	volume_info_t	volume;
+	struct bigblock	*bigblock;
+	hammer_off_t	off;
+	hammer_off_t	off_end;
+	int		fds[HAMMER_MAX_VOLUMES];	/* fd to read with */
+	int		dfds[HAMMER_MAX_VOLUMES];	/* O_DIRECT fd */
+} *scan_ring_t;
+
+typedef struct recover_file {
+	int		fd;
+	volatile u_int	refs;
+} *recover_file_t;
+
+typedef struct recover_write {
+	struct recover_write *next;
+	recover_file_t	file;
+	struct recover_dict *dict;
+	hammer_off_t	data_offset;
+	int64_t		file_offset;
+	int64_t		size;		/* dict->size when queued */
+	int		len;
+} *recover_write_t;
+
+typedef struct recover_writer {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	pthread_t	thread;
+	recover_write_t	head;
+	recover_write_t	*tailp;
+	int		exiting;
+} *recover_writer_t;
+
 typedef struct bigblock {
 	RB_ENTRY(bigblock) entry;
 	hammer_off_t phys_offset; /* zone-2 */
@@ -59,7 +142,8 @@ typedef struct bigblock {
 	struct hammer_blockmap_layer2 layer2;
 } *bigblock_t;
 
-static void recover_top(char *ptr, hammer_off_t offset);
+static void *scan_thread(void *arg);
+static void recover_top(char *ptr, char *isnode, hammer_off_t offset);
 static void recover_elm(hammer_btree_leaf_elm_t leaf);
 static struct recover_dict *get_dict(int64_t obj_id, uint16_t pfs_id);
 static char *recover_path(struct recover_dict *dict);
@@ -71,10 +155,21 @@ static void add_bigblock_entry(hammer_off_t offset,
 	hammer_blockmap_layer1_t layer1, hammer_blockmap_layer2_t layer2);
 static bigblock_t get_bigblock_entry(hammer_off_t offset);
 
+static void recover_write(recover_write_t wr);
+static void start_writers(int count);
+static void stop_writers(void);
+static void wait_writes(struct recover_dict *dict);
+static void rel_file(recover_file_t file);
+
 static const char *TargetDir;
-static int CachedFd = -1;
+static recover_file_t CachedFile;
 static char *CachedPath;
 
+static recover_writer_t Writers;
+static int NumWriters;
+static pthread_mutex_t WriteLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t WriteCond = PTHREAD_COND_INITIALIZER;
+
 static int
 bigblock_cmp(bigblock_t b1, bigblock_t b2)
 {
@@ -122,15 +217,12 @@ RB_GENERATE2(bigblock_rb_tree, bigblock, entry, bigblock_cmp, hammer_off_t,
 void
 hammer_cmd_recover(char **av, int ac)
 {
-	buffer_info_t data_buffer;
-	volume_info_t volume;
+	struct scan_ring ring;
+	scan_extent_t extent;
+	pthread_t *threads;
 	bigblock_t b = NULL;
-	hammer_off_t off;
-	hammer_off_t off_end;
-	hammer_off_t off_blk;
 	hammer_off_t raw_limit = 0;
 	hammer_off_t zone_limit = 0;
-	char *ptr;
 	int i;
 	int target_zone = HAMMER_ZONE_BTREE_INDEX;
 	int full = 0;
@@ -196,66 +288,261 @@ hammer_cmd_recover(char **av, int ac)
 		printf("\n");
 	}
 
-	data_buffer = NULL;
-	for (i = 0; i < HAMMER_MAX_VOLUMES; i++) {
-		volume = get_volume(i);
-		if (volume == NULL)
-			continue;
+	bzero(&ring, sizeof(ring));
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.cond, NULL);
+	ring.raw_limit = raw_limit;
+	ring.zone_limit = zone_limit;
+	ring.size = NThreadsOpt * 2 + 2;
+	if (ring.size > SCAN_RING_MAX)
+		ring.size = SCAN_RING_MAX;
+	ring.extents = calloc(ring.size, sizeof(*ring.extents));
+	for (i = 0; i < ring.size; ++i) {
+		if (posix_memalign((void **)&ring.extents[i].buf,
+				   HAMMER_BUFSIZE, HAMMER_BIGBLOCK_SIZE)) {
+			err(1, "posix_memalign");
+			/* not reached */
+		}
+		ring.extents[i].isnode = malloc(SCAN_NODES);
+	}
+	for (i = 0; i < HAMMER_MAX_VOLUMES; ++i)
+		ring.dfds[i] = -1;
+
+	if (NThreadsOpt > 1)
+		start_writers(NThreadsOpt);
+	threads = calloc(NThreadsOpt, sizeof(*threads));
+	for (i = 0; i < NThreadsOpt; ++i) {
+		if (pthread_create(&threads[i], NULL, scan_thread, &ring)) {
+			err(1, "pthread_create");
+			/* not reached */
+		}
+	}
 
-		printf("Scanning volume %d size %s\n",
-			volume->vol_no, sizetostr(volume->size));
-		off = HAMMER_ENCODE_RAW_BUFFER(volume->vol_no, 0);
-		off_end = off + HAMMER_VOL_BUF_SIZE(volume->ondisk);
+	for (;;) {
+		extent = &ring.extents[ring.beg % ring.size];
+		pthread_mutex_lock(&ring.lock);
+		while (ring.beg == ring.end || extent->ready == 0)
+			pthread_cond_wait(&ring.cond, &ring.lock);
+		pthread_mutex_unlock(&ring.lock);
 
-		while (off < off_end) {
-			off_blk = off & HAMMER_BIGBLOCK_MASK64;
-			if (off_blk == 0)
-				b = get_bigblock_entry(off);
+		if (extent->type == SCAN_END)
+			break;
+		if (extent->type == SCAN_LIMIT) {
+			printf("Done %016jx\n", (uintmax_t)extent->off);
+			break;
+		}
+		if (extent->type == SCAN_VOLUME) {
+			printf("Scanning volume %d size %s\n",
+				extent->volume->vol_no,
+				sizetostr(extent->volume->size));
+		}
+		for (i = 0; i < extent->len; i += HAMMER_BUFSIZE) {
+			recover_top(extent->buf + i,
+				    extent->isnode + i / SCAN_NODE_SIZE,
+				    extent->off + i);
+		}
 
-			if (raw_limit) {
-				if (off >= raw_limit) {
-					printf("Done %016jx\n", (uintmax_t)off);
-					goto end;
-				}
+		pthread_mutex_lock(&ring.lock);
+		extent->ready = 0;
+		++ring.beg;
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+	}
+	for (i = 0; i < NThreadsOpt; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	stop_writers();
+
+	for (i = 0; i < HAMMER_MAX_VOLUMES; ++i) {
+		if (ring.dfds[i] != -1)
+			close(ring.dfds[i]);
+	}
+	for (i = 0; i < ring.size; ++i) {
+		free(ring.extents[i].buf);
+		free(ring.extents[i].isnode);
+	}
+	free(ring.extents);
+	pthread_cond_destroy(&ring.cond);
+	pthread_mutex_destroy(&ring.lock);
+	free_bigblocks();
+
+	if (CachedPath) {
+		free(CachedPath);
+		rel_file(CachedFile);
+		CachedPath = NULL;
+		CachedFile = NULL;
+	}
+}
+
+/*
+ * Read len bytes at zone-2 offset off.  O_DIRECT is used if the volume
+ * can be opened with it, falling back to the normal descriptor if
+ * O_DIRECT reads turn out not to work.
+ */
+static
+void
+scan_read(scan_ring_t ring, volume_info_t volume, char *buf,
+	hammer_off_t off, int len)
+{
+	int64_t raw_offset;
+	ssize_t n;
+	int fd;
+
+	pthread_mutex_lock(&ring->lock);
+	fd = ring->fds[volume->vol_no];
+	pthread_mutex_unlock(&ring->lock);
+
+	raw_offset = hammer_xlate_to_phys(volume->ondisk, off);
+	n = pread(fd, buf, len, raw_offset);
+	if (n == -1 && errno == EINVAL && fd != volume->fd) {
+		pthread_mutex_lock(&ring->lock);
+		if (ring->fds[volume->vol_no] == fd)
+			ring->fds[volume->vol_no] = volume->fd;
+		pthread_mutex_unlock(&ring->lock);
+		n = pread(volume->fd, buf, len, raw_offset);
+	}
+	if (n != len) {
+		err(1, "Failed to read %s:%016jx at %016jx",
+		    volume->name, (intmax_t)off, (intmax_t)raw_offset);
+		/* not reached */
+	}
+}
+
+/*
+ * Find the next extent to scan, called with ring->lock held.  An extent
+ * ends at the end of its big-block, at the first buffer beyond the
+ * append offset of a B-Tree zone big-block, or at the end of the volume.
+ */
+static
+void
+scan_next(scan_ring_t ring, scan_extent_t extent)
+{
+	volume_info_t volume;
+	bigblock_t b;
+	hammer_off_t off;
+	hammer_off_t off_blk;
+	hammer_off_t ext_end;
+
+	extent->len = 0;
+	for (;;) {
+		if (ring->volume == NULL) {
+			volume = NULL;
+			while (ring->vol_no < HAMMER_MAX_VOLUMES &&
+			       volume == NULL) {
+				volume = get_volume(ring->vol_no++);
 			}
-			if (zone_limit) {
-				if (off >= zone_limit) {
-					printf("Done %016jx\n", (uintmax_t)off);
-					goto end;
-				}
-				if (b == NULL) {
-					off = HAMMER_ZONE_LAYER2_NEXT_OFFSET(off);
-					continue;
-				}
+			if (volume == NULL) {
+				extent->type = SCAN_END;
+				ring->finished = 1;
+				return;
 			}
+			ring->dfds[volume->vol_no] = open(volume->name,
+							  O_RDONLY | O_DIRECT);
+			if (ring->dfds[volume->vol_no] == -1)
+				ring->fds[volume->vol_no] = volume->fd;
+			else
+				ring->fds[volume->vol_no] =
+					ring->dfds[volume->vol_no];
+			ring->volume = volume;
+			ring->off = HAMMER_ENCODE_RAW_BUFFER(volume->vol_no, 0);
+			ring->off_end = ring->off +
+					HAMMER_VOL_BUF_SIZE(volume->ondisk);
+			extent->type = SCAN_VOLUME;
+			extent->volume = volume;
+			return;
+		}
+		if (ring->off >= ring->off_end) {
+			ring->volume = NULL;
+			continue;
+		}
 
-			if (b) {
-				if (hammer_crc_test_layer1(HammerVersion,
-							   &b->layer1) &&
-				    hammer_crc_test_layer2(HammerVersion,
-							   &b->layer2) &&
-				    off_blk >= b->layer2.append_off) {
-					off = HAMMER_ZONE_LAYER2_NEXT_OFFSET(off);
+		off = ring->off;
+		off_blk = off & HAMMER_BIGBLOCK_MASK64;
+		if (off_blk == 0)
+			ring->bigblock = get_bigblock_entry(off);
+		b = ring->bigblock;
+
+		if ((ring->raw_limit && off >= ring->raw_limit) ||
+		    (ring->zone_limit && off >= ring->zone_limit)) {
+			extent->type = SCAN_LIMIT;
+			extent->off = off;
+			ring->finished = 1;
+			return;
+		}
+		ext_end = HAMMER_ZONE_LAYER2_NEXT_OFFSET(off);
+		if (ring->zone_limit && b == NULL) {
+			ring->off = ext_end;
+			continue;
+		}
+		if (b) {
+			if (hammer_crc_test_layer1(HammerVersion, &b->layer1) &&
+			    hammer_crc_test_layer2(HammerVersion, &b->layer2)) {
+				if (off_blk >= b->layer2.append_off) {
+					ring->off = ext_end;
 					continue;
 				}
+				ext_end = (off & ~HAMMER_BIGBLOCK_MASK64) +
+					  HAMMER_BUFSIZE_DOALIGN(
+					  b->layer2.append_off);
 			}
-
-			ptr = get_buffer_data(off, &data_buffer, 0);
-			if (ptr)
-				recover_top(ptr, off);
-			off += HAMMER_BUFSIZE;
 		}
+		if (ext_end > ring->off_end)
+			ext_end = ring->off_end;
+
+		extent->type = SCAN_DATA;
+		extent->volume = ring->volume;
+		extent->off = off;
+		extent->len = (int)(ext_end - off);
+		ring->off = ext_end;
+		return;
 	}
-end:
-	rel_buffer(data_buffer);
-	free_bigblocks();
+}
 
-	if (CachedPath) {
-		free(CachedPath);
-		close(CachedFd);
-		CachedPath = NULL;
-		CachedFd = -1;
+/*
+ * Scanner thread.  Take the next free extent of the ring, read it and
+ * test the CRC of the nodes in it.
+ */
+static
+void *
+scan_thread(void *arg)
+{
+	scan_ring_t ring = arg;
+	scan_extent_t extent;
+	hammer_node_ondisk_t node;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&ring->lock);
+		while (ring->finished == 0 &&
+		       ring->end - ring->beg == ring->size) {
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		}
+		if (ring->finished) {
+			pthread_mutex_unlock(&ring->lock);
+			break;
+		}
+		extent = &ring->extents[ring->end % ring->size];
+		scan_next(ring, extent);
+		++ring->end;
+		pthread_mutex_unlock(&ring->lock);
+
+		if (extent->type == SCAN_DATA) {
+			scan_read(ring, extent->volume, extent->buf,
+				  extent->off, extent->len);
+			for (i = 0; i < extent->len / SCAN_NODE_SIZE; ++i) {
+				node = (void *)(extent->buf + i * SCAN_NODE_SIZE);
+				extent->isnode[i] =
+					hammer_crc_test_btree(HammerVersion,
+							      node);
+			}
+		}
+
+		pthread_mutex_lock(&ring->lock);
+		extent->ready = 1;
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
 	}
+	return(NULL);
 }
 
 static __inline
@@ -275,12 +562,13 @@ print_node(hammer_node_ondisk_t node, hammer_off_t offset)
 
 /*
  * Top level recovery processor.  Assume the data is a B-Tree node.
- * If the CRC is good we attempt to process the node, building the
- * object space and creating the dictionary as we go.
+ * If the CRC is good (as tested by the scanner) we attempt to process
+ * the node, building the object space and creating the dictionary as
+ * we go.
  */
 static
 void
-recover_top(char *ptr, hammer_off_t offset)
+recover_top(char *ptr, char *isnodep, hammer_off_t offset)
 {
 	hammer_node_ondisk_t node;
 	hammer_btree_elm_t elm;
@@ -289,7 +577,7 @@ recover_top(char *ptr, hammer_off_t offset)
 	int isnode;
 
 	for (node = (void *)ptr; (char *)node < ptr + HAMMER_BUFSIZE; ++node) {
-		isnode = hammer_crc_test_btree(HammerVersion, node);
+		isnode = *isnodep++;
 		maxcount = hammer_node_max_elements(node->type);
 
 		if (DebugOpt) {
@@ -319,11 +607,13 @@ recover_elm(hammer_btree_leaf_elm_t leaf)
 	struct recover_dict *dict2;
 	hammer_data_ondisk_t ondisk;
 	hammer_off_t data_offset;
+	recover_writer_t writer;
+	recover_write_t wr;
+	recover_file_t file;
 	struct stat st;
 	int chunk;
 	int len;
-	int zfill;
-	int64_t file_offset;
+	int error;
 	uint16_t pfs_id;
 	size_t nlen;
 	int fd;
@@ -345,12 +635,24 @@ recover_elm(hammer_btree_leaf_elm_t leaf)
 	if (get_volume(HAMMER_VOL_DECODE(data_offset)) == NULL)
 		return;
 
-	if (data_offset != 0)
-		ondisk = get_buffer_data(data_offset, &data_buffer, 0);
-	else
-		ondisk = NULL;
-	if (ondisk == NULL)
+	if (data_offset == 0)
 		goto done;
+	if (leaf->base.rec_type == HAMMER_RECTYPE_DATA) {
+		/*
+		 * File data is read by recover_write(), only make sure
+		 * that it can be.
+		 */
+		error = 0;
+		if (!hammer_is_zone_raw_buffer(data_offset))
+			blockmap_lookup(data_offset, &error);
+		if (error)
+			goto done;
+		ondisk = NULL;
+	} else {
+		ondisk = get_buffer_data(data_offset, &data_buffer, 0);
+		if (ondisk == NULL)
+			goto done;
+	}
 
 	len = leaf->data_len;
 	chunk = HAMMER_BUFSIZE - ((int)data_offset & HAMMER_BUFMASK);
@@ -412,6 +714,7 @@ recover_elm(hammer_btree_leaf_elm_t leaf)
 
 		if (lstat(path1, &st) == 0) {
 			if (ondisk->inode.obj_type == HAMMER_OBJTYPE_REGFILE) {
+				wait_writes(dict);
 				truncate(path1, dict->size);
 				/* chmod(path1, 0666); */
 			}
@@ -470,75 +773,56 @@ recover_elm(hammer_btree_leaf_elm_t leaf)
 		 * Create the file if necessary, report file creations
 		 */
 		path1 = recover_path(dict);
-		if (CachedPath && strcmp(CachedPath, path1) == 0)
-			fd = CachedFd;
-		else
+		if (CachedPath && strcmp(CachedPath, path1) == 0) {
+			file = CachedFile;
+		} else {
 			fd = open(path1, O_CREAT|O_RDWR, 0666);
-		if (fd < 0) {
-			printf("Unable to create %s: %s\n",
-				path1, strerror(errno));
-			free(path1);
-			break;
+			if (fd < 0) {
+				printf("Unable to create %s: %s\n",
+					path1, strerror(errno));
+				free(path1);
+				break;
+			}
+			file = malloc(sizeof(*file));
+			file->fd = fd;
+			file->refs = 1;
 		}
 		if ((dict->flags & DICTF_MADEFILE) == 0) {
 			dict->flags |= DICTF_MADEFILE;
 			printf("mkfile %s\n", path1);
 		}
 
-		/*
-		 * And write the record.  A HAMMER data block is aligned
-		 * and may contain trailing zeros after the file EOF.  The
-		 * inode record is required to get the actual file size.
-		 *
-		 * However, when the inode record is not available
-		 * we can do a sparse write and that will get it right
-		 * most of the time even if the inode record is never
-		 * found.
-		 */
-		file_offset = (int64_t)leaf->base.key - len;
-		lseek(fd, (off_t)file_offset, SEEK_SET);
-		while (len) {
-			if (dict->size == -1) {
-				for (zfill = chunk - 1; zfill >= 0; --zfill) {
-					if (((char *)ondisk)[zfill])
-						break;
-				}
-				++zfill;
-			} else {
-				zfill = chunk;
+		wr = malloc(sizeof(*wr));
+		wr->file = file;
+		wr->dict = dict;
+		wr->data_offset = data_offset;
+		wr->file_offset = (int64_t)leaf->base.key - len;
+		wr->size = dict->size;
+		wr->len = len;
+		atomic_add_int(&file->refs, 1);
+		atomic_add_int(&dict->pending, 1);
+
+		if (file == CachedFile) {
+			free(path1);
+		} else {
+			if (CachedPath) {
+				free(CachedPath);
+				rel_file(CachedFile);
 			}
-
-			if (zfill)
-				write(fd, ondisk, zfill);
-			if (zfill < chunk)
-				lseek(fd, chunk - zfill, SEEK_CUR);
-
-			len -= chunk;
-			data_offset += chunk;
-			file_offset += chunk;
-			ondisk = get_buffer_data(data_offset, &data_buffer, 0);
-			if (ondisk == NULL)
-				break;
-			chunk = HAMMER_BUFSIZE -
-				((int)data_offset & HAMMER_BUFMASK);
-			if (chunk > len)
-				chunk = len;
-		}
-		if (dict->size >= 0 && file_offset > dict->size) {
-			ftruncate(fd, dict->size);
-			/* fchmod(fd, 0666); */
+			CachedPath = path1;
+			CachedFile = file;
 		}
 
-		if (fd == CachedFd) {
-			free(path1);
-		} else if (CachedPath) {
-			free(CachedPath);
-			close(CachedFd);
-			CachedPath = path1;
-			CachedFd = fd;
+		if (NumWriters) {
+			writer = &Writers[(uint64_t)dict->obj_id % NumWriters];
+			wr->next = NULL;
+			pthread_mutex_lock(&writer->lock);
+			*writer->tailp = wr;
+			writer->tailp = &wr->next;
+			pthread_cond_signal(&writer->cond);
+			pthread_mutex_unlock(&writer->lock);
 		} else {
-			CachedPath = path1;
-			CachedFd = fd;
+			recover_write(wr);
 		}
 		break;
 	case HAMMER_RECTYPE_DIRENTRY:
@@ -611,6 +895,163 @@ done:
 	rel_buffer(data_buffer);
 }
 
+static
+void
+rel_file(recover_file_t file)
+{
+	if (atomic_fetchadd_int(&file->refs, -1) == 1) {
+		close(file->fd);
+		free(file);
+	}
+}
+
+/*
+ * Write a file data record.  A HAMMER data block is aligned and may
+ * contain trailing zeros after the file EOF.  The inode record is
+ * required to get the actual file size.
+ *
+ * However, when the inode record is not available we can do a sparse
+ * write and that will get it right most of the time even if the inode
+ * record is never found.
+ */
+static
+void
+recover_write(recover_write_t wr)
+{
+	buffer_info_t data_buffer = NULL;
+	struct recover_dict *dict = wr->dict;
+	hammer_off_t data_offset = wr->data_offset;
+	int64_t file_offset = wr->file_offset;
+	char *ondisk;
+	int len = wr->len;
+	int chunk;
+	int zfill;
+	int fd = wr->file->fd;
+
+	ondisk = get_buffer_data(data_offset, &data_buffer, 0);
+	while (ondisk && len) {
+		chunk = HAMMER_BUFSIZE - ((int)data_offset & HAMMER_BUFMASK);
+		if (chunk > len)
+			chunk = len;
+
+		if (wr->size == -1) {
+			for (zfill = chunk - 1; zfill >= 0; --zfill) {
+				if (ondisk[zfill])
+					break;
+			}
+			++zfill;
+		} else {
+			zfill = chunk;
+		}
+
+		if (zfill)
+			pwrite(fd, ondisk, zfill, (off_t)file_offset);
+
+		len -= chunk;
+		data_offset += chunk;
+		file_offset += chunk;
+		if (len)
+			ondisk = get_buffer_data(data_offset, &data_buffer, 0);
+	}
+	if (wr->size >= 0 && file_offset > wr->size) {
+		ftruncate(fd, wr->size);
+		/* fchmod(fd, 0666); */
+	}
+	rel_buffer(data_buffer);
+	rel_file(wr->file);
+	free(wr);
+
+	if (atomic_fetchadd_int(&dict->pending, -1) == 1 && NumWriters) {
+		pthread_mutex_lock(&WriteLock);
+		pthread_cond_broadcast(&WriteCond);
+		pthread_mutex_unlock(&WriteLock);
+	}
+}
+
+/*
+ * Wait for the queued writes of an inode before its file is truncated.
+ */
+static
+void
+wait_writes(struct recover_dict *dict)
+{
+	pthread_mutex_lock(&WriteLock);
+	while (dict->pending)
+		pthread_cond_wait(&WriteCond, &WriteLock);
+	pthread_mutex_unlock(&WriteLock);
+}
+
+static
+void *
+writer_thread(void *arg)
+{
+	recover_writer_t writer = arg;
+	recover_write_t wr;
+
+	pthread_mutex_lock(&writer->lock);
+	for (;;) {
+		wr = writer->head;
+		if (wr == NULL) {
+			if (writer->exiting)
+				break;
+			pthread_cond_wait(&writer->cond, &writer->lock);
+			continue;
+		}
+		writer->head = wr->next;
+		if (writer->head == NULL)
+			writer->tailp = &writer->head;
+		pthread_mutex_unlock(&writer->lock);
+		recover_write(wr);
+		pthread_mutex_lock(&writer->lock);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	return(NULL);
+}
+
+static
+void
+start_writers(int count)
+{
+	recover_writer_t writer;
+	int i;
+
+	Writers = calloc(count, sizeof(*Writers));
+	for (i = 0; i < count; ++i) {
+		writer = &Writers[i];
+		pthread_mutex_init(&writer->lock, NULL);
+		pthread_cond_init(&writer->cond, NULL);
+		writer->tailp = &writer->head;
+		if (pthread_create(&writer->thread, NULL, writer_thread,
+				   writer)) {
+			err(1, "pthread_create");
+			/* not reached */
+		}
+	}
+	NumWriters = count;
+}
+
+static
+void
+stop_writers(void)
+{
+	recover_writer_t writer;
+	int i;
+
+	for (i = 0; i < NumWriters; ++i) {
+		writer = &Writers[i];
+		pthread_mutex_lock(&writer->lock);
+		writer->exiting = 1;
+		pthread_cond_signal(&writer->cond);
+		pthread_mutex_unlock(&writer->lock);
+		pthread_join(writer->thread, NULL);
+		pthread_mutex_destroy(&writer->lock);
+		pthread_cond_destroy(&writer->cond);
+	}
+	free(Writers);
+	Writers = NULL;
+	NumWriters = 0;
+}
+
 #define RD_HSIZE	32768
 #define RD_HMASK	(RD_HSIZE - 1)
 
@@ -36,6 +36,8 @@
 
 #include <sys/tree.h>
 #include <libutil.h>
+#include <pthread.h>
+#include <machine/atomic.h>
 
 #define FLAG_TOOFARLEFT		0x0001
 #define FLAG_TOOFARRIGHT	0x0002
@@ -52,34 +54,35 @@ static struct {
 	zone_stat_t stats;
 } opt;
 
-static __inline void print_btree(hammer_off_t node_offset);
-static __inline void print_subtree(hammer_btree_elm_t elm);
-static void print_btree_node(hammer_off_t node_offset, hammer_tid_t mirror_tid,
-	hammer_btree_elm_t lbe);
+static void print_btree(hammer_off_t node_offset);
+static void print_btree_node(btree_walk_node_t wn, void *arg);
 static int test_node_count(hammer_node_ondisk_t node, char *badmp);
-static void print_btree_elm(hammer_node_ondisk_t node, hammer_off_t node_offset,
-	hammer_btree_elm_t elm, hammer_btree_elm_t lbe, const char *ext);
+static void print_btree_elm(btree_walk_node_t wn, hammer_node_ondisk_t node,
+	hammer_btree_elm_t elm, const char *ext);
 static int get_elm_flags(hammer_node_ondisk_t node, hammer_off_t node_offset,
 	hammer_btree_elm_t elm, hammer_btree_elm_t lbe);
 static int test_lr(hammer_btree_elm_t elm, hammer_btree_elm_t lbe);
 static int test_rbn_lr(hammer_btree_elm_t elm, hammer_btree_elm_t lbe);
-static void print_bigblock_fill(hammer_off_t offset);
+static void print_bigblock_fill(FILE *fp, hammer_off_t offset);
 static const char *check_data_crc(hammer_btree_elm_t elm, const char **whichp);
 static hammer_crc_t get_inode_crc(hammer_btree_leaf_elm_t leaf,
 	const char **whichp);
 static hammer_crc_t get_buf_crc(hammer_btree_leaf_elm_t leaf,
 	const char **whichp);
-static void print_record(hammer_btree_elm_t elm);
+static void print_record(btree_walk_node_t wn, hammer_btree_elm_t elm);
 static int init_btree_search(const char *arg);
 static int test_btree_search(hammer_btree_elm_t elm);
 static __inline int test_btree_match(hammer_btree_elm_t elm);
 static int test_btree_out_of_range(hammer_btree_elm_t elm);
-static void hexdump_record(const void *ptr, int length, const char *hdr);
+static void hexdump_record(FILE *fp, const void *ptr, int length,
+	const char *hdr);
+static int export_leaf(hammer_btree_leaf_elm_t leaf, void *arg);
+static void export_flush(int nrows);
 
-static int num_bad_node = 0;
-static int num_bad_elm = 0;
-static int num_bad_rec = 0;
-static int depth;
+static volatile u_int num_bad_node = 0;
+static volatile u_int num_bad_elm = 0;
+static volatile u_int num_bad_rec = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static const char* _indents[] = {
 	"",
@@ -93,7 +96,32 @@ static const char* _indents[] = {
 	"\t\t\t\t\t\t\t\t",
 	"\t\t\t\t\t\t\t\t\t", /* deep enough */
 };
-#define INDENT _indents[opt.indent ? depth : 0]
+#define INDENT _indents[opt.indent ? wn->depth : 0]
+
+/*
+ * Columns of the binary leaf export, see hammer_cmd_show_binary().
+ */
+#define EXPORT_MAGIC	"HAMMERC1"
+#define EXPORT_ROWS	65536		/* rows per chunk */
+
+static struct export_col {
+	const char	*name;
+	int		width;
+	char		*buf;
+} export_cols[] = {
+	{ "localization",	4 },
+	{ "obj_id",		8 },
+	{ "rec_type",		2 },
+	{ "obj_type",		1 },
+	{ "key",		8 },
+	{ "create_tid",		8 },
+	{ "delete_tid",		8 },
+	{ "create_ts",		4 },
+	{ "data_offset",	8 },
+	{ "data_len",		4 },
+	{ "data_crc",		4 },
+};
+#define EXPORT_NCOLS	(int)(sizeof(export_cols) / sizeof(export_cols[0]))
 
 void
 hammer_cmd_show(const char *arg, int filter, int obfuscate, int indent)
@@ -138,44 +166,47 @@ hammer_cmd_show(const char *arg, int filter, int obfuscate, int indent)
 	}
 
 	if (num_bad_node || VerboseOpt)
-		printf("%d bad nodes\n", num_bad_node);
+		printf("%u bad nodes\n", num_bad_node);
 	if (num_bad_elm || VerboseOpt)
-		printf("%d bad elms\n", num_bad_elm);
+		printf("%u bad elms\n", num_bad_elm);
 	if (num_bad_rec || VerboseOpt)
-		printf("%d bad records\n", num_bad_rec);
+		printf("%u bad records\n", num_bad_rec);
 }
 
-static __inline
+/*
+ * The default filter (-1) seeks to the lo:objid:rt:key:tid and then
+ * switches to normal iteration, which depends on the order the subtrees
+ * are visited in, so only walk the tree in parallel if that is not
+ * the case.
+ */
+static
 void
 print_btree(hammer_off_t node_offset)
 {
-	depth = -1;
-	print_btree_node(node_offset, HAMMER_MAX_TID, NULL);
-	assert(depth == -1);
-}
-
-static __inline
-void
-print_subtree(hammer_btree_elm_t elm)
-{
-	hammer_btree_internal_elm_t i = &elm->internal;
-	print_btree_node(i->subtree_offset, i->mirror_tid, elm);
+	void **args;
+	int nthreads = NThreadsOpt;
+
+	if (opt.limit && opt.filter == -1)
+		nthreads = 1;
+	args = calloc(nthreads, sizeof(*args));
+	btree_walk(node_offset, print_btree_node, args, nthreads);
+	free(args);
 }
 
 static
 void
-print_btree_node(hammer_off_t node_offset, hammer_tid_t mirror_tid,
-	hammer_btree_elm_t lbe)
+print_btree_node(btree_walk_node_t wn, void *arg __unused)
 {
 	buffer_info_t buffer = NULL;
 	hammer_node_ondisk_t node;
 	hammer_btree_elm_t elm;
+	hammer_off_t node_offset = wn->node_offset;
+	FILE *fp = wn->fp;
 	int i;
 	char badc = ' ';  /* good */
 	char badm = ' ';  /* good */
 	const char *ext;
 
-	depth++;
 	node = get_buffer_data(node_offset, &buffer, 0);
 
 	if (node == NULL) {
@@ -184,7 +215,7 @@ print_btree_node(hammer_off_t node_offset, hammer_tid_t mirror_tid,
 	} else {
 		if (!hammer_crc_test_btree(HammerVersion, node))
 			badc = 'B';
-		if (node->mirror_tid > mirror_tid) {
+		if (node->mirror_tid > wn->mirror_tid) {
 			badc = 'B';
 			badm = 'M';
 		}
@@ -195,22 +226,25 @@ print_btree_node(hammer_off_t node_offset, hammer_tid_t mirror_tid,
 	}
 
 	if (badm != ' ' || badc != ' ')  /* not good */
-		++num_bad_node;
+		atomic_add_int(&num_bad_node, 1);
 
-	printf("%s%c%c   NODE %016jx ",
+	fprintf(fp, "%s%c%c   NODE %016jx ",
 	       INDENT, badc, badm, (uintmax_t)node_offset);
-	printf("cnt=%02d p=%016jx type=%c depth=%d mirror=%016jx",
+	fprintf(fp, "cnt=%02d p=%016jx type=%c depth=%d mirror=%016jx",
 	       node->count,
 	       (uintmax_t)node->parent,
 	       (node->type ? node->type : '?'),
-	       depth,
+	       wn->depth,
 	       (uintmax_t)node->mirror_tid);
-	printf(" fill=");
-	print_bigblock_fill(node_offset);
-	printf(" {\n");
+	fprintf(fp, " fill=");
+	print_bigblock_fill(fp, node_offset);
+	fprintf(fp, " {\n");
 
-	if (opt.stats)
+	if (opt.stats) {
+		pthread_mutex_lock(&stats_lock);
 		hammer_add_zone_stat(opt.stats, node_offset, sizeof(*node));
+		pthread_mutex_unlock(&stats_lock);
+	}
 
 	for (i = 0; i < node->count; ++i) {
 		elm = &node->elms[i];
@@ -227,14 +261,14 @@ print_btree_node(hammer_off_t node_offset, hammer_tid_t mirror_tid,
 				break;
 			}
 		}
-		print_btree_elm(node, node_offset, elm, lbe, ext);
+		print_btree_elm(wn, node, elm, ext);
 	}
 	if (node->type == HAMMER_BTREE_TYPE_INTERNAL) {
 		assert(i == node->count);  /* boundary */
 		elm = &node->elms[i];
-		print_btree_elm(node, node_offset, elm, lbe, NULL);
+		print_btree_elm(wn, node, elm, NULL);
 	}
-	printf("%s     }\n", INDENT);
+	fprintf(fp, "%s     }\n", INDENT);
 
 	if (node->type == HAMMER_BTREE_TYPE_INTERNAL) {
 		for (i = 0; i < node->count; ++i) {
@@ -244,7 +278,7 @@ print_btree_node(hammer_off_t node_offset, hammer_tid_t mirror_tid,
 					continue;
 			}
 			if (elm->internal.subtree_offset) {
-				print_subtree(elm);
+				btree_walk_child(wn, elm);
 				/*
 				 * Cause show to do normal iteration after
 				 * seeking to the lo:objid:rt:key:tid
@@ -256,7 +290,6 @@ print_btree_node(hammer_off_t node_offset, hammer_tid_t mirror_tid,
 		}
 	}
 	rel_buffer(buffer);
-	depth--;
 }
 
 static
@@ -326,9 +359,10 @@ is_root_btree_end(uint8_t type, int i, hammer_btree_elm_t elm)
 
 static
 void
-print_btree_elm(hammer_node_ondisk_t node, hammer_off_t node_offset,
-	hammer_btree_elm_t elm, hammer_btree_elm_t lbe, const char *ext)
+print_btree_elm(btree_walk_node_t wn, hammer_node_ondisk_t node,
+	hammer_btree_elm_t elm, const char *ext)
 {
+	FILE *fp = wn->fp;
 	char flagstr[8] = { 0, '-', '-', '-', '-', '-', '-', 0 };
 	char deleted;
 	char rootelm;
@@ -338,7 +372,7 @@ print_btree_elm(hammer_node_ondisk_t node, hammer_off_t node_offset,
 	int flags;
 	int i = ((char*)elm - (char*)node) / (int)sizeof(*elm) - 1;
 
-	flags = get_elm_flags(node, node_offset, elm, lbe);
+	flags = get_elm_flags(node, wn->node_offset, elm, wn->lbe);
 	flagstr[0] = flags ? 'B' : 'G';
 	if (flags & FLAG_TOOFARLEFT)
 		flagstr[2] = 'L';
@@ -351,7 +385,7 @@ print_btree_elm(hammer_node_ondisk_t node, hammer_off_t node_offset,
 	if (flags & FLAG_BADMIRRORTID)
 		flagstr[6] = 'M';
 	if (flagstr[0] == 'B')
-		++num_bad_elm;
+		atomic_add_int(&num_bad_elm, 1);
 
 	/*
 	 * Check if elm is derived from root split
@@ -373,15 +407,15 @@ print_btree_elm(hammer_node_ondisk_t node, hammer_off_t node_offset,
 	else
 		label = "ELM";
 
-	printf("%s%s %s %2d %c ",
+	fprintf(fp, "%s%s %s %2d %c ",
 	       INDENT, flagstr, label, i, hammer_elm_btype(elm));
-	printf("lo=%08x objid=%016jx rt=%02x key=%016jx tid=%016jx\n",
+	fprintf(fp, "lo=%08x objid=%016jx rt=%02x key=%016jx tid=%016jx\n",
 	       elm->base.localization,
 	       (uintmax_t)elm->base.obj_id,
 	       elm->base.rec_type,
 	       (uintmax_t)elm->base.key,
 	       (uintmax_t)elm->base.create_tid);
-	printf("%s               %c del=%016jx ot=%02x",
+	fprintf(fp, "%s               %c del=%016jx ot=%02x",
 	       INDENT,
 	       (rootelm == ' ' ? deleted : rootelm),
 	       (uintmax_t)elm->base.delete_tid,
@@ -389,43 +423,45 @@ print_btree_elm(hammer_node_ondisk_t node, hammer_off_t node_offset,
 
 	switch(node->type) {
 	case HAMMER_BTREE_TYPE_INTERNAL:
-		printf(" suboff=%016jx mirror=%016jx",
+		fprintf(fp, " suboff=%016jx mirror=%016jx",
 		       (uintmax_t)elm->internal.subtree_offset,
 		       (uintmax_t)elm->internal.mirror_tid);
 		if (ext)
-			printf(" %s", ext);
+			fprintf(fp, " %s", ext);
 		break;
 	case HAMMER_BTREE_TYPE_LEAF:
 		switch(elm->base.btype) {
 		case HAMMER_BTREE_TYPE_RECORD:
-			printf(" dataoff=%016jx/%d",
+			fprintf(fp, " dataoff=%016jx/%d",
 			       (uintmax_t)elm->leaf.data_offset,
 			       elm->leaf.data_len);
 			p = check_data_crc(elm, &which);
-			printf(" %scrc=%08x", which, elm->leaf.data_crc);
+			fprintf(fp, " %scrc=%08x", which, elm->leaf.data_crc);
 			if (p) {
-				printf(" error=%s", p);
-				++num_bad_rec;
+				fprintf(fp, " error=%s", p);
+				atomic_add_int(&num_bad_rec, 1);
 			}
-			printf(" fill=");
-			print_bigblock_fill(elm->leaf.data_offset);
+			fprintf(fp, " fill=");
+			print_bigblock_fill(fp, elm->leaf.data_offset);
 			if (QuietOpt < 2)
-				print_record(elm);
+				print_record(wn, elm);
 			if (opt.stats) {
+				pthread_mutex_lock(&stats_lock);
 				hammer_add_zone_stat(opt.stats,
 					elm->leaf.data_offset,
 					elm->leaf.data_len);
+				pthread_mutex_unlock(&stats_lock);
 			}
 			break;
 		default:
-			printf(" badtype=%d", elm->base.btype);
+			fprintf(fp, " badtype=%d", elm->base.btype);
 			break;
 		}
 		if (ext)
-			printf(" %s", ext);
+			fprintf(fp, " %s", ext);
 		break;
 	}
-	printf("\n");
+	fprintf(fp, "\n");
 }
 
 static
@@ -512,47 +548,6 @@ get_elm_flags(hammer_node_ondisk_t node, hammer_off_t node_offset,
 	return(flags);
 }
 
-/*
- * Taken from /usr/src/sys/vfs/hammer/hammer_btree.c.
- */
-static
-int
-hammer_btree_cmp(hammer_base_elm_t key1, hammer_base_elm_t key2)
-{
-	if (key1->localization < key2->localization)
-		return(-5);
-	if (key1->localization > key2->localization)
-		return(5);
-
-	if (key1->obj_id < key2->obj_id)
-		return(-4);
-	if (key1->obj_id > key2->obj_id)
-		return(4);
-
-	if (key1->rec_type < key2->rec_type)
-		return(-3);
-	if (key1->rec_type > key2->rec_type)
-		return(3);
-
-	if (key1->key < key2->key)
-		return(-2);
-	if (key1->key > key2->key)
-		return(2);
-
-	if (key1->create_tid == 0) {
-		if (key2->create_tid == 0)
-			return(0);
-		return(1);
-	}
-	if (key2->create_tid == 0)
-		return(-1);
-	if (key1->create_tid < key2->create_tid)
-		return(-1);
-	if (key1->create_tid > key2->create_tid)
-		return(1);
-	return(0);
-}
-
 static
 int
 test_lr(hammer_btree_elm_t elm, hammer_btree_elm_t lbe)
@@ -583,7 +578,7 @@ test_rbn_lr(hammer_btree_elm_t rbn, hammer_btree_elm_t lbe)
 
 static
 void
-print_bigblock_fill(hammer_off_t offset)
+print_bigblock_fill(FILE *fp, hammer_off_t offset)
 {
 	struct hammer_blockmap_layer1 layer1;
 	struct hammer_blockmap_layer2 layer2;
@@ -591,7 +586,7 @@ print_bigblock_fill(hammer_off_t offset)
 	int error;
 
 	blockmap_lookup_save(offset, &layer1, &layer2, &error);
-	printf("z%d:v%d:%d:%d:%lu=",
+	fprintf(fp, "z%d:v%d:%d:%d:%lu=",
 		HAMMER_ZONE_DECODE(offset),
 		HAMMER_VOL_DECODE(offset),
 		HAMMER_BLOCKMAP_LAYER1_INDEX(offset),
@@ -599,10 +594,10 @@ print_bigblock_fill(hammer_off_t offset)
 		offset & HAMMER_BIGBLOCK_MASK64);
 
 	if (error) {
-		printf("B%d", error);
+		fprintf(fp, "B%d", error);
 	} else {
 		fill = layer2.bytes_free * 100 / HAMMER_BIGBLOCK_SIZE;
-		printf("%d%%", 100 - fill);
+		fprintf(fp, "%d%%", 100 - fill);
 	}
 }
 
@@ -727,27 +722,29 @@ end:
 
 static
 void
-print_config(char *cfgtxt)
+print_config(btree_walk_node_t wn, char *cfgtxt)
 {
+	FILE *fp = wn->fp;
 	char *token;
 
-	printf("\n%s%17s", INDENT, "");
-	printf("config text=\"\n");
+	fprintf(fp, "\n%s%17s", INDENT, "");
+	fprintf(fp, "config text=\"\n");
 	if (cfgtxt != NULL) {
 		while((token = strsep(&cfgtxt, "\r\n")) != NULL) {
 			if (strlen(token)) {
-				printf("%s%17s            %s\n",
+				fprintf(fp, "%s%17s            %s\n",
 					INDENT, "", token);
 			}
 		}
 	}
-	printf("%s%17s            \"", INDENT, "");
+	fprintf(fp, "%s%17s            \"", INDENT, "");
 }
 
 static
 void
-print_record(hammer_btree_elm_t elm)
+print_record(btree_walk_node_t wn, hammer_btree_elm_t elm)
 {
+	FILE *fp = wn->fp;
 	buffer_info_t data_buffer;
 	hammer_off_t data_offset;
 	int32_t data_len;
@@ -766,39 +763,39 @@ print_record(hammer_btree_elm_t elm)
 
 	switch(elm->leaf.base.rec_type) {
 	case HAMMER_RECTYPE_UNKNOWN:
-		printf("\n%s%17s", INDENT, "");
-		printf("unknown");
+		fprintf(fp, "\n%s%17s", INDENT, "");
+		fprintf(fp, "unknown");
 		break;
 	case HAMMER_RECTYPE_INODE:
-		printf("\n%s%17s", INDENT, "");
-		printf("inode size=%jd nlinks=%jd",
+		fprintf(fp, "\n%s%17s", INDENT, "");
+		fprintf(fp, "inode size=%jd nlinks=%jd",
 		       (intmax_t)data->inode.size,
 		       (intmax_t)data->inode.nlinks);
-		printf(" mode=%05o uflags=%08x caps=%02x",
+		fprintf(fp, " mode=%05o uflags=%08x caps=%02x",
 			data->inode.mode,
 			data->inode.uflags,
 			data->inode.cap_flags);
-		printf(" pobjid=%016jx ot=%02x\n",
+		fprintf(fp, " pobjid=%016jx ot=%02x\n",
 			(uintmax_t)data->inode.parent_obj_id,
 			data->inode.obj_type);
-		printf("%s%17s", INDENT, "");
-		printf("      ctime=%016jx mtime=%016jx atime=%016jx",
+		fprintf(fp, "%s%17s", INDENT, "");
+		fprintf(fp, "      ctime=%016jx mtime=%016jx atime=%016jx",
 			(uintmax_t)data->inode.ctime,
 			(uintmax_t)data->inode.mtime,
 			(uintmax_t)data->inode.atime);
 		if (data->inode.ext.symlink[0]) {
-			printf(" symlink=\"%s\"",
+			fprintf(fp, " symlink=\"%s\"",
 				data->inode.ext.symlink);
 		}
 		break;
 	case HAMMER_RECTYPE_DIRENTRY:
 		data_len -= HAMMER_ENTRY_NAME_OFF;
-		printf("\n%s%17s", INDENT, "");
-		printf("dir-entry objid=%016jx lo=%08x",
+		fprintf(fp, "\n%s%17s", INDENT, "");
+		fprintf(fp, "dir-entry objid=%016jx lo=%08x",
 		       (uintmax_t)data->entry.obj_id,
 		       data->entry.localization);
 		if (!opt.obfuscate) {
-			printf(" name=\"%*.*s\"",
+			fprintf(fp, " name=\"%*.*s\"",
 			       data_len, data_len, data->entry.name);
 		}
 		break;
@@ -806,54 +803,54 @@ print_record(hammer_btree_elm_t elm)
 		switch(elm->leaf.base.key) {
 		case HAMMER_FIXKEY_SYMLINK:
 			data_len -= HAMMER_SYMLINK_NAME_OFF;
-			printf("\n%s%17s", INDENT, "");
-			printf("fix-symlink name=\"%*.*s\"",
+			fprintf(fp, "\n%s%17s", INDENT, "");
+			fprintf(fp, "fix-symlink name=\"%*.*s\"",
 				data_len, data_len, data->symlink.name);
 			break;
 		}
 		break;
 	case HAMMER_RECTYPE_PFS:
-		printf("\n%s%17s", INDENT, "");
-		printf("pfs sync_beg_tid=%016jx sync_end_tid=%016jx\n",
+		fprintf(fp, "\n%s%17s", INDENT, "");
+		fprintf(fp, "pfs sync_beg_tid=%016jx sync_end_tid=%016jx\n",
 			(uintmax_t)data->pfsd.sync_beg_tid,
 			(uintmax_t)data->pfsd.sync_end_tid);
 		hammer_uuid_to_string(&data->pfsd.shared_uuid, &str1);
 		hammer_uuid_to_string(&data->pfsd.unique_uuid, &str2);
-		printf("%17s", "");
-		printf("    shared_uuid=%s\n", str1);
-		printf("%17s", "");
-		printf("    unique_uuid=%s\n", str2);
-		printf("%17s", "");
-		printf("    mirror_flags=%08x label=\"%s\"",
+		fprintf(fp, "%17s", "");
+		fprintf(fp, "    shared_uuid=%s\n", str1);
+		fprintf(fp, "%17s", "");
+		fprintf(fp, "    unique_uuid=%s\n", str2);
+		fprintf(fp, "%17s", "");
+		fprintf(fp, "    mirror_flags=%08x label=\"%s\"",
 			data->pfsd.mirror_flags, data->pfsd.label);
 		if (data->pfsd.snapshots[0])
-			printf(" snapshots=\"%s\"", data->pfsd.snapshots);
+			fprintf(fp, " snapshots=\"%s\"", data->pfsd.snapshots);
 		free(str1);
 		free(str2);
 		break;
 	case HAMMER_RECTYPE_SNAPSHOT:
-		printf("\n%s%17s", INDENT, "");
-		printf("snapshot tid=%016jx label=\"%s\"",
+		fprintf(fp, "\n%s%17s", INDENT, "");
+		fprintf(fp, "snapshot tid=%016jx label=\"%s\"",
 			(uintmax_t)data->snap.tid, data->snap.label);
 		break;
 	case HAMMER_RECTYPE_CONFIG:
 		if (VerboseOpt > 2) {
 			char *p = strdup(data->config.text);
-			print_config(p);
+			print_config(wn, p);
 			free(p);
 		}
 		break;
 	case HAMMER_RECTYPE_DATA:
 		if (VerboseOpt > 3) {
-			printf("\n");
-			hexdump_record(data, data_len, "\t\t  ");
+			fprintf(fp, "\n");
+			hexdump_record(fp, data, data_len, "\t\t  ");
 		}
 		break;
 	case HAMMER_RECTYPE_EXT:
 	case HAMMER_RECTYPE_DB:
 		if (VerboseOpt > 2) {
-			printf("\n");
-			hexdump_record(data, data_len, "\t\t  ");
+			fprintf(fp, "\n");
+			hexdump_record(fp, data, data_len, "\t\t  ");
 		}
 		break;
 	default:
@@ -870,16 +867,16 @@ print_record(hammer_btree_elm_t elm)
  */
 static
 void
-hexdump_record(const void *ptr, int length, const char *hdr)
+hexdump_record(FILE *fp, const void *ptr, int length, const char *hdr)
 {
 	int data_len = length;
 
 	if (data_len > HAMMER_BUFSIZE)  /* XXX */
 		data_len = HAMMER_BUFSIZE;
-	hexdump(ptr, data_len, hdr, 0);
+	fhexdump(fp, ptr, data_len, hdr, 0);
 
 	if (length > data_len)
-		printf("%s....\n", hdr);
+		fprintf(fp, "%s....\n", hdr);
 }
 
 static __inline __always_inline
@@ -1029,6 +1026,185 @@ test_btree_out_of_range(hammer_btree_elm_t elm)
 	return(0);
 }
 
+/*
+ * Write the B-Tree leaf elements to stdout in columnar chunks for
+ * analysis by other programs, instead of printing them.  All records,
+ * including deleted ones, are exported in B-Tree order.  arg limits
+ * the export to a lo:objid:rt:key:tid prefix as for show.
+ *
+ * The stream starts with the magic, the number of columns and, for
+ * each column, its name and width in bytes.  Chunks of up to
+ * EXPORT_ROWS rows follow, each being the row count followed by the
+ * values of each column in turn.  A chunk of 0 rows ends the stream.
+ * Integers are little-endian, the header fields 32 bits wide.
+ */
+void
+hammer_cmd_show_binary(const char *arg)
+{
+	struct btree_search search;
+	volume_info_t volume;
+	struct export_col *col;
+	char name[24];
+	uint32_t hdr[2];
+	int nrows = 0;
+	int error;
+	int i;
+
+	bzero(&search, sizeof(search));
+	search.key_beg.localization = HAMMER_MIN_ONDISK_LOCALIZATION;
+	search.key_beg.obj_id = HAMMER_MIN_OBJID;
+	search.key_beg.rec_type = HAMMER_MIN_RECTYPE;
+	search.key_beg.key = HAMMER_MIN_KEY;
+	search.key_beg.create_tid = 1;
+	search.key_end.localization = HAMMER_MAX_ONDISK_LOCALIZATION;
+	search.key_end.obj_id = HAMMER_MAX_OBJID;
+	search.key_end.rec_type = HAMMER_MAX_RECTYPE;
+	search.key_end.key = HAMMER_MAX_KEY;
+	search.key_end.create_tid = 0;	/* infinity */
+
+	bzero(&opt, sizeof(opt));
+	init_btree_search(arg);
+	if (opt.limit > 0) {
+		search.key_beg.localization = opt.base.localization;
+		search.key_end.localization = opt.base.localization;
+	}
+	if (opt.limit > 1) {
+		search.key_beg.obj_id = opt.base.obj_id;
+		search.key_end.obj_id = opt.base.obj_id;
+	}
+	if (opt.limit > 2) {
+		search.key_beg.rec_type = opt.base.rec_type;
+		search.key_end.rec_type = opt.base.rec_type;
+	}
+	if (opt.limit > 3) {
+		search.key_beg.key = opt.base.key;
+		search.key_end.key = opt.base.key;
+	}
+	if (opt.limit > 4) {
+		search.key_beg.create_tid = opt.base.create_tid;
+		search.key_end.create_tid = opt.base.create_tid;
+	}
+	search.asof = 0;	/* all records */
+	search.func = export_leaf;
+	search.arg = &nrows;
+
+	fwrite(EXPORT_MAGIC, 8, 1, stdout);
+	hdr[0] = htole32(EXPORT_NCOLS);
+	hdr[1] = 0;
+	fwrite(hdr, sizeof(hdr), 1, stdout);
+	for (i = 0; i < EXPORT_NCOLS; ++i) {
+		col = &export_cols[i];
+		col->buf = malloc(col->width * EXPORT_ROWS);
+		if (col->buf == NULL) {
+			err(1, "malloc");
+			/* not reached */
+		}
+		bzero(name, sizeof(name));
+		strncpy(name, col->name, sizeof(name) - 1);
+		hdr[0] = htole32(col->width);
+		fwrite(name, sizeof(name), 1, stdout);
+		fwrite(hdr, sizeof(hdr), 1, stdout);
+	}
+
+	volume = get_root_volume();
+	error = btree_search(volume->ondisk->vol0_btree_root, &search);
+	if (error) {
+		errx(1, "show: %s", strerror(error));
+		/* not reached */
+	}
+	if (nrows)
+		export_flush(nrows);
+	export_flush(0);
+
+	for (i = 0; i < EXPORT_NCOLS; ++i)
+		free(export_cols[i].buf);
+	if (fflush(stdout) || ferror(stdout)) {
+		err(1, "stdout");
+		/* not reached */
+	}
+}
+
+/*
+ * Store the value of column i in row n, converted to little-endian.
+ */
+static
+void
+export_put(int i, int n, const void *value)
+{
+	struct export_col *col = &export_cols[i];
+	char *dst = col->buf + col->width * n;
+	uint16_t v16;
+	uint32_t v32;
+	uint64_t v64;
+
+	switch(col->width) {
+	case 2:
+		bcopy(value, &v16, sizeof(v16));
+		v16 = htole16(v16);
+		bcopy(&v16, dst, sizeof(v16));
+		break;
+	case 4:
+		bcopy(value, &v32, sizeof(v32));
+		v32 = htole32(v32);
+		bcopy(&v32, dst, sizeof(v32));
+		break;
+	case 8:
+		bcopy(value, &v64, sizeof(v64));
+		v64 = htole64(v64);
+		bcopy(&v64, dst, sizeof(v64));
+		break;
+	default:
+		bcopy(value, dst, col->width);
+		break;
+	}
+}
+
+#define EXPORT_PUT(i, field)	export_put(i, n, &(field))
+
+static
+int
+export_leaf(hammer_btree_leaf_elm_t leaf, void *arg)
+{
+	int *nrowsp = arg;
+	int n = *nrowsp;
+
+	EXPORT_PUT(0, leaf->base.localization);
+	EXPORT_PUT(1, leaf->base.obj_id);
+	EXPORT_PUT(2, leaf->base.rec_type);
+	EXPORT_PUT(3, leaf->base.obj_type);
+	EXPORT_PUT(4, leaf->base.key);
+	EXPORT_PUT(5, leaf->base.create_tid);
+	EXPORT_PUT(6, leaf->base.delete_tid);
+	EXPORT_PUT(7, leaf->create_ts);
+	EXPORT_PUT(8, leaf->data_offset);
+	EXPORT_PUT(9, leaf->data_len);
+	EXPORT_PUT(10, leaf->data_crc);
+
+	if (++n == EXPORT_ROWS) {
+		export_flush(n);
+		n = 0;
+	}
+	*nrowsp = n;
+	return(0);
+}
+
+static
+void
+export_flush(int nrows)
+{
+	struct export_col *col;
+	uint32_t hdr[2];
+	int i;
+
+	hdr[0] = htole32(nrows);
+	hdr[1] = 0;
+	fwrite(hdr, sizeof(hdr), 1, stdout);
+	for (i = 0; i < EXPORT_NCOLS; ++i) {
+		col = &export_cols[i];
+		fwrite(col->buf, col->width, nrows, stdout);
+	}
+}
+
 /*
  * Dump the UNDO FIFO
  */
@@ -0,0 +1,531 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hammer.h"
+
+#include <poll.h>
+#include <pthread.h>
+
+/*
+ * zlib's own crc32() clashes with libkern's, neither is used here.
+ */
+#define crc32		zlib_crc32
+#include <zlib.h>
+#undef crc32
+
+/*
+ * Framed mirroring stream transport.
+ *
+ * Frames are encoded and decoded by a pool of worker threads, up to
+ * two per worker being in flight.  Jobs are queued and retired in
+ * stream order, so the encoder writes its frames in order and the
+ * decoder places each frame's data at its reserved offset in the
+ * caller's buffer.  With a single thread the jobs are run inline.
+ */
+#define FRAME_LEVEL		1		/* favour speed */
+
+typedef struct frame_job {
+	struct frame_head	*head;		/* followed by the payload */
+	char			*raw;		/* decoded data */
+	char			*rawbuf;	/* encoder's raw buffer */
+	int			decode;
+	int			done;
+	const char		*error;
+} *frame_job_t;
+
+struct frame_codec {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t		*threads;
+	int			nthreads;
+	int			exiting;
+	frame_job_t		jobs;
+	u_int			njobs;
+	u_int			submitted;	/* next job to queue */
+	u_int			taken;		/* next job for a worker */
+	u_int			retired;	/* oldest job in flight */
+	z_stream		defl;		/* inline codecs */
+	z_stream		infl;
+	char			*pending;	/* decoder input read ahead */
+	size_t			npending;
+};
+
+static void *frame_thread(void *arg);
+static void frame_run(frame_job_t job, z_stream *defl, z_stream *infl);
+static frame_job_t frame_get_job(frame_codec_t fc, int decode);
+static void frame_submit(frame_codec_t fc);
+static frame_job_t frame_retire(frame_codec_t fc);
+static ssize_t frame_read(frame_codec_t fc, int fd, void *buf, size_t bytes);
+static int frame_readable(frame_codec_t fc, int fd);
+
+static
+void
+frame_zinit(z_stream *defl, z_stream *infl)
+{
+	bzero(defl, sizeof(*defl));
+	bzero(infl, sizeof(*infl));
+
+	/*
+	 * Raw deflate streams, the frame carries its own CRC.
+	 */
+	if (deflateInit2(defl, FRAME_LEVEL, Z_DEFLATED, -15, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK ||
+	    inflateInit2(infl, -15) != Z_OK) {
+		errx(1, "frame: cannot initialize zlib");
+		/* not reached */
+	}
+}
+
+frame_codec_t
+frame_codec_open(int nthreads)
+{
+	frame_codec_t fc;
+	u_int i;
+
+	fc = calloc(1, sizeof(*fc));
+	pthread_mutex_init(&fc->lock, NULL);
+	pthread_cond_init(&fc->cond, NULL);
+	frame_zinit(&fc->defl, &fc->infl);
+
+	if (nthreads <= 1)
+		nthreads = 0;
+	fc->njobs = nthreads ? nthreads * 2 : 1;
+	fc->jobs = calloc(fc->njobs, sizeof(*fc->jobs));
+	for (i = 0; i < fc->njobs; ++i) {
+		fc->jobs[i].head = malloc(sizeof(struct frame_head) +
+					  FRAME_BUFSIZE);
+	}
+
+	fc->nthreads = nthreads;
+	fc->threads = calloc(nthreads + 1, sizeof(*fc->threads));
+	for (i = 0; i < (u_int)nthreads; ++i) {
+		if (pthread_create(&fc->threads[i], NULL, frame_thread, fc)) {
+			errx(1, "frame_codec_open: cannot create thread");
+			/* not reached */
+		}
+	}
+	return(fc);
+}
+
+/*
+ * Wait for the jobs in flight, which may still be writing to the
+ * caller's buffers, then tear the pool down.
+ */
+void
+frame_codec_close(frame_codec_t fc)
+{
+	u_int i;
+
+	if (fc == NULL)
+		return;
+	pthread_mutex_lock(&fc->lock);
+	while (fc->retired != fc->submitted) {
+		while (fc->jobs[fc->retired % fc->njobs].done == 0)
+			pthread_cond_wait(&fc->cond, &fc->lock);
+		++fc->retired;
+	}
+	fc->exiting = 1;
+	pthread_cond_broadcast(&fc->cond);
+	pthread_mutex_unlock(&fc->lock);
+	for (i = 0; i < (u_int)fc->nthreads; ++i)
+		pthread_join(fc->threads[i], NULL);
+
+	deflateEnd(&fc->defl);
+	inflateEnd(&fc->infl);
+	for (i = 0; i < fc->njobs; ++i) {
+		free(fc->jobs[i].head);
+		free(fc->jobs[i].rawbuf);
+	}
+	free(fc->jobs);
+	free(fc->threads);
+	free(fc->pending);
+	pthread_cond_destroy(&fc->cond);
+	pthread_mutex_destroy(&fc->lock);
+	free(fc);
+}
+
+static
+void *
+frame_thread(void *arg)
+{
+	frame_codec_t fc = arg;
+	frame_job_t job;
+	z_stream defl;
+	z_stream infl;
+
+	frame_zinit(&defl, &infl);
+
+	pthread_mutex_lock(&fc->lock);
+	for (;;) {
+		while (fc->taken == fc->submitted && fc->exiting == 0)
+			pthread_cond_wait(&fc->cond, &fc->lock);
+		if (fc->taken == fc->submitted)
+			break;
+		job = &fc->jobs[fc->taken++ % fc->njobs];
+		pthread_mutex_unlock(&fc->lock);
+
+		frame_run(job, &defl, &infl);
+
+		pthread_mutex_lock(&fc->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&fc->cond);
+	}
+	pthread_mutex_unlock(&fc->lock);
+
+	deflateEnd(&defl);
+	inflateEnd(&infl);
+	return(NULL);
+}
+
+/*
+ * Encode job->raw into job->head, or decode job->head into job->raw.
+ */
+static
+void
+frame_run(frame_job_t job, z_stream *defl, z_stream *infl)
+{
+	struct frame_head *head = job->head;
+	char *payload = (char *)(head + 1);
+
+	if (job->decode) {
+		if (head->type == FRAME_TYPE_STORED) {
+			bcopy(payload, job->raw, head->raw_bytes);
+		} else {
+			inflateReset(infl);
+			infl->next_in = (void *)payload;
+			infl->avail_in = head->bytes;
+			infl->next_out = (void *)job->raw;
+			infl->avail_out = head->raw_bytes;
+			if (inflate(infl, Z_FINISH) != Z_STREAM_END ||
+			    infl->avail_out != 0) {
+				job->error = "malformed deflate payload";
+				return;
+			}
+		}
+		if (iscsi_crc32(job->raw, head->raw_bytes) != head->data_crc)
+			job->error = "data crc mismatch";
+		return;
+	}
+
+	/*
+	 * Only keep the deflated payload if it is smaller than the data.
+	 */
+	head->signature = FRAME_SIGNATURE;
+	head->reserved01 = 0;
+	head->data_crc = iscsi_crc32(job->raw, head->raw_bytes);
+
+	deflateReset(defl);
+	defl->next_in = (void *)job->raw;
+	defl->avail_in = head->raw_bytes;
+	defl->next_out = (void *)payload;
+	defl->avail_out = head->raw_bytes - 1;
+	if (head->raw_bytes > 1 && deflate(defl, Z_FINISH) == Z_STREAM_END) {
+		head->type = FRAME_TYPE_DEFLATE;
+		head->bytes = head->raw_bytes - 1 - defl->avail_out;
+	} else {
+		head->type = FRAME_TYPE_STORED;
+		head->bytes = head->raw_bytes;
+		bcopy(job->raw, payload, head->raw_bytes);
+	}
+	head->head_crc = iscsi_crc32(head, offsetof(struct frame_head, head_crc));
+}
+
+/*
+ * Return the next free job.  The caller retires the oldest one first if
+ * they are all in flight.
+ */
+static
+frame_job_t
+frame_get_job(frame_codec_t fc, int decode)
+{
+	frame_job_t job;
+
+	assert(fc->submitted - fc->retired < fc->njobs);
+	job = &fc->jobs[fc->submitted % fc->njobs];
+	job->decode = decode;
+	job->done = 0;
+	job->error = NULL;
+	return(job);
+}
+
+static
+void
+frame_submit(frame_codec_t fc)
+{
+	frame_job_t job;
+
+	if (fc->nthreads == 0) {
+		job = &fc->jobs[fc->submitted % fc->njobs];
+		++fc->submitted;
+		++fc->taken;
+		frame_run(job, &fc->defl, &fc->infl);
+		job->done = 1;
+		return;
+	}
+	pthread_mutex_lock(&fc->lock);
+	++fc->submitted;
+	pthread_cond_broadcast(&fc->cond);
+	pthread_mutex_unlock(&fc->lock);
+}
+
+/*
+ * Wait for the oldest job in flight to complete and retire it.
+ */
+static
+frame_job_t
+frame_retire(frame_codec_t fc)
+{
+	frame_job_t job;
+
+	assert(fc->retired != fc->submitted);
+	job = &fc->jobs[fc->retired % fc->njobs];
+	if (fc->nthreads) {
+		pthread_mutex_lock(&fc->lock);
+		while (job->done == 0)
+			pthread_cond_wait(&fc->cond, &fc->lock);
+		pthread_mutex_unlock(&fc->lock);
+	}
+	++fc->retired;
+	return(job);
+}
+
+static
+int
+frame_output(frame_job_t job, frame_output_t output, void *arg)
+{
+	struct iovec iov;
+
+	iov.iov_base = job->head;
+	iov.iov_len = sizeof(*job->head) + job->head->bytes;
+	return(output(&iov, 1, arg));
+}
+
+/*
+ * Encode the data described by iov as frames, which are passed to
+ * output in order.  Returns 0, or -1 if output failed.
+ */
+int
+frame_encode(frame_codec_t fc, struct iovec *iov, int niov,
+	     frame_output_t output, void *arg)
+{
+	frame_job_t job;
+	size_t off = 0;
+	size_t n;
+	int error = 0;
+
+	while (niov) {
+		if (fc->submitted - fc->retired == fc->njobs) {
+			job = frame_retire(fc);
+			if (error == 0)
+				error = frame_output(job, output, arg);
+		}
+		job = frame_get_job(fc, 0);
+		if (job->rawbuf == NULL)
+			job->rawbuf = malloc(FRAME_BUFSIZE);
+		job->raw = job->rawbuf;
+
+		/*
+		 * Gather up to FRAME_BUFSIZE bytes for the frame.
+		 */
+		job->head->raw_bytes = 0;
+		while (niov && job->head->raw_bytes < FRAME_BUFSIZE) {
+			n = iov->iov_len - off;
+			if (n > FRAME_BUFSIZE - job->head->raw_bytes)
+				n = FRAME_BUFSIZE - job->head->raw_bytes;
+			bcopy((char *)iov->iov_base + off,
+			      job->raw + job->head->raw_bytes, n);
+			job->head->raw_bytes += n;
+			off += n;
+			if (off == iov->iov_len) {
+				off = 0;
+				++iov;
+				--niov;
+			}
+		}
+		if (job->head->raw_bytes)
+			frame_submit(fc);
+	}
+	while (fc->retired != fc->submitted) {
+		job = frame_retire(fc);
+		if (error == 0)
+			error = frame_output(job, output, arg);
+	}
+	return(error);
+}
+
+/*
+ * Hand the decoder stream data which was already read from the fd,
+ * e.g. to look for FRAME_SIGNATURE.
+ */
+void
+frame_decode_prefix(frame_codec_t fc, const char *buf, size_t bytes)
+{
+	fc->pending = realloc(fc->pending, fc->npending + bytes);
+	bcopy(buf, fc->pending + fc->npending, bytes);
+	fc->npending += bytes;
+}
+
+/*
+ * Read and decode frames from fd into buf, which must have room for at
+ * least one frame.  Frames are decoded while more are read, until buf
+ * has no room left or fd has no data ready.  Returns the number of
+ * bytes decoded, 0 on EOF, or -1 with errno set on a read error.
+ * Malformed frames are fatal.
+ *
+ * The calling thread may only be cancelled in read(), with no job in
+ * flight being waited on.
+ */
+ssize_t
+frame_decode(frame_codec_t fc, int fd, char *buf, size_t bytes)
+{
+	struct frame_head head;
+	frame_job_t job;
+	size_t fill = 0;
+	ssize_t n;
+	int cstate;
+	int error = 0;
+
+	assert(bytes >= FRAME_BUFSIZE);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cstate);
+	while (bytes - fill >= FRAME_BUFSIZE) {
+		/*
+		 * Complete what we have before blocking, the peer may be
+		 * waiting on us.
+		 */
+		if (fill && frame_readable(fc, fd) == 0)
+			break;
+
+		n = frame_read(fc, fd, &head, sizeof(head));
+		if (n <= 0) {
+			error = (n < 0) ? errno : 0;
+			break;
+		}
+		if (n != sizeof(head)) {
+			errx(1, "frame_decode: short frame header");
+			/* not reached */
+		}
+		if (head.signature != FRAME_SIGNATURE ||
+		    iscsi_crc32(&head, offsetof(struct frame_head, head_crc)) !=
+		    head.head_crc) {
+			errx(1, "frame_decode: malformed frame, bad header");
+			/* not reached */
+		}
+		if (head.raw_bytes > FRAME_BUFSIZE ||
+		    head.bytes > FRAME_BUFSIZE ||
+		    (head.type == FRAME_TYPE_STORED &&
+		     head.bytes != head.raw_bytes) ||
+		    (head.type != FRAME_TYPE_STORED &&
+		     head.type != FRAME_TYPE_DEFLATE)) {
+			errx(1, "frame_decode: malformed frame, bad size "
+				"or type");
+			/* not reached */
+		}
+
+		if (fc->submitted - fc->retired == fc->njobs) {
+			job = frame_retire(fc);
+			if (job->error) {
+				errx(1, "frame_decode: %s", job->error);
+				/* not reached */
+			}
+		}
+		job = frame_get_job(fc, 1);
+		*job->head = head;
+		n = frame_read(fc, fd, job->head + 1, head.bytes);
+		if (n != (ssize_t)head.bytes) {
+			errx(1, "frame_decode: short frame payload");
+			/* not reached */
+		}
+		job->raw = buf + fill;
+		fill += head.raw_bytes;
+		frame_submit(fc);
+	}
+	while (fc->retired != fc->submitted) {
+		job = frame_retire(fc);
+		if (job->error) {
+			errx(1, "frame_decode: %s", job->error);
+			/* not reached */
+		}
+	}
+	pthread_setcancelstate(cstate, NULL);
+
+	if (fill == 0 && error) {
+		errno = error;
+		return(-1);
+	}
+	return(fill);
+}
+
+/*
+ * Read bytes from the pending data, then from fd.  Returns less than
+ * bytes only on EOF or error.
+ */
+static
+ssize_t
+frame_read(frame_codec_t fc, int fd, void *buf, size_t bytes)
+{
+	size_t done = 0;
+	ssize_t n;
+	int cstate;
+
+	if (fc->npending) {
+		done = (bytes < fc->npending) ? bytes : fc->npending;
+		bcopy(fc->pending, buf, done);
+		fc->npending -= done;
+		bcopy(fc->pending + done, fc->pending, fc->npending);
+	}
+	while (done < bytes) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &cstate);
+		n = read(fd, (char *)buf + done, bytes - done);
+		pthread_setcancelstate(cstate, NULL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return(done ? (ssize_t)done : -1);
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return(done);
+}
+
+static
+int
+frame_readable(frame_codec_t fc, int fd)
+{
+	struct pollfd pfd;
+
+	if (fc->npending)
+		return(1);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return(poll(&pfd, 1, 0) > 0);
+}
@@ -52,6 +52,7 @@ int DelayOpt = 5;
 char *SshPort;
 int ForceYesOpt;
 int CompressOpt;
+int FrameOpt;
 int ForceOpt;
 int RunningIoctl;
 int DidInterrupt;
@@ -62,6 +63,7 @@ uint64_t SplitupOpt = 4ULL * 1024ULL * 1024ULL * 1024ULL;
 uint64_t MemoryLimit = 1024LLU * 1024 * 1024;
 const char *SplitupOptStr;
 const char *CyclePath;
+int NThreadsOpt = 1;
 
 int
 main(int ac, char **av)
@@ -72,7 +74,7 @@ main(int ac, char **av)
 	int ch;
 
 	while ((ch = getopt(ac, av,
-			    "b:c:de:hf:i:m:p:qrt:v2yABC:FR:S:T:X")) != -1) {
+			    "b:c:de:hf:i:j:m:p:qrt:v2yzABC:FR:S:T:X")) != -1) {
 		switch(ch) {
 		case '2':
 			TwoWayPipeOpt = 1;
@@ -80,6 +82,9 @@ main(int ac, char **av)
 		case 'y':
 			ForceYesOpt = 1;
 			break;
+		case 'z':
+			FrameOpt = 1;
+			break;
 		case 'b':
 			BandwidthOpt = strtoull(optarg, &ptr, 0);
 			switch(*ptr) {
@@ -142,6 +147,15 @@ main(int ac, char **av)
 		case 'i':
 			DelayOpt = strtol(optarg, NULL, 0);
 			break;
+		case 'j':
+			NThreadsOpt = strtol(optarg, &ptr, 0);
+			if (*ptr || NThreadsOpt < 1) {
+				usage(1);
+				/* not reached */
+			}
+			if (NThreadsOpt > NTHREADS_MAX)
+				NThreadsOpt = NTHREADS_MAX;
+			break;
 		case 'm':
 			MemoryLimit = strtouq(optarg, &ptr, 0);
 			switch(*ptr) {
@@ -462,7 +476,10 @@ main(int ac, char **av)
 		exit(0);
 	}
 	if (strncmp(av[0], "mirror", 6) == 0) {
-		if (strcmp(av[0], "mirror-read") == 0)
+		if (strcmp(av[0], "mirror-read") == 0 && blkdevs) {
+			hammer_parse_blkdevs(blkdevs, O_RDONLY);
+			hammer_cmd_mirror_read_image(av + 1, ac - 1);
+		} else if (strcmp(av[0], "mirror-read") == 0)
 			hammer_cmd_mirror_read(av + 1, ac - 1, 0);
 		else if (strcmp(av[0], "mirror-read-stream") == 0)
 			hammer_cmd_mirror_read(av + 1, ac - 1, 1);
@@ -480,6 +497,11 @@ main(int ac, char **av)
 		}
 		exit(0);
 	}
+	if (strcmp(av[0], "dedup-simulate") == 0 && blkdevs) {
+		hammer_parse_blkdevs(blkdevs, O_RDONLY);
+		hammer_cmd_dedup_simulate_image(av + 1, ac - 1);
+		exit(0);
+	}
 	if (strcmp(av[0], "dedup-simulate") == 0) {
 		hammer_cmd_dedup_simulate(av + 1, ac - 1);
 		exit(0);
@@ -519,6 +541,7 @@ main(int ac, char **av)
 		int filter = -1;
 		int obfuscate = 0;
 		int indent = 0;
+		int binary = 0;
 
 		hammer_parse_blkdevs(blkdevs, O_RDONLY);
 		if (ac > 3) {
@@ -538,10 +561,20 @@ main(int ac, char **av)
 					obfuscate = 1;
 				else if (strcmp(p, "indent") == 0)
 					indent = 1;
+				else if (strcmp(p, "binary") == 0)
+					binary = 1;
 			}
 			free(dup);
 		}
-		hammer_cmd_show(arg, filter, obfuscate, indent);
+		if (binary)
+			hammer_cmd_show_binary(arg);
+		else
+			hammer_cmd_show(arg, filter, obfuscate, indent);
+		exit(0);
+	}
+	if (strcmp(av[0], "lookup") == 0) {
+		hammer_parse_blkdevs(blkdevs, O_RDONLY);
+		hammer_cmd_lookup(av + 1, ac - 1);
 		exit(0);
 	}
 	if (strcmp(av[0], "show-undo") == 0) {
@@ -660,10 +693,11 @@ usage(int exit_code)
 {
 	fprintf(stderr,
 		"hammer -h\n"
-		"hammer [-2ABFqrvXy] [-b bandwidth] [-C cachesize[:readahead]] \n"
+		"hammer [-2ABFqrvXyz] [-b bandwidth] [-C cachesize[:readahead]] \n"
 		"       [-R restrictcmd] [-T restrictpath] [-c cyclefile]\n"
-		"       [-e scoreboardfile] [-f blkdevs] [-i delay] [-p ssh-port]\n"
-		"       [-S splitsize] [-t seconds] [-m memlimit] command [argument ...]\n"
+		"       [-e scoreboardfile] [-f blkdevs] [-i delay] [-j threads]\n"
+		"       [-p ssh-port] [-S splitsize] [-t seconds] [-m memlimit]\n"
+		"       command [argument ...]\n"
 		"hammer synctid <filesystem> [quick]\n"
 		"hammer bstats [interval]\n"
 		"hammer iostats [interval]\n"
@@ -723,10 +757,13 @@ usage(int exit_code)
 
 	fprintf(stderr,
 		"hammer -f blkdevs blockmap\n"
-		"hammer -f blkdevs checkmap\n"
-		"hammer -f blkdevs [-qqq] show [lo:objid]\n"
+		"hammer -f blkdevs [-j threads] checkmap\n"
+		"hammer -f blkdevs [-j threads] [-qqq] show [lo:objid]\n"
 		"hammer -f blkdevs show-undo\n"
-		"hammer -f blkdevs recover <target_dir> [full|quick]\n"
+		"hammer -f blkdevs [-qv] lookup lo:objid[:rt[:key]] [<transid>]\n"
+		"hammer -f blkdevs [-2v] mirror-read <pfs_id> [begin-tid [end-tid]]\n"
+		"hammer -f blkdevs [-j threads] recover <target_dir> [full|quick]\n"
+		"hammer -f blkdevs [-j threads] dedup-simulate [pfs_id]\n"
 		"hammer -f blkdevs strip\n"
 	);
 
@@ -37,6 +37,8 @@
 
 #include "hammer_util.h"
 
+#include <sys/uio.h>
+
 /*
  * pidfile management - common definitions so code is more robust
  */
@@ -50,6 +52,8 @@ static const char pidfile_loc[] = "/var/run";
  */
 #define SNAPSHOTS_BASE	"/var/hammer"	/* HAMMER VERS >= 3 */
 
+#define NTHREADS_MAX	64		/* -j limit */
+
 extern int RecurseOpt;
 extern int VerboseOpt;
 extern int QuietOpt;
@@ -58,6 +62,7 @@ extern int TimeoutOpt;
 extern int DelayOpt;
 extern char *SshPort;
 extern int CompressOpt;
+extern int FrameOpt;
 extern int ForceYesOpt;
 extern int RunningIoctl;
 extern int DidInterrupt;
@@ -71,6 +76,57 @@ extern const char *SplitupOptStr;
 extern const char *CyclePath;
 extern const char *ScoreBoardFile;
 extern const char *RestrictTarget;
+extern int NThreadsOpt;
+
+/*
+ * B-Tree walker, see btree.c.  The walk function is called for each
+ * node and calls btree_walk_child() for each child node to visit.
+ * Output must go to fp.
+ */
+typedef struct btree_walk_node {
+	hammer_off_t		node_offset;
+	hammer_tid_t		mirror_tid;	/* parent elm's mirror_tid */
+	int			depth;
+	hammer_btree_elm_t	lbe;		/* parent elm, NULL if root */
+	FILE			*fp;
+
+	/* private to btree.c */
+	struct btree_walk	*walk;
+	struct btree_walk_seg	*seg;
+	struct btree_walk_node	**children;
+	int			nchildren;
+	int			maxchildren;
+	union hammer_btree_elm	elms[2];
+} *btree_walk_node_t;
+
+typedef void (*btree_walk_func_t)(btree_walk_node_t node, void *arg);
+
+/*
+ * B-Tree search, see btree.c.  func is called for each record in
+ * [key_beg, key_end] visible as of asof, or for every record if asof
+ * is 0.  get_node may be set to read nodes through the caller's own
+ * cache, it defaults to btree_get_node().
+ * If skip is set, subtrees whose mirror_tid is below mirror_tid are not
+ * descended into and skip is called with their range instead.
+ */
+#define BTREE_SEARCH_STOP	(-1)
+#define BTREE_SEARCH_MAXDEPTH	32
+
+typedef int (*btree_search_func_t)(hammer_btree_leaf_elm_t leaf, void *arg);
+
+typedef struct btree_search {
+	struct hammer_base_elm	key_beg;
+	struct hammer_base_elm	key_end;
+	hammer_tid_t		asof;
+	btree_search_func_t	func;
+	void			*arg;
+	int			(*get_node)(hammer_off_t node_offset,
+					    hammer_node_ondisk_t node);
+	hammer_tid_t		mirror_tid;
+	int			(*skip)(hammer_base_elm_t skip_beg,
+					hammer_base_elm_t skip_end, void *arg);
+	int			nodes;		/* nodes read */
+} *btree_search_t;
 
 void hammer_cmd_synctid(char **av, int ac);
 void hammer_cmd_pseudofs_status(char **av, int ac);
@@ -97,10 +153,12 @@ void hammer_cmd_history(const char *offset_str, char **av, int ac);
 void hammer_cmd_rebalance(char **av, int ac);
 void hammer_cmd_reblock(char **av, int ac, int flags);
 void hammer_cmd_mirror_read(char **av, int ac, int streaming);
+void hammer_cmd_mirror_read_image(char **av, int ac);
 void hammer_cmd_mirror_write(char **av, int ac);
 void hammer_cmd_mirror_copy(char **av, int ac, int streaming);
 void hammer_cmd_mirror_dump(char **av, int ac);
 void hammer_cmd_dedup_simulate(char **av, int ac);
+void hammer_cmd_dedup_simulate_image(char **av, int ac);
 void hammer_cmd_dedup(char **av, int ac);
 void hammer_cmd_get_version(char **av, int ac);
 void hammer_cmd_set_version(char **av, int ac);
@@ -109,12 +167,54 @@ void hammer_cmd_volume_del(char **av, int ac);
 void hammer_cmd_volume_list(char **av, int ac);
 void hammer_cmd_volume_blkdevs(char **av, int ac);
 void hammer_cmd_show(const char *arg, int filter, int obfuscate, int indent);
+void hammer_cmd_show_binary(const char *arg);
 void hammer_cmd_show_undo(void);
+void hammer_cmd_lookup(char **av, int ac);
 void hammer_cmd_recover(char **av, int ac);
 void hammer_cmd_blockmap(void);
 void hammer_cmd_checkmap(void);
 void hammer_cmd_strip(void);
 
+void btree_walk(hammer_off_t node_offset, btree_walk_func_t func, void **args,
+	int nthreads);
+void btree_walk_child(btree_walk_node_t parent, hammer_btree_elm_t elm);
+int hammer_btree_cmp(hammer_base_elm_t key1, hammer_base_elm_t key2);
+int btree_get_node(hammer_off_t node_offset, hammer_node_ondisk_t node);
+int btree_search(hammer_off_t node_offset, btree_search_t search);
+int btree_lookup(hammer_off_t node_offset, hammer_base_elm_t key,
+	hammer_tid_t asof, hammer_btree_leaf_elm_t leaf);
+
+/*
+ * Framed mirroring stream transport, see frame.c.  The stream is cut
+ * into frames of at most FRAME_BUFSIZE bytes, each deflated unless that
+ * doesn't help and carrying a CRC32C of its raw data.  A receiver tells
+ * a framed stream from a raw one by the leading signature.
+ */
+#define FRAME_SIGNATURE		0x4d465248U	/* "HRFM" */
+#define FRAME_BUFSIZE		(128 * 1024)
+#define FRAME_TYPE_STORED	0x0000
+#define FRAME_TYPE_DEFLATE	0x0001
+
+struct frame_head {
+	uint32_t	signature;
+	uint16_t	type;
+	uint16_t	reserved01;
+	uint32_t	raw_bytes;	/* decoded size */
+	uint32_t	bytes;		/* payload size */
+	uint32_t	data_crc;	/* iscsi_crc32 of decoded data */
+	uint32_t	head_crc;	/* iscsi_crc32 of the above */
+};
+
+typedef struct frame_codec *frame_codec_t;
+typedef int (*frame_output_t)(struct iovec *iov, int niov, void *arg);
+
+frame_codec_t frame_codec_open(int nthreads);
+void frame_codec_close(frame_codec_t fc);
+int frame_encode(frame_codec_t fc, struct iovec *iov, int niov,
+	frame_output_t output, void *arg);
+void frame_decode_prefix(frame_codec_t fc, const char *buf, size_t bytes);
+ssize_t frame_decode(frame_codec_t fc, int fd, char *buf, size_t bytes);
+
 void hammer_get_cycle(hammer_base_elm_t base, hammer_tid_t *tidp);
 void hammer_set_cycle(hammer_base_elm_t base, hammer_tid_t tid);
 void hammer_reset_cycle(void);
@@ -72,8 +72,8 @@
 #include "../lib/libc/gen/util.h"
 #include "../sys/libkern/util.h"
 
-#define HAMMER_BUFLISTS		64
-#define HAMMER_BUFLISTMASK	(HAMMER_BUFLISTS - 1)
+#define HAMMER_CACHE_SHARDS	16
+#define HAMMER_CACHE_SHARDMASK	(HAMMER_CACHE_SHARDS - 1)
 
 /*
  * These structures are used by hammer(8) and newfs_hammer(8)
@@ -96,24 +96,22 @@ typedef struct volume_info {
 	hammer_off_t		vol_free_end;
 
 	hammer_volume_ondisk_t ondisk;
-
-	TAILQ_HEAD(, buffer_info) buffer_lists[HAMMER_BUFLISTS];
 } *volume_info_t;
 
 typedef struct cache_info {
-	TAILQ_ENTRY(cache_info) entry;
-	int			refs;		/* structural references */
+	volatile u_int		refs;		/* structural references */
 	int			modified;	/* ondisk modified flag */
-	int			delete;		/* delete flag - delete on last ref */
+	volatile u_int		used;		/* CLOCK reference bit */
 } *cache_info_t;
 
 typedef struct buffer_info {
 	struct cache_info	cache;		/* must be at offset 0 */
-	TAILQ_ENTRY(buffer_info) entry;
 	hammer_off_t		zone2_offset;	/* zone-2 offset */
 	int64_t			raw_offset;	/* physical offset */
 	volume_info_t		volume;
 	void			*ondisk;
+	volatile u_int		io_pending;	/* async read in progress */
+	int			io_error;	/* errno of async read */
 } *buffer_info_t;
 
 /*
@@ -170,11 +168,15 @@ hammer_off_t blockmap_lookup_save(hammer_off_t bmap_off,
 				int *errorp);
 
 int hammer_parse_cache_size(const char *arg);
-void hammer_cache_add(cache_info_t cache);
-void hammer_cache_del(cache_info_t cache);
+buffer_info_t hammer_cache_lookup(hammer_off_t zone2_offset);
+buffer_info_t hammer_cache_add(buffer_info_t buffer, int readahead);
 void hammer_cache_used(cache_info_t cache);
+void hammer_cache_scan(volume_info_t volume, void (*func)(buffer_info_t));
 void hammer_cache_flush(void);
 
+void hammer_io_submit(buffer_info_t *buffers, int count);
+int hammer_io_wait(buffer_info_t buffer);
+
 void hammer_key_beg_init(hammer_base_elm_t base);
 void hammer_key_end_init(hammer_base_elm_t base);
 int getyn(void);
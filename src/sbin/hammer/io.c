@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "hammer_util.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <machine/atomic.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * Asynchronous buffer reads.
+ *
+ * Readahead buffers are added to the cache with io_pending set and a
+ * reference held by the I/O, and are submitted to one of the engines
+ * below in batches.  The reference is dropped when the read completes,
+ * so a buffer can not be evicted while its read is in progress.
+ * Anyone who finds a buffer in the cache must call hammer_io_wait()
+ * before looking at its data.
+ *
+ * The engine is selected by the HAMMER_IO environment variable.
+ * By default io_uring is used if the kernel supports it, otherwise a
+ * pool of threads doing pread(2).  "sync" reads the buffers in the
+ * submitting thread as was done before.
+ */
+typedef struct hammer_io_engine {
+	const char	*name;
+	int		(*init)(void);
+	void		(*submit)(buffer_info_t *buffers, int count);
+} *hammer_io_engine_t;
+
+static int sync_init(void);
+static void sync_submit(buffer_info_t *buffers, int count);
+static int thread_init(void);
+static void thread_submit(buffer_info_t *buffers, int count);
+#ifdef __NR_io_uring_setup
+static int uring_init(void);
+static void uring_submit(buffer_info_t *buffers, int count);
+#endif
+
+static struct hammer_io_engine IoEngines[] = {
+#ifdef __NR_io_uring_setup
+	{ "uring", uring_init, uring_submit },
+#endif
+	{ "thread", thread_init, thread_submit },
+	{ "sync", sync_init, sync_submit },
+};
+#define IO_ENGINES	(int)(sizeof(IoEngines) / sizeof(IoEngines[0]))
+
+static hammer_io_engine_t IoEngine;
+static pthread_once_t IoOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t IoLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t IoCond = PTHREAD_COND_INITIALIZER;
+static int IoInflight;
+
+static
+int
+io_pread(buffer_info_t buffer)
+{
+	ssize_t n;
+
+	n = pread(buffer->volume->fd, buffer->ondisk, HAMMER_BUFSIZE,
+		  buffer->raw_offset);
+	if (n == -1)
+		return(errno);
+	if (n != HAMMER_BUFSIZE)
+		return(EIO);
+	return(0);
+}
+
+/*
+ * Complete the read of a buffer and drop the reference held by the I/O.
+ */
+static
+void
+io_done(buffer_info_t buffer, int error)
+{
+	buffer->io_error = error;
+	pthread_mutex_lock(&IoLock);
+	atomic_store_rel_int(&buffer->io_pending, 0);
+	--IoInflight;
+	pthread_cond_broadcast(&IoCond);
+	pthread_mutex_unlock(&IoLock);
+	rel_buffer(buffer);
+}
+
+/*
+ * Threads can not be used in a forked child, so wait for reads in
+ * progress before forking and fall back to synchronous reads in the
+ * child.
+ */
+static
+void
+io_atfork_prepare(void)
+{
+	pthread_mutex_lock(&IoLock);
+	while (IoInflight)
+		pthread_cond_wait(&IoCond, &IoLock);
+	pthread_mutex_unlock(&IoLock);
+}
+
+static
+void
+io_atfork_child(void)
+{
+	IoEngine = &IoEngines[IO_ENGINES - 1];
+}
+
+static
+void
+io_init(void)
+{
+	const char *name;
+	int i;
+
+	name = getenv("HAMMER_IO");
+	for (i = 0; i < IO_ENGINES; ++i) {
+		if (name && strcmp(name, IoEngines[i].name))
+			continue;
+		if (IoEngines[i].init() == 0) {
+			IoEngine = &IoEngines[i];
+			break;
+		}
+		if (name) {
+			hwarnx("Failed to initialize %s I/O, using sync", name);
+			break;
+		}
+	}
+	if (IoEngine == NULL) {
+		if (name && i == IO_ENGINES)
+			hwarnx("Unknown I/O engine %s, using sync", name);
+		IoEngine = &IoEngines[IO_ENGINES - 1];
+	}
+	pthread_atfork(io_atfork_prepare, NULL, io_atfork_child);
+}
+
+/*
+ * Submit reads of count buffers.  Each buffer must have io_pending set
+ * and a reference which is released when the read completes.
+ */
+void
+hammer_io_submit(buffer_info_t *buffers, int count)
+{
+	if (count == 0)
+		return;
+	pthread_once(&IoOnce, io_init);
+
+	pthread_mutex_lock(&IoLock);
+	IoInflight += count;
+	pthread_mutex_unlock(&IoLock);
+
+	IoEngine->submit(buffers, count);
+}
+
+/*
+ * Wait for a buffer's read to complete.  Returns 0 on success, otherwise
+ * -1 with errno set.
+ */
+int
+hammer_io_wait(buffer_info_t buffer)
+{
+	if (atomic_load_acq_int(&buffer->io_pending)) {
+		pthread_mutex_lock(&IoLock);
+		while (buffer->io_pending)
+			pthread_cond_wait(&IoCond, &IoLock);
+		pthread_mutex_unlock(&IoLock);
+	}
+	if (buffer->io_error) {
+		errno = buffer->io_error;
+		return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Synchronous engine.
+ */
+static
+int
+sync_init(void)
+{
+	return(0);
+}
+
+static
+void
+sync_submit(buffer_info_t *buffers, int count)
+{
+	int i;
+
+	for (i = 0; i < count; ++i)
+		io_done(buffers[i], io_pread(buffers[i]));
+}
+
+/*
+ * Thread pool engine.
+ */
+#define IO_THREADS	8
+
+static pthread_mutex_t ThreadLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ThreadCond = PTHREAD_COND_INITIALIZER;
+static buffer_info_t *ThreadQueue;
+static int ThreadQueueSize;
+static int ThreadQueueBeg;
+static int ThreadQueueEnd;
+
+static
+void *
+thread_main(void *arg __unused)
+{
+	buffer_info_t buffer;
+
+	for (;;) {
+		pthread_mutex_lock(&ThreadLock);
+		while (ThreadQueueBeg == ThreadQueueEnd)
+			pthread_cond_wait(&ThreadCond, &ThreadLock);
+		buffer = ThreadQueue[ThreadQueueBeg++ & (ThreadQueueSize - 1)];
+		pthread_mutex_unlock(&ThreadLock);
+
+		io_done(buffer, io_pread(buffer));
+	}
+	return(NULL);
+}
+
+static
+int
+thread_init(void)
+{
+	pthread_t thread;
+	int i;
+
+	for (i = 0; i < IO_THREADS; ++i) {
+		if (pthread_create(&thread, NULL, thread_main, NULL))
+			return(i ? 0 : -1);
+		pthread_detach(thread);
+	}
+	return(0);
+}
+
+static
+void
+thread_submit(buffer_info_t *buffers, int count)
+{
+	buffer_info_t *queue;
+	int n;
+	int i;
+
+	pthread_mutex_lock(&ThreadLock);
+	n = ThreadQueueEnd - ThreadQueueBeg;
+	if (n + count > ThreadQueueSize) {
+		i = ThreadQueueSize ? ThreadQueueSize : 64;
+		while (i < n + count)
+			i <<= 1;
+		queue = malloc(i * sizeof(*queue));
+		for (n = 0; ThreadQueueBeg != ThreadQueueEnd; ++n) {
+			queue[n] = ThreadQueue[ThreadQueueBeg++ &
+					       (ThreadQueueSize - 1)];
+		}
+		free(ThreadQueue);
+		ThreadQueue = queue;
+		ThreadQueueSize = i;
+		ThreadQueueBeg = 0;
+		ThreadQueueEnd = n;
+	}
+	for (i = 0; i < count; ++i)
+		ThreadQueue[ThreadQueueEnd++ & (ThreadQueueSize - 1)] = buffers[i];
+	pthread_cond_broadcast(&ThreadCond);
+	pthread_mutex_unlock(&ThreadLock);
+}
+
+#ifdef __NR_io_uring_setup
+/*
+ * io_uring engine.  Submitting threads fill the SQ ring under UringLock
+ * and a reaper thread waits for and completes CQEs.  The number of
+ * reads in flight is limited to the SQ size so neither ring overflows.
+ */
+#define IO_URING_ENTRIES	256
+
+static pthread_mutex_t UringLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t UringCond = PTHREAD_COND_INITIALIZER;
+static int UringFd = -1;
+static int UringInflight;
+static u_int UringEntries;
+
+static volatile u_int *SqHead;
+static volatile u_int *SqTail;
+static u_int SqMask;
+static u_int *SqArray;
+static struct io_uring_sqe *Sqes;
+
+static volatile u_int *CqHead;
+static volatile u_int *CqTail;
+static u_int CqMask;
+static struct io_uring_cqe *Cqes;
+
+static
+void *
+uring_main(void *arg __unused)
+{
+	struct io_uring_cqe *cqe;
+	buffer_info_t buffer;
+	u_int head;
+	int n;
+	int error;
+
+	for (;;) {
+		n = syscall(__NR_io_uring_enter, UringFd, 0, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n == -1 && errno != EINTR) {
+			err(1, "io_uring_enter");
+			/* not reached */
+		}
+
+		n = 0;
+		head = *CqHead;
+		while (head != atomic_load_acq_int(CqTail)) {
+			cqe = &Cqes[head & CqMask];
+			buffer = (buffer_info_t)(uintptr_t)cqe->user_data;
+			if (cqe->res == HAMMER_BUFSIZE)
+				error = 0;
+			else if (cqe->res == -EINVAL)	/* no IORING_OP_READ */
+				error = io_pread(buffer);
+			else if (cqe->res < 0)
+				error = -cqe->res;
+			else
+				error = EIO;
+			io_done(buffer, error);
+			++head;
+			++n;
+		}
+		atomic_store_rel_int(CqHead, head);
+
+		if (n) {
+			pthread_mutex_lock(&UringLock);
+			UringInflight -= n;
+			pthread_cond_broadcast(&UringCond);
+			pthread_mutex_unlock(&UringLock);
+		}
+	}
+	return(NULL);
+}
+
+static
+int
+uring_init(void)
+{
+	struct io_uring_params p;
+	pthread_t thread;
+	size_t sqsize;
+	size_t cqsize;
+	char *sq;
+	char *cq;
+
+	bzero(&p, sizeof(p));
+	UringFd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &p);
+	if (UringFd == -1)
+		return(-1);
+
+	sqsize = p.sq_off.array + p.sq_entries * sizeof(u_int);
+	cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cqsize > sqsize)
+			sqsize = cqsize;
+		cqsize = sqsize;
+	}
+	sq = mmap(NULL, sqsize, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, UringFd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto failed;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, cqsize, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, UringFd,
+			  IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto failed;
+	}
+	Sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    UringFd, IORING_OFF_SQES);
+	if (Sqes == MAP_FAILED)
+		goto failed;
+
+	SqHead = (u_int *)(sq + p.sq_off.head);
+	SqTail = (u_int *)(sq + p.sq_off.tail);
+	SqMask = *(u_int *)(sq + p.sq_off.ring_mask);
+	SqArray = (u_int *)(sq + p.sq_off.array);
+	CqHead = (u_int *)(cq + p.cq_off.head);
+	CqTail = (u_int *)(cq + p.cq_off.tail);
+	CqMask = *(u_int *)(cq + p.cq_off.ring_mask);
+	Cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	UringEntries = p.sq_entries;
+
+	if (pthread_create(&thread, NULL, uring_main, NULL))
+		goto failed;
+	pthread_detach(thread);
+	return(0);
+failed:
+	/* the mappings go away with the last reference to the ring */
+	close(UringFd);
+	UringFd = -1;
+	return(-1);
+}
+
+static
+void
+uring_submit(buffer_info_t *buffers, int count)
+{
+	struct io_uring_sqe *sqe;
+	buffer_info_t buffer;
+	u_int tail;
+	int left;
+	int r;
+	int n;
+	int i;
+
+	pthread_mutex_lock(&UringLock);
+	for (i = 0; i < count; i += n) {
+		while (UringInflight == (int)UringEntries)
+			pthread_cond_wait(&UringCond, &UringLock);
+
+		tail = *SqTail;
+		for (n = 0; i + n < count && UringInflight < (int)UringEntries;
+		     ++n) {
+			buffer = buffers[i + n];
+			sqe = &Sqes[tail & SqMask];
+			bzero(sqe, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = buffer->volume->fd;
+			sqe->off = buffer->raw_offset;
+			sqe->addr = (uintptr_t)buffer->ondisk;
+			sqe->len = HAMMER_BUFSIZE;
+			sqe->user_data = (uintptr_t)buffer;
+			SqArray[tail & SqMask] = tail & SqMask;
+			++tail;
+			++UringInflight;
+		}
+		atomic_store_rel_int(SqTail, tail);
+
+		for (left = n; left > 0; left -= r) {
+			r = syscall(__NR_io_uring_enter, UringFd, left, 0, 0,
+				    NULL, 0);
+			if (r == -1) {
+				if (errno != EINTR && errno != EAGAIN) {
+					err(1, "io_uring_enter");
+					/* not reached */
+				}
+				r = 0;
+			}
+		}
+	}
+	pthread_mutex_unlock(&UringLock);
+}
+#endif
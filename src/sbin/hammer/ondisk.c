@@ -34,10 +34,13 @@
 
 #include "hammer_util.h"
 
+#include <machine/atomic.h>
+
 static void check_volume(volume_info_t volume);
 static void get_buffer_readahead(buffer_info_t base);
 static __inline int readhammervol(volume_info_t volume);
 static __inline int readhammerbuf(buffer_info_t buffer);
+static void __read_failed(buffer_info_t buffer);
 static __inline int writehammervol(volume_info_t volume);
 static __inline int writehammerbuf(buffer_info_t buffer);
 
@@ -53,41 +56,11 @@ TAILQ_HEAD(volume_list, volume_info);
 static struct volume_list VolList = TAILQ_HEAD_INITIALIZER(VolList);
 static int valid_hammer_volumes;
 
-static __inline
-int
-buffer_hash(hammer_off_t zone2_offset)
-{
-	int hi;
-
-	hi = (int)(zone2_offset / HAMMER_BUFSIZE) & HAMMER_BUFLISTMASK;
-	return(hi);
-}
-
-static
-buffer_info_t
-find_buffer(hammer_off_t zone2_offset)
-{
-	volume_info_t volume;
-	buffer_info_t buffer;
-	int hi;
-
-	volume = get_volume(HAMMER_VOL_DECODE(zone2_offset));
-	assert(volume);
-
-	hi = buffer_hash(zone2_offset);
-	TAILQ_FOREACH(buffer, &volume->buffer_lists[hi], entry) {
-		if (buffer->zone2_offset == zone2_offset)
-			return(buffer);
-	}
-	return(NULL);
-}
-
 static
 volume_info_t
 __alloc_volume(const char *volname, int oflags)
 {
 	volume_info_t volume;
-	int i;
 
 	volume = calloc(1, sizeof(*volume));
 	volume->vol_no = -1;
@@ -102,9 +75,6 @@ __alloc_volume(const char *volname, int oflags)
 
 	volume->ondisk = calloc(1, HAMMER_BUFSIZE);
 
-	for (i = 0; i < HAMMER_BUFLISTS; ++i)
-		TAILQ_INIT(&volume->buffer_lists[i]);
-
 	return(volume);
 }
 
@@ -325,13 +295,21 @@ __blockmap_xlate_to_zone2(hammer_off_t buf_offset)
 	return(zone2_offset);
 }
 
+/*
+ * Allocate and read a buffer and add it to the cache.  The buffer which
+ * ends up in the cache is returned referenced, which may not be the one
+ * allocated here if another thread got there first.
+ *
+ * With isnew -1 the buffer is not read but marked io_pending, and NULL
+ * is returned if it is already cached.  The caller submits the read.
+ */
 static
 buffer_info_t
 __alloc_buffer(hammer_off_t zone2_offset, int isnew)
 {
 	volume_info_t volume;
 	buffer_info_t buffer;
-	int hi;
+	buffer_info_t found;
 
 	volume = get_volume(HAMMER_VOL_DECODE(zone2_offset));
 	assert(volume != NULL);
@@ -342,21 +320,24 @@ __alloc_buffer(hammer_off_t zone2_offset, int isnew)
 	buffer->volume = volume;
 	buffer->ondisk = calloc(1, HAMMER_BUFSIZE);
 
-	if (isnew <= 0) {
-		if (readhammerbuf(buffer) == -1) {
-			err(1, "Failed to read %s:%016jx at %016jx",
-			    volume->name,
-			    (intmax_t)buffer->zone2_offset,
-			    (intmax_t)buffer->raw_offset);
-			/* not reached */
-		}
+	if (isnew < 0) {
+		buffer->io_pending = 1;
+	} else if (isnew == 0) {
+		if (readhammerbuf(buffer) == -1)
+			__read_failed(buffer);
 	}
 
-	hi = buffer_hash(zone2_offset);
-	TAILQ_INSERT_TAIL(&volume->buffer_lists[hi], buffer, entry);
-	hammer_cache_add(&buffer->cache);
+	found = hammer_cache_add(buffer, isnew < 0);
+	if (found != buffer) {
+		free(buffer->ondisk);
+		free(buffer);
+		if (isnew < 0) {
+			rel_buffer(found);
+			found = NULL;
+		}
+	}
 
-	return(buffer);
+	return(found);
 }
 
 /*
@@ -375,18 +356,16 @@ get_buffer(hammer_off_t buf_offset, int isnew)
 		return(NULL);
 
 	zone2_offset &= ~HAMMER_BUFMASK64;
-	buffer = find_buffer(zone2_offset);
+	buffer = hammer_cache_lookup(zone2_offset);
 
 	if (buffer == NULL) {
 		buffer = __alloc_buffer(zone2_offset, isnew);
 		dora = (isnew == 0);
-	} else {
-		assert(isnew != -1);
-		hammer_cache_used(&buffer->cache);
 	}
+	if (hammer_io_wait(buffer) == -1)	/* may be a readahead buffer */
+		__read_failed(buffer);
 	assert(buffer->ondisk != NULL);
 
-	++buffer->cache.refs;
 	hammer_cache_flush();
 
 	if (isnew > 0) {
@@ -399,16 +378,22 @@ get_buffer(hammer_off_t buf_offset, int isnew)
 	return(buffer);
 }
 
+/*
+ * Read the buffers around base asynchronously.  Missing buffers are added
+ * to the cache and submitted in batches, get_buffer() waits for them.
+ */
 static
 void
 get_buffer_readahead(const buffer_info_t base)
 {
+	buffer_info_t buffers[64];
 	buffer_info_t buffer;
 	volume_info_t volume;
 	hammer_off_t zone2_offset;
 	int64_t raw_offset;
 	int ri = UseReadBehind;
 	int re = UseReadAhead;
+	int n = 0;
 
 	raw_offset = base->raw_offset + ri * HAMMER_BUFSIZE;
 	volume = base->volume;
@@ -423,38 +408,36 @@ get_buffer_readahead(const buffer_info_t base)
 		}
 		zone2_offset = HAMMER_ENCODE_RAW_BUFFER(volume->vol_no,
 			raw_offset - volume->ondisk->vol_buf_beg);
-		buffer = find_buffer(zone2_offset);
+		buffer = hammer_cache_lookup(zone2_offset);
 		if (buffer == NULL) {
-			/* call with -1 to prevent another readahead */
-			buffer = get_buffer(zone2_offset, -1);
+			/* the reference is released when the read completes */
+			buffer = __alloc_buffer(zone2_offset, -1);
+			if (buffer)
+				buffers[n++] = buffer;
+			if (n == (int)(sizeof(buffers) / sizeof(buffers[0]))) {
+				hammer_io_submit(buffers, n);
+				n = 0;
+			}
+		} else {
 			rel_buffer(buffer);
 		}
 		++ri;
 		raw_offset += HAMMER_BUFSIZE;
 	}
+	hammer_io_submit(buffers, n);
 }
 
+/*
+ * Release a buffer reference.  Unreferenced buffers stay in the cache
+ * until they are evicted by hammer_cache_flush().
+ */
 void
 rel_buffer(buffer_info_t buffer)
 {
-	volume_info_t volume;
-	int hi;
-
 	if (buffer == NULL)
 		return;
 	assert(buffer->cache.refs > 0);
-	if (--buffer->cache.refs == 0) {
-		if (buffer->cache.delete) {
-			hi = buffer_hash(buffer->zone2_offset);
-			volume = buffer->volume;
-			if (buffer->cache.modified)
-				flush_buffer(buffer);
-			TAILQ_REMOVE(&volume->buffer_lists[hi], buffer, entry);
-			hammer_cache_del(&buffer->cache);
-			free(buffer->ondisk);
-			free(buffer);
-		}
-	}
+	atomic_subtract_int(&buffer->cache.refs, 1);
 }
 
 /*
@@ -915,13 +898,7 @@ flush_all_volumes(void)
 void
 flush_volume(volume_info_t volume)
 {
-	buffer_info_t buffer;
-	int i;
-
-	for (i = 0; i < HAMMER_BUFLISTS; ++i) {
-		TAILQ_FOREACH(buffer, &volume->buffer_lists[i], entry)
-			flush_buffer(buffer);
-	}
+	hammer_cache_scan(volume, flush_buffer);
 	if (writehammervol(volume) == -1) {
 		err(1, "Write volume %d (%s)", volume->vol_no, volume->name);
 		/* not reached */
@@ -934,6 +911,8 @@ flush_buffer(buffer_info_t buffer)
 	volume_info_t volume;
 
 	volume = buffer->volume;
+	if (hammer_io_wait(buffer) == -1)
+		__read_failed(buffer);
 	if (writehammerbuf(buffer) == -1) {
 		err(1, "Write volume %d (%s)", volume->vol_no, volume->name);
 		/* not reached */
@@ -971,6 +950,17 @@ readhammerbuf(buffer_info_t buffer)
 		HAMMER_BUFSIZE));
 }
 
+static
+void
+__read_failed(buffer_info_t buffer)
+{
+	err(1, "Failed to read %s:%016jx at %016jx",
+	    buffer->volume->name,
+	    (intmax_t)buffer->zone2_offset,
+	    (intmax_t)buffer->raw_offset);
+	/* not reached */
+}
+
 static
 int
 __write(volume_info_t volume, const void *data, int64_t offset, int size)
@@ -35,6 +35,7 @@
 
 #include "hammer2.h"
 
+#include <sys/mman.h>
 #include <openssl/sha.h>
 
 #define GIG	(1024LL*1024*1024)
@@ -45,10 +46,11 @@ static int show_tab = 2;
 static int show_depth = -1;
 static hammer2_tid_t show_min_mirror_tid = 0;
 static hammer2_tid_t show_min_modify_tid = 0;
+static int show_mmap = 0;
 
 static void shell_msghandler(dmsg_msg_t *msg, int unmanaged);
 static void shell_ttymsg(dmsg_iocom_t *iocom);
-static void count_blocks(hammer2_bmap_data_t *bmap, int value,
+static void count_blocks(const hammer2_bmap_data_t *bmap,
 		hammer2_off_t *accum16, hammer2_off_t *accum64);
 
 /************************************************************************
@@ -385,7 +387,9 @@ cmd_debugspan(const char *hostname)
 
 static void show_volhdr(hammer2_volume_data_t *voldata, int bi);
 static void show_bref(hammer2_volume_data_t *voldata, int tab,
-			int bi, hammer2_blockref_t *bref, int norecurse);
+			int bi, const hammer2_blockref_t *bref, int norecurse,
+			int check);
+static int show_bref_omit(const hammer2_blockref_t *bref);
 static void tabprintf(int tab, const char *ctl, ...);
 
 static hammer2_off_t TotalAccum16[4]; /* includes TotalAccum64 */
@@ -393,6 +397,59 @@ static hammer2_off_t TotalAccum64[4];
 static hammer2_off_t TotalUnavail;
 static hammer2_off_t TotalFreemap;
 
+/*
+ * Free run histogram, one row per level-1 zone (freemap leaf).  Runs of
+ * unallocated 16KB blocks are binned by power-of-2 size class, 16KB..1GB.
+ */
+#define FRAG_CLASSES	(HAMMER2_FREEMAP_LEVEL1_RADIX - \
+			 HAMMER2_FREEMAP_BLOCK_RADIX + 1)
+
+typedef struct frag_stats {
+	hammer2_off_t	run;		/* current run, in 16KB blocks */
+	hammer2_off_t	free;
+	hammer2_off_t	largest;
+	hammer2_off_t	hist[FRAG_CLASSES];
+} frag_stats_t;
+
+static FILE *FragFile;
+
+static void frag_scan_bmap(const hammer2_bmap_data_t *bmap,
+		frag_stats_t *fs);
+static void frag_flush_run(frag_stats_t *fs);
+
+/*
+ * Columns of the binary blockref export, see show_binary().
+ */
+#define EXPORT_MAGIC	"HAMMERC1"
+#define EXPORT_ROWS	65536		/* rows per chunk */
+
+static struct export_col {
+	const char	*name;
+	int		width;
+	char		*buf;
+} export_cols[] = {
+	{ "type",		1 },
+	{ "methods",		1 },
+	{ "keybits",		1 },
+	{ "flags",		1 },
+	{ "leaf_count",		2 },
+	{ "key",		8 },
+	{ "data_off",		8 },
+	{ "mirror_tid",		8 },
+	{ "modify_tid",		8 },
+	{ "update_tid",		8 },
+	{ "check",		8 },
+};
+#define EXPORT_NCOLS	(int)(sizeof(export_cols) / sizeof(export_cols[0]))
+
+static int show_binary_fmt = 0;
+static int export_nrows;
+static int export_errors;
+
+static int show_binary(void);
+static void show_binary_bref(const hammer2_blockref_t *bref);
+static void export_flush(int nrows);
+
 static
 hammer2_off_t
 get_next_volume(hammer2_volume_data_t *voldata, hammer2_off_t volu_loff)
@@ -457,8 +514,53 @@ cmd_show(const char *devpath, int which)
 		if (errno)
 			show_min_modify_tid = 0;
 	}
+	env = getenv("HAMMER2_SHOW_MMAP");
+	if (env != NULL) {
+		show_mmap = (int)strtol(env, NULL, 0);
+		if (errno)
+			show_mmap = 0;
+	}
+	env = getenv("HAMMER2_SHOW_FORMAT");
+	if (env != NULL) {
+		if (strcmp(env, "binary") == 0) {
+			show_binary_fmt = 1;
+		} else if (strcmp(env, "text") != 0) {
+			fprintf(stderr, "hammer2 show: unknown format %s\n",
+				env);
+			return 1;
+		}
+	}
+
+	/*
+	 * Only one freemap tree is walked unless all volume headers are
+	 * shown, in which case zones would be reported more than once.
+	 */
+	env = getenv("HAMMER2_FREEMAP_HISTOGRAM");
+	if (env != NULL && which == 1 &&
+	    VerboseOpt < 3 && show_all_volume_headers == 0) {
+		FragFile = fopen(env, "w");
+		if (FragFile == NULL) {
+			fprintf(stderr, "hammer2 freemap: unable to open %s\n",
+				env);
+			return 1;
+		}
+		fprintf(FragFile, "# zone\tfree\tlargest");
+		for (i = 0; i < FRAG_CLASSES; ++i)
+			fprintf(FragFile, "\t%ju",
+				(uintmax_t)HAMMER2_FREEMAP_BLOCK_SIZE << i);
+		fprintf(FragFile, "\n");
+	}
 
 	hammer2_init_volumes(devpath, 1);
+	hammer2_media_cache_init(HAMMER2_MEDIA_CACHE_BUFS);
+	if (show_mmap)
+		hammer2_media_mmap_init(HAMMER2_MEDIA_MAP_WINDOWS, MADV_RANDOM);
+	if (show_binary_fmt && which == 0) {
+		i = show_binary();
+		hammer2_media_cache_cleanup();
+		hammer2_cleanup_volumes();
+		return i;
+	}
 	int all_volume_headers = VerboseOpt >= 3 || show_all_volume_headers;
 next_volume:
 	volu_loff = next_volu_loff;
@@ -493,12 +595,12 @@ next_volume:
 				case 0:
 					broot.type = HAMMER2_BREF_TYPE_VOLUME;
 					show_bref(&media.voldata, 0, i, &broot,
-						  0);
+						  0, -1);
 					break;
 				case 1:
 					broot.type = HAMMER2_BREF_TYPE_FREEMAP;
 					show_bref(&media.voldata, 0, i, &broot,
-						  0);
+						  0, -1);
 					break;
 				default:
 					show_volhdr(&media.voldata, i);
@@ -520,11 +622,11 @@ next_volume:
 		switch(which) {
 		case 0:
 			best.type = HAMMER2_BREF_TYPE_VOLUME;
-			show_bref(&best_media.voldata, 0, best_i, &best, 0);
+			show_bref(&best_media.voldata, 0, best_i, &best, 0, -1);
 			break;
 		case 1:
 			best.type = HAMMER2_BREF_TYPE_FREEMAP;
-			show_bref(&best_media.voldata, 0, best_i, &best, 0);
+			show_bref(&best_media.voldata, 0, best_i, &best, 0, -1);
 			break;
 		default:
 			show_volhdr(&best_media.voldata, best_i);
@@ -552,6 +654,11 @@ next_volume:
 		printf("Total freemap storage:       %6.3fGiB\n",
 		       (double)TotalFreemap / GIG);
 	}
+	if (FragFile) {
+		fclose(FragFile);
+		FragFile = NULL;
+	}
+	hammer2_media_cache_cleanup();
 	hammer2_cleanup_volumes();
 
 	return 0;
@@ -702,14 +809,14 @@ show_volhdr(hammer2_volume_data_t *voldata, int bi)
 	printf("    sroot_blockset {\n");
 	for (i = 0; i < HAMMER2_SET_COUNT; ++i) {
 		show_bref(voldata, 16, i,
-			  &voldata->sroot_blockset.blockref[i], 2);
+			  &voldata->sroot_blockset.blockref[i], 2, -1);
 	}
 	printf("    }\n");
 
 	printf("    freemap_blockset {\n");
 	for (i = 0; i < HAMMER2_SET_COUNT; ++i) {
 		show_bref(voldata, 16, i,
-			  &voldata->freemap_blockset.blockref[i], 2);
+			  &voldata->freemap_blockset.blockref[i], 2, -1);
 	}
 	printf("    }\n");
 
@@ -727,14 +834,38 @@ show_volhdr(hammer2_volume_data_t *voldata, int bi)
 	printf("}\n");
 }
 
+static
+int
+show_bref_omit(const hammer2_blockref_t *bref)
+{
+	/* omit if smaller than mininum mirror_tid threshold */
+	if (bref->mirror_tid < show_min_mirror_tid)
+		return 1;
+	/* omit if smaller than mininum modify_tid threshold */
+	if (bref->modify_tid < show_min_modify_tid) {
+		if (bref->modify_tid)
+			return 1;
+		else if (bref->type == HAMMER2_BREF_TYPE_INODE && !bref->leaf_count)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * check is the result of a batched verification of bref's check code by
+ * the parent (0 good, 1 bad), or -1 if bref must be verified here.
+ */
 static void
 show_bref(hammer2_volume_data_t *voldata, int tab, int bi,
-	  hammer2_blockref_t *bref, int norecurse)
+	  const hammer2_blockref_t *bref, int norecurse, int check)
 {
-	hammer2_media_data_t media;
-	hammer2_blockref_t *bscan;
+	static const hammer2_media_data_t zero_media;
+	const hammer2_media_data_t *media = &zero_media;
+	const hammer2_blockref_t *bscan;
+	hammer2_media_buf_t *mbuf = NULL;
 	hammer2_off_t tmp;
-	int i, bcount, namelen, failed, obrace, fd;
+	int8_t *bcheck = NULL;
+	int i, bcount, namelen, failed, obrace;
 	int type_pad;
 	size_t bytes;
 	const char *type_str;
@@ -750,16 +881,8 @@ show_bref(hammer2_volume_data_t *voldata, int tab, int bi,
 		uint64_t digest64[SHA256_DIGEST_LENGTH/8];
 	} u;
 
-	/* omit if smaller than mininum mirror_tid threshold */
-	if (bref->mirror_tid < show_min_mirror_tid)
+	if (show_bref_omit(bref))
 		return;
-	/* omit if smaller than mininum modify_tid threshold */
-	if (bref->modify_tid < show_min_modify_tid) {
-		if (bref->modify_tid)
-			return;
-		else if (bref->type == HAMMER2_BREF_TYPE_INODE && !bref->leaf_count)
-			return;
-	}
 
 	if (init_tab == -1)
 		init_tab = tab;
@@ -781,20 +904,20 @@ show_bref(hammer2_volume_data_t *voldata, int tab, int bi,
 		while (io_bytes + boff < bytes)
 			io_bytes <<= 1;
 
-		if (io_bytes > sizeof(media)) {
+		if (io_bytes > HAMMER2_PBUFSIZE) {
 			printf("(bad block size %zu)\n", bytes);
 			return;
 		}
-		if (bref->type != HAMMER2_BREF_TYPE_DATA || VerboseOpt >= 1) {
-			fd = hammer2_get_volume_fd(io_off);
-			lseek(fd, io_base - hammer2_get_volume_offset(io_base),
-			      SEEK_SET);
-			if (read(fd, &media, io_bytes) != (ssize_t)io_bytes) {
+		/*
+		 * A data block which passed the parent's batched check
+		 * doesn't have to be read again.
+		 */
+		if (bref->type != HAMMER2_BREF_TYPE_DATA ||
+		    (VerboseOpt >= 1 && check != 0)) {
+			if (hammer2_media_get(bref, &media, NULL, &mbuf)) {
 				printf("(media read failed)\n");
 				return;
 			}
-			if (boff)
-				bcopy((char *)&media + boff, &media, bytes);
 		}
 	}
 
@@ -812,27 +935,27 @@ show_bref(hammer2_volume_data_t *voldata, int tab, int bi,
 	switch(bref->type) {
 	case HAMMER2_BREF_TYPE_INODE:
 		assert(bytes);
-		if (!(media.ipdata.meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA)) {
-			bscan = &media.ipdata.u.blockset.blockref[0];
+		if (!(media->ipdata.meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA)) {
+			bscan = &media->ipdata.u.blockset.blockref[0];
 			bcount = HAMMER2_SET_COUNT;
 		}
 		break;
 	case HAMMER2_BREF_TYPE_INDIRECT:
 		assert(bytes);
-		bscan = &media.npdata[0];
+		bscan = &media->npdata[0];
 		bcount = bytes / sizeof(hammer2_blockref_t);
 		break;
 	case HAMMER2_BREF_TYPE_VOLUME:
-		bscan = &media.voldata.sroot_blockset.blockref[0];
+		bscan = &media->voldata.sroot_blockset.blockref[0];
 		bcount = HAMMER2_SET_COUNT;
 		break;
 	case HAMMER2_BREF_TYPE_FREEMAP:
-		bscan = &media.voldata.freemap_blockset.blockref[0];
+		bscan = &media->voldata.freemap_blockset.blockref[0];
 		bcount = HAMMER2_SET_COUNT;
 		break;
 	case HAMMER2_BREF_TYPE_FREEMAP_NODE:
 		assert(bytes);
-		bscan = &media.npdata[0];
+		bscan = &media->npdata[0];
 		bcount = bytes / sizeof(hammer2_blockref_t);
 		break;
 	}
@@ -905,7 +1028,7 @@ show_bref(hammer2_volume_data_t *voldata, int tab, int bi,
 			printf("meth=%02x ", bref->methods);
 			break;
 		case HAMMER2_CHECK_ISCSI32:
-			cv = hammer2_icrc32(&media, bytes);
+			cv = hammer2_icrc32(media, bytes);
 			if (bref->check.iscsi32.value != cv) {
 				printf("(icrc %02x:%08x/%08x failed) ",
 				       bref->methods,
@@ -918,7 +1041,10 @@ show_bref(hammer2_volume_data_t *voldata, int tab, int bi,
 			}
 			break;
 		case HAMMER2_CHECK_XXHASH64:
-			cv64 = XXH64(&media, bytes, XXH_HAMMER2_SEED);
+			if (check == 0)
+				cv64 = bref->check.xxhash64.value;
+			else
+				cv64 = XXH64(media, bytes, XXH_HAMMER2_SEED);
 			if (bref->check.xxhash64.value != cv64) {
 				printf("(xxhash64 %02x:%016jx/%016jx failed) ",
 				       bref->methods,
@@ -932,7 +1058,7 @@ show_bref(hammer2_volume_data_t *voldata, int tab, int bi,
 			break;
 		case HAMMER2_CHECK_SHA192:
 			SHA256_Init(&hash_ctx);
-			SHA256_Update(&hash_ctx, &media, bytes);
+			SHA256_Update(&hash_ctx, media, bytes);
 			SHA256_Final(u.digest, &hash_ctx);
 			u.digest64[2] ^= u.digest64[3];
 			if (memcmp(u.digest, bref->check.sha192.data,
@@ -944,7 +1070,7 @@ show_bref(hammer2_volume_data_t *voldata, int tab, int bi,
 			}
 			break;
 		case HAMMER2_CHECK_FREEMAP:
-			cv = hammer2_icrc32(&media, bytes);
+			cv = hammer2_icrc32(media, bytes);
 			if (bref->check.freemap.icrc32 != cv) {
 				printf("(fcrc %02x:%08x/%08x failed) ",
 					bref->methods,
@@ -984,7 +1110,7 @@ show_bref(hammer2_volume_data_t *voldata, int tab, int bi,
 			tabprintf(tab, "filename \"%*.*s\"\n",
 				bref->embed.dirent.namlen,
 				bref->embed.dirent.namlen,
-				media.buf);
+				media->buf);
 		}
 		tabprintf(tab, "inum 0x%016jx\n",
 			  (uintmax_t)bref->embed.dirent.inum);
@@ -994,97 +1120,97 @@ show_bref(hammer2_volume_data_t *voldata, int tab, int bi,
 		break;
 	case HAMMER2_BREF_TYPE_INODE:
 		printf("{\n");
-		namelen = media.ipdata.meta.name_len;
+		namelen = media->ipdata.meta.name_len;
 		if (namelen > HAMMER2_INODE_MAXNAME)
 			namelen = 0;
 		tabprintf(tab, "filename \"%*.*s\"\n",
-			  namelen, namelen, media.ipdata.filename);
-		tabprintf(tab, "version  %d\n", media.ipdata.meta.version);
-		if ((media.ipdata.meta.op_flags & HAMMER2_OPFLAG_PFSROOT) ||
-		    media.ipdata.meta.pfs_type == HAMMER2_PFSTYPE_SUPROOT) {
+			  namelen, namelen, media->ipdata.filename);
+		tabprintf(tab, "version  %d\n", media->ipdata.meta.version);
+		if ((media->ipdata.meta.op_flags & HAMMER2_OPFLAG_PFSROOT) ||
+		    media->ipdata.meta.pfs_type == HAMMER2_PFSTYPE_SUPROOT) {
 			tabprintf(tab, "pfs_st   %d (%s)\n",
-				  media.ipdata.meta.pfs_subtype,
-				  hammer2_pfssubtype_to_str(media.ipdata.meta.pfs_subtype));
+				  media->ipdata.meta.pfs_subtype,
+				  hammer2_pfssubtype_to_str(media->ipdata.meta.pfs_subtype));
 		}
 		tabprintf(tab, "uflags   0x%08x\n",
-			  media.ipdata.meta.uflags);
-		if (media.ipdata.meta.rmajor || media.ipdata.meta.rminor) {
+			  media->ipdata.meta.uflags);
+		if (media->ipdata.meta.rmajor || media->ipdata.meta.rminor) {
 			tabprintf(tab, "rmajor   %d\n",
-				  media.ipdata.meta.rmajor);
+				  media->ipdata.meta.rmajor);
 			tabprintf(tab, "rminor   %d\n",
-				  media.ipdata.meta.rminor);
+				  media->ipdata.meta.rminor);
 		}
 		tabprintf(tab, "ctime    %s\n",
-			  hammer2_time64_to_str(media.ipdata.meta.ctime, &str));
+			  hammer2_time64_to_str(media->ipdata.meta.ctime, &str));
 		tabprintf(tab, "mtime    %s\n",
-			  hammer2_time64_to_str(media.ipdata.meta.mtime, &str));
+			  hammer2_time64_to_str(media->ipdata.meta.mtime, &str));
 		tabprintf(tab, "atime    %s\n",
-			  hammer2_time64_to_str(media.ipdata.meta.atime, &str));
+			  hammer2_time64_to_str(media->ipdata.meta.atime, &str));
 		tabprintf(tab, "btime    %s\n",
-			  hammer2_time64_to_str(media.ipdata.meta.btime, &str));
-		uuid = media.ipdata.meta.uid;
+			  hammer2_time64_to_str(media->ipdata.meta.btime, &str));
+		uuid = media->ipdata.meta.uid;
 		tabprintf(tab, "uid      %s\n",
 			  hammer2_uuid_to_str(&uuid, &str));
-		uuid = media.ipdata.meta.gid;
+		uuid = media->ipdata.meta.gid;
 		tabprintf(tab, "gid      %s\n",
 			  hammer2_uuid_to_str(&uuid, &str));
 		tabprintf(tab, "type     %s\n",
-			  hammer2_iptype_to_str(media.ipdata.meta.type));
+			  hammer2_iptype_to_str(media->ipdata.meta.type));
 		tabprintf(tab, "opflgs   0x%02x\n",
-			  media.ipdata.meta.op_flags);
+			  media->ipdata.meta.op_flags);
 		tabprintf(tab, "capflgs  0x%04x\n",
-			  media.ipdata.meta.cap_flags);
+			  media->ipdata.meta.cap_flags);
 		tabprintf(tab, "mode     %-7o\n",
-			  media.ipdata.meta.mode);
+			  media->ipdata.meta.mode);
 		tabprintf(tab, "inum     0x%016jx\n",
-			  media.ipdata.meta.inum);
+			  media->ipdata.meta.inum);
 		tabprintf(tab, "size     %ju ",
-			  (uintmax_t)media.ipdata.meta.size);
-		if (media.ipdata.meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA &&
-		    media.ipdata.meta.size <= HAMMER2_EMBEDDED_BYTES)
+			  (uintmax_t)media->ipdata.meta.size);
+		if (media->ipdata.meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA &&
+		    media->ipdata.meta.size <= HAMMER2_EMBEDDED_BYTES)
 			printf("(embedded data)\n");
 		else
 			printf("\n");
 		tabprintf(tab, "nlinks   %ju\n",
-			  (uintmax_t)media.ipdata.meta.nlinks);
+			  (uintmax_t)media->ipdata.meta.nlinks);
 		tabprintf(tab, "iparent  0x%016jx\n",
-			  (uintmax_t)media.ipdata.meta.iparent);
+			  (uintmax_t)media->ipdata.meta.iparent);
 		tabprintf(tab, "name_key 0x%016jx\n",
-			  (uintmax_t)media.ipdata.meta.name_key);
+			  (uintmax_t)media->ipdata.meta.name_key);
 		tabprintf(tab, "name_len %u\n",
-			  media.ipdata.meta.name_len);
+			  media->ipdata.meta.name_len);
 		tabprintf(tab, "ncopies  %u\n",
-			  media.ipdata.meta.ncopies);
+			  media->ipdata.meta.ncopies);
 		tabprintf(tab, "compalg  %u\n",
-			  media.ipdata.meta.comp_algo);
+			  media->ipdata.meta.comp_algo);
 		tabprintf(tab, "target_t %u\n",
-			  media.ipdata.meta.target_type);
+			  media->ipdata.meta.target_type);
 		tabprintf(tab, "checkalg %u\n",
-			  media.ipdata.meta.check_algo);
-		if ((media.ipdata.meta.op_flags & HAMMER2_OPFLAG_PFSROOT) ||
-		    media.ipdata.meta.pfs_type == HAMMER2_PFSTYPE_SUPROOT) {
+			  media->ipdata.meta.check_algo);
+		if ((media->ipdata.meta.op_flags & HAMMER2_OPFLAG_PFSROOT) ||
+		    media->ipdata.meta.pfs_type == HAMMER2_PFSTYPE_SUPROOT) {
 			tabprintf(tab, "pfs_nmas %u\n",
-				  media.ipdata.meta.pfs_nmasters);
+				  media->ipdata.meta.pfs_nmasters);
 			tabprintf(tab, "pfs_type %u (%s)\n",
-				  media.ipdata.meta.pfs_type,
-				  hammer2_pfstype_to_str(media.ipdata.meta.pfs_type));
+				  media->ipdata.meta.pfs_type,
+				  hammer2_pfstype_to_str(media->ipdata.meta.pfs_type));
 			tabprintf(tab, "pfs_inum 0x%016jx\n",
-				  (uintmax_t)media.ipdata.meta.pfs_inum);
-			uuid = media.ipdata.meta.pfs_clid;
+				  (uintmax_t)media->ipdata.meta.pfs_inum);
+			uuid = media->ipdata.meta.pfs_clid;
 			tabprintf(tab, "pfs_clid %s\n",
 				  hammer2_uuid_to_str(&uuid, &str));
-			uuid = media.ipdata.meta.pfs_fsid;
+			uuid = media->ipdata.meta.pfs_fsid;
 			tabprintf(tab, "pfs_fsid %s\n",
 				  hammer2_uuid_to_str(&uuid, &str));
 			tabprintf(tab, "pfs_lsnap_tid 0x%016jx\n",
-				  (uintmax_t)media.ipdata.meta.pfs_lsnap_tid);
+				  (uintmax_t)media->ipdata.meta.pfs_lsnap_tid);
 		}
 		tabprintf(tab, "data_quota  %ju\n",
-			  (uintmax_t)media.ipdata.meta.data_quota);
+			  (uintmax_t)media->ipdata.meta.data_quota);
 		tabprintf(tab, "data_count  %ju\n",
 			  (uintmax_t)bref->embed.stats.data_count);
 		tabprintf(tab, "inode_quota %ju\n",
-			  (uintmax_t)media.ipdata.meta.inode_quota);
+			  (uintmax_t)media->ipdata.meta.inode_quota);
 		tabprintf(tab, "inode_count %ju\n",
 			  (uintmax_t)bref->embed.stats.inode_count);
 		break;
@@ -1097,14 +1223,14 @@ show_bref(hammer2_volume_data_t *voldata, int tab, int bi,
 		break;
 	case HAMMER2_BREF_TYPE_VOLUME:
 		printf("mirror_tid=%016jx freemap_tid=%016jx ",
-			media.voldata.mirror_tid,
-			media.voldata.freemap_tid);
+			media->voldata.mirror_tid,
+			media->voldata.freemap_tid);
 		printf("{\n");
 		break;
 	case HAMMER2_BREF_TYPE_FREEMAP:
 		printf("mirror_tid=%016jx freemap_tid=%016jx ",
-			media.voldata.mirror_tid,
-			media.voldata.freemap_tid);
+			media->voldata.mirror_tid,
+			media->voldata.freemap_tid);
 		printf("{\n");
 		break;
 	case HAMMER2_BREF_TYPE_FREEMAP_LEAF:
@@ -1127,17 +1253,17 @@ show_bref(hammer2_volume_data_t *voldata, int tab, int bi,
 			tabprintf(tab + 4, "%016jx %04d.%04x linear=%06x avail=%06x "
 				  "%016jx %016jx %016jx %016jx "
 				  "%016jx %016jx %016jx %016jx\n",
-				  data_off, i, media.bmdata[i].class,
-				  media.bmdata[i].linear,
-				  media.bmdata[i].avail,
-				  media.bmdata[i].bitmapq[0],
-				  media.bmdata[i].bitmapq[1],
-				  media.bmdata[i].bitmapq[2],
-				  media.bmdata[i].bitmapq[3],
-				  media.bmdata[i].bitmapq[4],
-				  media.bmdata[i].bitmapq[5],
-				  media.bmdata[i].bitmapq[6],
-				  media.bmdata[i].bitmapq[7]);
+				  data_off, i, media->bmdata[i].class,
+				  media->bmdata[i].linear,
+				  media->bmdata[i].avail,
+				  media->bmdata[i].bitmapq[0],
+				  media->bmdata[i].bitmapq[1],
+				  media->bmdata[i].bitmapq[2],
+				  media->bmdata[i].bitmapq[3],
+				  media->bmdata[i].bitmapq[4],
+				  media->bmdata[i].bitmapq[5],
+				  media->bmdata[i].bitmapq[6],
+				  media->bmdata[i].bitmapq[7]);
 		}
 		tabprintf(tab, "}\n");
 		break;
@@ -1166,21 +1292,39 @@ skip_data:
 	 */
 	switch(bref->type) {
 	case HAMMER2_BREF_TYPE_FREEMAP_LEAF:
+	{
+		frag_stats_t fs;
+
+		bzero(&fs, sizeof(fs));
 		for (i = 0; i < HAMMER2_FREEMAP_COUNT; ++i) {
 			hammer2_off_t data_off = bref->key +
 				i * HAMMER2_FREEMAP_LEVEL0_SIZE;
 			if (data_off >= voldata->aux_end &&
 			    data_off < hammer2_get_total_size()) {
-				int j;
-				for (j = 0; j < 4; ++j)
-					count_blocks(&media.bmdata[i], j,
-						    &TotalAccum16[j],
-						    &TotalAccum64[j]);
-			} else
+				count_blocks(&media->bmdata[i],
+					     TotalAccum16, TotalAccum64);
+				if (FragFile)
+					frag_scan_bmap(&media->bmdata[i], &fs);
+			} else {
 				TotalUnavail += HAMMER2_FREEMAP_LEVEL0_SIZE;
+				if (FragFile)
+					frag_flush_run(&fs);
+			}
 		}
 		TotalFreemap += HAMMER2_FREEMAP_LEVEL1_SIZE;
+
+		if (FragFile) {
+			frag_flush_run(&fs);
+			fprintf(FragFile, "%016jx\t%ju\t%ju",
+				(intmax_t)bref->key,
+				(uintmax_t)fs.free * HAMMER2_FREEMAP_BLOCK_SIZE,
+				(uintmax_t)fs.largest * HAMMER2_FREEMAP_BLOCK_SIZE);
+			for (i = 0; i < FRAG_CLASSES; ++i)
+				fprintf(FragFile, "\t%ju", (uintmax_t)fs.hist[i]);
+			fprintf(FragFile, "\n");
+		}
 		break;
+	}
 	default:
 		break;
 	}
@@ -1192,62 +1336,333 @@ skip_data:
 	 * that because they are probably garbage.
 	 */
 	if (show_depth == -1 || ((tab - init_tab) / show_tab) < show_depth) {
+		if (norecurse == 0)
+			hammer2_media_readahead(bscan, bcount,
+						show_min_mirror_tid);
+		if (norecurse == 0 && VerboseOpt >= 1 && bcount) {
+			bcheck = malloc(bcount);
+			assert(bcheck);
+			hammer2_media_verify_xxhash64(bscan, bcount,
+						      show_min_mirror_tid,
+						      bcheck);
+		}
 		for (i = 0; norecurse == 0 && i < bcount; ++i) {
 			if (bscan[i].type != HAMMER2_BREF_TYPE_EMPTY) {
 				show_bref(voldata, tab, i, &bscan[i],
-				    failed);
+				    failed, bcheck ? bcheck[i] : -1);
 			}
 		}
+		free(bcheck);
 	}
 	tab -= show_tab;
 	if (obrace) {
 		if (bref->type == HAMMER2_BREF_TYPE_INODE)
 			tabprintf(tab, "} (%s.%d, \"%*.*s\")\n",
 				  type_str, bi, namelen, namelen,
-				  media.ipdata.filename);
+				  media->ipdata.filename);
 		else
 			tabprintf(tab, "} (%s.%d)\n", type_str, bi);
 	}
+	hammer2_media_put(mbuf);
 }
 
+/*
+ * Write the blockrefs of the filesystem topology to stdout in columnar
+ * chunks for analysis by other programs, instead of printing them.
+ * Blockrefs are exported in the order show visits them, DATA blocks
+ * are not read.  The stream has the same layout as the binary export
+ * of hammer(8) show: the magic, the number of columns, the name and
+ * width of each column, then chunks of up to EXPORT_ROWS rows, each
+ * being the row count followed by the values of each column in turn.
+ * A chunk of 0 rows ends the stream.  Integers are little-endian, the
+ * header fields 32 bits wide.
+ */
+static
+int
+show_binary(void)
+{
+	hammer2_blockref_t best;
+	hammer2_media_data_t media;
+	struct export_col *col;
+	hammer2_off_t off;
+	char name[24];
+	uint32_t hdr[2];
+	int fd;
+	int i;
+
+	bzero(&best, sizeof(best));
+	fd = hammer2_get_root_volume_fd();
+	for (i = 0; i < HAMMER2_NUM_VOLHDRS; ++i) {
+		off = i * HAMMER2_ZONE_BYTES64;
+		if (pread(fd, &media, HAMMER2_PBUFSIZE, off) !=
+		    (ssize_t)HAMMER2_PBUFSIZE)
+			continue;
+		if (media.voldata.magic != HAMMER2_VOLUME_ID_HBO)
+			continue;
+		if (best.data_off == 0 ||
+		    best.mirror_tid < media.voldata.mirror_tid) {
+			best.data_off = off | HAMMER2_PBUFRADIX;
+			best.mirror_tid = media.voldata.mirror_tid;
+		}
+	}
+	if (best.data_off == 0) {
+		fprintf(stderr, "hammer2 show: no valid volume header\n");
+		return 1;
+	}
+	best.type = HAMMER2_BREF_TYPE_VOLUME;
+
+	fwrite(EXPORT_MAGIC, 8, 1, stdout);
+	hdr[0] = htole32(EXPORT_NCOLS);
+	hdr[1] = 0;
+	fwrite(hdr, sizeof(hdr), 1, stdout);
+	for (i = 0; i < EXPORT_NCOLS; ++i) {
+		col = &export_cols[i];
+		col->buf = malloc(col->width * EXPORT_ROWS);
+		assert(col->buf);
+		bzero(name, sizeof(name));
+		strncpy(name, col->name, sizeof(name) - 1);
+		hdr[0] = htole32(col->width);
+		fwrite(name, sizeof(name), 1, stdout);
+		fwrite(hdr, sizeof(hdr), 1, stdout);
+	}
+
+	export_nrows = 0;
+	export_errors = 0;
+	show_binary_bref(&best);
+	if (export_nrows)
+		export_flush(export_nrows);
+	export_flush(0);
+
+	for (i = 0; i < EXPORT_NCOLS; ++i)
+		free(export_cols[i].buf);
+	if (fflush(stdout) || ferror(stdout)) {
+		fprintf(stderr, "hammer2 show: %s\n", strerror(errno));
+		return 1;
+	}
+	if (export_errors) {
+		fprintf(stderr, "hammer2 show: %d blocks failed to read\n",
+			export_errors);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Store the value of column i in row n, converted to little-endian.
+ */
 static
 void
-count_blocks(hammer2_bmap_data_t *bmap, int value,
-	     hammer2_off_t *accum16, hammer2_off_t *accum64)
+export_put(int i, int n, const void *value)
+{
+	struct export_col *col = &export_cols[i];
+	char *dst = col->buf + col->width * n;
+	uint16_t v16;
+	uint32_t v32;
+	uint64_t v64;
+
+	switch(col->width) {
+	case 2:
+		bcopy(value, &v16, sizeof(v16));
+		v16 = htole16(v16);
+		bcopy(&v16, dst, sizeof(v16));
+		break;
+	case 4:
+		bcopy(value, &v32, sizeof(v32));
+		v32 = htole32(v32);
+		bcopy(&v32, dst, sizeof(v32));
+		break;
+	case 8:
+		bcopy(value, &v64, sizeof(v64));
+		v64 = htole64(v64);
+		bcopy(&v64, dst, sizeof(v64));
+		break;
+	default:
+		bcopy(value, dst, col->width);
+		break;
+	}
+}
+
+#define EXPORT_PUT(i, field)	export_put(i, n, &(field))
+
+static
+void
+show_binary_bref(const hammer2_blockref_t *bref)
+{
+	const hammer2_media_data_t *media;
+	const hammer2_blockref_t *bscan = NULL;
+	hammer2_media_buf_t *mbuf = NULL;
+	const char *errstr;
+	size_t bytes;
+	int bcount = 0;
+	int n = export_nrows;
+	int i;
+
+	if (show_bref_omit(bref))
+		return;
+
+	EXPORT_PUT(0, bref->type);
+	EXPORT_PUT(1, bref->methods);
+	EXPORT_PUT(2, bref->keybits);
+	EXPORT_PUT(3, bref->flags);
+	EXPORT_PUT(4, bref->leaf_count);
+	EXPORT_PUT(5, bref->key);
+	EXPORT_PUT(6, bref->data_off);
+	EXPORT_PUT(7, bref->mirror_tid);
+	EXPORT_PUT(8, bref->modify_tid);
+	EXPORT_PUT(9, bref->update_tid);
+	EXPORT_PUT(10, bref->check.buf);
+	if (++n == EXPORT_ROWS) {
+		export_flush(n);
+		n = 0;
+	}
+	export_nrows = n;
+
+	switch(bref->type) {
+	case HAMMER2_BREF_TYPE_VOLUME:
+	case HAMMER2_BREF_TYPE_INODE:
+	case HAMMER2_BREF_TYPE_INDIRECT:
+		break;
+	default:
+		return;
+	}
+	errstr = hammer2_media_get_verified(bref, &media, &bytes, &mbuf);
+	if (errstr || media == NULL) {
+		fprintf(stderr, "hammer2 show: %016jx: %s\n",
+			(intmax_t)bref->data_off, errstr ? errstr : "no data");
+		++export_errors;
+		return;
+	}
+
+	switch(bref->type) {
+	case HAMMER2_BREF_TYPE_VOLUME:
+		bscan = &media->voldata.sroot_blockset.blockref[0];
+		bcount = HAMMER2_SET_COUNT;
+		break;
+	case HAMMER2_BREF_TYPE_INODE:
+		if (!(media->ipdata.meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA)) {
+			bscan = &media->ipdata.u.blockset.blockref[0];
+			bcount = HAMMER2_SET_COUNT;
+		}
+		break;
+	case HAMMER2_BREF_TYPE_INDIRECT:
+		bscan = &media->npdata[0];
+		bcount = bytes / sizeof(hammer2_blockref_t);
+		break;
+	}
+
+	hammer2_media_readahead(bscan, bcount, show_min_mirror_tid);
+	for (i = 0; i < bcount; ++i) {
+		if (bscan[i].type != HAMMER2_BREF_TYPE_EMPTY)
+			show_binary_bref(&bscan[i]);
+	}
+	hammer2_media_put(mbuf);
+}
+
+static
+void
+export_flush(int nrows)
 {
-	int i, j, bits;
-	hammer2_bitmap_t value16, value64;
+	struct export_col *col;
+	uint32_t hdr[2];
+	int i;
 
-	bits = (int)sizeof(hammer2_bitmap_t) * 8;
-	assert(bits == 64);
+	hdr[0] = htole32(nrows);
+	hdr[1] = 0;
+	fwrite(hdr, sizeof(hdr), 1, stdout);
+	for (i = 0; i < EXPORT_NCOLS; ++i) {
+		col = &export_cols[i];
+		fwrite(col->buf, col->width, nrows, stdout);
+	}
+}
+
+/*
+ * Each 64-bit bitmap word holds 32 2-bit states, one per 16KB block, and
+ * each byte covers a 64KB chunk.  Split the word into its low and high
+ * state bits and build a per-state match mask with one bit per block,
+ * then popcount it.  A 64KB chunk matches when all four of its blocks
+ * do, which folds down to the lowest bit of each byte.
+ */
+#define BMAP_LOBITS	0x5555555555555555LLU
+#define BMAP_BYTEBITS	0x0101010101010101LLU
+
+static
+void
+count_blocks(const hammer2_bmap_data_t *bmap,
+	     hammer2_off_t *accum16, hammer2_off_t *accum64)
+{
+	int i, value;
 
-	value16 = value;
-	assert(value16 < 4);
-	value64 = (value16 << 6) | (value16 << 4) | (value16 << 2) | value16;
-	assert(value64 < 256);
+	_Static_assert(sizeof(hammer2_bitmap_t) == 8, "64-bit bitmap");
 
 	for (i = 0; i < HAMMER2_BMAP_ELEMENTS; ++i) {
 		hammer2_bitmap_t bm = bmap->bitmapq[i];
-		hammer2_bitmap_t bm_save = bm;
-		hammer2_bitmap_t mask;
-
-		mask = 0x03; /* 2 bits per 16KB */
-		for (j = 0; j < bits; j += 2) {
-			if ((bm & mask) == value16)
-				*accum16 += 16384;
-			bm >>= 2;
+		hammer2_bitmap_t lo = bm & BMAP_LOBITS;
+		hammer2_bitmap_t hi = (bm >> 1) & BMAP_LOBITS;
+
+		for (value = 0; value < 4; ++value) {
+			hammer2_bitmap_t match;
+
+			match = ((value & 1) ? lo : ~lo) &
+				((value & 2) ? hi : ~hi) & BMAP_LOBITS;
+			accum16[value] += (hammer2_off_t)
+				__builtin_popcountll(match) * 16384;
+			match &= match >> 2;
+			match &= match >> 4;
+			accum64[value] += (hammer2_off_t)
+				__builtin_popcountll(match & BMAP_BYTEBITS) *
+				65536;
 		}
+	}
+}
+
+/*
+ * Extend the current run of free (unallocated) blocks across one
+ * level-0 bitmap, closing runs at allocated blocks.
+ */
+static
+void
+frag_scan_bmap(const hammer2_bmap_data_t *bmap, frag_stats_t *fs)
+{
+	int i, j;
+
+	for (i = 0; i < HAMMER2_BMAP_ELEMENTS; ++i) {
+		hammer2_bitmap_t bm = bmap->bitmapq[i];
+		hammer2_bitmap_t freebits = ~(bm | (bm >> 1)) & BMAP_LOBITS;
 
-		bm = bm_save;
-		mask = 0xFF; /* 8 bits per 64KB chunk */
-		for (j = 0; j < bits; j += 8) {
-			if ((bm & mask) == value64)
-				*accum64 += 65536;
-			bm >>= 8;
+		if (freebits == BMAP_LOBITS) {
+			fs->run += HAMMER2_BMAP_BLOCKS_PER_ELEMENT;
+			continue;
+		}
+		if (freebits == 0) {
+			frag_flush_run(fs);
+			continue;
+		}
+		for (j = 0; j < HAMMER2_BMAP_BLOCKS_PER_ELEMENT; ++j) {
+			if (freebits & ((hammer2_bitmap_t)1 << (j * 2)))
+				++fs->run;
+			else
+				frag_flush_run(fs);
 		}
 	}
 }
 
+static
+void
+frag_flush_run(frag_stats_t *fs)
+{
+	int class;
+
+	if (fs->run == 0)
+		return;
+	class = 63 - __builtin_clzll(fs->run);
+	assert(class < FRAG_CLASSES);
+	++fs->hist[class];
+	fs->free += fs->run;
+	if (fs->largest < fs->run)
+		fs->largest = fs->run;
+	fs->run = 0;
+}
+
 int
 cmd_hash(int ac, const char **av)
 {
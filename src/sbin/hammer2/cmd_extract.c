@@ -0,0 +1,589 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Copy files out of an unmounted HAMMER2 image.
+ *
+ * The calling thread resolves the PFS, directory entries, inodes and
+ * indirect blocks, and queues the DATA blockrefs of each file into a
+ * batch.  A pool of threads reads, verifies and decompresses the batch
+ * into one output arena, after which each file's contiguous run of
+ * blocks is written with a single pwrite(2).
+ */
+
+#include "hammer2.h"
+
+#include <err.h>
+
+#define EXTRACT_JOBS	1024		/* blocks per batch */
+#define EXTRACT_FILES	256		/* files open per batch */
+#define EXTRACT_ARENA	((size_t)EXTRACT_JOBS * HAMMER2_PBUFSIZE)
+
+typedef struct extract_file {
+	char			*path;
+	int			fd;
+	int			failed;
+	hammer2_inode_meta_t	meta;
+} extract_file_t;
+
+typedef struct extract_job {
+	hammer2_blockref_t	bref;
+	extract_file_t		*file;
+	char			*data;		/* into the arena */
+	size_t			bytes;		/* logical size */
+	const char		*error;
+} extract_job_t;
+
+typedef struct extract_seg {
+	extract_file_t		*file;
+	off_t			offset;
+	char			*data;
+	size_t			bytes;
+} extract_seg_t;
+
+typedef struct extract_dir {
+	char			*path;
+	hammer2_inode_meta_t	meta;
+} extract_dir_t;
+
+static extract_job_t Jobs[EXTRACT_JOBS];
+static extract_seg_t Segs[EXTRACT_JOBS];
+static extract_file_t *Files[EXTRACT_FILES];
+static int NJobs;
+static int NSegs;
+static int NFiles;
+static char *Arena;
+static size_t ArenaUsed;
+
+static extract_dir_t *Dirs;
+static int NDirs;
+static int MaxDirs;
+
+static hammer2_inode_data_t IRoot;	/* PFS root, indexes all inodes */
+static int ExtractErrors;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done_cond = PTHREAD_COND_INITIALIZER;
+static int pool_next;
+static int pool_njobs;
+static int pool_ndone;
+static int pool_exit;
+
+static int extract_object(const hammer2_inode_data_t *ipdata,
+			const char *path);
+static void extract_flush(void);
+
+/*
+ * Look up an inode of the PFS by inode number.
+ */
+static
+int
+extract_lookup_inum(hammer2_tid_t inum, hammer2_inode_data_t *ipdata)
+{
+	if (hammer2_lookup_inum(&IRoot, inum, ipdata)) {
+		++ExtractErrors;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Thread pool.  The calling thread also runs jobs while it waits for
+ * the batch to complete.
+ */
+static
+void
+extract_run_jobs(int wait)
+{
+	extract_job_t *job;
+
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (pool_next >= pool_njobs && !pool_exit && wait)
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		if (pool_exit || pool_next >= pool_njobs)
+			break;
+		job = &Jobs[pool_next++];
+		pthread_mutex_unlock(&pool_lock);
+
+		job->error = hammer2_read_block(&job->bref, job->data, job->bytes);
+
+		pthread_mutex_lock(&pool_lock);
+		if (++pool_ndone == pool_njobs)
+			pthread_cond_signal(&pool_done_cond);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static
+void *
+extract_thread(void *arg __unused)
+{
+	extract_run_jobs(1);
+	return NULL;
+}
+
+static
+void
+extract_finish_file(extract_file_t *file)
+{
+	struct timespec ts[2];
+
+	if (ftruncate(file->fd, file->meta.size) < 0 ||
+	    fchmod(file->fd, file->meta.mode & 07777) < 0) {
+		fprintf(stderr, "%s: %s\n", file->path, strerror(errno));
+		file->failed = 1;
+	}
+	ts[0].tv_sec = file->meta.mtime / 1000000;
+	ts[0].tv_nsec = file->meta.mtime % 1000000 * 1000;
+	ts[1] = ts[0];
+	futimens(file->fd, ts);
+	close(file->fd);
+
+	if (file->failed)
+		++ExtractErrors;
+	free(file->path);
+	free(file);
+}
+
+/*
+ * Decompress the queued blocks, write them out and finish the files
+ * whose blocks have all been queued.
+ */
+static
+void
+extract_flush(void)
+{
+	extract_job_t *job;
+	extract_seg_t *seg;
+	ssize_t n;
+	size_t done;
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_next = 0;
+	pool_ndone = 0;
+	pool_njobs = NJobs;
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	extract_run_jobs(0);
+
+	pthread_mutex_lock(&pool_lock);
+	while (pool_ndone != pool_njobs)
+		pthread_cond_wait(&pool_done_cond, &pool_lock);
+	pool_njobs = 0;
+	pool_next = 0;
+	pthread_mutex_unlock(&pool_lock);
+
+	for (i = 0; i < NJobs; ++i) {
+		job = &Jobs[i];
+		if (job->error) {
+			fprintf(stderr, "%s: offset %016jx: %s\n",
+				job->file->path, (intmax_t)job->bref.key,
+				job->error);
+			job->file->failed = 1;
+		}
+	}
+	for (i = 0; i < NSegs; ++i) {
+		seg = &Segs[i];
+		for (done = 0; done < seg->bytes; done += n) {
+			n = pwrite(seg->file->fd, seg->data + done,
+				   seg->bytes - done, seg->offset + done);
+			if (n <= 0) {
+				fprintf(stderr, "%s: %s\n", seg->file->path,
+					n < 0 ? strerror(errno) : "short write");
+				seg->file->failed = 1;
+				break;
+			}
+		}
+	}
+	for (i = 0; i < NFiles; ++i)
+		extract_finish_file(Files[i]);
+
+	NJobs = 0;
+	NSegs = 0;
+	NFiles = 0;
+	ArenaUsed = 0;
+}
+
+/*
+ * Queue a DATA blockref of the current file.
+ */
+static
+int
+extract_data_callback(const hammer2_blockref_t *bref, void *arg)
+{
+	extract_file_t *file = arg;
+	extract_job_t *job;
+	extract_seg_t *seg;
+	size_t bytes;
+	size_t wbytes;
+
+	if (bref->type != HAMMER2_BREF_TYPE_DATA)
+		return 0;
+	if (bref->key >= file->meta.size)
+		return 0;
+	if (bref->keybits > HAMMER2_PBUFRADIX) {
+		fprintf(stderr, "%s: offset %016jx: bad keybits %d\n",
+			file->path, (intmax_t)bref->key, bref->keybits);
+		file->failed = 1;
+		return 0;
+	}
+	bytes = (size_t)1 << bref->keybits;
+	wbytes = bytes;
+	if (wbytes > file->meta.size - bref->key)
+		wbytes = file->meta.size - bref->key;
+
+	if (NJobs == EXTRACT_JOBS || ArenaUsed + bytes > EXTRACT_ARENA)
+		extract_flush();
+
+	job = &Jobs[NJobs++];
+	job->bref = *bref;
+	job->file = file;
+	job->data = Arena + ArenaUsed;
+	job->bytes = bytes;
+	job->error = NULL;
+
+	/*
+	 * Extend the previous segment if the block follows it in both the
+	 * file and the arena.
+	 */
+	seg = NSegs ? &Segs[NSegs - 1] : NULL;
+	if (seg && seg->file == file &&
+	    seg->offset + (off_t)seg->bytes == (off_t)bref->key &&
+	    seg->data + seg->bytes == job->data) {
+		seg->bytes += wbytes;
+	} else {
+		seg = &Segs[NSegs++];
+		seg->file = file;
+		seg->offset = bref->key;
+		seg->data = job->data;
+		seg->bytes = wbytes;
+	}
+	ArenaUsed += bytes;
+
+	return 0;
+}
+
+static
+int
+extract_regfile(const hammer2_inode_data_t *ipdata, const char *path)
+{
+	extract_file_t *file;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (NFiles == EXTRACT_FILES)
+		extract_flush();
+
+	file = calloc(1, sizeof(*file));
+	file->path = strdup(path);
+	file->fd = fd;
+	file->meta = ipdata->meta;
+
+	if (ipdata->meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA) {
+		size_t bytes = ipdata->meta.size;
+
+		if (bytes > sizeof(ipdata->u.data))
+			bytes = sizeof(ipdata->u.data);
+		if (pwrite(fd, ipdata->u.data, bytes, 0) != (ssize_t)bytes) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			file->failed = 1;
+		}
+	} else if (ipdata->meta.size) {
+		if (hammer2_scan(ipdata->u.blockset.blockref,
+				 HAMMER2_SET_COUNT, 0, ipdata->meta.size - 1,
+				 extract_data_callback, file))
+			file->failed = 1;
+	}
+	Files[NFiles++] = file;
+
+	return 0;
+}
+
+static
+int
+extract_link_callback(const hammer2_blockref_t *bref, void *arg)
+{
+	char *buf = arg;
+	char data[HAMMER2_PBUFSIZE];
+	const char *error;
+	size_t bytes;
+
+	if (bref->type != HAMMER2_BREF_TYPE_DATA || bref->key >= PATH_MAX)
+		return 0;
+	if (bref->keybits > HAMMER2_PBUFRADIX)
+		return -1;
+	bytes = (size_t)1 << bref->keybits;
+	error = hammer2_read_block(bref, data, bytes);
+	if (error) {
+		fprintf(stderr, "symlink data %016jx: %s\n",
+			(intmax_t)bref->data_off, error);
+		return -1;
+	}
+	if (bytes > PATH_MAX - bref->key)
+		bytes = PATH_MAX - bref->key;
+	memcpy(buf + bref->key, data, bytes);
+
+	return 0;
+}
+
+static
+int
+extract_symlink(const hammer2_inode_data_t *ipdata, const char *path)
+{
+	char buf[PATH_MAX + 1];
+	size_t bytes = ipdata->meta.size;
+
+	if (bytes > PATH_MAX) {
+		fprintf(stderr, "%s: symlink too long\n", path);
+		return -1;
+	}
+	bzero(buf, sizeof(buf));
+	if (ipdata->meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA) {
+		if (bytes > sizeof(ipdata->u.data))
+			bytes = sizeof(ipdata->u.data);
+		memcpy(buf, ipdata->u.data, bytes);
+	} else if (hammer2_scan(ipdata->u.blockset.blockref,
+				HAMMER2_SET_COUNT, 0, PATH_MAX - 1,
+				extract_link_callback, buf)) {
+		return -1;
+	}
+	buf[bytes] = 0;
+
+	if (symlink(buf, path) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static
+int
+extract_directory(const hammer2_inode_data_t *ipdata, const char *path)
+{
+	hammer2_inode_data_t child;
+	hammer2_dirlist_t list;
+	hammer2_dirent_entry_t *entry;
+	extract_dir_t *dir;
+	struct stat st;
+	char *cpath;
+	int i;
+
+	if (mkdir(path, 0700) < 0 &&
+	    (errno != EEXIST || stat(path, &st) < 0 || !S_ISDIR(st.st_mode))) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (NDirs == MaxDirs) {
+		MaxDirs = MaxDirs ? MaxDirs * 2 : 64;
+		Dirs = realloc(Dirs, MaxDirs * sizeof(*Dirs));
+	}
+	dir = &Dirs[NDirs++];
+	dir->path = strdup(path);
+	dir->meta = ipdata->meta;
+
+	if (hammer2_readdir(ipdata, &list))
+		++ExtractErrors;
+
+	for (i = 0; i < list.count; ++i) {
+		entry = &list.ary[i];
+		if (entry->name[0] == 0 || strchr(entry->name, '/') ||
+		    strcmp(entry->name, ".") == 0 ||
+		    strcmp(entry->name, "..") == 0) {
+			fprintf(stderr, "%s: skipping bad entry name \"%s\"\n",
+				path, entry->name);
+			++ExtractErrors;
+			continue;
+		}
+		if (entry->ipdata)
+			child = *entry->ipdata;
+		else if (extract_lookup_inum(entry->inum, &child))
+			continue;
+		asprintf(&cpath, "%s/%s", path, entry->name);
+		if (extract_object(&child, cpath))
+			++ExtractErrors;
+		free(cpath);
+	}
+	hammer2_dirlist_free(&list);
+
+	return 0;
+}
+
+static
+int
+extract_object(const hammer2_inode_data_t *ipdata, const char *path)
+{
+	if (VerboseOpt)
+		printf("%s\n", path);
+
+	switch(ipdata->meta.type) {
+	case HAMMER2_OBJTYPE_DIRECTORY:
+		return extract_directory(ipdata, path);
+	case HAMMER2_OBJTYPE_REGFILE:
+		return extract_regfile(ipdata, path);
+	case HAMMER2_OBJTYPE_SOFTLINK:
+		return extract_symlink(ipdata, path);
+	default:
+		fprintf(stderr, "%s: skipping %s\n", path,
+			hammer2_iptype_to_str(ipdata->meta.type));
+		return 0;
+	}
+}
+
+/*
+ * Apply directory modes and times after their contents are written,
+ * deepest first.
+ */
+static
+void
+extract_finish_dirs(void)
+{
+	struct timespec ts[2];
+	extract_dir_t *dir;
+	int i;
+
+	for (i = NDirs - 1; i >= 0; --i) {
+		dir = &Dirs[i];
+		ts[0].tv_sec = dir->meta.mtime / 1000000;
+		ts[0].tv_nsec = dir->meta.mtime % 1000000 * 1000;
+		ts[1] = ts[0];
+		utimensat(AT_FDCWD, dir->path, ts, 0);
+		if (chmod(dir->path, dir->meta.mode & 07777) < 0) {
+			fprintf(stderr, "%s: %s\n", dir->path,
+				strerror(errno));
+			++ExtractErrors;
+		}
+		free(dir->path);
+	}
+	free(Dirs);
+	Dirs = NULL;
+	NDirs = MaxDirs = 0;
+}
+
+int
+cmd_extract(const char *devpath, const char *pfs, const char *path,
+	    const char *dest)
+{
+	hammer2_volume_data_t *voldata;
+	hammer2_inode_data_t ipdata;
+	pthread_t *threads;
+	char *copy, *name, *next;
+	int nthreads;
+	int i;
+
+	hammer2_init_volumes(devpath, 1);
+	hammer2_media_cache_init(HAMMER2_MEDIA_CACHE_BUFS);
+	voldata = hammer2_read_root_volume_header();
+	ExtractErrors = 0;
+
+	if (hammer2_lookup_pfs(voldata, pfs, &IRoot)) {
+		free(voldata);
+		hammer2_media_cache_cleanup();
+		hammer2_cleanup_volumes();
+		return 1;
+	}
+
+	/*
+	 * Resolve the path from the PFS root.
+	 */
+	ipdata = IRoot;
+	copy = strdup(path);
+	for (name = copy; name; name = next) {
+		next = strchr(name, '/');
+		if (next)
+			*next++ = 0;
+		if (name[0] == 0 || strcmp(name, ".") == 0)
+			continue;
+		if (ipdata.meta.type != HAMMER2_OBJTYPE_DIRECTORY) {
+			fprintf(stderr, "%s: not a directory\n", path);
+			break;
+		}
+		if (strcmp(name, "..") == 0) {
+			if (extract_lookup_inum(ipdata.meta.iparent, &ipdata))
+				break;
+		} else if (hammer2_lookup_name(&IRoot, &ipdata, name, &ipdata)) {
+			fprintf(stderr, "%s: not found\n", path);
+			break;
+		}
+	}
+	free(copy);
+
+	if (name == NULL) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads < 1)
+			nthreads = 1;
+		threads = calloc(nthreads, sizeof(*threads));
+		if (threads == NULL) {
+			err(1, "calloc");
+			/* not reached */
+		}
+		Arena = malloc(EXTRACT_ARENA);
+		if (Arena == NULL) {
+			err(1, "malloc");
+			/* not reached */
+		}
+		pool_exit = 0;
+		for (i = 1; i < nthreads; ++i) {
+			if (pthread_create(&threads[i], NULL, extract_thread,
+					   NULL)) {
+				err(1, "pthread_create");
+				/* not reached */
+			}
+		}
+
+		if (extract_object(&ipdata, dest))
+			++ExtractErrors;
+		extract_flush();
+		extract_finish_dirs();
+
+		pthread_mutex_lock(&pool_lock);
+		pool_exit = 1;
+		pthread_cond_broadcast(&pool_cond);
+		pthread_mutex_unlock(&pool_lock);
+		for (i = 1; i < nthreads; ++i)
+			pthread_join(threads[i], NULL);
+		free(threads);
+		free(Arena);
+		Arena = NULL;
+	} else {
+		++ExtractErrors;
+	}
+
+	free(voldata);
+	hammer2_media_cache_cleanup();
+	hammer2_cleanup_volumes();
+
+	return ExtractErrors ? 1 : 0;
+}
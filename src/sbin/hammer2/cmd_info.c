@@ -412,8 +412,7 @@ h2pfs_check(int fd, hammer2_blockref_t *bref, cmd_callback callback2)
 		return;
 	}
 	if (bref->type != HAMMER2_BREF_TYPE_DATA) {
-		lseek(fd, io_base, SEEK_SET);
-		if (read(fd, &media, io_bytes) != (ssize_t)io_bytes) {
+		if (pread(fd, &media, io_bytes, io_base) != (ssize_t)io_bytes) {
 			printf("(media read failed)\n");
 			return;
 		}
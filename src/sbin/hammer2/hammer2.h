@@ -170,6 +170,8 @@ int cmd_emergency_mode(const char *sel_path, int enable,
 			int ac, const char **av);
 int cmd_growfs(const char *sel_path, int ac, const char **av);
 int cmd_show(const char *devpath, int which);
+int cmd_extract(const char *devpath, const char *pfs, const char *path,
+		const char *dest);
 int cmd_volume_list(int ac, char **av);
 int cmd_rsainit(const char *dir_path);
 int cmd_rsaenc(const char **keys, int nkeys);
@@ -105,6 +105,69 @@ hammer2_off_t hammer2_get_root_volume_size(void);
 hammer2_off_t hammer2_get_total_size(void);
 hammer2_volume_data_t* hammer2_read_root_volume_header(void);
 
+/*
+ * Media I/O
+ */
+#define HAMMER2_MEDIA_CACHE_BUFS	512	/* 32MB of 64KB buffers */
+#define HAMMER2_MEDIA_MAP_WINDOW	HAMMER2_FREEMAP_LEVEL1_SIZE /* 1GB */
+#define HAMMER2_MEDIA_MAP_WINDOWS	64
+
+typedef struct hammer2_media_buf hammer2_media_buf_t;
+
+void hammer2_media_cache_init(int nbufs);
+void hammer2_media_cache_cleanup(void);
+void hammer2_media_mmap_init(int nmaps, int advice);
+int hammer2_media_get(const hammer2_blockref_t *bref,
+	const hammer2_media_data_t **mediap, size_t *media_bytes,
+	hammer2_media_buf_t **bufp);
+void hammer2_media_put(hammer2_media_buf_t *buf);
+int hammer2_media_read(const hammer2_blockref_t *bref,
+	hammer2_media_data_t *media, size_t *media_bytes);
+void hammer2_media_readahead(const hammer2_blockref_t *bscan, int bcount,
+	hammer2_tid_t min_mirror_tid);
+void hammer2_media_verify_xxhash64(const hammer2_blockref_t *bscan,
+	int bcount, hammer2_tid_t min_mirror_tid, int8_t *check);
+
+/*
+ * Read-only inode and directory access
+ */
+typedef int (*hammer2_scan_func_t)(const hammer2_blockref_t *bref, void *arg);
+
+typedef struct hammer2_dirent_entry {
+	char			*name;
+	hammer2_tid_t		inum;
+	uint8_t			type;
+	hammer2_inode_data_t	*ipdata;	/* inode embedded in directory */
+} hammer2_dirent_entry_t;
+
+typedef struct hammer2_dirlist {
+	hammer2_dirent_entry_t	*ary;
+	int			count;
+	int			max;
+} hammer2_dirlist_t;
+
+int hammer2_media_verify(const hammer2_blockref_t *bref, const void *media,
+	size_t bytes);
+const char *hammer2_media_get_verified(const hammer2_blockref_t *bref,
+	const hammer2_media_data_t **mediap, size_t *media_bytes,
+	hammer2_media_buf_t **bufp);
+const char *hammer2_read_block(const hammer2_blockref_t *bref, char *data,
+	size_t bytes);
+int hammer2_scan(const hammer2_blockref_t *bscan, int bcount,
+	hammer2_key_t key_beg, hammer2_key_t key_end,
+	hammer2_scan_func_t func, void *arg);
+int hammer2_read_inode(const hammer2_blockref_t *bref,
+	hammer2_inode_data_t *ipdata);
+int hammer2_lookup_inum(const hammer2_inode_data_t *iroot,
+	hammer2_tid_t inum, hammer2_inode_data_t *ipdata);
+int hammer2_lookup_name(const hammer2_inode_data_t *iroot,
+	const hammer2_inode_data_t *dip, const char *name,
+	hammer2_inode_data_t *ipdata);
+int hammer2_lookup_pfs(const hammer2_volume_data_t *voldata, const char *pfs,
+	hammer2_inode_data_t *ipdata);
+int hammer2_readdir(const hammer2_inode_data_t *dip, hammer2_dirlist_t *list);
+void hammer2_dirlist_free(hammer2_dirlist_t *list);
+
 void hammer2_uuid_create(hammer2_uuid_t *uuid);
 int hammer2_uuid_from_string(const char *str, hammer2_uuid_t *uuid);
 int hammer2_uuid_to_string(const hammer2_uuid_t *uuid, char **str);
@@ -0,0 +1,603 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <openssl/sha.h>
+#include <zlib.h>
+
+#include <vfs/hammer2/hammer2_disk.h>
+#include <vfs/hammer2/hammer2_xxhash.h>
+
+#include "hammer2_subs.h"
+
+/*
+ * Read-only access to the files of a PFS through the media cache.
+ *
+ * The PFS root inode indexes every inode of the PFS by inode number,
+ * and each directory inode indexes its entries by name hash.  Lookups
+ * only descend into indirect blocks overlapping the wanted key range,
+ * so indirect blocks stay in the media cache across lookups.
+ *
+ * Errors are reported on stderr.
+ */
+
+typedef struct dirent_scan {
+	hammer2_dirlist_t	*list;
+	const char		*name;		/* lookup a single name */
+	size_t			name_len;
+	int			error;
+} dirent_scan_t;
+
+/*
+ * Verify the check code of media read for bref.  Returns 0 on success.
+ */
+int
+hammer2_media_verify(const hammer2_blockref_t *bref, const void *media,
+		     size_t bytes)
+{
+	union {
+		uint8_t digest[SHA256_DIGEST_LENGTH];
+		uint64_t digest64[SHA256_DIGEST_LENGTH/8];
+	} u;
+
+	switch(HAMMER2_DEC_CHECK(bref->methods)) {
+	case HAMMER2_CHECK_ISCSI32:
+		if (bref->check.iscsi32.value != hammer2_icrc32(media, bytes))
+			return(-1);
+		break;
+	case HAMMER2_CHECK_XXHASH64:
+		if (bref->check.xxhash64.value !=
+		    XXH64(media, bytes, XXH_HAMMER2_SEED))
+			return(-1);
+		break;
+	case HAMMER2_CHECK_SHA192:
+		SHA256(media, bytes, u.digest);
+		u.digest64[2] ^= u.digest64[3];
+		if (memcmp(u.digest, bref->check.sha192.data,
+		    sizeof(bref->check.sha192.data)))
+			return(-1);
+		break;
+	case HAMMER2_CHECK_FREEMAP:
+		if (bref->check.freemap.icrc32 != hammer2_icrc32(media, bytes))
+			return(-1);
+		break;
+	default:
+		break;
+	}
+	return(0);
+}
+
+/*
+ * hammer2_media_get() followed by hammer2_media_verify().  Returns NULL
+ * on success, or an error string.  *mediap is NULL if bref has no media.
+ */
+const char *
+hammer2_media_get_verified(const hammer2_blockref_t *bref,
+			   const hammer2_media_data_t **mediap,
+			   size_t *media_bytes, hammer2_media_buf_t **bufp)
+{
+	switch(hammer2_media_get(bref, mediap, media_bytes, bufp)) {
+	case 0:
+		break;
+	case -1:
+		return("bad I/O size");
+	default:
+		return("read error");
+	}
+	if (*mediap && hammer2_media_verify(bref, *mediap, *media_bytes)) {
+		hammer2_media_put(*bufp);
+		*mediap = NULL;
+		*bufp = NULL;
+		return("check failed");
+	}
+	return(NULL);
+}
+
+/*
+ * Decompress an LZ4 block.  Returns the number of bytes produced, or -1
+ * if the input is malformed or doesn't fit in dst.
+ */
+static
+int
+decompress_lz4(const uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + srclen;
+	const uint8_t *match;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dstlen;
+	size_t len, off;
+	unsigned int token, s;
+
+	for (;;) {
+		if (ip >= iend)
+			return(-1);
+		token = *ip++;
+
+		len = token >> 4;
+		if (len == 15) {
+			do {
+				if (ip >= iend)
+					return(-1);
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+		}
+		if ((size_t)(iend - ip) < len || (size_t)(oend - op) < len)
+			return(-1);
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		if (ip == iend)
+			break;		/* last sequence is literals only */
+
+		if (iend - ip < 2)
+			return(-1);
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - dst))
+			return(-1);
+
+		len = token & 15;
+		if (len == 15) {
+			do {
+				if (ip >= iend)
+					return(-1);
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+		}
+		len += 4;
+		if ((size_t)(oend - op) < len)
+			return(-1);
+
+		match = op - off;
+		if (off >= len) {
+			memcpy(op, match, len);
+			op += len;
+		} else {
+			while (len--)
+				*op++ = *match++;
+		}
+	}
+	return((int)(op - dst));
+}
+
+static
+int
+decompress_zlib(const uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen)
+{
+	z_stream strm;
+	int error;
+
+	bzero(&strm, sizeof(strm));
+	if (inflateInit(&strm) != Z_OK)
+		return(-1);
+	strm.next_in = (Bytef *)src;
+	strm.avail_in = srclen;
+	strm.next_out = dst;
+	strm.avail_out = dstlen;
+	error = inflate(&strm, Z_FINISH);
+	inflateEnd(&strm);
+	if (error != Z_STREAM_END)
+		return(-1);
+	return((int)(dstlen - strm.avail_out));
+}
+
+/*
+ * Read, verify and decompress the logical block of a DATA bref into
+ * data[bytes].  Returns NULL on success, or an error string, in which
+ * case data is zero-filled.
+ */
+const char *
+hammer2_read_block(const hammer2_blockref_t *bref, char *data, size_t bytes)
+{
+	const hammer2_media_data_t *media;
+	hammer2_media_buf_t *mbuf;
+	const char *error;
+	size_t psize;
+	int csize;
+	int n;
+
+	error = hammer2_media_get_verified(bref, &media, &psize, &mbuf);
+	if (error || media == NULL) {
+		bzero(data, bytes);
+		return(error);
+	}
+
+	switch(HAMMER2_DEC_COMP(bref->methods)) {
+	case HAMMER2_COMP_LZ4:
+		csize = *(const int *)media->buf;
+		if (csize < 0 || (size_t)csize > psize - sizeof(int))
+			n = -1;
+		else
+			n = decompress_lz4((const uint8_t *)media->buf +
+					   sizeof(int), csize,
+					   (uint8_t *)data, bytes);
+		break;
+	case HAMMER2_COMP_ZLIB:
+		n = decompress_zlib((const uint8_t *)media->buf, psize,
+				    (uint8_t *)data, bytes);
+		break;
+	default:
+		n = psize < bytes ? psize : bytes;
+		memcpy(data, media->buf, n);
+		break;
+	}
+	hammer2_media_put(mbuf);
+
+	if (n < 0) {
+		bzero(data, bytes);
+		return("decompression failed");
+	}
+	if ((size_t)n < bytes)
+		bzero(data + n, bytes - n);
+	return(NULL);
+}
+
+static
+int
+scan_recurse(const hammer2_blockref_t *bscan, int bcount,
+	     hammer2_key_t key_beg, hammer2_key_t key_end,
+	     hammer2_scan_func_t func, void *arg, int *failedp)
+{
+	const hammer2_blockref_t *bref;
+	const hammer2_media_data_t *media;
+	hammer2_media_buf_t *mbuf;
+	hammer2_key_t bref_end;
+	const char *error;
+	size_t bytes;
+	int count;
+	int ret = 0;
+	int i;
+
+	for (i = 0; ret == 0 && i < bcount; ++i) {
+		bref = &bscan[i];
+		if (bref->type == HAMMER2_BREF_TYPE_EMPTY)
+			continue;
+		if (bref->keybits >= 64)
+			bref_end = (hammer2_key_t)-1;
+		else
+			bref_end = bref->key +
+				   ((hammer2_key_t)1 << bref->keybits) - 1;
+		if (bref_end < key_beg || bref->key > key_end)
+			continue;
+
+		switch(bref->type) {
+		case HAMMER2_BREF_TYPE_INDIRECT:
+			error = hammer2_media_get_verified(bref, &media,
+							   &bytes, &mbuf);
+			if (error) {
+				fprintf(stderr, "indirect %016jx: %s\n",
+					(intmax_t)bref->data_off, error);
+				*failedp = 1;
+				break;
+			}
+			if (media == NULL)
+				break;
+			count = bytes / sizeof(hammer2_blockref_t);
+			hammer2_media_readahead(media->npdata, count, 0);
+			ret = scan_recurse(media->npdata, count,
+					   key_beg, key_end, func, arg, failedp);
+			hammer2_media_put(mbuf);
+			break;
+		default:
+			ret = func(bref, arg);
+			break;
+		}
+	}
+	return(ret);
+}
+
+/*
+ * Call func for each non-indirect blockref under bscan[] which overlaps
+ * [key_beg, key_end], only descending into indirect blocks which overlap
+ * the range.
+ *
+ * Returns the first non-zero return value of func, which stops the scan.
+ * Otherwise returns -1 if an indirect block couldn't be read, else 0.
+ */
+int
+hammer2_scan(const hammer2_blockref_t *bscan, int bcount,
+	     hammer2_key_t key_beg, hammer2_key_t key_end,
+	     hammer2_scan_func_t func, void *arg)
+{
+	int failed = 0;
+	int ret;
+
+	ret = scan_recurse(bscan, bcount, key_beg, key_end, func, arg,
+			   &failed);
+	if (ret == 0 && failed)
+		ret = -1;
+	return(ret);
+}
+
+/*
+ * Read an INODE bref into *ipdata.  Returns 0 on success.
+ */
+int
+hammer2_read_inode(const hammer2_blockref_t *bref,
+		   hammer2_inode_data_t *ipdata)
+{
+	const hammer2_media_data_t *media;
+	hammer2_media_buf_t *mbuf;
+	const char *error;
+	size_t bytes;
+
+	error = hammer2_media_get_verified(bref, &media, &bytes, &mbuf);
+	if (error == NULL && (media == NULL || bytes < sizeof(*ipdata))) {
+		hammer2_media_put(mbuf);
+		error = "bad inode size";
+	}
+	if (error) {
+		fprintf(stderr, "inode %016jx: %s\n",
+			(intmax_t)bref->key, error);
+		return(-1);
+	}
+	memcpy(ipdata, &media->ipdata, sizeof(*ipdata));
+	hammer2_media_put(mbuf);
+	return(0);
+}
+
+static
+int
+inode_callback(const hammer2_blockref_t *bref, void *arg)
+{
+	if (bref->type != HAMMER2_BREF_TYPE_INODE)
+		return(0);
+	if (hammer2_read_inode(bref, arg))
+		return(-1);
+	return(1);
+}
+
+/*
+ * Look up an inode of the PFS rooted at iroot by inode number.
+ * Returns 0 on success.
+ */
+int
+hammer2_lookup_inum(const hammer2_inode_data_t *iroot, hammer2_tid_t inum,
+		    hammer2_inode_data_t *ipdata)
+{
+	if (inum == iroot->meta.inum) {
+		*ipdata = *iroot;
+		return(0);
+	}
+	if (hammer2_scan(iroot->u.blockset.blockref, HAMMER2_SET_COUNT,
+			 inum, inum, inode_callback, ipdata) != 1) {
+		fprintf(stderr, "inode %016jx: not found\n", (intmax_t)inum);
+		return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Collect directory entries, or the single entry matching scan->name.
+ * Entries are either DIRENTs referencing an inode number, or inodes
+ * embedded in the directory as in the super-root.
+ */
+static
+int
+dirent_callback(const hammer2_blockref_t *bref, void *arg)
+{
+	dirent_scan_t *scan = arg;
+	hammer2_dirlist_t *list = scan->list;
+	hammer2_dirent_entry_t *entry;
+	hammer2_inode_data_t *ipdata = NULL;
+	const hammer2_media_data_t *media;
+	hammer2_media_buf_t *mbuf;
+	const char *error;
+	char *name;
+	size_t bytes;
+	size_t len;
+
+	switch(bref->type) {
+	case HAMMER2_BREF_TYPE_DIRENT:
+		len = bref->embed.dirent.namlen;
+		if (len <= sizeof(bref->check.buf)) {
+			name = strndup(bref->check.buf, len);
+			break;
+		}
+		error = hammer2_media_get_verified(bref, &media, &bytes, &mbuf);
+		if (error == NULL && (media == NULL || bytes < len)) {
+			hammer2_media_put(mbuf);
+			error = "bad dirent size";
+		}
+		if (error) {
+			fprintf(stderr, "dirent %016jx: %s\n",
+				(intmax_t)bref->key, error);
+			scan->error = -1;
+			return(0);
+		}
+		name = strndup(media->buf, len);
+		hammer2_media_put(mbuf);
+		break;
+	case HAMMER2_BREF_TYPE_INODE:
+		ipdata = malloc(sizeof(*ipdata));
+		if (hammer2_read_inode(bref, ipdata)) {
+			free(ipdata);
+			scan->error = -1;
+			return(0);
+		}
+		len = ipdata->meta.name_len;
+		if (len > sizeof(ipdata->filename))
+			len = sizeof(ipdata->filename);
+		name = strndup((const char *)ipdata->filename, len);
+		break;
+	default:
+		return(0);
+	}
+
+	if (scan->name && (len != scan->name_len ||
+	    memcmp(name, scan->name, len) != 0)) {
+		free(name);
+		free(ipdata);
+		return(0);
+	}
+	if (list->count == list->max) {
+		list->max = list->max ? list->max * 2 : 16;
+		list->ary = realloc(list->ary, list->max * sizeof(*entry));
+	}
+	entry = &list->ary[list->count++];
+	entry->name = name;
+	if (ipdata) {
+		entry->inum = ipdata->meta.inum;
+		entry->type = ipdata->meta.type;
+	} else {
+		entry->inum = bref->embed.dirent.inum;
+		entry->type = bref->embed.dirent.type;
+	}
+	entry->ipdata = ipdata;
+
+	return(scan->name ? 1 : 0);
+}
+
+static
+int
+readdir_range(const hammer2_inode_data_t *dip, hammer2_key_t key_beg,
+	      hammer2_dirlist_t *list)
+{
+	dirent_scan_t scan;
+
+	bzero(list, sizeof(*list));
+	bzero(&scan, sizeof(scan));
+	scan.list = list;
+
+	if (hammer2_scan(dip->u.blockset.blockref, HAMMER2_SET_COUNT,
+			 key_beg, (hammer2_key_t)-1, dirent_callback, &scan))
+		scan.error = -1;
+
+	return(scan.error);
+}
+
+/*
+ * Read the entries of directory dip, in directory hash order, into
+ * *list, which must be freed with hammer2_dirlist_free().  Returns 0 on
+ * success, or -1 if some entries couldn't be read.
+ *
+ * Only visible keys are scanned; the PFS root also indexes every inode
+ * of the PFS below HAMMER2_DIRHASH_VISIBLE.
+ */
+int
+hammer2_readdir(const hammer2_inode_data_t *dip, hammer2_dirlist_t *list)
+{
+	return(readdir_range(dip, HAMMER2_DIRHASH_VISIBLE, list));
+}
+
+void
+hammer2_dirlist_free(hammer2_dirlist_t *list)
+{
+	int i;
+
+	for (i = 0; i < list->count; ++i) {
+		free(list->ary[i].name);
+		free(list->ary[i].ipdata);
+	}
+	free(list->ary);
+	bzero(list, sizeof(*list));
+}
+
+/*
+ * Look up name in directory dip of the PFS rooted at iroot.
+ * Returns 0 on success, -1 if not found or on error.
+ */
+int
+hammer2_lookup_name(const hammer2_inode_data_t *iroot,
+		    const hammer2_inode_data_t *dip, const char *name,
+		    hammer2_inode_data_t *ipdata)
+{
+	hammer2_dirlist_t list;
+	dirent_scan_t scan;
+	hammer2_key_t lhc;
+	int error = -1;
+
+	bzero(&list, sizeof(list));
+	bzero(&scan, sizeof(scan));
+	scan.list = &list;
+	scan.name = name;
+	scan.name_len = strlen(name);
+	lhc = dirhash(name, scan.name_len);
+
+	hammer2_scan(dip->u.blockset.blockref, HAMMER2_SET_COUNT,
+		     lhc, lhc + HAMMER2_DIRHASH_LOMASK,
+		     dirent_callback, &scan);
+	if (list.count) {
+		if (list.ary[0].ipdata) {
+			*ipdata = *list.ary[0].ipdata;
+			error = 0;
+		} else {
+			error = hammer2_lookup_inum(iroot, list.ary[0].inum,
+						    ipdata);
+		}
+	}
+	hammer2_dirlist_free(&list);
+
+	return(error);
+}
+
+/*
+ * Locate the root inode of the PFS named pfs under the super-root.
+ * Returns 0 on success.
+ */
+int
+hammer2_lookup_pfs(const hammer2_volume_data_t *voldata, const char *pfs,
+		   hammer2_inode_data_t *ipdata)
+{
+	hammer2_inode_data_t sroot;
+	hammer2_dirlist_t list;
+	int error = -1;
+	int i;
+
+	if (hammer2_scan(voldata->sroot_blockset.blockref, HAMMER2_SET_COUNT,
+			 0, (hammer2_key_t)-1, inode_callback, &sroot) != 1) {
+		fprintf(stderr, "Failed to read super-root\n");
+		return(-1);
+	}
+
+	readdir_range(&sroot, 0, &list);
+	for (i = 0; i < list.count; ++i) {
+		if (list.ary[i].ipdata && strcmp(list.ary[i].name, pfs) == 0) {
+			*ipdata = *list.ary[i].ipdata;
+			error = 0;
+			break;
+		}
+	}
+	if (error) {
+		fprintf(stderr, "PFS \"%s\" not found, available:", pfs);
+		for (i = 0; i < list.count; ++i)
+			fprintf(stderr, " %s", list.ary[i].name);
+		fprintf(stderr, "\n");
+	}
+	hammer2_dirlist_free(&list);
+
+	return(error);
+}
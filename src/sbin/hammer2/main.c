@@ -437,6 +437,17 @@ main(int ac, char **av)
 		} else {
 			cmd_show(av[1], 2);
 		}
+	} else if (strcmp(av[0], "extract") == 0) {
+		/*
+		 * Copy a file or directory tree out of an image.
+		 */
+		if (ac != 5) {
+			fprintf(stderr, "extract: requires device path, pfs, "
+					"path and destination\n");
+			usage(1);
+		} else {
+			ecode = cmd_extract(av[1], av[2], av[3], av[4]);
+		}
 	} else if (strcmp(av[0], "volume-list") == 0) {
 		/*
 		 * List all volumes
@@ -603,6 +614,9 @@ usage(int code)
 			"Raw hammer2 media dump for freemap\n"
 		"    volhdr <devpath>                  "
 			"Raw hammer2 media dump for the volume header(s)\n"
+		"    extract <devpath> <pfs> <path> <dest>\n"
+		"                                      "
+			"Copy files out of an unmounted image\n"
 		"    volume-list [<path>...]           "
 			"List volumes\n"
 		"    setcomp <comp[:level]> <path>...  "
@@ -0,0 +1,600 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include <err.h>
+
+#include <vfs/hammer2/hammer2_disk.h>
+#include <vfs/hammer2/hammer2_xxhash.h>
+
+#include "hammer2_subs.h"
+
+/*
+ * Media I/O for blockrefs.
+ *
+ * Blockref data never crosses a HAMMER2_PBUFSIZE (64KB) boundary, so media
+ * is read in whole 64KB physical blocks which are cached by io_base.  Media
+ * is returned as a pointer into the cached block, which stays referenced
+ * until hammer2_media_put().  Sibling blockrefs sharing a physical block
+ * (inodes in particular) are therefore read once.
+ *
+ * Without a cache, or for a (corrupted) blockref which would cross a 64KB
+ * boundary, media is read into a private buffer instead.
+ *
+ * Read-only tools may instead map the volumes with hammer2_media_mmap_init().
+ * Volumes are mapped in windows of HAMMER2_MEDIA_MAP_WINDOW bytes on demand,
+ * and media is returned as a pointer into the mapping.  If a volume can't
+ * be mapped, the pread() path above is used.
+ *
+ * All functions are thread-safe and only use pread().
+ */
+
+struct hammer2_media_buf {
+	TAILQ_ENTRY(hammer2_media_buf) entry;	/* free list or window list */
+	struct hammer2_media_buf *next;		/* hash chain */
+	hammer2_off_t io_base;
+	int refs;
+	int flags;
+	size_t valid;				/* bytes successfully read */
+	char *data;
+};
+
+#define MEDIA_BUF_LOADING	0x0001
+#define MEDIA_BUF_PRIVATE	0x0002
+#define MEDIA_BUF_MAPPED	0x0004	/* mmap window */
+
+#define MEDIA_VERIFY_BATCH	64	/* blocks per XXH64_verifyBatch() */
+
+static TAILQ_HEAD(, hammer2_media_buf) media_free =
+	TAILQ_HEAD_INITIALIZER(media_free);
+static hammer2_media_buf_t **media_hash;
+static int media_hash_mask;
+static int media_nbufs;		/* cached buffers allocated */
+static int media_maxbufs;	/* 0 if the cache is disabled */
+static TAILQ_HEAD(hammer2_media_buf_list, hammer2_media_buf) media_maps =
+	TAILQ_HEAD_INITIALIZER(media_maps);	/* MRU first */
+static int media_nmaps;		/* mapped windows */
+static int media_maxmaps;	/* 0 if mapping is disabled */
+static int media_map_advice;
+static pthread_mutex_t media_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t media_cond = PTHREAD_COND_INITIALIZER;
+
+static __inline int
+media_hashval(hammer2_off_t io_base)
+{
+	return((int)((io_base >> HAMMER2_PBUFRADIX) ^
+		     (io_base >> (HAMMER2_PBUFRADIX + 16))) & media_hash_mask);
+}
+
+static void
+media_unhash(hammer2_media_buf_t *buf)
+{
+	hammer2_media_buf_t **bufp;
+
+	bufp = &media_hash[media_hashval(buf->io_base)];
+	while (*bufp != buf)
+		bufp = &(*bufp)->next;
+	*bufp = buf->next;
+}
+
+static ssize_t
+media_pread(hammer2_off_t io_off, void *data, size_t bytes)
+{
+	int fd;
+
+	fd = hammer2_get_volume_fd(io_off);
+	if (fd == -1)
+		return(-1);
+	return(pread(fd, data, bytes,
+		     io_off - hammer2_get_volume_offset(io_off)));
+}
+
+/*
+ * Enable the media cache with up to nbufs 64KB buffers, 0 disables it.
+ * Buffers are allocated on demand.  More than nbufs may exist temporarily
+ * if all of them are referenced.
+ */
+void
+hammer2_media_cache_init(int nbufs)
+{
+	int n;
+
+	hammer2_media_cache_cleanup();
+	if (nbufs <= 0)
+		return;
+
+	for (n = 16; n < nbufs * 2; n <<= 1)
+		;
+	media_hash = calloc(n, sizeof(*media_hash));
+	if (media_hash == NULL)
+		err(1, "calloc");
+	media_hash_mask = n - 1;
+	media_maxbufs = nbufs;
+}
+
+void
+hammer2_media_cache_cleanup(void)
+{
+	hammer2_media_buf_t *buf;
+
+	while ((buf = TAILQ_FIRST(&media_maps)) != NULL) {
+		assert(buf->refs == 0);
+		TAILQ_REMOVE(&media_maps, buf, entry);
+		munmap(buf->data, buf->valid);
+		free(buf);
+		--media_nmaps;
+	}
+	assert(media_nmaps == 0);
+	media_maxmaps = 0;
+
+	while ((buf = TAILQ_FIRST(&media_free)) != NULL) {
+		TAILQ_REMOVE(&media_free, buf, entry);
+		media_unhash(buf);
+		free(buf->data);
+		free(buf);
+		--media_nbufs;
+	}
+	assert(media_nbufs == 0);
+	free(media_hash);
+	media_hash = NULL;
+	media_maxbufs = 0;
+}
+
+/*
+ * Map volumes instead of reading them, with advice (MADV_RANDOM,
+ * MADV_SEQUENTIAL, ...) applied to each window.  Up to nmaps windows
+ * stay mapped.  Only for read-only access, media is never written back
+ * through the mapping.
+ */
+void
+hammer2_media_mmap_init(int nmaps, int advice)
+{
+	media_maxmaps = nmaps;
+	media_map_advice = advice;
+}
+
+/*
+ * Return the referenced mmap window containing io_off, or NULL if it
+ * can't be mapped, in which case mapping is disabled.
+ */
+static hammer2_media_buf_t *
+media_getmap(hammer2_off_t io_off)
+{
+	hammer2_media_buf_t *buf, *scan;
+	hammer2_off_t vol_off, vol_size, win_off;
+	size_t win_size;
+	void *data;
+	int fd;
+
+	pthread_mutex_lock(&media_lock);
+	if (media_maxmaps == 0) {
+		pthread_mutex_unlock(&media_lock);
+		return(NULL);
+	}
+	TAILQ_FOREACH(buf, &media_maps, entry) {
+		if (io_off >= buf->io_base && io_off < buf->io_base + buf->valid)
+			break;
+	}
+	if (buf) {
+		if (buf != TAILQ_FIRST(&media_maps)) {
+			TAILQ_REMOVE(&media_maps, buf, entry);
+			TAILQ_INSERT_HEAD(&media_maps, buf, entry);
+		}
+		++buf->refs;
+		pthread_mutex_unlock(&media_lock);
+		return(buf);
+	}
+
+	fd = hammer2_get_volume_fd(io_off);
+	if (fd == -1) {
+		pthread_mutex_unlock(&media_lock);
+		return(NULL);
+	}
+	vol_off = hammer2_get_volume_offset(io_off);
+	vol_size = hammer2_get_volume_size(io_off);
+	win_off = vol_off + ((io_off - vol_off) &
+			     ~(hammer2_off_t)(HAMMER2_MEDIA_MAP_WINDOW - 1));
+	win_size = HAMMER2_MEDIA_MAP_WINDOW;
+	if (win_off + win_size > vol_off + vol_size)
+		win_size = vol_off + vol_size - win_off;
+
+	/*
+	 * Unmap the least recently used idle window if at the limit.
+	 */
+	if (media_nmaps >= media_maxmaps) {
+		TAILQ_FOREACH_REVERSE(scan, &media_maps, hammer2_media_buf_list,
+				      entry) {
+			if (scan->refs == 0)
+				break;
+		}
+		if (scan) {
+			TAILQ_REMOVE(&media_maps, scan, entry);
+			munmap(scan->data, scan->valid);
+			free(scan);
+			--media_nmaps;
+		}
+	}
+
+	data = mmap(NULL, win_size, PROT_READ, MAP_SHARED, fd,
+		    win_off - vol_off);
+	if (data == MAP_FAILED) {
+		media_maxmaps = 0;
+		pthread_mutex_unlock(&media_lock);
+		return(NULL);
+	}
+	if (media_map_advice)
+		madvise(data, win_size, media_map_advice);
+
+	buf = calloc(1, sizeof(*buf));
+	if (buf == NULL)
+		err(1, "calloc");
+	buf->io_base = win_off;
+	buf->refs = 1;
+	buf->flags = MEDIA_BUF_MAPPED;
+	buf->valid = win_size;
+	buf->data = data;
+	TAILQ_INSERT_HEAD(&media_maps, buf, entry);
+	++media_nmaps;
+	pthread_mutex_unlock(&media_lock);
+
+	return(buf);
+}
+
+/*
+ * Return the referenced cache buffer for io_base, reading it if necessary.
+ */
+static hammer2_media_buf_t *
+media_getblk(hammer2_off_t io_base)
+{
+	hammer2_media_buf_t *buf;
+	ssize_t n;
+	int hv;
+
+	hv = media_hashval(io_base);
+	pthread_mutex_lock(&media_lock);
+	for (buf = media_hash[hv]; buf; buf = buf->next) {
+		if (buf->io_base == io_base)
+			break;
+	}
+	if (buf) {
+		if (buf->refs++ == 0)
+			TAILQ_REMOVE(&media_free, buf, entry);
+		while (buf->flags & MEDIA_BUF_LOADING)
+			pthread_cond_wait(&media_cond, &media_lock);
+		pthread_mutex_unlock(&media_lock);
+		return(buf);
+	}
+
+	if (media_nbufs >= media_maxbufs &&
+	    (buf = TAILQ_FIRST(&media_free)) != NULL) {
+		TAILQ_REMOVE(&media_free, buf, entry);
+		media_unhash(buf);
+	} else {
+		buf = calloc(1, sizeof(*buf));
+		if (buf == NULL)
+			err(1, "calloc");
+		buf->data = malloc(HAMMER2_PBUFSIZE);
+		if (buf->data == NULL)
+			err(1, "malloc");
+		++media_nbufs;
+	}
+	buf->io_base = io_base;
+	buf->refs = 1;
+	buf->flags = MEDIA_BUF_LOADING;
+	buf->valid = 0;
+	buf->next = media_hash[hv];
+	media_hash[hv] = buf;
+	pthread_mutex_unlock(&media_lock);
+
+	/*
+	 * A short read is kept, the blockrefs within the valid range can
+	 * still be used.
+	 */
+	n = media_pread(io_base, buf->data, HAMMER2_PBUFSIZE);
+
+	pthread_mutex_lock(&media_lock);
+	buf->valid = (n > 0) ? (size_t)n : 0;
+	buf->flags &= ~MEDIA_BUF_LOADING;
+	pthread_cond_broadcast(&media_cond);
+	pthread_mutex_unlock(&media_lock);
+
+	return(buf);
+}
+
+/*
+ * Get a pointer to the media of bref, which remains valid until *bufp is
+ * released with hammer2_media_put().  *mediap is set to NULL if bref has
+ * no media.
+ *
+ * Returns 0 on success, -1 if the blockref's I/O size is invalid, or -2
+ * if the media couldn't be read.
+ */
+int
+hammer2_media_get(const hammer2_blockref_t *bref,
+		  const hammer2_media_data_t **mediap, size_t *media_bytes,
+		  hammer2_media_buf_t **bufp)
+{
+	hammer2_media_buf_t *buf;
+	hammer2_off_t io_off, io_base;
+	size_t bytes, io_bytes, boff;
+
+	*mediap = NULL;
+	*bufp = NULL;
+
+	bytes = (bref->data_off & HAMMER2_OFF_MASK_RADIX);
+	if (bytes)
+		bytes = (size_t)1 << bytes;
+	if (media_bytes)
+		*media_bytes = bytes;
+
+	if (!bytes)
+		return(0);
+
+	/*
+	 * Same limit as a HAMMER2_LBUFSIZE aligned read of the media.
+	 */
+	io_off = bref->data_off & ~HAMMER2_OFF_MASK_RADIX;
+	io_base = io_off & ~(hammer2_off_t)(HAMMER2_LBUFSIZE - 1);
+	boff = io_off - io_base;
+
+	io_bytes = HAMMER2_LBUFSIZE;
+	while (io_bytes + boff < bytes)
+		io_bytes <<= 1;
+
+	if (io_bytes > HAMMER2_PBUFSIZE)
+		return(-1);
+
+	if (media_maxmaps && (buf = media_getmap(io_off)) != NULL) {
+		boff = io_off - buf->io_base;
+		if (boff + bytes > buf->valid) {
+			hammer2_media_put(buf);
+			return(-2);
+		}
+		*mediap = (const void *)(buf->data + boff);
+		*bufp = buf;
+		return(0);
+	}
+
+	io_base = io_off & ~HAMMER2_PBUFMASK64;
+	boff = io_off - io_base;
+
+	if (media_maxbufs == 0 || boff + bytes > HAMMER2_PBUFSIZE) {
+		buf = calloc(1, sizeof(*buf));
+		if (buf == NULL)
+			err(1, "calloc");
+		buf->data = malloc(bytes);
+		if (buf->data == NULL)
+			err(1, "malloc");
+		buf->flags = MEDIA_BUF_PRIVATE;
+		buf->refs = 1;
+		if (media_pread(io_off, buf->data, bytes) != (ssize_t)bytes) {
+			hammer2_media_put(buf);
+			return(-2);
+		}
+		*mediap = (const void *)buf->data;
+		*bufp = buf;
+		return(0);
+	}
+
+	buf = media_getblk(io_base);
+	if (boff + bytes > buf->valid) {
+		hammer2_media_put(buf);
+		return(-2);
+	}
+	*mediap = (const void *)(buf->data + boff);
+	*bufp = buf;
+
+	return(0);
+}
+
+void
+hammer2_media_put(hammer2_media_buf_t *buf)
+{
+	if (buf == NULL)
+		return;
+
+	if (buf->flags & MEDIA_BUF_PRIVATE) {
+		free(buf->data);
+		free(buf);
+		return;
+	}
+
+	pthread_mutex_lock(&media_lock);
+	assert(buf->refs > 0);
+	if (buf->flags & MEDIA_BUF_MAPPED) {
+		--buf->refs;	/* stays mapped */
+	} else if (--buf->refs == 0) {
+		if (media_nbufs > media_maxbufs || buf->valid == 0) {
+			media_unhash(buf);
+			free(buf->data);
+			free(buf);
+			--media_nbufs;
+		} else {
+			TAILQ_INSERT_TAIL(&media_free, buf, entry);
+		}
+	}
+	pthread_mutex_unlock(&media_lock);
+}
+
+/*
+ * Copy the media of bref into *media, same return values as
+ * hammer2_media_get().
+ */
+int
+hammer2_media_read(const hammer2_blockref_t *bref, hammer2_media_data_t *media,
+		   size_t *media_bytes)
+{
+	const hammer2_media_data_t *data;
+	hammer2_media_buf_t *buf;
+	size_t bytes;
+	int error;
+
+	error = hammer2_media_get(bref, &data, &bytes, &buf);
+	if (error == 0 && data)
+		memcpy(media, data, bytes);
+	if (media_bytes)
+		*media_bytes = bytes;
+	hammer2_media_put(buf);
+
+	return(error);
+}
+
+static int
+media_range_cmp(const void *p1, const void *p2)
+{
+	const hammer2_off_t *r1 = p1;
+	const hammer2_off_t *r2 = p2;
+
+	if (r1[0] < r2[0])
+		return(-1);
+	if (r1[0] > r2[0])
+		return(1);
+	return(0);
+}
+
+/*
+ * Hint the kernel to start reading the physical blocks of all blockrefs
+ * in bscan which aren't cached, e.g. the children of an indirect block
+ * before they are visited.  Adjacent blocks are merged into one request.
+ * Blockrefs below min_mirror_tid won't be visited and are skipped.
+ */
+void
+hammer2_media_readahead(const hammer2_blockref_t *bscan, int bcount,
+			hammer2_tid_t min_mirror_tid)
+{
+	hammer2_media_buf_t *buf;
+	hammer2_off_t (*ranges)[2];
+	hammer2_off_t io_off, io_base, beg, end;
+	int i, n, fd;
+
+	if (bcount <= 1)
+		return;
+	ranges = malloc(bcount * sizeof(*ranges));
+	if (ranges == NULL)
+		err(1, "malloc");
+
+	n = 0;
+	pthread_mutex_lock(&media_lock);
+	for (i = 0; i < bcount; ++i) {
+		if ((bscan[i].data_off & HAMMER2_OFF_MASK_RADIX) == 0)
+			continue;
+		if (bscan[i].mirror_tid < min_mirror_tid)
+			continue;
+		io_off = bscan[i].data_off & ~HAMMER2_OFF_MASK_RADIX;
+		io_base = io_off & ~HAMMER2_PBUFMASK64;
+		if (media_maxbufs) {
+			buf = media_hash[media_hashval(io_base)];
+			while (buf && buf->io_base != io_base)
+				buf = buf->next;
+			if (buf)
+				continue;
+		}
+		ranges[n][0] = io_base;
+		ranges[n][1] = io_base + HAMMER2_PBUFSIZE;
+		++n;
+	}
+	pthread_mutex_unlock(&media_lock);
+
+	qsort(ranges, n, sizeof(*ranges), media_range_cmp);
+	for (i = 0; i < n; ++i) {
+		beg = ranges[i][0];
+		end = ranges[i][1];
+		fd = hammer2_get_volume_fd(beg);
+		while (i + 1 < n && ranges[i + 1][0] <= end &&
+		       hammer2_get_volume_fd(ranges[i + 1][0]) == fd)
+			end = ranges[++i][1];
+		if (fd != -1) {
+			posix_fadvise(fd, beg - hammer2_get_volume_offset(beg),
+				      end - beg, POSIX_FADV_WILLNEED);
+		}
+	}
+	free(ranges);
+}
+
+/*
+ * Verify the XXHASH64 check codes of the data blockrefs in bscan with
+ * XXH64_verifyBatch(), which hashes several blocks at once.  check[i] is
+ * set to 0 if bscan[i] verified and 1 if it didn't, or left at -1 if it
+ * wasn't checked (not a data block, another check method, below
+ * min_mirror_tid or unreadable media).  Callers verify those themselves,
+ * a data block with a result doesn't have to be read again.
+ */
+void
+hammer2_media_verify_xxhash64(const hammer2_blockref_t *bscan, int bcount,
+			      hammer2_tid_t min_mirror_tid, int8_t *check)
+{
+	XXH64_verify_t jobs[MEDIA_VERIFY_BATCH];
+	hammer2_media_buf_t *bufs[MEDIA_VERIFY_BATCH];
+	unsigned char bad[MEDIA_VERIFY_BATCH];
+	int index[MEDIA_VERIFY_BATCH];
+	const hammer2_media_data_t *media;
+	size_t bytes;
+	int i, j, n;
+
+	for (i = 0; i < bcount; ++i)
+		check[i] = -1;
+
+	i = 0;
+	while (i < bcount) {
+		n = 0;
+		for (; i < bcount && n < MEDIA_VERIFY_BATCH; ++i) {
+			if (bscan[i].type != HAMMER2_BREF_TYPE_DATA ||
+			    HAMMER2_DEC_CHECK(bscan[i].methods) !=
+			    HAMMER2_CHECK_XXHASH64 ||
+			    bscan[i].mirror_tid < min_mirror_tid)
+				continue;
+			if (hammer2_media_get(&bscan[i], &media, &bytes,
+					      &bufs[n]) != 0 || media == NULL) {
+				hammer2_media_put(bufs[n]);
+				continue;
+			}
+			jobs[n].input = media;
+			jobs[n].length = bytes;
+			jobs[n].expected = bscan[i].check.xxhash64.value;
+			index[n] = i;
+			++n;
+		}
+		XXH64_verifyBatch(jobs, n, XXH_HAMMER2_SEED, bad);
+		for (j = 0; j < n; ++j) {
+			check[index[j]] = bad[j];
+			hammer2_media_put(bufs[j]);
+		}
+	}
+}
@@ -0,0 +1,1144 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Read-only HAMMER filesystem served over FUSE.
+ *
+ * Objects are looked up by descending the B-Tree from the root volume
+ * and filtering records by their create/delete TIDs, so any TID still
+ * present on the media can be viewed.  As in the kernel, "name@@<tid>"
+ * looks name up as of the transaction id and "@@<tid>:<pfs>" is the
+ * root of a PFS.
+ *
+ * Objects of PFS#0 as of the mount TID use their obj_id as node id,
+ * the root inode being FUSE_ROOT_ID.  All other (obj_id, PFS, as-of)
+ * views get node ids with the top bit set, which obj_ids never have.
+ *
+ * CRC checked B-Tree nodes are kept in a cache indexed by node
+ * offset, inodes and failed name lookups in small direct-mapped
+ * caches.  File data is replied straight out of the buffer cache.
+ */
+
+#include "hammer.h"
+
+#include <sys/sysmacros.h>
+#include <pthread.h>
+
+#include "fuse.h"
+
+#define H1FUSE_VIEWID		0x8000000000000000ULL
+#define H1FUSE_VIEW_HASH	1024		/* power of 2 */
+#define H1FUSE_ICACHE		4096		/* cached inodes, power of 2 */
+#define H1FUSE_NCACHE		1024		/* cached nodes, power of 2 */
+#define H1FUSE_NCACHE_LOCKS	16
+#define H1FUSE_NEGCACHE		4096		/* failed lookups, power of 2 */
+#define H1FUSE_NEGNAME		48		/* longer names aren't cached */
+#define H1FUSE_MAXNAMLEN	1023
+
+
+/*
+ * An object as seen at some point in time.
+ */
+typedef struct h1fuse_obj {
+	int64_t			obj_id;
+	uint32_t		localization;	/* PFS, low 16 bits 0 */
+	hammer_tid_t		asof;
+} h1fuse_obj_t;
+
+typedef struct h1fuse_view {
+	struct h1fuse_view	*next;		/* hash chain */
+	h1fuse_obj_t		obj;
+	uint64_t		id;
+} h1fuse_view_t;
+
+typedef struct h1fuse_icache {
+	h1fuse_obj_t		obj;		/* obj_id 0 if empty */
+	struct hammer_inode_data ino;
+} h1fuse_icache_t;
+
+typedef struct h1fuse_ncache {
+	hammer_off_t		node_offset;	/* 0 if empty */
+	struct hammer_node_ondisk node;
+} h1fuse_ncache_t;
+
+typedef struct h1fuse_negcache {
+	h1fuse_obj_t		dir;		/* obj_id 0 if empty */
+	int64_t			namekey;
+	int			len;
+	char			name[H1FUSE_NEGNAME];
+} h1fuse_negcache_t;
+
+/*
+ * Open file handle, a private copy of the inode.
+ */
+typedef struct h1fuse_file {
+	h1fuse_obj_t		obj;
+	struct hammer_inode_data ino;
+} h1fuse_file_t;
+
+typedef struct h1fuse_dirent {
+	char			*name;
+	int64_t			obj_id;
+	uint32_t		localization;
+	uint8_t			obj_type;
+} h1fuse_dirent_t;
+
+typedef struct h1fuse_dir {
+	h1fuse_obj_t		obj;
+	int64_t			parent_obj_id;
+	h1fuse_dirent_t		*ary;
+	int			count;
+	int			max;
+} h1fuse_dir_t;
+
+typedef struct h1fuse_find {
+	const char		*name;
+	int			len;
+	int64_t			obj_id;
+	uint32_t		localization;
+	int			found;
+} h1fuse_find_t;
+
+typedef struct h1fuse_read {
+	hfuse_reply_t		*rep;
+	off_t			beg;
+	off_t			pos;		/* replied up to */
+	off_t			end;
+} h1fuse_read_t;
+
+/*
+ * Directory entry record data with room for the longest name.
+ */
+typedef union h1fuse_entry {
+	struct hammer_direntry_data entry;
+	char			buf[HAMMER_ENTRY_NAME_OFF + H1FUSE_MAXNAMLEN];
+} h1fuse_entry_t;
+
+static hammer_tid_t AsOf = HAMMER_MAX_TID;
+static hammer_off_t BTreeRoot;
+
+static h1fuse_view_t **Views;
+static h1fuse_view_t *ViewHash[H1FUSE_VIEW_HASH];
+static int ViewCount;
+static int ViewMax;
+static pthread_mutex_t view_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static h1fuse_icache_t *ICache;
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+static h1fuse_ncache_t *NCache;
+static pthread_mutex_t ncache_locks[H1FUSE_NCACHE_LOCKS];
+static h1fuse_negcache_t *NegCache;
+static pthread_mutex_t negcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char ZeroBuf[HAMMER_BUFSIZE];
+
+/*
+ * Return a CRC checked copy of the B-Tree node.
+ */
+static
+int
+h1fuse_get_node(hammer_off_t node_offset, hammer_node_ondisk_t node)
+{
+	h1fuse_ncache_t *nc;
+	pthread_mutex_t *lock;
+	int error;
+	int i;
+
+	i = (node_offset / sizeof(*node)) & (H1FUSE_NCACHE - 1);
+	nc = &NCache[i];
+	lock = &ncache_locks[i & (H1FUSE_NCACHE_LOCKS - 1)];
+
+	pthread_mutex_lock(lock);
+	if (nc->node_offset == node_offset) {
+		bcopy(&nc->node, node, sizeof(*node));
+		pthread_mutex_unlock(lock);
+		return(0);
+	}
+	pthread_mutex_unlock(lock);
+
+	error = btree_get_node(node_offset, node);
+	if (error)
+		return(error);
+
+	pthread_mutex_lock(lock);
+	nc->node_offset = node_offset;
+	bcopy(node, &nc->node, sizeof(*node));
+	pthread_mutex_unlock(lock);
+
+	return(0);
+}
+
+/*
+ * Scan the records of one object and record type with keys in
+ * [key_beg, key_end].  Returns 0 or an errno value, func stops the
+ * scan by returning BTREE_SEARCH_STOP or an errno value.
+ */
+static
+int
+h1fuse_scan(const h1fuse_obj_t *obj, uint32_t localization, uint16_t rec_type,
+	    int64_t key_beg, int64_t key_end, btree_search_func_t func,
+	    void *arg)
+{
+	struct btree_search search;
+
+	bzero(&search, sizeof(search));
+	search.key_beg.localization = obj->localization | localization;
+	search.key_beg.obj_id = obj->obj_id;
+	search.key_beg.rec_type = rec_type;
+	search.key_beg.key = key_beg;
+	search.key_beg.create_tid = 1;
+	search.key_end = search.key_beg;
+	search.key_end.key = key_end;
+	search.key_end.create_tid = 0;	/* infinity */
+	search.asof = obj->asof;
+	search.func = func;
+	search.arg = arg;
+	search.get_node = h1fuse_get_node;
+
+	return(btree_search(BTreeRoot, &search));
+}
+
+/*
+ * Copy the data of a small record and check its CRC.
+ */
+static
+int
+h1fuse_read_record(hammer_btree_leaf_elm_t leaf, void *data, int bytes)
+{
+	buffer_info_t buffer = NULL;
+	hammer_off_t data_offset;
+	char *ptr;
+	int i, n;
+
+	if (leaf->data_len < 0 || leaf->data_len > bytes)
+		goto failed;
+	for (i = 0; i < leaf->data_len; i += n) {
+		data_offset = leaf->data_offset + i;
+		n = HAMMER_BUFSIZE - (data_offset & HAMMER_BUFMASK);
+		if (n > leaf->data_len - i)
+			n = leaf->data_len - i;
+		ptr = get_buffer_data(data_offset, &buffer, 0);
+		if (ptr == NULL)
+			goto failed;
+		bcopy(ptr, (char *)data + i, n);
+	}
+	rel_buffer(buffer);
+	if (hammer_crc_test_leaf(HammerVersion, data, leaf))
+		return(0);
+failed:
+	rel_buffer(buffer);
+	fprintf(stderr, "record %016jx/%04x data %016jx: bad data or CRC\n",
+		(intmax_t)leaf->base.obj_id, leaf->base.rec_type,
+		(intmax_t)leaf->data_offset);
+	return(EIO);
+}
+
+/*
+ * CRC the data of a file data record in place.
+ */
+static
+int
+h1fuse_test_data(hammer_btree_leaf_elm_t leaf, uint32_t version)
+{
+	buffer_info_t buffer = NULL;
+	hammer_off_t data_offset;
+	hammer_crc_t crc = 0;
+	char *ptr;
+	int i, n;
+
+	for (i = 0; i < leaf->data_len; i += n) {
+		data_offset = leaf->data_offset + i;
+		n = HAMMER_BUFSIZE - (data_offset & HAMMER_BUFMASK);
+		if (n > leaf->data_len - i)
+			n = leaf->data_len - i;
+		ptr = get_buffer_data(data_offset, &buffer, 0);
+		if (ptr == NULL)
+			return(0);
+		crc = hammer_datacrc_ext(version, ptr, n, crc);
+	}
+	rel_buffer(buffer);
+
+	return(crc == leaf->data_crc);
+}
+
+static
+int
+h1fuse_inode_callback(hammer_btree_leaf_elm_t leaf, void *arg)
+{
+	hammer_inode_data_t ino = arg;
+	int error;
+
+	if (leaf->data_len != sizeof(*ino))
+		return(EIO);
+	error = h1fuse_read_record(leaf, ino, leaf->data_len);
+	if (error)
+		return(error);
+	if (ino->version == 0)
+		ino->version = HAMMER_INODE_DATA_VERSION;	/* found */
+	return(BTREE_SEARCH_STOP);
+}
+
+static __inline
+int
+h1fuse_icache_index(const h1fuse_obj_t *obj)
+{
+	return((obj->obj_id ^ obj->asof ^ (obj->localization >> 16)) &
+	       (H1FUSE_ICACHE - 1));
+}
+
+static
+int
+h1fuse_get_inode(const h1fuse_obj_t *obj, hammer_inode_data_t ino)
+{
+	h1fuse_icache_t *ic;
+	int error;
+
+	ic = &ICache[h1fuse_icache_index(obj)];
+	pthread_mutex_lock(&icache_lock);
+	if (ic->obj.obj_id == obj->obj_id &&
+	    ic->obj.localization == obj->localization &&
+	    ic->obj.asof == obj->asof) {
+		*ino = ic->ino;
+		pthread_mutex_unlock(&icache_lock);
+		return(0);
+	}
+	pthread_mutex_unlock(&icache_lock);
+
+	ino->version = 0;
+	error = h1fuse_scan(obj, HAMMER_LOCALIZE_INODE, HAMMER_RECTYPE_INODE,
+			    0, 0, h1fuse_inode_callback, ino);
+	if (error)
+		return(error);
+	if (ino->version == 0)
+		return(ENOENT);
+
+	pthread_mutex_lock(&icache_lock);
+	ic->obj = *obj;
+	ic->ino = *ino;
+	pthread_mutex_unlock(&icache_lock);
+
+	return(0);
+}
+
+/*
+ * Map between node ids and objects.
+ */
+static
+int
+h1fuse_get_obj(uint64_t id, h1fuse_obj_t *obj)
+{
+	int error = 0;
+
+	if ((id & H1FUSE_VIEWID) == 0) {
+		obj->obj_id = id;
+		obj->localization = HAMMER_DEF_LOCALIZATION;
+		obj->asof = AsOf;
+		return(0);
+	}
+	id &= ~H1FUSE_VIEWID;
+
+	pthread_mutex_lock(&view_lock);
+	if (id < (uint64_t)ViewCount)
+		*obj = Views[id]->obj;
+	else
+		error = ESTALE;
+	pthread_mutex_unlock(&view_lock);
+
+	return(error);
+}
+
+static
+uint64_t
+h1fuse_get_id(const h1fuse_obj_t *obj)
+{
+	h1fuse_view_t *view;
+	int i;
+
+	if (obj->localization == HAMMER_DEF_LOCALIZATION && obj->asof == AsOf)
+		return(obj->obj_id);
+
+	i = (obj->obj_id ^ obj->asof ^ (obj->localization >> 16)) &
+	    (H1FUSE_VIEW_HASH - 1);
+	pthread_mutex_lock(&view_lock);
+	for (view = ViewHash[i]; view; view = view->next) {
+		if (view->obj.obj_id == obj->obj_id &&
+		    view->obj.localization == obj->localization &&
+		    view->obj.asof == obj->asof)
+			break;
+	}
+	if (view == NULL) {
+		if (ViewCount == ViewMax) {
+			ViewMax = ViewMax ? ViewMax * 2 : 64;
+			Views = realloc(Views, ViewMax * sizeof(*Views));
+		}
+		view = malloc(sizeof(*view));
+		view->obj = *obj;
+		view->id = H1FUSE_VIEWID | ViewCount;
+		view->next = ViewHash[i];
+		ViewHash[i] = view;
+		Views[ViewCount++] = view;
+	}
+	pthread_mutex_unlock(&view_lock);
+
+	return(view->id);
+}
+
+/*
+ * Directory entry keys, see hammer_direntry_namekey() in the kernel.
+ * The low bits of the key iterate over hash collisions, up to
+ * max_iterations.
+ */
+static
+int64_t
+h1fuse_namekey(const struct hammer_inode_data *dip, const char *name,
+	       int len, uint32_t *max_iterationsp)
+{
+	int64_t key;
+	int32_t crcx;
+	int i, j;
+
+	switch(dip->cap_flags & HAMMER_INODE_CAP_DIRHASH_MASK) {
+	case HAMMER_INODE_CAP_DIRHASH_ALG0:
+		key = (int64_t)(crc32(name, len) & 0x7FFFFFFF) << 32;
+		if (key == 0)
+			key |= 0x100000000LL;
+		*max_iterationsp = 0xFFFFFFFFU;
+		break;
+	case HAMMER_INODE_CAP_DIRHASH_ALG1:
+		/*
+		 * Top 32 bits from the domains separated by '.', '-', '_'
+		 * and '~', then 16 bits of the crc of the whole name.
+		 */
+		crcx = 0;
+		for (i = j = 0; i < len; ++i) {
+			if (name[i] == '.' || name[i] == '-' ||
+			    name[i] == '_' || name[i] == '~') {
+				if (i != j)
+					crcx += crc32(name + j, i - j);
+				j = i + 1;
+			}
+		}
+		if (i != j)
+			crcx += crc32(name + j, i - j);
+		crcx &= 0x7FFFFFFFU;
+		key = (uint64_t)crcx << 32;
+
+		crcx = crc32(name, len);
+		crcx = crcx ^ (crcx << 16);
+		key |= crcx & 0xFFFF0000U;
+
+		if ((key & 0xFFFFFFFF00000000LL) == 0)
+			key |= 0x100000000LL;
+		*max_iterationsp = 0x00FFFFFF;
+		break;
+	default:
+		key = 0;
+		*max_iterationsp = 0;
+		break;
+	}
+	return(key);
+}
+
+static
+int
+h1fuse_find_callback(hammer_btree_leaf_elm_t leaf, void *arg)
+{
+	h1fuse_find_t *find = arg;
+	h1fuse_entry_t data;
+	int error;
+
+	if (leaf->data_len != (int)HAMMER_ENTRY_NAME_OFF + find->len)
+		return(0);
+	error = h1fuse_read_record(leaf, &data, sizeof(data));
+	if (error)
+		return(error);
+	if (bcmp(data.entry.name, find->name, find->len))
+		return(0);
+	find->obj_id = data.entry.obj_id;
+	find->localization = data.entry.localization &
+			     HAMMER_LOCALIZE_PSEUDOFS_MASK;
+	find->found = 1;
+	return(BTREE_SEARCH_STOP);
+}
+
+/*
+ * Failed lookups are cached by namekey, which is the only part of the
+ * lookup needing no media access.
+ */
+static
+h1fuse_negcache_t *
+h1fuse_negcache(const h1fuse_obj_t *dir, int64_t namekey)
+{
+	uint64_t h;
+
+	h = namekey ^ (namekey >> 32) ^ dir->obj_id ^ dir->asof ^
+	    (dir->localization >> 16);
+	return(&NegCache[h & (H1FUSE_NEGCACHE - 1)]);
+}
+
+static
+int
+h1fuse_negcache_test(const h1fuse_negcache_t *neg, const h1fuse_obj_t *dir,
+		     int64_t namekey, const char *name, int len)
+{
+	return(neg->dir.obj_id == dir->obj_id &&
+	       neg->dir.localization == dir->localization &&
+	       neg->dir.asof == dir->asof &&
+	       neg->namekey == namekey &&
+	       neg->len == len && bcmp(neg->name, name, len) == 0);
+}
+
+/*
+ * Look up name[0..len) in directory dir as of dir->asof, and return
+ * the object it references.
+ */
+static
+int
+h1fuse_find(const h1fuse_obj_t *dir, const struct hammer_inode_data *dip,
+	    const char *name, int len, h1fuse_obj_t *obj)
+{
+	h1fuse_negcache_t *neg;
+	h1fuse_find_t find;
+	uint32_t max_iterations;
+	int64_t namekey;
+	int error;
+
+	if (len > H1FUSE_MAXNAMLEN)
+		return(ENAMETOOLONG);
+	namekey = h1fuse_namekey(dip, name, len, &max_iterations);
+	if (max_iterations == 0)
+		return(EIO);		/* unknown hash algorithm */
+
+	neg = h1fuse_negcache(dir, namekey);
+	if (len <= H1FUSE_NEGNAME) {
+		pthread_mutex_lock(&negcache_lock);
+		if (h1fuse_negcache_test(neg, dir, namekey, name, len)) {
+			pthread_mutex_unlock(&negcache_lock);
+			return(ENOENT);
+		}
+		pthread_mutex_unlock(&negcache_lock);
+	}
+
+	bzero(&find, sizeof(find));
+	find.name = name;
+	find.len = len;
+	error = h1fuse_scan(dir, HAMMER_DIR_INODE_LOCALIZATION(dip),
+			    HAMMER_RECTYPE_DIRENTRY,
+			    namekey, namekey + max_iterations,
+			    h1fuse_find_callback, &find);
+	if (error)
+		return(error);
+
+	if (find.found == 0) {
+		if (len <= H1FUSE_NEGNAME) {
+			pthread_mutex_lock(&negcache_lock);
+			neg->dir = *dir;
+			neg->namekey = namekey;
+			neg->len = len;
+			bcopy(name, neg->name, len);
+			pthread_mutex_unlock(&negcache_lock);
+		}
+		return(ENOENT);
+	}
+	obj->obj_id = find.obj_id;
+	obj->localization = find.localization;
+	obj->asof = dir->asof;
+	return(0);
+}
+
+/*
+ * Parse the "<tid>" or "<tid>:<pfs>" extension following "@@", see
+ * hammer_str_to_tid() in the kernel.  <tid> is either -1 or 0x and
+ * 16 hex digits, <pfs> 5 decimal digits.
+ */
+static
+int
+h1fuse_str_to_tid(const char *str, int *ispfsp, hammer_tid_t *tidp,
+		  uint32_t *localizationp)
+{
+	hammer_tid_t tid;
+	uint32_t localization;
+	char *ptr;
+	int ispfs;
+	int n;
+
+	tid = strtoull(str, &ptr, 0);
+	n = ptr - str;
+	if (n == 2 && str[0] == '-' && str[1] == '1') {
+		/* ok */
+	} else if (n == 18 && str[0] == '0' && (str[1] | 0x20) == 'x') {
+		/* ok */
+	} else {
+		return(EINVAL);
+	}
+
+	str = ptr;
+	if (*str == ':') {
+		localization = pfs_to_lo(strtoul(str + 1, &ptr, 10));
+		if (ptr - str != 6)
+			return(EINVAL);
+		str = ptr;
+		ispfs = 1;
+	} else {
+		localization = *localizationp;
+		ispfs = 0;
+	}
+	if (*str)
+		return(EINVAL);
+
+	*tidp = tid;
+	*localizationp = localization;
+	*ispfsp = ispfs;
+	return(0);
+}
+
+static
+void
+h1fuse_fill_stat(uint64_t id, const struct hammer_inode_data *ino,
+		 struct stat *st)
+{
+	bzero(st, sizeof(*st));
+	st->st_ino = id;
+
+	switch(ino->obj_type) {
+	case HAMMER_OBJTYPE_DIRECTORY:
+		st->st_mode = S_IFDIR;
+		break;
+	case HAMMER_OBJTYPE_FIFO:
+		st->st_mode = S_IFIFO;
+		break;
+	case HAMMER_OBJTYPE_CDEV:
+		st->st_mode = S_IFCHR;
+		break;
+	case HAMMER_OBJTYPE_BDEV:
+		st->st_mode = S_IFBLK;
+		break;
+	case HAMMER_OBJTYPE_SOFTLINK:
+		st->st_mode = S_IFLNK;
+		break;
+	case HAMMER_OBJTYPE_SOCKET:
+		st->st_mode = S_IFSOCK;
+		break;
+	default:
+		st->st_mode = S_IFREG;
+		break;
+	}
+	st->st_mode |= ino->mode & 07777;
+	st->st_nlink = ino->nlinks ? ino->nlinks : 1;
+
+	/* degenerate unix ids live in node[2..5], see hammer_to_unix_xid() */
+	memcpy(&st->st_uid, (const char *)&ino->uid + 12, sizeof(uint32_t));
+	memcpy(&st->st_gid, (const char *)&ino->gid + 12, sizeof(uint32_t));
+
+	st->st_rdev = makedev(ino->rmajor, ino->rminor);
+	st->st_size = ino->size;
+	st->st_blocks = (ino->size + 511) / 512;
+	st->st_blksize = HAMMER_BUFSIZE;
+
+	st->st_mtim.tv_sec = ino->mtime / 1000000;
+	st->st_mtim.tv_nsec = ino->mtime % 1000000 * 1000;
+	st->st_atim.tv_sec = ino->atime / 1000000;
+	st->st_atim.tv_nsec = ino->atime % 1000000 * 1000;
+	st->st_ctim.tv_sec = ino->ctime / 1000000;
+	st->st_ctim.tv_nsec = ino->ctime % 1000000 * 1000;
+}
+
+static
+int
+h1fuse_getattr(uint64_t id, struct stat *st)
+{
+	struct hammer_inode_data ino;
+	h1fuse_obj_t obj;
+	int error;
+
+	error = h1fuse_get_obj(id, &obj);
+	if (error == 0)
+		error = h1fuse_get_inode(&obj, &ino);
+	if (error == 0)
+		h1fuse_fill_stat(id, &ino, st);
+	return(error);
+}
+
+static
+int
+h1fuse_lookup(uint64_t dir, const char *name, struct stat *st)
+{
+	struct hammer_inode_data dip;
+	struct hammer_inode_data ino;
+	h1fuse_obj_t dobj;
+	h1fuse_obj_t obj;
+	const char *ptr;
+	int ispfs = 0;
+	int error;
+	int len;
+
+	error = h1fuse_get_obj(dir, &dobj);
+	if (error == 0)
+		error = h1fuse_get_inode(&dobj, &dip);
+	if (error)
+		return(error);
+	if (dip.obj_type != HAMMER_OBJTYPE_DIRECTORY)
+		return(ENOTDIR);
+
+	/*
+	 * "name@@<tid>" is name as of <tid>, a bare "@@<tid>" the
+	 * directory itself and "@@<tid>:<pfs>" the root of the PFS.
+	 * Anything else containing "@@" is an ordinary name.
+	 */
+	len = strlen(name);
+	obj = dobj;
+	ptr = strstr(name, "@@");
+	if (ptr && h1fuse_str_to_tid(ptr + 2, &ispfs, &obj.asof,
+				     &obj.localization) == 0) {
+		len = ptr - name;
+	}
+
+	if (len == 0) {
+		if (ispfs)
+			obj.obj_id = HAMMER_OBJID_ROOT;
+	} else {
+		dobj.asof = obj.asof;
+		error = h1fuse_find(&dobj, &dip, name, len, &obj);
+		if (error)
+			return(error);
+	}
+
+	error = h1fuse_get_inode(&obj, &ino);
+	if (error)
+		return(error);
+	h1fuse_fill_stat(h1fuse_get_id(&obj), &ino, st);
+	return(0);
+}
+
+static
+int
+h1fuse_open(uint64_t id, uint64_t *fhp)
+{
+	h1fuse_file_t *file;
+	int error;
+
+	file = malloc(sizeof(*file));
+	error = h1fuse_get_obj(id, &file->obj);
+	if (error == 0)
+		error = h1fuse_get_inode(&file->obj, &file->ino);
+	if (error == 0 && file->ino.obj_type == HAMMER_OBJTYPE_DIRECTORY)
+		error = EISDIR;
+	if (error) {
+		free(file);
+		return(error);
+	}
+	*fhp = (uintptr_t)file;
+	return(0);
+}
+
+static
+void
+h1fuse_release(uint64_t id __unused, uint64_t fh)
+{
+	free((void *)(uintptr_t)fh);
+}
+
+static
+void
+h1fuse_put(void *arg)
+{
+	rel_buffer(arg);
+}
+
+static
+void
+h1fuse_reply_zeros(hfuse_reply_t *rep, off_t bytes)
+{
+	size_t n;
+
+	while (bytes > 0) {
+		n = bytes < (off_t)sizeof(ZeroBuf) ? bytes : sizeof(ZeroBuf);
+		hfuse_reply_data(rep, ZeroBuf, n, NULL, NULL);
+		bytes -= n;
+	}
+}
+
+/*
+ * Reply with the part of a data record which overlaps the READ.
+ * Records come in file order, the gap before one is a hole.  The
+ * key of a data record is the offset of its end.
+ */
+static
+int
+h1fuse_read_callback(hammer_btree_leaf_elm_t leaf, void *arg)
+{
+	h1fuse_read_t *rd = arg;
+	buffer_info_t buffer;
+	hammer_off_t data_offset;
+	off_t base, beg, end;
+	void *ptr;
+	int n;
+
+	base = leaf->base.key - leaf->data_len;
+	if (base >= rd->end)
+		return(BTREE_SEARCH_STOP);
+	if (leaf->data_len <= 0 || leaf->data_len > HAMMER_XBUFSIZE ||
+	    (base < rd->pos && rd->pos > rd->beg))
+		return(EIO);		/* overlapping records are corrupt */
+
+	if (h1fuse_test_data(leaf, HammerVersion) == 0 &&
+	    (HammerVersion < HAMMER_VOL_VERSION_SEVEN ||
+	     h1fuse_test_data(leaf, HAMMER_VOL_VERSION_SIX) == 0)) {
+		fprintf(stderr, "record %016jx/%016jx data %016jx: "
+			"bad data or CRC\n",
+			(intmax_t)leaf->base.obj_id,
+			(intmax_t)leaf->base.key,
+			(intmax_t)leaf->data_offset);
+		return(EIO);
+	}
+
+	beg = base > rd->pos ? base : rd->pos;
+	end = leaf->base.key < rd->end ? leaf->base.key : rd->end;
+	h1fuse_reply_zeros(rd->rep, beg - rd->pos);
+
+	for (; beg < end; beg += n) {
+		data_offset = leaf->data_offset + (beg - base);
+		n = HAMMER_BUFSIZE - (data_offset & HAMMER_BUFMASK);
+		if (n > end - beg)
+			n = end - beg;
+		buffer = NULL;
+		ptr = get_buffer_data(data_offset, &buffer, 0);
+		if (ptr == NULL)
+			return(EIO);
+		hfuse_reply_data(rd->rep, ptr, n, h1fuse_put, buffer);
+	}
+	rd->pos = end;
+
+	return(0);
+}
+
+static
+int
+h1fuse_read(uint64_t id __unused, uint64_t fh, off_t offset, size_t size,
+	    hfuse_reply_t *rep)
+{
+	h1fuse_file_t *file = (void *)(uintptr_t)fh;
+	h1fuse_read_t rd;
+	int error;
+
+	if (offset < 0 || (uint64_t)offset >= file->ino.size)
+		return(0);
+	if (size > file->ino.size - offset)
+		size = file->ino.size - offset;
+
+	bzero(&rd, sizeof(rd));
+	rd.rep = rep;
+	rd.beg = offset;
+	rd.pos = offset;
+	rd.end = offset + size;
+	error = h1fuse_scan(&file->obj, HAMMER_LOCALIZE_MISC,
+			    HAMMER_RECTYPE_DATA,
+			    rd.beg + 1, rd.end + HAMMER_XBUFSIZE - 1,
+			    h1fuse_read_callback, &rd);
+	if (error == 0)
+		h1fuse_reply_zeros(rep, rd.end - rd.pos);
+	return(error);
+}
+
+static
+int
+h1fuse_symlink_callback(hammer_btree_leaf_elm_t leaf, void *arg)
+{
+	hfuse_reply_t *rep = arg;
+	char *data;
+	int error;
+
+	data = hfuse_reply_buffer(rep, leaf->data_len);
+	if (data == NULL)
+		return(EIO);
+	error = h1fuse_read_record(leaf, data, leaf->data_len);
+	if (error)
+		return(error);
+	hfuse_reply_data(rep, data, leaf->data_len, NULL, NULL);
+	return(BTREE_SEARCH_STOP);
+}
+
+/*
+ * Short symlinks are stored in the inode, longer ones in a FIX record.
+ */
+static
+int
+h1fuse_readlink(uint64_t id, hfuse_reply_t *rep)
+{
+	struct hammer_inode_data ino;
+	h1fuse_obj_t obj;
+	char *data;
+	int error;
+
+	error = h1fuse_get_obj(id, &obj);
+	if (error == 0)
+		error = h1fuse_get_inode(&obj, &ino);
+	if (error)
+		return(error);
+	if (ino.obj_type != HAMMER_OBJTYPE_SOFTLINK)
+		return(EINVAL);
+
+	if (ino.size <= HAMMER_INODE_BASESYMLEN) {
+		data = hfuse_reply_buffer(rep, ino.size);
+		if (data == NULL)
+			return(EIO);
+		bcopy(ino.ext.symlink, data, ino.size);
+		hfuse_reply_data(rep, data, ino.size, NULL, NULL);
+		return(0);
+	}
+	return(h1fuse_scan(&obj, HAMMER_LOCALIZE_MISC, HAMMER_RECTYPE_FIX,
+			   HAMMER_FIXKEY_SYMLINK, HAMMER_FIXKEY_SYMLINK,
+			   h1fuse_symlink_callback, rep));
+}
+
+static
+int
+h1fuse_readdir_callback(hammer_btree_leaf_elm_t leaf, void *arg)
+{
+	h1fuse_dir_t *dir = arg;
+	h1fuse_dirent_t *dirent;
+	h1fuse_entry_t data;
+	int error;
+	int len;
+
+	error = h1fuse_read_record(leaf, &data, sizeof(data));
+	if (error)
+		return(0);		/* skip the entry */
+	len = leaf->data_len - HAMMER_ENTRY_NAME_OFF;
+	if (len <= 0 || memchr(data.entry.name, '/', len) ||
+	    memchr(data.entry.name, 0, len)) {
+		return(0);
+	}
+
+	if (dir->count == dir->max) {
+		dir->max = dir->max ? dir->max * 2 : 32;
+		dir->ary = realloc(dir->ary, dir->max * sizeof(*dirent));
+	}
+	dirent = &dir->ary[dir->count++];
+	dirent->name = strndup(data.entry.name, len);
+	dirent->obj_id = data.entry.obj_id;
+	dirent->localization = data.entry.localization &
+			       HAMMER_LOCALIZE_PSEUDOFS_MASK;
+	dirent->obj_type = leaf->base.obj_type;
+
+	return(0);
+}
+
+/*
+ * The directory is read once at open time, and READDIR offsets index
+ * into that list after "." and "..".
+ */
+static
+int
+h1fuse_opendir(uint64_t id, uint64_t *fhp)
+{
+	struct hammer_inode_data ino;
+	h1fuse_dir_t *dir;
+	h1fuse_obj_t obj;
+	int error;
+
+	error = h1fuse_get_obj(id, &obj);
+	if (error == 0)
+		error = h1fuse_get_inode(&obj, &ino);
+	if (error)
+		return(error);
+	if (ino.obj_type != HAMMER_OBJTYPE_DIRECTORY)
+		return(ENOTDIR);
+
+	dir = calloc(1, sizeof(*dir));
+	dir->obj = obj;
+	dir->parent_obj_id = ino.parent_obj_id;
+	if (obj.obj_id == HAMMER_OBJID_ROOT || dir->parent_obj_id == 0)
+		dir->parent_obj_id = obj.obj_id;
+	if (h1fuse_scan(&obj, HAMMER_DIR_INODE_LOCALIZATION(&ino),
+			HAMMER_RECTYPE_DIRENTRY, 0, HAMMER_MAX_KEY,
+			h1fuse_readdir_callback, dir)) {
+		fprintf(stderr, "directory %016jx: some entries unreadable\n",
+			(intmax_t)obj.obj_id);
+	}
+	*fhp = (uintptr_t)dir;
+
+	return(0);
+}
+
+static
+int
+h1fuse_dtype(uint8_t obj_type)
+{
+	switch(obj_type) {
+	case HAMMER_OBJTYPE_DIRECTORY:
+		return(DT_DIR);
+	case HAMMER_OBJTYPE_REGFILE:
+	case HAMMER_OBJTYPE_DBFILE:
+		return(DT_REG);
+	case HAMMER_OBJTYPE_FIFO:
+		return(DT_FIFO);
+	case HAMMER_OBJTYPE_CDEV:
+		return(DT_CHR);
+	case HAMMER_OBJTYPE_BDEV:
+		return(DT_BLK);
+	case HAMMER_OBJTYPE_SOFTLINK:
+		return(DT_LNK);
+	case HAMMER_OBJTYPE_SOCKET:
+		return(DT_SOCK);
+	default:
+		return(DT_UNKNOWN);
+	}
+}
+
+static
+int
+h1fuse_readdir(uint64_t id __unused, uint64_t fh, off_t offset,
+	       hfuse_reply_t *rep)
+{
+	h1fuse_dir_t *dir = (void *)(uintptr_t)fh;
+	h1fuse_dirent_t *dirent;
+	h1fuse_obj_t obj;
+	off_t i;
+
+	for (i = offset; i < dir->count + 2; ++i) {
+		obj = dir->obj;
+		if (i == 0) {
+			if (hfuse_reply_dirent(rep, ".", h1fuse_get_id(&obj),
+			    DT_DIR, i + 1))
+				break;
+			continue;
+		}
+		if (i == 1) {
+			obj.obj_id = dir->parent_obj_id;
+			if (hfuse_reply_dirent(rep, "..", h1fuse_get_id(&obj),
+			    DT_DIR, i + 1))
+				break;
+			continue;
+		}
+		dirent = &dir->ary[i - 2];
+		obj.obj_id = dirent->obj_id;
+		obj.localization = dirent->localization;
+		if (hfuse_reply_dirent(rep, dirent->name, h1fuse_get_id(&obj),
+		    h1fuse_dtype(dirent->obj_type), i + 1))
+			break;
+	}
+	return(0);
+}
+
+static
+void
+h1fuse_releasedir(uint64_t id __unused, uint64_t fh)
+{
+	h1fuse_dir_t *dir = (void *)(uintptr_t)fh;
+	int i;
+
+	for (i = 0; i < dir->count; ++i)
+		free(dir->ary[i].name);
+	free(dir->ary);
+	free(dir);
+}
+
+static
+int
+h1fuse_statfs(struct statvfs *sfs)
+{
+	hammer_volume_ondisk_t ondisk = get_root_volume()->ondisk;
+	int64_t bufs = HAMMER_BIGBLOCK_SIZE / HAMMER_BUFSIZE;
+
+	sfs->f_bsize = HAMMER_BUFSIZE;
+	sfs->f_frsize = HAMMER_BUFSIZE;
+	sfs->f_blocks = ondisk->vol0_stat_bigblocks * bufs;
+	sfs->f_bfree = ondisk->vol0_stat_freebigblocks * bufs;
+	sfs->f_bavail = sfs->f_bfree;
+	sfs->f_files = ondisk->vol0_stat_inodes;
+	sfs->f_namemax = H1FUSE_MAXNAMLEN;
+	return(0);
+}
+
+const hfuse_ops_t hammer_fuse_ops = {
+	.getattr	= h1fuse_getattr,
+	.lookup		= h1fuse_lookup,
+	.readlink	= h1fuse_readlink,
+	.open		= h1fuse_open,
+	.read		= h1fuse_read,
+	.release	= h1fuse_release,
+	.opendir	= h1fuse_opendir,
+	.readdir	= h1fuse_readdir,
+	.releasedir	= h1fuse_releasedir,
+	.statfs		= h1fuse_statfs,
+};
+
+/*
+ * Load the volumes read-only and check the root inode is there as of
+ * asof, 0 being the current state.  Returns 0 on success.
+ */
+int
+hammer_fuse_init(char **volumes, int nvolumes, uint64_t asof)
+{
+	struct hammer_inode_data ino;
+	volume_info_t volume = NULL;
+	h1fuse_obj_t obj;
+	char *path;
+	int i;
+
+	if (hammer_uuid_name_lookup(&Hammer_FSType, HAMMER_FSTYPE_STRING)) {
+		errx(1, "uuids file does not have the DragonFly "
+			"HAMMER filesystem type");
+		/* not reached */
+	}
+	for (i = 0; i < nvolumes; ++i) {
+		path = getdevpath(volumes[i], 0);
+		volume = load_volume(path, O_RDONLY, 1);
+		free(path);
+	}
+	if (volume == NULL || volume->ondisk->vol_count != nvolumes) {
+		fprintf(stderr, "Volume header says %d volumes, "
+			"but %d specified\n",
+			volume ? volume->ondisk->vol_count : 0, nvolumes);
+		return(-1);
+	}
+	if (get_root_volume() == NULL) {
+		fprintf(stderr, "No root volume found\n");
+		return(-1);
+	}
+	BTreeRoot = get_root_volume()->ondisk->vol0_btree_root;
+	if (asof)
+		AsOf = asof;
+
+	for (i = 0; i < H1FUSE_NCACHE_LOCKS; ++i)
+		pthread_mutex_init(&ncache_locks[i], NULL);
+	ICache = calloc(H1FUSE_ICACHE, sizeof(*ICache));
+	NCache = calloc(H1FUSE_NCACHE, sizeof(*NCache));
+	NegCache = calloc(H1FUSE_NEGCACHE, sizeof(*NegCache));
+
+	obj.obj_id = HAMMER_OBJID_ROOT;
+	obj.localization = HAMMER_DEF_LOCALIZATION;
+	obj.asof = AsOf;
+	if (h1fuse_get_inode(&obj, &ino)) {
+		fprintf(stderr, "No root directory as of 0x%016jx\n",
+			(uintmax_t)AsOf);
+		return(-1);
+	}
+	return(0);
+}
@@ -34,6 +34,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mount.h>
 #include "./mount.h"
 #include <libutil.h> // before <vfs/hammer/hammer_mount.h>
 #include <vfs/hammer/hammer_mount.h>
@@ -48,6 +49,8 @@
 #include <err.h>
 #include <mntopts.h>
 
+#include "fuse.h"
+
 static void test_master_id(int master_id);
 static void extract_volumes(struct hammer_mount_info *info, char **av, int ac);
 static void free_volumes(struct hammer_mount_info *info);
@@ -63,22 +66,41 @@ static void usage(void);
 static struct mntopt mopts[] = { MOPT_STDOPTS, MOPT_HAMMEROPTS,
 				 MOPT_UPDATE, MOPT_NULL };
 
+/*
+ * There is no kernel HAMMER on Linux, the file system is mounted
+ * read-only through FUSE and served by this process until it is
+ * unmounted.  The history, master and mirror options only matter
+ * to writable mounts and are accepted but ignored.
+ */
 int
 main(int ac, char **av)
 {
 	struct hammer_mount_info info;
-	//struct vfsconf vfc;
+	unsigned long ms_flags;
 	int mount_flags = 0;
 	int init_flags = 0;
-	//int error;
+	int foreground = 0;
+	int nthreads;
 	int ch;
-	//char *mountpt;
+	int fd;
+	char *mountpt;
 	char *ptr;
 
 	bzero(&info, sizeof(info));
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
 
-	while ((ch = getopt(ac, av, "o:T:u")) != -1) {
+	while ((ch = getopt(ac, av, "fj:o:T:u")) != -1) {
 		switch(ch) {
+		case 'f':
+			foreground = 1;
+			break;
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			if (nthreads < 1) {
+				usage();
+				/* not reached */
+			}
+			break;
 		case 'T':
 			info.asof = strtoull(optarg, NULL, 0);
 			break;
@@ -115,21 +137,11 @@ main(int ac, char **av)
 	mount_flags |= init_flags;
 
 	/*
-	 * Only the mount point need be specified in update mode.
+	 * FUSE mounts are always read-only, there is nothing to update.
 	 */
 	if (init_flags & MNT_UPDATE) {
-		if (ac != 1) {
-			usage();
-			/* not reached */
-		}
-#if 0
-		mountpt = av[0];
-		if (mount(vfc.vfc_name, mountpt, mount_flags, &info)) {
-			err(1, "mountpoint %s", mountpt);
-			/* not reached */
-		}
-#endif
-		exit(0);
+		fprintf(stderr, "mount_hammer: -u is not supported\n");
+		exit(1);
 	}
 
 	if (ac < 2) {
@@ -141,32 +153,30 @@ main(int ac, char **av)
 	 * Mount arguments: vol [vol...] mountpt
 	 */
 	extract_volumes(&info, av, ac - 1);
-#if 0
 	mountpt = av[ac - 1];
 
-	/*
-	 * Load the hammer module if necessary (this bit stolen from
-	 * mount_null).
-	 */
-	error = getvfsbyname("hammer", &vfc);
-	if (error && vfsisloadable("hammer")) {
-		if (vfsload("hammer") != 0) {
-			err(1, "vfsload(hammer)");
-			/* not reached */
-		}
-		endvfsent();
-		error = getvfsbyname("hammer", &vfc);
-	}
-	if (error) {
-		errx(1, "hammer filesystem is not available");
-		/* not reached */
-	}
+	if (hammer_fuse_init(info.volumes, info.nvolumes, info.asof))
+		exit(1);
+
+	ms_flags = 0;
+	if (mount_flags & MNT_NOEXEC)
+		ms_flags |= MS_NOEXEC;
+	if (mount_flags & MNT_NOSUID)
+		ms_flags |= MS_NOSUID;
+	if (mount_flags & MNT_NODEV)
+		ms_flags |= MS_NODEV;
+	if (mount_flags & MNT_NOATIME)
+		ms_flags |= MS_NOATIME;
 
-	if (mount(vfc.vfc_name, mountpt, mount_flags, &info)) {
-		perror("mount");
+	fd = hfuse_mount(av[0], "fuse.hammer", mountpt, ms_flags);
+	if (fd < 0)
+		exit(1);
+	if (foreground == 0 && daemon(0, 0) < 0) {
+		perror("daemon");
 		exit(1);
 	}
-#endif
+	hfuse_main(fd, &hammer_fuse_ops, nthreads);
+
 	free_volumes(&info);
 
 	return(0);
@@ -250,10 +260,9 @@ static
 void
 usage(void)
 {
-	fprintf(stderr, "usage: mount_hammer [-o options] [-T transaction-id] "
-			"special ... node\n");
-	fprintf(stderr, "       mount_hammer [-o options] [-T transaction-id] "
-			"special[:special]* node\n");
-	fprintf(stderr, "       mount_hammer -u [-o options] node\n");
+	fprintf(stderr, "usage: mount_hammer [-f] [-j nthreads] [-o options] "
+			"[-T transaction-id] special ... node\n");
+	fprintf(stderr, "       mount_hammer [-f] [-j nthreads] [-o options] "
+			"[-T transaction-id] special[:special]* node\n");
 	exit(1);
 }
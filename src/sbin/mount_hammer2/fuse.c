@@ -0,0 +1,586 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Each server thread reads a request from /dev/fuse, dispatches it and
+ * writes the reply with a single writev(2).  Read replies are gathered
+ * from iovecs pointing directly at the filesystem's buffers, which are
+ * released once the reply has been written, so file data is copied
+ * only once, by the kernel into the page cache.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/uio.h>
+#include <linux/fuse.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "fuse.h"
+
+#define HFUSE_INBUF	(64 * 1024)		/* request buffer */
+#define HFUSE_ARENA	(3 * HFUSE_MAX_READ)	/* per-thread reply buffer */
+#define HFUSE_MAX_IOV	256
+
+#define HFUSE_INIT_FLAGS	(FUSE_ASYNC_READ | FUSE_PARALLEL_DIROPS | \
+				 FUSE_CACHE_SYMLINKS | FUSE_MAX_PAGES)
+
+typedef struct hfuse_release {
+	void	(*func)(void *arg);
+	void	*arg;
+} hfuse_release_t;
+
+struct hfuse_reply {
+	int			fd;
+	const hfuse_ops_t	*ops;
+	char			*inbuf;
+	char			*arena;
+	size_t			arena_used;
+	size_t			bytes;		/* reply payload */
+	size_t			limit;		/* max reply payload */
+	int			error;
+	int			niov;
+	int			nrel;
+	struct fuse_out_header	hdr;
+	struct iovec		iov[HFUSE_MAX_IOV + 1];
+	hfuse_release_t		rel[HFUSE_MAX_IOV];
+};
+
+static int hfuse_exit;
+
+/*
+ * Mount the FUSE filesystem read-only on mountpt and return the
+ * /dev/fuse descriptor to serve it, or -1 on error.
+ */
+int
+hfuse_mount(const char *source, const char *fstype, const char *mountpt,
+	    unsigned long mount_flags)
+{
+	struct stat st;
+	char opts[256];
+	int fd;
+
+	if (stat(mountpt, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", mountpt, strerror(errno));
+		return(-1);
+	}
+	fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "/dev/fuse: %s\n", strerror(errno));
+		return(-1);
+	}
+	snprintf(opts, sizeof(opts),
+		 "fd=%d,rootmode=%o,user_id=%u,group_id=%u,"
+		 "default_permissions,allow_other,max_read=%d",
+		 fd, st.st_mode & S_IFMT, getuid(), getgid(), HFUSE_MAX_READ);
+	if (mount(source, mountpt, fstype, MS_RDONLY | mount_flags, opts) < 0) {
+		fprintf(stderr, "mount %s: %s\n", mountpt, strerror(errno));
+		close(fd);
+		return(-1);
+	}
+	return(fd);
+}
+
+/*
+ * Return bytes of scratch space which stays valid until the reply has
+ * been written, or NULL if the per-request space is exhausted.
+ */
+void *
+hfuse_reply_buffer(hfuse_reply_t *rep, size_t bytes)
+{
+	void *ptr;
+
+	bytes = (bytes + 7) & ~(size_t)7;
+	if (rep->arena_used + bytes > HFUSE_ARENA)
+		return(NULL);
+	ptr = rep->arena + rep->arena_used;
+	rep->arena_used += bytes;
+	return(ptr);
+}
+
+/*
+ * Copy the reply payload so far into one buffer to free up iovecs, and
+ * release what it referenced.
+ */
+static
+int
+hfuse_reply_flatten(hfuse_reply_t *rep, size_t extra)
+{
+	char *buf;
+	size_t off = 0;
+	int i;
+
+	buf = hfuse_reply_buffer(rep, rep->bytes + extra);
+	if (buf == NULL)
+		return(-1);
+	for (i = 1; i < rep->niov; ++i) {
+		memcpy(buf + off, rep->iov[i].iov_base, rep->iov[i].iov_len);
+		off += rep->iov[i].iov_len;
+	}
+	for (i = 0; i < rep->nrel; ++i)
+		rep->rel[i].func(rep->rel[i].arg);
+	rep->nrel = 0;
+	rep->iov[1].iov_base = buf;
+	rep->iov[1].iov_len = off;
+	rep->niov = 2;
+	return(0);
+}
+
+/*
+ * Append data to the reply without copying it.  release(arg), if not
+ * NULL, is called once the reply has been written.
+ */
+void
+hfuse_reply_data(hfuse_reply_t *rep, const void *data, size_t bytes,
+		 void (*release)(void *arg), void *arg)
+{
+	struct iovec *iov;
+
+	if (bytes > rep->limit - rep->bytes)
+		bytes = rep->limit - rep->bytes;
+	if (bytes == 0 || rep->error)
+		goto done;
+
+	/*
+	 * Out of iovecs, fall back to copying.  Only replies made of many
+	 * tiny blocks get here.
+	 */
+	if (rep->niov == HFUSE_MAX_IOV + 1 ||
+	    (release && rep->nrel == HFUSE_MAX_IOV)) {
+		if (hfuse_reply_flatten(rep, bytes)) {
+			rep->error = EIO;
+			goto done;
+		}
+		iov = &rep->iov[1];
+		memcpy((char *)iov->iov_base + iov->iov_len, data, bytes);
+		iov->iov_len += bytes;
+		rep->bytes += bytes;
+		goto done;
+	}
+
+	iov = &rep->iov[rep->niov - 1];
+	if (rep->niov > 1 &&
+	    (const char *)iov->iov_base + iov->iov_len == data) {
+		iov->iov_len += bytes;
+	} else {
+		++iov;
+		iov->iov_base = (void *)data;
+		iov->iov_len = bytes;
+		++rep->niov;
+	}
+	rep->bytes += bytes;
+	if (release) {
+		rep->rel[rep->nrel].func = release;
+		rep->rel[rep->nrel].arg = arg;
+		++rep->nrel;
+		return;
+	}
+done:
+	if (release)
+		release(arg);
+}
+
+/*
+ * Append a directory entry whose successor is at offset next.  Returns
+ * -1 when the entry doesn't fit in the reply.
+ */
+int
+hfuse_reply_dirent(hfuse_reply_t *rep, const char *name, uint64_t ino,
+		   int dtype, off_t next)
+{
+	struct fuse_dirent *dirent;
+	size_t namelen = strlen(name);
+	size_t bytes;
+
+	bytes = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+	if (bytes > rep->limit - rep->bytes)
+		return(-1);
+	dirent = hfuse_reply_buffer(rep, bytes);
+	if (dirent == NULL)
+		return(-1);
+	dirent->ino = ino;
+	dirent->off = next;
+	dirent->namelen = namelen;
+	dirent->type = dtype;
+	memcpy(dirent->name, name, namelen);
+	bzero(dirent->name + namelen, bytes - FUSE_NAME_OFFSET - namelen);
+	hfuse_reply_data(rep, dirent, bytes, NULL, NULL);
+
+	return(0);
+}
+
+static
+void
+hfuse_stat_to_attr(const struct stat *st, struct fuse_attr *attr)
+{
+	bzero(attr, sizeof(*attr));
+	attr->ino = st->st_ino;
+	attr->size = st->st_size;
+	attr->blocks = st->st_blocks;
+	attr->atime = st->st_atim.tv_sec;
+	attr->atimensec = st->st_atim.tv_nsec;
+	attr->mtime = st->st_mtim.tv_sec;
+	attr->mtimensec = st->st_mtim.tv_nsec;
+	attr->ctime = st->st_ctim.tv_sec;
+	attr->ctimensec = st->st_ctim.tv_nsec;
+	attr->mode = st->st_mode;
+	attr->nlink = st->st_nlink;
+	attr->uid = st->st_uid;
+	attr->gid = st->st_gid;
+	attr->rdev = st->st_rdev;
+	attr->blksize = st->st_blksize;
+}
+
+/*
+ * Write the reply, or just the error, and release the buffers it
+ * referenced.
+ */
+static
+void
+hfuse_send(hfuse_reply_t *rep, uint64_t unique)
+{
+	int i;
+
+	if (rep->error)
+		rep->niov = 1;
+	rep->hdr.error = -rep->error;
+	rep->hdr.unique = unique;
+	rep->hdr.len = sizeof(rep->hdr);
+	for (i = 1; i < rep->niov; ++i)
+		rep->hdr.len += rep->iov[i].iov_len;
+
+	/* ENOENT means the request was interrupted */
+	if (writev(rep->fd, rep->iov, rep->niov) < 0 && errno != ENOENT)
+		fprintf(stderr, "fuse reply: %s\n", strerror(errno));
+
+	for (i = 0; i < rep->nrel; ++i)
+		rep->rel[i].func(rep->rel[i].arg);
+}
+
+static
+void
+hfuse_init(hfuse_reply_t *rep, const struct fuse_init_in *in)
+{
+	struct fuse_init_out *out;
+
+	out = hfuse_reply_buffer(rep, sizeof(*out));
+	bzero(out, sizeof(*out));
+	out->major = FUSE_KERNEL_VERSION;
+	out->minor = FUSE_KERNEL_MINOR_VERSION;
+
+	if (in->major < 7) {
+		rep->error = EPROTO;
+		return;
+	}
+	if (in->major > 7) {
+		/* the kernel will retry with our major version */
+		hfuse_reply_data(rep, out, FUSE_COMPAT_INIT_OUT_SIZE,
+				 NULL, NULL);
+		return;
+	}
+	if (in->minor < out->minor)
+		out->minor = in->minor;
+	out->max_readahead = in->max_readahead;
+	if (out->max_readahead > HFUSE_MAX_READ)
+		out->max_readahead = HFUSE_MAX_READ;
+	out->flags = in->flags & HFUSE_INIT_FLAGS;
+	out->max_background = 64;
+	out->congestion_threshold = 48;
+	out->max_write = 4096;
+	out->time_gran = 1000;
+	out->max_pages = HFUSE_MAX_READ / 4096;
+
+	hfuse_reply_data(rep, out, in->minor < 23 ?
+			 FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof(*out),
+			 NULL, NULL);
+}
+
+static
+void
+hfuse_entry(hfuse_reply_t *rep, uint64_t dir, const char *name)
+{
+	struct fuse_entry_out *out;
+	struct stat st;
+
+	out = hfuse_reply_buffer(rep, sizeof(*out));
+	bzero(out, sizeof(*out));
+	bzero(&st, sizeof(st));
+	rep->error = rep->ops->lookup(dir, name, &st);
+
+	/* cache negative lookups as well */
+	if (rep->error == ENOENT)
+		rep->error = 0;
+	else if (rep->error)
+		return;
+	else
+		hfuse_stat_to_attr(&st, &out->attr);
+	out->nodeid = st.st_ino;
+	out->entry_valid = HFUSE_TIMEOUT;
+	out->attr_valid = HFUSE_TIMEOUT;
+	hfuse_reply_data(rep, out, sizeof(*out), NULL, NULL);
+}
+
+static
+void
+hfuse_getattr(hfuse_reply_t *rep, uint64_t ino)
+{
+	struct fuse_attr_out *out;
+	struct stat st;
+
+	out = hfuse_reply_buffer(rep, sizeof(*out));
+	bzero(out, sizeof(*out));
+	bzero(&st, sizeof(st));
+	rep->error = rep->ops->getattr(ino, &st);
+	if (rep->error)
+		return;
+	hfuse_stat_to_attr(&st, &out->attr);
+	out->attr_valid = HFUSE_TIMEOUT;
+	hfuse_reply_data(rep, out, sizeof(*out), NULL, NULL);
+}
+
+static
+void
+hfuse_open(hfuse_reply_t *rep, uint64_t ino, const struct fuse_open_in *in,
+	   int isdir)
+{
+	struct fuse_open_out *out;
+	uint64_t fh = 0;
+
+	if ((in->flags & O_ACCMODE) != O_RDONLY || (in->flags & O_TRUNC)) {
+		rep->error = EROFS;
+		return;
+	}
+	out = hfuse_reply_buffer(rep, sizeof(*out));
+	bzero(out, sizeof(*out));
+	if (isdir) {
+		rep->error = rep->ops->opendir(ino, &fh);
+		out->open_flags = FOPEN_KEEP_CACHE | FOPEN_CACHE_DIR;
+	} else {
+		rep->error = rep->ops->open(ino, &fh);
+		out->open_flags = FOPEN_KEEP_CACHE;
+	}
+	out->fh = fh;
+	hfuse_reply_data(rep, out, sizeof(*out), NULL, NULL);
+}
+
+static
+void
+hfuse_statfs(hfuse_reply_t *rep)
+{
+	struct fuse_statfs_out *out;
+	struct statvfs sfs;
+
+	out = hfuse_reply_buffer(rep, sizeof(*out));
+	bzero(out, sizeof(*out));
+	bzero(&sfs, sizeof(sfs));
+	rep->error = rep->ops->statfs(&sfs);
+	out->st.blocks = sfs.f_blocks;
+	out->st.bfree = sfs.f_bfree;
+	out->st.bavail = sfs.f_bavail;
+	out->st.files = sfs.f_files;
+	out->st.ffree = sfs.f_ffree;
+	out->st.bsize = sfs.f_bsize;
+	out->st.frsize = sfs.f_frsize;
+	out->st.namelen = sfs.f_namemax;
+	hfuse_reply_data(rep, out, sizeof(*out), NULL, NULL);
+}
+
+/*
+ * Handle one request.  Returns 0 if no reply is expected.
+ */
+static
+int
+hfuse_dispatch(hfuse_reply_t *rep, const struct fuse_in_header *in)
+{
+	const hfuse_ops_t *ops = rep->ops;
+	const void *arg = in + 1;
+	const struct fuse_read_in *rd = arg;
+	const struct fuse_release_in *rel = arg;
+
+	switch(in->opcode) {
+	case FUSE_INIT:
+		hfuse_init(rep, arg);
+		break;
+	case FUSE_DESTROY:
+		hfuse_exit = 1;
+		break;
+	case FUSE_FORGET:
+	case FUSE_BATCH_FORGET:
+	case FUSE_INTERRUPT:
+		return(0);
+	case FUSE_LOOKUP:
+		hfuse_entry(rep, in->nodeid, arg);
+		break;
+	case FUSE_GETATTR:
+		hfuse_getattr(rep, in->nodeid);
+		break;
+	case FUSE_READLINK:
+		rep->error = ops->readlink(in->nodeid, rep);
+		break;
+	case FUSE_OPEN:
+		hfuse_open(rep, in->nodeid, arg, 0);
+		break;
+	case FUSE_OPENDIR:
+		hfuse_open(rep, in->nodeid, arg, 1);
+		break;
+	case FUSE_READ:
+		rep->limit = rd->size;
+		rep->error = ops->read(in->nodeid, rd->fh, rd->offset,
+				       rep->limit, rep);
+		break;
+	case FUSE_READDIR:
+		rep->limit = rd->size;
+		rep->error = ops->readdir(in->nodeid, rd->fh, rd->offset, rep);
+		break;
+	case FUSE_RELEASE:
+		ops->release(in->nodeid, rel->fh);
+		break;
+	case FUSE_RELEASEDIR:
+		ops->releasedir(in->nodeid, rel->fh);
+		break;
+	case FUSE_STATFS:
+		hfuse_statfs(rep);
+		break;
+	case FUSE_ACCESS:
+	case FUSE_FLUSH:
+		break;
+	case FUSE_SETATTR:
+	case FUSE_SYMLINK:
+	case FUSE_MKNOD:
+	case FUSE_MKDIR:
+	case FUSE_UNLINK:
+	case FUSE_RMDIR:
+	case FUSE_RENAME:
+	case FUSE_RENAME2:
+	case FUSE_LINK:
+	case FUSE_WRITE:
+	case FUSE_CREATE:
+	case FUSE_SETXATTR:
+	case FUSE_REMOVEXATTR:
+	case FUSE_FALLOCATE:
+		rep->error = EROFS;
+		break;
+	default:
+		rep->error = ENOSYS;
+		break;
+	}
+	return(1);
+}
+
+/*
+ * Serve requests until the filesystem is unmounted.
+ */
+static
+void *
+hfuse_thread(void *arg)
+{
+	hfuse_reply_t *rep = arg;
+	struct fuse_in_header *in;
+	ssize_t n;
+
+	in = (struct fuse_in_header *)rep->inbuf;
+	while (!hfuse_exit) {
+		n = read(rep->fd, rep->inbuf, HFUSE_INBUF);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == ENOENT)
+				continue;
+			if (errno != ENODEV)	/* unmounted */
+				fprintf(stderr, "fuse read: %s\n",
+					strerror(errno));
+			break;
+		}
+		if ((size_t)n < sizeof(*in) || (size_t)n < in->len)
+			continue;
+
+		rep->arena_used = 0;
+		rep->bytes = 0;
+		rep->limit = HFUSE_ARENA;
+		rep->error = 0;
+		rep->niov = 1;
+		rep->nrel = 0;
+		if (hfuse_dispatch(rep, in))
+			hfuse_send(rep, in->unique);
+	}
+	hfuse_exit = 1;
+
+	return(NULL);
+}
+
+/*
+ * Serve the mount with nthreads threads, including the caller, until it
+ * is unmounted.
+ */
+int
+hfuse_main(int fd, const hfuse_ops_t *ops, int nthreads)
+{
+	hfuse_reply_t *reps;
+	pthread_t *threads;
+	int i;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	reps = calloc(nthreads, sizeof(*reps));
+	threads = calloc(nthreads, sizeof(*threads));
+	for (i = 0; i < nthreads; ++i) {
+		reps[i].fd = fd;
+		reps[i].ops = ops;
+		reps[i].inbuf = malloc(HFUSE_INBUF);
+		reps[i].arena = malloc(HFUSE_ARENA);
+		reps[i].iov[0].iov_base = &reps[i].hdr;
+		reps[i].iov[0].iov_len = sizeof(reps[i].hdr);
+	}
+	for (i = 1; i < nthreads; ++i) {
+		if (pthread_create(&threads[i], NULL, hfuse_thread, &reps[i])) {
+			err(1, "pthread_create");
+			/* not reached */
+		}
+	}
+	hfuse_thread(&reps[0]);
+	for (i = 1; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < nthreads; ++i) {
+		free(reps[i].inbuf);
+		free(reps[i].arena);
+	}
+	free(reps);
+	free(threads);
+	close(fd);
+
+	return(0);
+}
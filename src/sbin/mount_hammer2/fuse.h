@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef HAMMER_FUSE_H_
+#define HAMMER_FUSE_H_
+
+/*
+ * Minimal read-only FUSE server speaking the kernel protocol directly
+ * on /dev/fuse, shared by the userland HAMMER and HAMMER2 mounts.
+ *
+ * Node ids are chosen by the filesystem, FUSE_ROOT_ID (1) being the
+ * root directory.  Operations return 0 or an errno value, and append
+ * their reply data with hfuse_reply_data() or hfuse_reply_dirent().
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <stdint.h>
+
+#define HFUSE_ROOT_ID		1
+#define HFUSE_MAX_READ		(1024 * 1024)	/* largest READ request */
+#define HFUSE_TIMEOUT		3600		/* attr/entry cache seconds */
+
+typedef struct hfuse_reply hfuse_reply_t;
+
+typedef struct hfuse_ops {
+	int	(*getattr)(uint64_t ino, struct stat *st);
+	int	(*lookup)(uint64_t dir, const char *name, struct stat *st);
+	int	(*readlink)(uint64_t ino, hfuse_reply_t *rep);
+	int	(*open)(uint64_t ino, uint64_t *fhp);
+	int	(*read)(uint64_t ino, uint64_t fh, off_t offset, size_t size,
+			hfuse_reply_t *rep);
+	void	(*release)(uint64_t ino, uint64_t fh);
+	int	(*opendir)(uint64_t ino, uint64_t *fhp);
+	int	(*readdir)(uint64_t ino, uint64_t fh, off_t offset,
+			   hfuse_reply_t *rep);
+	void	(*releasedir)(uint64_t ino, uint64_t fh);
+	int	(*statfs)(struct statvfs *sfs);
+} hfuse_ops_t;
+
+int hfuse_mount(const char *source, const char *fstype, const char *mountpt,
+	unsigned long mount_flags);
+int hfuse_main(int fd, const hfuse_ops_t *ops, int nthreads);
+
+void hfuse_reply_data(hfuse_reply_t *rep, const void *data, size_t bytes,
+	void (*release)(void *arg), void *arg);
+void *hfuse_reply_buffer(hfuse_reply_t *rep, size_t bytes);
+int hfuse_reply_dirent(hfuse_reply_t *rep, const char *name, uint64_t ino,
+	int dtype, off_t next);
+
+/*
+ * Filesystems
+ */
+extern const hfuse_ops_t hammer_fuse_ops;
+int hammer_fuse_init(char **volumes, int nvolumes, uint64_t asof);
+extern const hfuse_ops_t hammer2_fuse_ops;
+int hammer2_fuse_init(const char *pfs);
+
+#endif /* !HAMMER_FUSE_H_ */
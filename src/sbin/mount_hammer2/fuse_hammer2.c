@@ -0,0 +1,599 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Read-only HAMMER2 PFS served over FUSE.
+ *
+ * Node ids are inode numbers, except that the PFS root and FUSE_ROOT_ID
+ * trade places.  Inodes are kept in a small direct-mapped cache, and
+ * indirect blocks in the media cache.  Uncompressed file data is
+ * replied straight out of the media cache, compressed blocks are only
+ * decompressed once a READ covers them.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <vfs/hammer2/hammer2_disk.h>
+
+#include "hammer2_subs.h"
+#include "fuse.h"
+
+#define H2FUSE_ICACHE	4096		/* cached inodes, power of 2 */
+
+typedef struct h2fuse_icache {
+	hammer2_tid_t		inum;		/* 0 if empty */
+	hammer2_inode_data_t	ipdata;
+} h2fuse_icache_t;
+
+typedef struct h2fuse_dir {
+	hammer2_tid_t		inum;
+	hammer2_tid_t		iparent;
+	hammer2_dirlist_t	list;
+} h2fuse_dir_t;
+
+/*
+ * A piece of a READ reply, in file order once sorted.
+ */
+typedef struct h2fuse_piece {
+	off_t			offset;
+	size_t			bytes;
+	const char		*data;
+	hammer2_media_buf_t	*mbuf;		/* held until replied */
+} h2fuse_piece_t;
+
+typedef struct h2fuse_read {
+	hfuse_reply_t		*rep;
+	off_t			beg;
+	off_t			end;
+	h2fuse_piece_t		*ary;
+	int			count;
+	int			max;
+	int			error;
+} h2fuse_read_t;
+
+static hammer2_inode_data_t IRoot;
+static hammer2_volume_data_t *VolData;
+static h2fuse_icache_t *ICache;
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char ZeroBuf[HAMMER2_PBUFSIZE];
+
+/*
+ * Map between node ids and inode numbers, the mapping is its own
+ * inverse.
+ */
+static
+uint64_t
+h2fuse_swapid(uint64_t id)
+{
+	if (id == HFUSE_ROOT_ID)
+		return(IRoot.meta.inum);
+	if (id == IRoot.meta.inum)
+		return(HFUSE_ROOT_ID);
+	return(id);
+}
+
+static
+int
+h2fuse_get_inode(uint64_t ino, hammer2_inode_data_t *ipdata)
+{
+	h2fuse_icache_t *ic;
+	hammer2_tid_t inum;
+
+	inum = h2fuse_swapid(ino);
+	if (inum == IRoot.meta.inum) {
+		*ipdata = IRoot;
+		return(0);
+	}
+	ic = &ICache[inum & (H2FUSE_ICACHE - 1)];
+
+	pthread_mutex_lock(&icache_lock);
+	if (ic->inum == inum) {
+		*ipdata = ic->ipdata;
+		pthread_mutex_unlock(&icache_lock);
+		return(0);
+	}
+	pthread_mutex_unlock(&icache_lock);
+
+	if (hammer2_lookup_inum(&IRoot, inum, ipdata))
+		return(EIO);
+
+	pthread_mutex_lock(&icache_lock);
+	ic->inum = inum;
+	ic->ipdata = *ipdata;
+	pthread_mutex_unlock(&icache_lock);
+
+	return(0);
+}
+
+static
+void
+h2fuse_fill_stat(const hammer2_inode_data_t *ipdata, struct stat *st)
+{
+	const hammer2_inode_meta_t *meta = &ipdata->meta;
+	uint32_t uid, gid;
+
+	bzero(st, sizeof(*st));
+	st->st_ino = h2fuse_swapid(meta->inum);
+
+	switch(meta->type) {
+	case HAMMER2_OBJTYPE_DIRECTORY:
+		st->st_mode = S_IFDIR;
+		break;
+	case HAMMER2_OBJTYPE_FIFO:
+		st->st_mode = S_IFIFO;
+		break;
+	case HAMMER2_OBJTYPE_CDEV:
+		st->st_mode = S_IFCHR;
+		break;
+	case HAMMER2_OBJTYPE_BDEV:
+		st->st_mode = S_IFBLK;
+		break;
+	case HAMMER2_OBJTYPE_SOFTLINK:
+		st->st_mode = S_IFLNK;
+		break;
+	case HAMMER2_OBJTYPE_SOCKET:
+		st->st_mode = S_IFSOCK;
+		break;
+	default:
+		st->st_mode = S_IFREG;
+		break;
+	}
+	st->st_mode |= meta->mode & 07777;
+	st->st_nlink = meta->nlinks ? meta->nlinks : 1;
+
+	/* degenerate unix ids live in node[2..5] of the uuid */
+	memcpy(&uid, (const char *)&meta->uid + 12, sizeof(uid));
+	memcpy(&gid, (const char *)&meta->gid + 12, sizeof(gid));
+	st->st_uid = uid;
+	st->st_gid = gid;
+
+	st->st_rdev = makedev(meta->rmajor, meta->rminor);
+	st->st_size = meta->size;
+	st->st_blocks = (meta->size + 511) / 512;
+	st->st_blksize = HAMMER2_PBUFSIZE;
+
+	/* HAMMER2 doesn't maintain atime */
+	st->st_mtim.tv_sec = meta->mtime / 1000000;
+	st->st_mtim.tv_nsec = meta->mtime % 1000000 * 1000;
+	st->st_ctim.tv_sec = meta->ctime / 1000000;
+	st->st_ctim.tv_nsec = meta->ctime % 1000000 * 1000;
+	st->st_atim = st->st_mtim;
+}
+
+static
+int
+h2fuse_getattr(uint64_t ino, struct stat *st)
+{
+	hammer2_inode_data_t ipdata;
+	int error;
+
+	error = h2fuse_get_inode(ino, &ipdata);
+	if (error == 0)
+		h2fuse_fill_stat(&ipdata, st);
+	return(error);
+}
+
+static
+int
+h2fuse_lookup(uint64_t dir, const char *name, struct stat *st)
+{
+	hammer2_inode_data_t dip;
+	hammer2_inode_data_t ipdata;
+	h2fuse_icache_t *ic;
+	int error;
+
+	error = h2fuse_get_inode(dir, &dip);
+	if (error)
+		return(error);
+	if (dip.meta.type != HAMMER2_OBJTYPE_DIRECTORY)
+		return(ENOTDIR);
+	if (hammer2_lookup_name(&IRoot, &dip, name, &ipdata))
+		return(ENOENT);
+
+	/* the kernel will ask for the inode by number next */
+	ic = &ICache[ipdata.meta.inum & (H2FUSE_ICACHE - 1)];
+	pthread_mutex_lock(&icache_lock);
+	ic->inum = ipdata.meta.inum;
+	ic->ipdata = ipdata;
+	pthread_mutex_unlock(&icache_lock);
+
+	h2fuse_fill_stat(&ipdata, st);
+	return(0);
+}
+
+/*
+ * File handles are private copies of the inode, so reads don't go
+ * through the inode cache.
+ */
+static
+int
+h2fuse_open(uint64_t ino, uint64_t *fhp)
+{
+	hammer2_inode_data_t *ipdata;
+	int error;
+
+	ipdata = malloc(sizeof(*ipdata));
+	error = h2fuse_get_inode(ino, ipdata);
+	if (error == 0 && ipdata->meta.type == HAMMER2_OBJTYPE_DIRECTORY)
+		error = EISDIR;
+	if (error) {
+		free(ipdata);
+		return(error);
+	}
+	*fhp = (uintptr_t)ipdata;
+	return(0);
+}
+
+static
+void
+h2fuse_release(uint64_t ino __unused, uint64_t fh)
+{
+	free((void *)(uintptr_t)fh);
+}
+
+static
+void
+h2fuse_put(void *arg)
+{
+	hammer2_media_put(arg);
+}
+
+/*
+ * Record the part of a DATA block which overlaps the READ.  Compressed
+ * blocks are decompressed into reply scratch space, uncompressed blocks
+ * are referenced in the media cache.
+ */
+static
+int
+h2fuse_read_callback(const hammer2_blockref_t *bref, void *arg)
+{
+	h2fuse_read_t *rd = arg;
+	h2fuse_piece_t *piece;
+	const hammer2_media_data_t *media;
+	hammer2_media_buf_t *mbuf = NULL;
+	const char *error;
+	const char *data;
+	size_t bytes;
+	size_t avail;
+	off_t beg, end;
+
+	if (bref->type != HAMMER2_BREF_TYPE_DATA)
+		return(0);
+	if (bref->keybits > HAMMER2_PBUFRADIX) {
+		rd->error = EIO;
+		return(1);
+	}
+	bytes = (size_t)1 << bref->keybits;
+	beg = bref->key > (hammer2_key_t)rd->beg ? (off_t)bref->key : rd->beg;
+	end = bref->key + bytes < (hammer2_key_t)rd->end ?
+	      (off_t)(bref->key + bytes) : rd->end;
+	if (beg >= end)
+		return(0);
+
+	if (HAMMER2_DEC_COMP(bref->methods) == HAMMER2_COMP_NONE) {
+		error = hammer2_media_get_verified(bref, &media, &avail,
+						   &mbuf);
+		data = media ? media->buf : NULL;
+	} else {
+		avail = bytes;
+		data = hfuse_reply_buffer(rd->rep, bytes);
+		error = data ? hammer2_read_block(bref, (char *)data, bytes) :
+			       "out of reply space";
+	}
+	if (error) {
+		fprintf(stderr, "inode data %016jx: %s\n",
+			(intmax_t)bref->data_off, error);
+		rd->error = EIO;
+		return(1);
+	}
+	if (data == NULL)
+		return(0);		/* no media, zero-fill */
+
+	/* a short block reads back as zeros */
+	if ((off_t)(bref->key + avail) < end)
+		end = bref->key + avail;
+	if (beg >= end) {
+		hammer2_media_put(mbuf);
+		return(0);
+	}
+
+	if (rd->count == rd->max) {
+		rd->max = rd->max ? rd->max * 2 : 32;
+		rd->ary = realloc(rd->ary, rd->max * sizeof(*piece));
+	}
+	piece = &rd->ary[rd->count++];
+	piece->offset = beg;
+	piece->bytes = end - beg;
+	piece->data = data + (beg - bref->key);
+	piece->mbuf = mbuf;
+
+	return(0);
+}
+
+static
+int
+h2fuse_piece_cmp(const void *p1, const void *p2)
+{
+	const h2fuse_piece_t *piece1 = p1;
+	const h2fuse_piece_t *piece2 = p2;
+
+	if (piece1->offset < piece2->offset)
+		return(-1);
+	if (piece1->offset > piece2->offset)
+		return(1);
+	return(0);
+}
+
+/*
+ * Reply with [offset, offset + size) of the file, clipped to its size.
+ * Holes are replied from a static zero buffer.
+ */
+static
+int
+h2fuse_read_data(const hammer2_inode_data_t *ipdata, off_t offset,
+		 size_t size, hfuse_reply_t *rep)
+{
+	h2fuse_read_t rd;
+	h2fuse_piece_t *piece;
+	char *data;
+	off_t pos;
+	size_t bytes;
+	int i;
+
+	if (offset < 0 || (hammer2_key_t)offset >= ipdata->meta.size)
+		return(0);
+	if (size > ipdata->meta.size - offset)
+		size = ipdata->meta.size - offset;
+
+	if (ipdata->meta.op_flags & HAMMER2_OPFLAG_DIRECTDATA) {
+		data = hfuse_reply_buffer(rep, size);
+		if (data == NULL)
+			return(EIO);
+		bzero(data, size);
+		if ((size_t)offset < sizeof(ipdata->u.data)) {
+			bytes = sizeof(ipdata->u.data) - offset;
+			if (bytes > size)
+				bytes = size;
+			memcpy(data, ipdata->u.data + offset, bytes);
+		}
+		hfuse_reply_data(rep, data, size, NULL, NULL);
+		return(0);
+	}
+
+	bzero(&rd, sizeof(rd));
+	rd.rep = rep;
+	rd.beg = offset;
+	rd.end = offset + size;
+	if (hammer2_scan(ipdata->u.blockset.blockref, HAMMER2_SET_COUNT,
+			 rd.beg, rd.end - 1, h2fuse_read_callback, &rd) &&
+	    rd.error == 0) {
+		rd.error = EIO;
+	}
+	qsort(rd.ary, rd.count, sizeof(*rd.ary), h2fuse_piece_cmp);
+
+	pos = rd.beg;
+	for (i = 0; i < rd.count; ++i) {
+		piece = &rd.ary[i];
+		while (rd.error == 0 && pos < piece->offset) {
+			bytes = piece->offset - pos;
+			if (bytes > sizeof(ZeroBuf))
+				bytes = sizeof(ZeroBuf);
+			hfuse_reply_data(rep, ZeroBuf, bytes, NULL, NULL);
+			pos += bytes;
+		}
+		if (rd.error || piece->offset < pos) {
+			/* overlapping blocks are corrupt */
+			hammer2_media_put(piece->mbuf);
+			rd.error = EIO;
+			continue;
+		}
+		hfuse_reply_data(rep, piece->data, piece->bytes,
+				 piece->mbuf ? h2fuse_put : NULL, piece->mbuf);
+		pos += piece->bytes;
+	}
+	while (rd.error == 0 && pos < rd.end) {
+		bytes = rd.end - pos;
+		if (bytes > sizeof(ZeroBuf))
+			bytes = sizeof(ZeroBuf);
+		hfuse_reply_data(rep, ZeroBuf, bytes, NULL, NULL);
+		pos += bytes;
+	}
+	free(rd.ary);
+
+	return(rd.error);
+}
+
+static
+int
+h2fuse_read(uint64_t ino __unused, uint64_t fh, off_t offset, size_t size,
+	    hfuse_reply_t *rep)
+{
+	return(h2fuse_read_data((void *)(uintptr_t)fh, offset, size, rep));
+}
+
+static
+int
+h2fuse_readlink(uint64_t ino, hfuse_reply_t *rep)
+{
+	hammer2_inode_data_t ipdata;
+	int error;
+
+	error = h2fuse_get_inode(ino, &ipdata);
+	if (error)
+		return(error);
+	if (ipdata.meta.type != HAMMER2_OBJTYPE_SOFTLINK)
+		return(EINVAL);
+	return(h2fuse_read_data(&ipdata, 0, ipdata.meta.size, rep));
+}
+
+/*
+ * The directory is read once at open time, and READDIR offsets index
+ * into that list after "." and "..".
+ */
+static
+int
+h2fuse_opendir(uint64_t ino, uint64_t *fhp)
+{
+	hammer2_inode_data_t ipdata;
+	h2fuse_dir_t *dir;
+	int error;
+
+	error = h2fuse_get_inode(ino, &ipdata);
+	if (error)
+		return(error);
+	if (ipdata.meta.type != HAMMER2_OBJTYPE_DIRECTORY)
+		return(ENOTDIR);
+
+	dir = malloc(sizeof(*dir));
+	dir->inum = ipdata.meta.inum;
+	dir->iparent = ipdata.meta.iparent;
+	if (dir->inum == IRoot.meta.inum || dir->iparent == 0)
+		dir->iparent = dir->inum;
+	if (hammer2_readdir(&ipdata, &dir->list))
+		fprintf(stderr, "directory %016jx: some entries unreadable\n",
+			(intmax_t)dir->inum);
+	*fhp = (uintptr_t)dir;
+
+	return(0);
+}
+
+static
+int
+h2fuse_dtype(uint8_t type)
+{
+	switch(type) {
+	case HAMMER2_OBJTYPE_DIRECTORY:
+		return(DT_DIR);
+	case HAMMER2_OBJTYPE_REGFILE:
+		return(DT_REG);
+	case HAMMER2_OBJTYPE_FIFO:
+		return(DT_FIFO);
+	case HAMMER2_OBJTYPE_CDEV:
+		return(DT_CHR);
+	case HAMMER2_OBJTYPE_BDEV:
+		return(DT_BLK);
+	case HAMMER2_OBJTYPE_SOFTLINK:
+		return(DT_LNK);
+	case HAMMER2_OBJTYPE_SOCKET:
+		return(DT_SOCK);
+	default:
+		return(DT_UNKNOWN);
+	}
+}
+
+static
+int
+h2fuse_readdir(uint64_t ino __unused, uint64_t fh, off_t offset,
+	       hfuse_reply_t *rep)
+{
+	h2fuse_dir_t *dir = (void *)(uintptr_t)fh;
+	hammer2_dirent_entry_t *entry;
+	off_t i;
+
+	for (i = offset; i < dir->list.count + 2; ++i) {
+		if (i == 0) {
+			if (hfuse_reply_dirent(rep, ".",
+			    h2fuse_swapid(dir->inum), DT_DIR, i + 1))
+				break;
+			continue;
+		}
+		if (i == 1) {
+			if (hfuse_reply_dirent(rep, "..",
+			    h2fuse_swapid(dir->iparent), DT_DIR, i + 1))
+				break;
+			continue;
+		}
+		entry = &dir->list.ary[i - 2];
+		if (entry->name[0] == 0 || strchr(entry->name, '/'))
+			continue;
+		if (hfuse_reply_dirent(rep, entry->name,
+		    h2fuse_swapid(entry->inum), h2fuse_dtype(entry->type),
+		    i + 1))
+			break;
+	}
+	return(0);
+}
+
+static
+void
+h2fuse_releasedir(uint64_t ino __unused, uint64_t fh)
+{
+	h2fuse_dir_t *dir = (void *)(uintptr_t)fh;
+
+	hammer2_dirlist_free(&dir->list);
+	free(dir);
+}
+
+static
+int
+h2fuse_statfs(struct statvfs *sfs)
+{
+	sfs->f_bsize = HAMMER2_PBUFSIZE;
+	sfs->f_frsize = HAMMER2_PBUFSIZE;
+	sfs->f_blocks = VolData->allocator_size / HAMMER2_PBUFSIZE;
+	sfs->f_bfree = VolData->allocator_free / HAMMER2_PBUFSIZE;
+	sfs->f_bavail = sfs->f_bfree;
+	sfs->f_namemax = HAMMER2_INODE_MAXNAME;
+	return(0);
+}
+
+const hfuse_ops_t hammer2_fuse_ops = {
+	.getattr	= h2fuse_getattr,
+	.lookup		= h2fuse_lookup,
+	.readlink	= h2fuse_readlink,
+	.open		= h2fuse_open,
+	.read		= h2fuse_read,
+	.release	= h2fuse_release,
+	.opendir	= h2fuse_opendir,
+	.readdir	= h2fuse_readdir,
+	.releasedir	= h2fuse_releasedir,
+	.statfs		= h2fuse_statfs,
+};
+
+/*
+ * Locate the PFS on the volumes, which must already be initialized.
+ * Returns 0 on success.
+ */
+int
+hammer2_fuse_init(const char *pfs)
+{
+	VolData = hammer2_read_root_volume_header();
+	if (hammer2_lookup_pfs(VolData, pfs, &IRoot))
+		return(-1);
+	ICache = calloc(H2FUSE_ICACHE, sizeof(*ICache));
+	return(0);
+}
@@ -38,9 +38,8 @@
 #include <sys/types.h>
 #include <sys/stat.h> // before <sys/dfly.h>
 #include <sys/mount.h>
-#include <sys/socket.h>
+#include <sys/mman.h>
 #include <sys/dfly.h>
-#include <netinet/in.h>
 #include "../mount_hammer/mount.h"
 #include <libutil.h> // before <vfs/hammer2/hammer2_mount.h>
 #include <vfs/hammer2/hammer2_mount.h>
@@ -51,10 +50,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <dmsg.h>
 #include <mntopts.h>
 
-static int cluster_connect(const char *volume);
+#include "hammer2_subs.h"
+#include "fuse.h"
+
 static void usage(const char *ctl, ...);
 
 static struct mntopt mopts[] = {
@@ -66,25 +66,48 @@ static struct mntopt mopts[] = {
 
 /*
  * Usage: mount_hammer2 [volume] [mtpt]
+ *
+ * There is no kernel HAMMER2 on Linux, the PFS is mounted read-only
+ * through FUSE and served by this process until it is unmounted.
  */
 int
 main(int ac, char *av[])
 {
 	struct hammer2_mount_info info;
-	//struct vfsconf vfc;
-	//char *mountpt;
+	unsigned long ms_flags;
+	char *mountpt;
 	char *devpath;
-	//int error;
+	char *label;
 	int ch;
 	int mount_flags;
 	int init_flags;
+	int foreground;
+	int nthreads;
+	int mmap_opt;
+	int fd;
 
 	bzero(&info, sizeof(info));
 	mount_flags = 0;
 	init_flags = 0;
+	foreground = 0;
+	mmap_opt = 0;
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
 
-	while ((ch = getopt(ac, av, "o:u")) != -1) {
+	while ((ch = getopt(ac, av, "fj:Mo:u")) != -1) {
 		switch(ch) {
+		case 'f':
+			foreground = 1;
+			break;
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			if (nthreads < 1) {
+				usage("bad thread count: %s", optarg);
+				/* not reached */
+			}
+			break;
+		case 'M':
+			mmap_opt = 1;
+			break;
 		case 'o':
 			getmntopts(optarg, mopts, &mount_flags, &info.hflags);
 			break;
@@ -99,27 +122,13 @@ main(int ac, char *av[])
 	ac -= optind;
 	av += optind;
 	mount_flags |= init_flags;
-#if 0
-	error = getvfsbyname("hammer2", &vfc);
-	if (error) {
-		fprintf(stderr, "hammer2 vfs not loaded\n");
-		exit(1);
-	}
-#endif
+
 	/*
-	 * Only the mount point need be specified in update mode.
+	 * FUSE mounts are always read-only, there is nothing to update.
 	 */
 	if (init_flags & MNT_UPDATE) {
-		if (ac != 1) {
-			usage("missing parameter (node)");
-			/* not reached */
-		}
-#if 0
-		mountpt = av[0];
-		if (mount(vfc.vfc_name, mountpt, mount_flags, &info))
-			usage("mount %s: %s", mountpt, strerror(errno));
-#endif
-		exit(0);
+		fprintf(stderr, "mount_hammer2: -u is not supported\n");
+		exit(1);
 	}
 
 	/*
@@ -131,7 +140,7 @@ main(int ac, char *av[])
 	}
 
 	devpath = strdup(av[0]);
-	//mountpt = av[1];
+	mountpt = av[1];
 
 	if (devpath[0] == 0) {
 		fprintf(stderr, "mount_hammer2: empty device path\n");
@@ -156,107 +165,55 @@ main(int ac, char *av[])
 			break;
 		}
 	}
+	info.volume = devpath;
 
 	/*
-	 * Connect to the cluster controller.  This handles both remote
-	 * mounts and device cache/master/slave mounts.
-	 *
-	 * When doing remote mounts that are allowed to run in the background
-	 * the mount program will fork, detach, print a message, and exit(0)
-	 * the originator while retrying in the background.
-	 *
-	 * Don't exit on failure, this isn't likely going to work for
-	 * the root [re]mount in early boot.
+	 * The short @label form refers to an already mounted HAMMER2,
+	 * which doesn't exist without kernel support.
 	 */
-	info.cluster_fd = cluster_connect(devpath);
-	if (info.cluster_fd < 0) {
-		fprintf(stderr,
-			"mount_hammer2: cluster_connect(%s) failed\n",
+	label = strrchr(devpath, '@');
+	if (label == devpath) {
+		fprintf(stderr, "mount_hammer2: %s: special required\n",
 			devpath);
+		exit(1);
 	}
+	*label++ = 0;
+
+	hammer2_init_volumes(devpath, 1);
+	hammer2_media_cache_init(HAMMER2_MEDIA_CACHE_BUFS);
+	if (mmap_opt)
+		hammer2_media_mmap_init(HAMMER2_MEDIA_MAP_WINDOWS,
+					MADV_NORMAL);
+	if (hammer2_fuse_init(label))
+		exit(1);
 
-	/*
-	 * Try to mount it, prefix if necessary.
-	 */
-	if (!strchr(devpath, ':') && devpath[0] != '/' && devpath[0] != '@') {
-		char *p2;
-		asprintf(&p2, "/dev/%s", devpath);
-		free(devpath);
-		devpath = p2;
-	}
-	info.volume = devpath;
-#if 0
-	error = mount(vfc.vfc_name, mountpt, mount_flags, &info);
-	if (error < 0) {
-		if (errno == ERANGE) {
-			fprintf(stderr,
-				"mount_hammer2: %s integrated with %s\n",
-				info.volume, mountpt);
-		} else if (errno == ENOENT) {
-			fprintf(stderr, "mount_hammer2: %s not found\n",
-				info.volume);
-		} else if (errno == ENXIO) {
-			fprintf(stderr, "mount_hammer2: incorrect volume "
-				"specification %s\n",
-				info.volume);
-		} else {
-			perror("mount");
-		}
+	ms_flags = 0;
+	if (mount_flags & MNT_NOEXEC)
+		ms_flags |= MS_NOEXEC;
+	if (mount_flags & MNT_NOSUID)
+		ms_flags |= MS_NOSUID;
+	if (mount_flags & MNT_NODEV)
+		ms_flags |= MS_NODEV;
+	if (mount_flags & MNT_NOATIME)
+		ms_flags |= MS_NOATIME;
+
+	label[-1] = '@';
+	fd = hfuse_mount(devpath, "fuse.hammer2", mountpt, ms_flags);
+	if (fd < 0)
+		exit(1);
+	if (foreground == 0 && daemon(0, 0) < 0) {
+		perror("daemon");
 		exit(1);
 	}
-#endif
-	free(devpath);
+	hfuse_main(fd, &hammer2_fuse_ops, nthreads);
 
-	/*
-	 * XXX fork a backgrounded reconnector process to handle connection
-	 *     failures.
-	 */
+	hammer2_media_cache_cleanup();
+	hammer2_cleanup_volumes();
+	free(devpath);
 
 	return (0);
 }
 
-/*
- * Connect to the cluster controller.  We can connect to a local or remote
- * cluster controller, depending.  For a multi-node cluster we always want
- * to connect to the local controller and let it maintain the connections
- * to the multiple remote nodes.
- */
-static
-int
-cluster_connect(const char *volume __unused)
-{
-	struct sockaddr_in lsin;
-	int fd;
-
-	/*
-	 * This starts the hammer2 service if it isn't already running,
-	 * so we can connect to it.
-	 */
-	system("/sbin/hammer2 -q service");
-
-	/*
-	 * Connect us to the service but leave the rest to the kernel.
-	 * If the connection is lost during the mount
-	 */
-	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("socket");
-		return(-1);
-	}
-	bzero(&lsin, sizeof(lsin));
-	lsin.sin_family = AF_INET;
-	lsin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-	lsin.sin_port = htons(DMSG_LISTEN_PORT);
-
-	if (connect(fd, (struct sockaddr *)&lsin, sizeof(lsin)) < 0) {
-		close(fd);
-		fprintf(stderr, "mount_hammer2: unable to connect to "
-				"cluster controller\n");
-		return(-1);
-	}
-
-	return(fd);
-}
-
 static
 void
 usage(const char *ctl, ...)
@@ -268,9 +225,8 @@ usage(const char *ctl, ...)
 	vfprintf(stderr, ctl, va);
 	va_end(va);
 	fprintf(stderr, "\n");
-	fprintf(stderr, " mount_hammer2 [-o options] special[@label] node\n");
-	fprintf(stderr, " mount_hammer2 [-o options] @label node\n");
-	fprintf(stderr, " mount_hammer2 -u [-o options] node\n");
+	fprintf(stderr, " mount_hammer2 [-fM] [-j nthreads] [-o options] "
+			"special[@label] node\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "options:\n"
 			" <standard_mount_options>\n"
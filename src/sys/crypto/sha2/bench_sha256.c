@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Verify and time the SHA-256 implementations in sha2.c.
+ *
+ * bench_sha256 [-i impl] [-n megabytes] [size ...]
+ *
+ * Every implementation supported by the CPU is checked against the C
+ * transform for a range of lengths and alignments, through both the
+ * SHA256_Update() and SHA256_Batch() interfaces.  Then the throughput of
+ * one stream and of batches of 64 messages is reported per size.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <crypto/sha2/sha2.h>
+
+#define BUFSIZE		(4 * 1024 * 1024)
+#define BATCH		64
+
+static const char *Impls[] = { "c", "shani", "avx2", NULL };
+
+static void usage(void);
+
+static
+void
+sha256(const u_int8_t *data, size_t len, u_int8_t *digest)
+{
+	SHA256_CTX ctx;
+
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, data, len);
+	SHA256_Final(digest, &ctx);
+}
+
+static
+int
+verify(const u_int8_t *buf, u_int8_t (*ref)[SHA256_DIGEST_LENGTH],
+       size_t nref)
+{
+	static const u_int8_t abc[SHA256_DIGEST_LENGTH] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+		0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+		0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+		0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+	};
+	SHA256_JOB *jobs;
+	SHA256_CTX ctx;
+	u_int8_t digest[SHA256_DIGEST_LENGTH];
+	size_t len;
+	size_t i;
+	int bad = 0;
+
+	sha256((const u_int8_t *)"abc", 3, digest);
+	if (bcmp(digest, abc, sizeof(digest)) != 0) {
+		printf("    \"abc\" mismatch\n");
+		++bad;
+	}
+
+	/* one shot, at odd alignments */
+	for (len = 0; len < nref; ++len) {
+		sha256(buf + (len & 7), len, digest);
+		if (bcmp(digest, ref[len], sizeof(digest)) != 0) {
+			printf("    mismatch len %zu\n", len);
+			++bad;
+		}
+	}
+
+	/* piecemeal updates */
+	SHA256_Init(&ctx);
+	for (i = 0, len = 0; len + i <= nref - 1; len += i, ++i)
+		SHA256_Update(&ctx, buf + 7 + len, i);
+	SHA256_Update(&ctx, buf + 7 + len, nref - 1 - len);
+	SHA256_Final(digest, &ctx);
+	if (bcmp(digest, ref[nref], sizeof(digest)) != 0) {
+		printf("    piecemeal update mismatch\n");
+		++bad;
+	}
+
+	/* batches of mixed lengths */
+	jobs = calloc(nref, sizeof(*jobs));
+	for (len = 0; len < nref; ++len) {
+		jobs[len].data = buf + (len & 7);
+		jobs[len].len = len;
+	}
+	SHA256_Batch(jobs, nref);
+	for (len = 0; len < nref; ++len) {
+		if (bcmp(jobs[len].digest, ref[len], sizeof(digest)) != 0) {
+			printf("    batch mismatch len %zu\n", len);
+			++bad;
+		}
+	}
+	free(jobs);
+
+	return(bad);
+}
+
+static
+double
+elapsed(struct timeval *tv1)
+{
+	struct timeval tv2;
+	double secs;
+
+	gettimeofday(&tv2, NULL);
+	secs = (tv2.tv_sec - tv1->tv_sec) +
+	       (tv2.tv_usec - tv1->tv_usec) / 1000000.0;
+	return(secs > 0.0 ? secs : 1e-6);
+}
+
+static
+void
+bench(const u_int8_t *buf, size_t size, long total)
+{
+	struct timeval tv1;
+	SHA256_JOB jobs[BATCH];
+	u_int8_t digest[SHA256_DIGEST_LENGTH];
+	double single;
+	double batch;
+	long loops;
+	long n;
+	int i;
+
+	loops = total / size;
+	if (loops < BATCH)
+		loops = BATCH;
+
+	gettimeofday(&tv1, NULL);
+	for (n = 0; n < loops; ++n)
+		sha256(buf + (n % BATCH) * size % (BUFSIZE - size), size,
+		       digest);
+	single = (double)size * loops / elapsed(&tv1) / 1000000.0;
+
+	for (i = 0; i < BATCH; ++i) {
+		jobs[i].data = buf + i * size % (BUFSIZE - size);
+		jobs[i].len = size;
+	}
+	gettimeofday(&tv1, NULL);
+	for (n = 0; n < loops; n += BATCH)
+		SHA256_Batch(jobs, BATCH);
+	batch = (double)size * n / elapsed(&tv1) / 1000000.0;
+
+	printf("    %8zu bytes %10.1f MB/s %10.1f MB/s batched\n",
+		size, single, batch);
+}
+
+int
+main(int ac, char **av)
+{
+	static const size_t defsizes[] = { 512, 4096, 16384, 65536 };
+	u_int8_t (*ref)[SHA256_DIGEST_LENGTH];
+	u_int8_t *buf;
+	const char *impl = NULL;
+	const char *best;
+	size_t nref = 1100;
+	size_t *sizes;
+	size_t nsizes;
+	size_t i;
+	long total = 256;
+	int bad = 0;
+	int ch;
+	int j;
+
+	while ((ch = getopt(ac, av, "i:n:")) != -1) {
+		switch(ch) {
+		case 'i':
+			impl = optarg;
+			break;
+		case 'n':
+			total = strtol(optarg, NULL, 0);
+			if (total < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	ac -= optind;
+	av += optind;
+
+	if (ac) {
+		nsizes = ac;
+		sizes = calloc(nsizes, sizeof(*sizes));
+		for (i = 0; i < nsizes; ++i) {
+			sizes[i] = strtoul(av[i], NULL, 0);
+			if (sizes[i] == 0 || sizes[i] > BUFSIZE / 2)
+				usage();
+		}
+	} else {
+		nsizes = sizeof(defsizes) / sizeof(defsizes[0]);
+		sizes = calloc(nsizes, sizeof(*sizes));
+		memcpy(sizes, defsizes, sizeof(defsizes));
+	}
+
+	buf = malloc(BUFSIZE);
+	srandom(1);
+	for (i = 0; i < BUFSIZE; ++i)
+		buf[i] = random();
+
+	/* reference digests from the C transform */
+	best = sha256_impl();
+	printf("default implementation: %s\n", best);
+	sha256_select("c");
+	ref = calloc(nref + 1, sizeof(*ref));
+	for (i = 0; i < nref; ++i)
+		sha256(buf + (i & 7), i, ref[i]);
+	sha256(buf + 7, nref - 1, ref[nref]);
+
+	for (j = 0; Impls[j]; ++j) {
+		if (impl && strcmp(impl, Impls[j]) != 0)
+			continue;
+		if (sha256_select(Impls[j]) < 0) {
+			printf("%s: not supported\n", Impls[j]);
+			continue;
+		}
+		printf("%s:\n", Impls[j]);
+		if (verify(buf, ref, nref)) {
+			++bad;
+			continue;
+		}
+		for (i = 0; i < nsizes; ++i)
+			bench(buf, sizes[i], total * 1000000);
+	}
+	sha256_select(best);
+
+	return(bad ? 1 : 0);
+}
+
+static
+void
+usage(void)
+{
+	fprintf(stderr, "bench_sha256 [-i impl] [-n megabytes] [size ...]\n");
+	exit(1);
+}
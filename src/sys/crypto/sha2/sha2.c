@@ -363,7 +363,7 @@ void SHA256_Init(SHA256_CTX* context) {
 	(h) = T1 + Sigma0_256(a) + Maj((a), (b), (c)); \
 	j++
 
-void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+static void SHA256_Transform_C(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word32	T1, *W256;
 	int		j;
@@ -421,7 +421,7 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 
 #else /* SHA2_UNROLL_TRANSFORM */
 
-void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+static void SHA256_Transform_C(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word32	T1, T2, *W256;
 	int		j;
@@ -501,8 +501,417 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 
 #endif /* SHA2_UNROLL_TRANSFORM */
 
+/*** SHA-256 ACCELERATED TRANSFORMS ***********************************/
+/*
+ * SHA256_Transform() and SHA256_Update() hash whole blocks through
+ * sha256_blocks, selected once at startup:
+ *
+ *   c		The reference C transform above.
+ *   shani	Intel SHA extensions (sha256rnds2/sha256msg1/sha256msg2).
+ *
+ * SHA256_Batch() additionally has an AVX2 multi-buffer mode which runs
+ * eight independent messages through one 8-lane transform.  It is used
+ * when AVX2 is present but the SHA extensions are not, since a single
+ * SHA-NI stream is faster than eight AVX2 lanes.
+ */
+static void sha256_blocks_c(SHA256_CTX*, const sha2_byte*, size_t);
+
+static void (*sha256_blocks)(SHA256_CTX*, const sha2_byte*, size_t) =
+	sha256_blocks_c;
+static int sha256_multibuf;
+static const char *sha256_name = "c";
+
+static void sha256_blocks_c(SHA256_CTX* context, const sha2_byte *data, size_t blocks) {
+	while (blocks--) {
+		SHA256_Transform_C(context, (const sha2_word32*)data);
+		data += SHA256_BLOCK_LENGTH;
+	}
+}
+
+void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+	sha256_blocks(context, (const sha2_byte*)data, 1);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_KERNEL)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+/*
+ * One group of four rounds.  cur holds W[4g..4g+3], prev the group
+ * before it.  msg2 completes W for the next group in next and msg1
+ * starts the schedule three groups ahead in prev.
+ */
+#define SHANI_QUAD(g, cur, next, prev, domsg2, domsg1)			\
+	msg = _mm_add_epi32(cur,					\
+		_mm_loadu_si128((const __m128i*)&K256[4 * (g)]));	\
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);		\
+	if (domsg2) {							\
+		tmp = _mm_alignr_epi8(cur, prev, 4);			\
+		next = _mm_add_epi32(next, tmp);			\
+		next = _mm_sha256msg2_epu32(next, cur);			\
+	}								\
+	msg = _mm_shuffle_epi32(msg, 0x0E);				\
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);		\
+	if (domsg1)							\
+		prev = _mm_sha256msg1_epu32(prev, cur)
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(SHA256_CTX* context, const sha2_byte *data, size_t blocks) {
+	const __m128i	mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					      0x0405060700010203ULL);
+	__m128i		state0, state1, msg, tmp;
+	__m128i		m0, m1, m2, m3;
+	__m128i		abef, cdgh;
+
+	/* Rearrange the state into ABEF/CDGH order */
+	tmp = _mm_loadu_si128((const __m128i*)&context->state[0]);
+	state1 = _mm_loadu_si128((const __m128i*)&context->state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);
+	state1 = _mm_shuffle_epi32(state1, 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	while (blocks--) {
+		abef = state0;
+		cdgh = state1;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), mask);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+
+		SHANI_QUAD(0,  m0, m1, m3, 0, 0);
+		SHANI_QUAD(1,  m1, m2, m0, 0, 1);
+		SHANI_QUAD(2,  m2, m3, m1, 0, 1);
+		SHANI_QUAD(3,  m3, m0, m2, 1, 1);
+		SHANI_QUAD(4,  m0, m1, m3, 1, 1);
+		SHANI_QUAD(5,  m1, m2, m0, 1, 1);
+		SHANI_QUAD(6,  m2, m3, m1, 1, 1);
+		SHANI_QUAD(7,  m3, m0, m2, 1, 1);
+		SHANI_QUAD(8,  m0, m1, m3, 1, 1);
+		SHANI_QUAD(9,  m1, m2, m0, 1, 1);
+		SHANI_QUAD(10, m2, m3, m1, 1, 1);
+		SHANI_QUAD(11, m3, m0, m2, 1, 1);
+		SHANI_QUAD(12, m0, m1, m3, 1, 1);
+		SHANI_QUAD(13, m1, m2, m0, 1, 0);
+		SHANI_QUAD(14, m2, m3, m1, 1, 0);
+		SHANI_QUAD(15, m3, m0, m2, 0, 0);
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+		data += SHA256_BLOCK_LENGTH;
+	}
+
+	/* And back to ABCD/EFGH */
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+	_mm_storeu_si128((__m128i*)&context->state[0], state0);
+	_mm_storeu_si128((__m128i*)&context->state[4], state1);
+}
+
+#undef SHANI_QUAD
+
+#define ROTR8x(x,n)	_mm256_or_si256(_mm256_srli_epi32((x), (n)), \
+				_mm256_slli_epi32((x), 32 - (n)))
+#define Sigma0_8x(x)	_mm256_xor_si256(ROTR8x((x), 2), \
+			_mm256_xor_si256(ROTR8x((x), 13), ROTR8x((x), 22)))
+#define Sigma1_8x(x)	_mm256_xor_si256(ROTR8x((x), 6), \
+			_mm256_xor_si256(ROTR8x((x), 11), ROTR8x((x), 25)))
+#define sigma0_8x(x)	_mm256_xor_si256(ROTR8x((x), 7), \
+			_mm256_xor_si256(ROTR8x((x), 18), _mm256_srli_epi32((x), 3)))
+#define sigma1_8x(x)	_mm256_xor_si256(ROTR8x((x), 17), \
+			_mm256_xor_si256(ROTR8x((x), 19), _mm256_srli_epi32((x), 10)))
+
+/*
+ * Load 8 words from each of the 8 lanes and transpose them so that
+ * w[j] holds word j of every lane, in host byte order.
+ */
+__attribute__((target("avx2")))
+static inline void sha256_x8_load(__m256i *w, const sha2_byte * const *p, int off) {
+	const __m256i	bswap = _mm256_set_epi8(
+				12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+				12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i		r[8], t[8], u[8];
+	int		i;
+
+	for (i = 0; i < 8; i++)
+		r[i] = _mm256_loadu_si256((const __m256i*)(p[i] + off));
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; i++) {
+		w[i] = _mm256_shuffle_epi8(
+			_mm256_permute2x128_si256(u[i], u[i + 4], 0x20), bswap);
+		w[i + 4] = _mm256_shuffle_epi8(
+			_mm256_permute2x128_si256(u[i], u[i + 4], 0x31), bswap);
+	}
+}
+
+/*
+ * Run blocks blocks of each of 8 independent messages through the
+ * compression function.  state[j] holds word j of the 8 lane states.
+ */
+__attribute__((target("avx2")))
+static void sha256_x8_avx2(sha2_word32 state[8][8], const sha2_byte * const *p, size_t blocks) {
+	const sha2_byte	*lp[8];
+	__m256i		s[8], v[8], w[16];
+	__m256i		T1, T2;
+	int		i, j;
+
+	for (i = 0; i < 8; i++) {
+		s[i] = _mm256_loadu_si256((const __m256i*)state[i]);
+		lp[i] = p[i];
+	}
+	while (blocks--) {
+		sha256_x8_load(&w[0], lp, 0);
+		sha256_x8_load(&w[8], lp, 32);
+		for (i = 0; i < 8; i++) {
+			v[i] = s[i];
+			lp[i] += SHA256_BLOCK_LENGTH;
+		}
+		for (j = 0; j < 64; j++) {
+			if (j >= 16) {
+				w[j & 15] = _mm256_add_epi32(w[j & 15],
+				    _mm256_add_epi32(
+					_mm256_add_epi32(sigma1_8x(w[(j + 14) & 15]),
+							 w[(j + 9) & 15]),
+					sigma0_8x(w[(j + 1) & 15])));
+			}
+			T1 = _mm256_add_epi32(
+				_mm256_add_epi32(v[7], Sigma1_8x(v[4])),
+				_mm256_add_epi32(
+				    _mm256_xor_si256(_mm256_and_si256(v[4], v[5]),
+						     _mm256_andnot_si256(v[4], v[6])),
+				    _mm256_add_epi32(_mm256_set1_epi32(K256[j]),
+						     w[j & 15])));
+			T2 = _mm256_add_epi32(Sigma0_8x(v[0]),
+				_mm256_xor_si256(_mm256_and_si256(v[0], v[1]),
+				    _mm256_and_si256(v[2],
+					_mm256_xor_si256(v[0], v[1]))));
+			v[7] = v[6];
+			v[6] = v[5];
+			v[5] = v[4];
+			v[4] = _mm256_add_epi32(v[3], T1);
+			v[3] = v[2];
+			v[2] = v[1];
+			v[1] = v[0];
+			v[0] = _mm256_add_epi32(T1, T2);
+		}
+		for (i = 0; i < 8; i++)
+			s[i] = _mm256_add_epi32(s[i], v[i]);
+	}
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i*)state[i], s[i]);
+}
+
+#undef ROTR8x
+#undef Sigma0_8x
+#undef Sigma1_8x
+#undef sigma0_8x
+#undef sigma1_8x
+
+static int sha256_cpu_has(const char *name) {
+	unsigned int	eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return 0;
+	if (strcmp(name, "shani") == 0) {
+		if ((ecx & bit_SSE4_1) == 0 ||
+		    __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) == 0)
+			return 0;
+		return (ebx & bit_SHA) != 0;
+	}
+	if (strcmp(name, "avx2") == 0) {
+		/* The OS must also save the YMM state */
+		if ((ecx & bit_OSXSAVE) == 0 || (ecx & bit_AVX) == 0)
+			return 0;
+		__asm __volatile("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+		if ((eax & 6) != 6 ||
+		    __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) == 0)
+			return 0;
+		return (ebx & bit_AVX2) != 0;
+	}
+	return 0;
+}
+
+#else /* __x86_64__ */
+
+static int sha256_cpu_has(const char *name) {
+	return 0;
+}
+
+#endif /* __x86_64__ */
+
+/*
+ * Select the SHA-256 implementation, "c", "shani" or "avx2" (the C
+ * transform plus multi-buffer SHA256_Batch()).  A NULL name picks the
+ * fastest one available.  Returns 0 on success, -1 if the CPU does not
+ * support the requested implementation.
+ */
+int sha256_select(const char *name) {
+	if (name == NULL) {
+		if (sha256_select("shani") == 0 || sha256_select("avx2") == 0)
+			return 0;
+		name = "c";
+	}
+	if (strcmp(name, "c") == 0) {
+		sha256_blocks = sha256_blocks_c;
+		sha256_multibuf = 0;
+	}
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_KERNEL)
+	else if (strcmp(name, "shani") == 0 && sha256_cpu_has(name)) {
+		sha256_blocks = sha256_blocks_shani;
+		sha256_multibuf = 0;
+	} else if (strcmp(name, "avx2") == 0 && sha256_cpu_has(name)) {
+		sha256_blocks = sha256_blocks_c;
+		sha256_multibuf = 1;
+	}
+#endif
+	else {
+		return -1;
+	}
+	sha256_name = name;
+	return 0;
+}
+
+const char *sha256_impl(void) {
+	return sha256_name;
+}
+
+static void sha256_init(void) __attribute__((constructor));
+
+static void sha256_init(void) {
+	sha256_select(NULL);
+}
+
+/*
+ * Complete a message whose first "done" bytes have been hashed into
+ * state, from a fresh context (used by SHA256_Batch()).
+ */
+static void sha256_finish(SHA256_JOB *job, const sha2_word32 *state, size_t done) {
+	SHA256_CTX	context;
+
+	bcopy(state, context.state, sizeof(context.state));
+	context.bitcount = (sha2_word64)done << 3;
+	SHA256_Update(&context, job->data + done, job->len - done);
+	SHA256_Final(job->digest, &context);
+}
+
+/*
+ * Hash count independent messages, storing each digest in its job.
+ * With the AVX2 multi-buffer engine eight messages are in flight at a
+ * time, a lane is refilled with the next job as soon as its message
+ * runs out of whole blocks.  Messages of similar size (e.g. 16KB-64KB
+ * records) keep all lanes busy.
+ */
+void SHA256_Batch(SHA256_JOB *jobs, int count) {
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_KERNEL)
+	sha2_word32	state[8][8];
+	sha2_word32	lstate[8];
+	SHA256_JOB	*lane[8];
+	const sha2_byte	*lp[8];
+	size_t		left[8];
+	size_t		n;
+	int		active;
+	int		next;
+	int		i, j;
+
+	if (sha256_multibuf == 0)
+		goto serial;
+
+	next = 0;
+	for (i = 0; i < 8; i++)
+		lane[i] = NULL;
+
+	for (;;) {
+		/* Refill idle lanes, messages with no whole block go serial */
+		active = 0;
+		for (i = 0; i < 8; i++) {
+			while (lane[i] == NULL && next < count) {
+				if (jobs[next].len < SHA256_BLOCK_LENGTH) {
+					sha256_finish(&jobs[next],
+						      sha256_initial_hash_value, 0);
+				} else {
+					lane[i] = &jobs[next];
+					lp[i] = lane[i]->data;
+					left[i] = lane[i]->len / SHA256_BLOCK_LENGTH;
+					for (j = 0; j < 8; j++)
+						state[j][i] = sha256_initial_hash_value[j];
+				}
+				next++;
+			}
+			if (lane[i])
+				active++;
+		}
+		if (active == 0)
+			break;
+
+		/*
+		 * Once the queue drains a mostly idle 8-lane transform is
+		 * slower than finishing the stragglers one at a time.
+		 */
+		if (active <= 2 && next == count) {
+			for (i = 0; i < 8; i++) {
+				if (lane[i] == NULL)
+					continue;
+				for (j = 0; j < 8; j++)
+					lstate[j] = state[j][i];
+				sha256_finish(lane[i], lstate,
+					      lp[i] - lane[i]->data);
+			}
+			break;
+		}
+
+		/* Idle lanes shadow an active one, their result is unused */
+		n = (size_t)-1;
+		for (i = 0; i < 8; i++) {
+			if (lane[i] && left[i] < n)
+				n = left[i];
+		}
+		for (i = 0; i < 8; i++) {
+			if (lane[i])
+				continue;
+			for (j = 0; lane[j] == NULL; j++)
+				;
+			lp[i] = lp[j];
+		}
+		sha256_x8_avx2(state, lp, n);
+
+		for (i = 0; i < 8; i++) {
+			if (lane[i] == NULL)
+				continue;
+			lp[i] += n * SHA256_BLOCK_LENGTH;
+			left[i] -= n;
+			if (left[i])
+				continue;
+			for (j = 0; j < 8; j++)
+				lstate[j] = state[j][i];
+			sha256_finish(lane[i], lstate, lp[i] - lane[i]->data);
+			lane[i] = NULL;
+		}
+	}
+	return;
+serial:
+#endif
+	while (count--) {
+		sha256_finish(jobs, sha256_initial_hash_value, 0);
+		jobs++;
+	}
+}
+
 void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
 	unsigned int	freespace, usedspace;
+	size_t		blocks;
 
 	if (len == 0) {
 		/* Calling with no data is valid - we do nothing */
@@ -533,12 +942,13 @@ void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
 			return;
 		}
 	}
-	while (len >= SHA256_BLOCK_LENGTH) {
+	if (len >= SHA256_BLOCK_LENGTH) {
 		/* Process as many complete blocks as we can */
-		SHA256_Transform(context, (const sha2_word32*)data);
-		context->bitcount += SHA256_BLOCK_LENGTH << 3;
-		len -= SHA256_BLOCK_LENGTH;
-		data += SHA256_BLOCK_LENGTH;
+		blocks = len / SHA256_BLOCK_LENGTH;
+		sha256_blocks(context, data, blocks);
+		context->bitcount += (sha2_word64)blocks << 9;
+		len -= blocks * SHA256_BLOCK_LENGTH;
+		data += blocks * SHA256_BLOCK_LENGTH;
 	}
 	if (len > 0) {
 		/* There's left-overs, so save 'em */
@@ -112,6 +112,13 @@ typedef struct _SHA512_CTX {
 
 typedef SHA512_CTX SHA384_CTX;
 
+/* One message for SHA256_Batch() */
+typedef struct _SHA256_JOB {
+	const u_int8_t	*data;
+	size_t		len;
+	u_int8_t	digest[SHA256_DIGEST_LENGTH];
+} SHA256_JOB;
+
 
 /*** SHA-256/384/512 Function Prototypes ******************************/
 
@@ -120,6 +127,9 @@ void SHA256_Update(SHA256_CTX*, const u_int8_t*, size_t);
 void SHA256_Final(u_int8_t[SHA256_DIGEST_LENGTH], SHA256_CTX*);
 char* SHA256_End(SHA256_CTX*, char[SHA256_DIGEST_STRING_LENGTH]);
 char* SHA256_Data(const u_int8_t*, size_t, char[SHA256_DIGEST_STRING_LENGTH]);
+void SHA256_Batch(SHA256_JOB*, int);
+int sha256_select(const char*);
+const char* sha256_impl(void);
 
 void SHA384_Init(SHA384_CTX*);
 void SHA384_Update(SHA384_CTX*, const u_int8_t*, size_t);
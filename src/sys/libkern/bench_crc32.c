@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Verify and time the CRC32 (crc32.c) and CRC32C (icrc32.c)
+ * implementations.
+ *
+ * bench_crc32 [-i impl] [-n megabytes] [size ...]
+ *
+ * Every implementation supported by the CPU is first checked against a
+ * bit-at-a-time reference over a range of lengths and alignments, then
+ * the throughput of each is reported for the given buffer sizes.
+ */
+
+#include <sys/time.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "./util.h"
+
+#define BUFSIZE	262144
+
+static const struct crc_family {
+	const char	*name;
+	uint32_t	poly;
+	uint32_t	check;		/* crc of "123456789" */
+	const char	*impls[4];
+	int		(*select)(const char *);
+	const char	*(*impl)(void);
+	uint32_t	(*crc)(const void *, size_t);
+	uint32_t	(*crc_ext)(const void *, size_t, uint32_t);
+} Families[] = {
+	{ "crc32", 0xEDB88320U, 0xCBF43926U,
+	  { "byte", "sb16", "pclmul", NULL },
+	  crc32_select, crc32_impl, crc32, crc32_ext },
+	{ "crc32c", 0x82F63B78U, 0xE3069283U,
+	  { "soft", "sse42", "pclmul", NULL },
+	  crc32c_select, crc32c_impl, iscsi_crc32, iscsi_crc32_ext },
+};
+
+static void usage(void);
+
+static
+uint32_t
+ref_crc(const struct crc_family *fam, const unsigned char *p, size_t length)
+{
+	uint32_t crc = ~0U;
+	int i;
+
+	while (length--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; ++i)
+			crc = (crc >> 1) ^ ((crc & 1) ? fam->poly : 0);
+	}
+	return(~crc);
+}
+
+static
+int
+verify(const struct crc_family *fam, const unsigned char *buf)
+{
+	static const size_t big[] = { 3 * 256, 3 * 8192, 3 * 8192 + 3 * 256,
+				      65536, 65536 + 777, 200000 };
+	uint32_t crc, ref;
+	size_t len;
+	size_t i;
+	int align;
+	int bad = 0;
+
+	if (fam->crc("123456789", 9) != fam->check) {
+		printf("    check value mismatch\n");
+		++bad;
+	}
+	for (align = 0; align < 16; ++align) {
+		for (len = 0; len <= 1600; ++len) {
+			ref = ref_crc(fam, buf + align, len);
+			crc = fam->crc(buf + align, len);
+			if (crc != ref) {
+				printf("    mismatch len %zu align %d\n",
+					len, align);
+				++bad;
+			}
+		}
+		for (i = 0; i < sizeof(big) / sizeof(big[0]); ++i) {
+			len = big[i] - align;
+			ref = ref_crc(fam, buf + align, len);
+			crc = fam->crc(buf + align, len);
+			if (crc != ref) {
+				printf("    mismatch len %zu align %d\n",
+					len, align);
+				++bad;
+			}
+		}
+	}
+	/* the _ext API must chain */
+	crc = fam->crc_ext(buf + 1000, 60000, fam->crc(buf, 1000));
+	if (crc != fam->crc(buf, 61000)) {
+		printf("    %s_ext chaining mismatch\n", fam->name);
+		++bad;
+	}
+	if (fam->crc == crc32) {
+		for (len = 0; len <= 70000; len += 997) {
+			crc = crc32_ext_combine(crc32(buf, 1234),
+					    crc32(buf + 1234, len), len);
+			if (crc != crc32(buf, 1234 + len)) {
+				printf("    crc32_ext_combine mismatch len %zu\n",
+					len);
+				++bad;
+			}
+		}
+	}
+	return(bad);
+}
+
+static
+void
+bench(const struct crc_family *fam, const unsigned char *buf, size_t size,
+      long total)
+{
+	struct timeval tv1, tv2;
+	volatile uint32_t crc = 0;
+	double secs;
+	long loops;
+	long n;
+
+	loops = total / size;
+	if (loops < 1)
+		loops = 1;
+	gettimeofday(&tv1, NULL);
+	for (n = 0; n < loops; ++n)
+		crc ^= fam->crc(buf, size);
+	gettimeofday(&tv2, NULL);
+
+	secs = (tv2.tv_sec - tv1.tv_sec) +
+	       (tv2.tv_usec - tv1.tv_usec) / 1000000.0;
+	if (secs <= 0.0)
+		secs = 1e-6;
+	printf("    %8zu bytes %10.1f MB/s\n",
+		size, (double)size * loops / secs / 1000000.0);
+}
+
+int
+main(int ac, char **av)
+{
+	static const size_t defsizes[] = { 64, 512, 4096, 16384, 65536 };
+	const struct crc_family *fam;
+	unsigned char *buf;
+	const char *impl = NULL;
+	const char *best;
+	size_t *sizes;
+	size_t nsizes;
+	size_t i;
+	long total = 256;
+	int bad = 0;
+	int ch;
+	int f;
+	int j;
+
+	while ((ch = getopt(ac, av, "i:n:")) != -1) {
+		switch(ch) {
+		case 'i':
+			impl = optarg;
+			break;
+		case 'n':
+			total = strtol(optarg, NULL, 0);
+			if (total < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	ac -= optind;
+	av += optind;
+
+	if (ac) {
+		nsizes = ac;
+		sizes = calloc(nsizes, sizeof(*sizes));
+		for (i = 0; i < nsizes; ++i) {
+			sizes[i] = strtoul(av[i], NULL, 0);
+			if (sizes[i] == 0)
+				usage();
+			if (sizes[i] > BUFSIZE)
+				sizes[i] = BUFSIZE;
+		}
+	} else {
+		nsizes = sizeof(defsizes) / sizeof(defsizes[0]);
+		sizes = calloc(nsizes, sizeof(*sizes));
+		memcpy(sizes, defsizes, sizeof(defsizes));
+	}
+
+	buf = malloc(BUFSIZE);
+	srandom(1);
+	for (i = 0; i < BUFSIZE; ++i)
+		buf[i] = random();
+
+	for (f = 0; f < (int)(sizeof(Families) / sizeof(Families[0])); ++f) {
+		fam = &Families[f];
+		best = fam->impl();
+		printf("%s: default implementation %s\n", fam->name, best);
+
+		for (j = 0; fam->impls[j]; ++j) {
+			if (impl && strcmp(impl, fam->impls[j]) != 0)
+				continue;
+			if (fam->select(fam->impls[j]) < 0) {
+				printf("  %s: not supported\n", fam->impls[j]);
+				continue;
+			}
+			printf("  %s:\n", fam->impls[j]);
+			if (verify(fam, buf)) {
+				++bad;
+				continue;
+			}
+			for (i = 0; i < nsizes; ++i)
+				bench(fam, buf, sizes[i], total * 1000000);
+		}
+		fam->select(best);
+	}
+
+	return(bad ? 1 : 0);
+}
+
+static
+void
+usage(void)
+{
+	fprintf(stderr, "bench_crc32 [-i impl] [-n megabytes] [size ...]\n");
+	exit(1);
+}
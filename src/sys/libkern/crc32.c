@@ -50,6 +50,10 @@
 
 #include "./util.h"
 
+#ifndef _KERNEL
+#include <string.h>
+#endif
+
 #if 0
 /* see icrc32.c */
 const uint32_t crc32_tab[] = {
@@ -99,33 +103,326 @@ const uint32_t crc32_tab[] = {
 };
 #endif
 
-uint32_t
-crc32(const void *buf, size_t size)
-{
-	const uint8_t *p;
-	uint32_t crc;
+/*
+ * The register update below is the non-inverting form, crc32() and
+ * crc32_ext() do the inversion.  Three implementations are provided and
+ * one is selected once at startup:
+ *
+ *  byte	The classic byte-at-a-time crc32_tab loop.
+ *  sb16	Slicing-by-16, 16 table lookups per 16 bytes of input.  The
+ *		extra 15 tables are derived from crc32_tab at startup.
+ *  pclmul	PCLMULQDQ folding (Intel, "Fast CRC Computation for Generic
+ *		Polynomials Using PCLMULQDQ Instruction") of 64 bytes per
+ *		iteration followed by a Barrett reduction, for buffers of
+ *		64 bytes or more.  The tail is handled by sb16.
+ */
+#define CRC32_POLY	0xEDB88320U
+
+typedef uint32_t (*crc32_func_t)(uint32_t, const uint8_t *, size_t);
 
-	p = buf;
-	crc = ~0U;
+static uint32_t crc32_sb16_tab[16][256];
+static uint32_t crc32_x2n_tab[32];
 
+static
+uint32_t
+byte_crc32(uint32_t crc, const uint8_t *p, size_t size)
+{
 	while (size--)
 		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return(crc);
+}
+
+static
+uint32_t
+sb16_crc32(uint32_t crc, const uint8_t *p, size_t size)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	const uint32_t (*t)[256] = (const uint32_t (*)[256])crc32_sb16_tab;
+	uint32_t w[4];
 
-	return crc ^ ~0U;
+	while (size >= 16) {
+		memcpy(w, p, sizeof(w));
+		w[0] ^= crc;
+		crc = t[15][w[0] & 0xFF] ^ t[14][(w[0] >> 8) & 0xFF] ^
+		      t[13][(w[0] >> 16) & 0xFF] ^ t[12][w[0] >> 24] ^
+		      t[11][w[1] & 0xFF] ^ t[10][(w[1] >> 8) & 0xFF] ^
+		      t[9][(w[1] >> 16) & 0xFF] ^ t[8][w[1] >> 24] ^
+		      t[7][w[2] & 0xFF] ^ t[6][(w[2] >> 8) & 0xFF] ^
+		      t[5][(w[2] >> 16) & 0xFF] ^ t[4][w[2] >> 24] ^
+		      t[3][w[3] & 0xFF] ^ t[2][(w[3] >> 8) & 0xFF] ^
+		      t[1][(w[3] >> 16) & 0xFF] ^ t[0][w[3] >> 24];
+		p += 16;
+		size -= 16;
+	}
+#endif
+	return(byte_crc32(crc, p, size));
 }
 
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_KERNEL)
+
+#include <cpuid.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+
+/*
+ * Folding constants for the reflected polynomial, see the Intel paper.
+ * k1/k2 fold across 512 bits, k3/k4 across 128 bits, k5 performs the
+ * final 64->32 bit fold and mu/poly are the Barrett reduction constants.
+ */
+#define CRC32_K1	0x154442BD4ULL
+#define CRC32_K2	0x1C6E41596ULL
+#define CRC32_K3	0x1751997D0ULL
+#define CRC32_K4	0x0CCAA009EULL
+#define CRC32_K5	0x163CD6124ULL
+#define CRC32_MU	0x1F7011641ULL
+#define CRC32_P		0x1DB710641ULL
+
+__attribute__((target("sse4.1,pclmul")))
+static
 uint32_t
-crc32_ext(const void *buf, size_t size, uint32_t ocrc)
+pclmul_crc32(uint32_t crc, const uint8_t *p, size_t size)
 {
-	const uint8_t *p;
-	uint32_t crc;
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7;
+	__m128i k, mask32;
+	size_t n;
 
-	p = buf;
-	crc = ~ocrc;
+	if (size < 64)
+		return(sb16_crc32(crc, p, size));
+	n = size & ~(size_t)15;
 
-	while (size--)
-		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 64;
+	n -= 64;
+
+	/*
+	 * Fold 4x128 bits at a time
+	 */
+	k = _mm_set_epi64x(CRC32_K2, CRC32_K1);
+	while (n >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+		x0 = _mm_clmulepi64_si128(x4, k, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+			_mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+			_mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+			_mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x0),
+			_mm_loadu_si128((const __m128i *)(p + 0x30)));
+		p += 64;
+		n -= 64;
+	}
+
+	/*
+	 * Fold into 128 bits, then consume any remaining 16 byte blocks
+	 */
+	k = _mm_set_epi64x(CRC32_K4, CRC32_K3);
+	x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), x2);
+	x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), x3);
+	x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), x4);
+	while (n >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+			_mm_loadu_si128((const __m128i *)p));
+		p += 16;
+		n -= 16;
+	}
+
+	/*
+	 * Fold 128 -> 64 -> 32 bits and Barrett-reduce
+	 */
+	mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+	k = _mm_set_epi64x(0, CRC32_K5);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
 
-	return crc ^ ~0U;
+	k = _mm_set_epi64x(CRC32_MU, CRC32_P);
+	x2 = x1;
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	crc = _mm_extract_epi32(x1, 1);
+
+	return(sb16_crc32(crc, p, size & 15));
 }
 
+#endif
+
+static const struct {
+	const char	*name;
+	crc32_func_t	func;
+} crc32_impls[] = {
+	{ "byte",	byte_crc32 },
+	{ "sb16",	sb16_crc32 },
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_KERNEL)
+	{ "pclmul",	pclmul_crc32 },
+#endif
+	{ NULL,		NULL }
+};
+
+static crc32_func_t crc32_func = byte_crc32;
+static const char *crc32_name = "byte";
+
+static
+int
+crc32_supported(const char *name)
+{
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_KERNEL)
+	unsigned int eax, ebx, ecx, edx;
+
+	if (strcmp(name, "pclmul") == 0) {
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+			return(0);
+		return((ecx & bit_SSE4_1) && (ecx & bit_PCLMUL));
+	}
+#endif
+	return(1);
+}
+
+/*
+ * Select the CRC32 implementation by name, returns 0 on success or -1
+ * if it does not exist or the CPU does not support it.  A NULL name picks
+ * the fastest implementation available (the last supported table entry).
+ */
+int
+crc32_select(const char *name)
+{
+	int i;
+	int n;
+
+	for (n = 0; crc32_impls[n].name; ++n)
+		;
+	for (i = n - 1; i >= 0; --i) {
+		if (name && strcmp(crc32_impls[i].name, name) != 0)
+			continue;
+		if (crc32_supported(crc32_impls[i].name) == 0)
+			continue;
+		crc32_func = crc32_impls[i].func;
+		crc32_name = crc32_impls[i].name;
+		return(0);
+	}
+	return(-1);
+}
+
+/*
+ * Return the name of the CRC32 implementation in use.
+ */
+const char *
+crc32_impl(void)
+{
+	return(crc32_name);
+}
+
+/*
+ * Multiply a and b modulo the polynomial, both bit-reflected (zlib).
+ */
+static
+uint32_t
+crc32_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31;
+	uint32_t p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+	}
+	return(p);
+}
+
+/*
+ * Return x^(n * 2^k) modulo the polynomial.
+ */
+static
+uint32_t
+crc32_x2nmodp(uint64_t n, unsigned int k)
+{
+	uint32_t p = 1U << 31;		/* x^0 */
+
+	while (n) {
+		if (n & 1)
+			p = crc32_multmodp(crc32_x2n_tab[k & 31], p);
+		n >>= 1;
+		++k;
+	}
+	return(p);
+}
+
+static void crc32_init(void) __attribute__((constructor));
+
+static
+void
+crc32_init(void)
+{
+	uint32_t c;
+	int i;
+	int j;
+
+	for (i = 0; i < 256; ++i) {
+		c = crc32_tab[i];
+		crc32_sb16_tab[0][i] = c;
+		for (j = 1; j < 16; ++j) {
+			c = crc32_tab[c & 0xFF] ^ (c >> 8);
+			crc32_sb16_tab[j][i] = c;
+		}
+	}
+	c = 1U << 30;			/* x^1 */
+	for (i = 0; i < 32; ++i) {
+		crc32_x2n_tab[i] = c;
+		c = crc32_multmodp(c, c);
+	}
+	crc32_select(NULL);
+}
+
+uint32_t
+crc32(const void *buf, size_t size)
+{
+	return(crc32_func(~0U, buf, size) ^ ~0U);
+}
+
+uint32_t
+crc32_ext(const void *buf, size_t size, uint32_t ocrc)
+{
+	return(crc32_func(~ocrc, buf, size) ^ ~0U);
+}
+
+/*
+ * Given crc1 = crc32(A) and crc2 = crc32(B), return crc32(A B) where
+ * len2 is the length of B.  This allows a large buffer to be checksummed
+ * in independent pieces (e.g. by several threads) which are then merged.
+ * crc32_ext(B, len2, crc1) is the serial equivalent.
+ */
+uint32_t
+crc32_ext_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	return(crc32_multmodp(crc32_x2nmodp(len2, 3), crc1) ^ crc2);
+}
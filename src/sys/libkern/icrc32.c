@@ -5,6 +5,10 @@
 
 #include "./util.h"
 
+#ifndef _KERNEL
+#include <string.h>
+#endif
+
 /*
  *  First, the polynomial itself and its table of feedback terms.  The
  *  polynomial is
@@ -740,6 +744,234 @@ multitable_crc32c(uint32_t crc32c,
 	return (crc32c_sb8_64_bit(crc32c, buffer, length, to_even_word));
 }
 
+/*
+ * Hardware CRC32C.  The SSE4.2 crc32 instruction implements exactly the
+ * non-inverting CRC32C register update used by calculate_crc32c(), 8 bytes
+ * per instruction.  It has a 3 cycle latency and a 1 cycle throughput, so
+ * large buffers are cut into three lanes which are run concurrently and then
+ * stitched back together with a carry-less multiply (PCLMULQDQ) by x^(8*n),
+ * n being the number of bytes following each lane.
+ *
+ * The implementation is selected once at startup.  The slicing-by-8 code
+ * above remains the fallback for other CPUs and non-x86 builds.
+ */
+typedef uint32_t (*crc32c_func_t)(uint32_t, const unsigned char *,
+			unsigned int);
+
+static uint32_t
+soft_crc32c(uint32_t crc32c, const unsigned char *buffer, unsigned int length)
+{
+	if (length < 4) {
+		return (singletable_crc32c(crc32c, buffer, length));
+	} else {
+		return (multitable_crc32c(crc32c, buffer, length));
+	}
+}
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_KERNEL)
+
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
+/*
+ * Lane sizes (bytes per lane) for the interleaved loops.  The long lanes
+ * cover HAMMER2 metadata blocks (up to 64KB), the short lanes cover
+ * inodes and small dmsg payloads.  Both must be multiples of 8.
+ */
+#define CRC32C_LONG	8192
+#define CRC32C_SHORT	256
+
+/*
+ * Folding constants, x^(8*n-33) mod P bit-reflected for n = lane and
+ * n = 2 * lane.  The -33 accounts for the one bit shift of a reflected
+ * carry-less multiply and the x^32 applied by the final crc32 reduction.
+ */
+static uint32_t crc32c_long_k1, crc32c_long_k2;
+static uint32_t crc32c_short_k1, crc32c_short_k2;
+
+static
+uint32_t
+crc32c_xpow(unsigned int n)
+{
+	uint32_t r = 0x80000000U;	/* x^0 */
+
+	while (n--)
+		r = (r >> 1) ^ ((r & 1) ? 0x82F63B78U : 0);
+	return(r);
+}
+
+__attribute__((target("sse4.2")))
+static
+uint32_t
+sse42_crc32c(uint32_t crc, const unsigned char *p, unsigned int length)
+{
+	uint64_t crc0 = crc;
+
+	while (length && ((uintptr_t)p & 7)) {
+		crc0 = _mm_crc32_u8(crc0, *p++);
+		--length;
+	}
+	while (length >= 8) {
+		crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)p);
+		p += 8;
+		length -= 8;
+	}
+	while (length) {
+		crc0 = _mm_crc32_u8(crc0, *p++);
+		--length;
+	}
+	return((uint32_t)crc0);
+}
+
+/*
+ * Shift crc0 over 2 lanes and crc1 over 1 lane and merge them into crc2.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static inline
+uint32_t
+sse42_crc32c_fold(uint64_t crc0, uint64_t crc1, uint64_t crc2,
+		  uint32_t k1, uint32_t k2)
+{
+	__m128i t0;
+	__m128i t1;
+
+	t0 = _mm_clmulepi64_si128(_mm_cvtsi32_si128((uint32_t)crc0),
+				  _mm_cvtsi32_si128(k2), 0x00);
+	t1 = _mm_clmulepi64_si128(_mm_cvtsi32_si128((uint32_t)crc1),
+				  _mm_cvtsi32_si128(k1), 0x00);
+	t0 = _mm_xor_si128(t0, t1);
+	return((uint32_t)(_mm_crc32_u64(0, _mm_cvtsi128_si64(t0)) ^ crc2));
+}
+
+#define CRC32C_3WAY(lane, k1, k2)					\
+	while (length >= 3 * (lane)) {					\
+		const uint64_t *q = (const uint64_t *)p;		\
+		uint64_t crc1 = 0;					\
+		uint64_t crc2 = 0;					\
+		unsigned int i;						\
+									\
+		for (i = 0; i < (lane) / 8; ++i) {			\
+			crc0 = _mm_crc32_u64(crc0, q[i]);		\
+			crc1 = _mm_crc32_u64(crc1, q[i + (lane) / 8]);	\
+			crc2 = _mm_crc32_u64(crc2, q[i + (lane) / 4]);	\
+		}							\
+		crc0 = sse42_crc32c_fold(crc0, crc1, crc2, k1, k2);	\
+		p += 3 * (lane);					\
+		length -= 3 * (lane);					\
+	}
+
+__attribute__((target("sse4.2,pclmul")))
+static
+uint32_t
+pclmul_crc32c(uint32_t crc, const unsigned char *p, unsigned int length)
+{
+	uint64_t crc0 = crc;
+
+	if (length < 3 * CRC32C_SHORT + 7)
+		return(sse42_crc32c(crc, p, length));
+	while ((uintptr_t)p & 7) {
+		crc0 = _mm_crc32_u8(crc0, *p++);
+		--length;
+	}
+	CRC32C_3WAY(CRC32C_LONG, crc32c_long_k1, crc32c_long_k2);
+	CRC32C_3WAY(CRC32C_SHORT, crc32c_short_k1, crc32c_short_k2);
+
+	return(sse42_crc32c((uint32_t)crc0, p, length));
+}
+
+#undef CRC32C_3WAY
+
+#endif
+
+static const struct {
+	const char	*name;
+	crc32c_func_t	func;
+} crc32c_impls[] = {
+	{ "soft",	soft_crc32c },
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_KERNEL)
+	{ "sse42",	sse42_crc32c },
+	{ "pclmul",	pclmul_crc32c },
+#endif
+	{ NULL,		NULL }
+};
+
+static crc32c_func_t crc32c_func = soft_crc32c;
+static const char *crc32c_name = "soft";
+
+/*
+ * Return non-zero if the CPU can run the named implementation.
+ */
+static
+int
+crc32c_supported(const char *name)
+{
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_KERNEL)
+	unsigned int eax, ebx, ecx, edx;
+
+	if (strcmp(name, "soft") == 0)
+		return(1);
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return(0);
+	if (strcmp(name, "sse42") == 0)
+		return((ecx & bit_SSE4_2) != 0);
+	if (strcmp(name, "pclmul") == 0)
+		return((ecx & bit_SSE4_2) && (ecx & bit_PCLMUL));
+	return(0);
+#else
+	return(strcmp(name, "soft") == 0);
+#endif
+}
+
+/*
+ * Select the CRC32C implementation by name, returns 0 on success or -1
+ * if it does not exist or the CPU does not support it.  A NULL name picks
+ * the fastest implementation available (the last supported table entry).
+ */
+int
+crc32c_select(const char *name)
+{
+	int i;
+	int n;
+
+	for (n = 0; crc32c_impls[n].name; ++n)
+		;
+	for (i = n - 1; i >= 0; --i) {
+		if (name && strcmp(crc32c_impls[i].name, name) != 0)
+			continue;
+		if (crc32c_supported(crc32c_impls[i].name) == 0)
+			continue;
+		crc32c_func = crc32c_impls[i].func;
+		crc32c_name = crc32c_impls[i].name;
+		return(0);
+	}
+	return(-1);
+}
+
+/*
+ * Return the name of the CRC32C implementation in use.
+ */
+const char *
+crc32c_impl(void)
+{
+	return(crc32c_name);
+}
+
+static void crc32c_init(void) __attribute__((constructor));
+
+static
+void
+crc32c_init(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_KERNEL)
+	crc32c_long_k1 = crc32c_xpow(8 * CRC32C_LONG - 33);
+	crc32c_long_k2 = crc32c_xpow(8 * 2 * CRC32C_LONG - 33);
+	crc32c_short_k1 = crc32c_xpow(8 * CRC32C_SHORT - 33);
+	crc32c_short_k2 = crc32c_xpow(8 * 2 * CRC32C_SHORT - 33);
+#endif
+	crc32c_select(NULL);
+}
+
 /*
  * NOTE: This version does not invert the incoming and outgoing crc.
  *	 Taken from FreeBSD verbatim, I'm not going to change the API.
@@ -751,11 +983,7 @@ calculate_crc32c(uint32_t crc32c,
     const unsigned char *buffer,
     unsigned int length)
 {
-	if (length < 4) {
-		return (singletable_crc32c(crc32c, buffer, length));
-	} else {
-		return (multitable_crc32c(crc32c, buffer, length));
-	}
+	return (crc32c_func(crc32c, buffer, length));
 }
 
 /*
@@ -42,9 +42,14 @@ extern const uint32_t crc32_tab[];
 
 uint32_t crc32(const void *buf, size_t size);
 uint32_t crc32_ext(const void *buf, size_t size, uint32_t ocrc);
+uint32_t crc32_ext_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+int crc32_select(const char *name);
+const char *crc32_impl(void);
 uint32_t iscsi_crc32(const void *buf, size_t size);
 uint32_t iscsi_crc32_ext(const void *buf, size_t size, uint32_t ocrc);
 uint32_t calculate_crc32c(uint32_t crc32c, const unsigned char *buffer,
 			unsigned int length);
+int crc32c_select(const char *name);
+const char *crc32c_impl(void);
 
 #endif /* !LIBKERN_UTIL_H_ */
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2026 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Verify and time XXH64() and the XXH64_verifyBatch() engines.
+ *
+ * bench_xxhash [-e engine] [-n megabytes] [size ...]
+ *
+ * Each engine supported by the CPU is checked against XXH64() over mixed
+ * lengths and alignments, including detection of corrupted expected
+ * values, then the throughput of a plain XXH64() loop and of batches of
+ * 64 buffers is reported per size (64KB, the HAMMER2 block size, by
+ * default).
+ */
+
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xxhash.h"
+
+#define BUFSIZE		(16 * 1024 * 1024)
+#define BATCH		64
+#define SEED		0x4d617474446c6c6eULL	/* XXH_HAMMER2_SEED */
+
+static const char *Engines[] = { "scalar", "avx512", NULL };
+
+static void usage(void);
+
+static
+int
+verify(const unsigned char *buf)
+{
+	XXH64_verify_t *jobs;
+	unsigned char *bad;
+	size_t count = 3000;
+	size_t nbad;
+	size_t i;
+	int errors = 0;
+
+	if (XXH64("", 0, 0) != 0xEF46DB3751D8E999ULL) {
+		printf("    empty input mismatch\n");
+		++errors;
+	}
+	jobs = calloc(count, sizeof(*jobs));
+	bad = calloc(count, 1);
+	for (i = 0; i < count; ++i) {
+		jobs[i].input = buf + (i * 7919) % 4096;
+		if (i < 1000)
+			jobs[i].length = i;
+		else if (i < 2000)
+			jobs[i].length = 65536 >> (i % 7);
+		else
+			jobs[i].length = (i * 104729) % 70000;
+		jobs[i].expected = XXH64(jobs[i].input, jobs[i].length, SEED);
+		if (i % 97 == 0)
+			jobs[i].expected ^= 1ULL << (i % 64);
+	}
+	nbad = XXH64_verifyBatch(jobs, count, SEED, bad);
+	if (nbad != (count + 96) / 97) {
+		printf("    %zu mismatches, expected %zu\n",
+			nbad, (count + 96) / 97);
+		++errors;
+	}
+	for (i = 0; i < count; ++i) {
+		if (bad[i] != (i % 97 == 0)) {
+			printf("    job %zu len %zu wrong result\n",
+				i, jobs[i].length);
+			++errors;
+		}
+	}
+	free(bad);
+	free(jobs);
+
+	return(errors);
+}
+
+static
+double
+elapsed(struct timeval *tv1)
+{
+	struct timeval tv2;
+	double secs;
+
+	gettimeofday(&tv2, NULL);
+	secs = (tv2.tv_sec - tv1->tv_sec) +
+	       (tv2.tv_usec - tv1->tv_usec) / 1000000.0;
+	return(secs > 0.0 ? secs : 1e-6);
+}
+
+static
+void
+bench(const unsigned char *buf, size_t size, long total)
+{
+	struct timeval tv1;
+	XXH64_verify_t jobs[BATCH];
+	volatile XXH64_hash_t h = 0;
+	double single;
+	double batch;
+	long loops;
+	long n;
+	int i;
+
+	for (i = 0; i < BATCH; ++i) {
+		jobs[i].input = buf + i * size % (BUFSIZE - size);
+		jobs[i].length = size;
+		jobs[i].expected = XXH64(jobs[i].input, size, SEED);
+	}
+	loops = total / size;
+	if (loops < BATCH)
+		loops = BATCH;
+
+	gettimeofday(&tv1, NULL);
+	for (n = 0; n < loops; ++n)
+		h ^= XXH64(jobs[n % BATCH].input, size, SEED);
+	single = (double)size * loops / elapsed(&tv1) / 1000000.0;
+
+	gettimeofday(&tv1, NULL);
+	for (n = 0; n < loops; n += BATCH) {
+		if (XXH64_verifyBatch(jobs, BATCH, SEED, NULL) != 0)
+			printf("    unexpected mismatch\n");
+	}
+	batch = (double)size * n / elapsed(&tv1) / 1000000.0;
+
+	printf("    %8zu bytes %10.1f MB/s XXH64 %10.1f MB/s batched\n",
+		size, single, batch);
+}
+
+int
+main(int ac, char **av)
+{
+	static const size_t defsizes[] = { 65536 };
+	unsigned char *buf;
+	const char *engine = NULL;
+	const char *best;
+	size_t *sizes;
+	size_t nsizes;
+	size_t i;
+	long total = 1024;
+	int errors = 0;
+	int ch;
+	int j;
+
+	while ((ch = getopt(ac, av, "e:n:")) != -1) {
+		switch(ch) {
+		case 'e':
+			engine = optarg;
+			break;
+		case 'n':
+			total = strtol(optarg, NULL, 0);
+			if (total < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	ac -= optind;
+	av += optind;
+
+	if (ac) {
+		nsizes = ac;
+		sizes = calloc(nsizes, sizeof(*sizes));
+		for (i = 0; i < nsizes; ++i) {
+			sizes[i] = strtoul(av[i], NULL, 0);
+			if (sizes[i] == 0 || sizes[i] > BUFSIZE / 2)
+				usage();
+		}
+	} else {
+		nsizes = sizeof(defsizes) / sizeof(defsizes[0]);
+		sizes = calloc(nsizes, sizeof(*sizes));
+		memcpy(sizes, defsizes, sizeof(defsizes));
+	}
+
+	buf = malloc(BUFSIZE);
+	srandom(1);
+	for (i = 0; i < BUFSIZE; ++i)
+		buf[i] = random();
+
+	best = XXH64_engineName();
+	printf("default engine: %s\n", best);
+
+	for (j = 0; Engines[j]; ++j) {
+		if (engine && strcmp(engine, Engines[j]) != 0)
+			continue;
+		if (XXH64_selectEngine(Engines[j]) < 0) {
+			printf("%s: not supported\n", Engines[j]);
+			continue;
+		}
+		printf("%s:\n", Engines[j]);
+		if (verify(buf)) {
+			++errors;
+			continue;
+		}
+		for (i = 0; i < nsizes; ++i)
+			bench(buf, sizes[i], total * 1000000);
+	}
+	XXH64_selectEngine(best);
+
+	return(errors ? 1 : 0);
+}
+
+static
+void
+usage(void)
+{
+	fprintf(stderr,
+		"bench_xxhash [-e engine] [-n megabytes] [size ...]\n");
+	exit(1);
+}
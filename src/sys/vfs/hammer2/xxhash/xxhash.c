@@ -520,6 +520,285 @@ XXH_PUBLIC_API unsigned long long XXH64 (const void* input, size_t len, unsigned
 #endif
 }
 
+/* **************************************************
+*  Batch verification
+****************************************************/
+
+/* XXH64_verifyBatch() checks many independent (buffer, expected hash)
+ * pairs in one call.  A single XXH64 stream is a chain of dependent 64-bit
+ * multiplies and does not get faster with SIMD, but independent buffers
+ * do : one vector register holds the same accumulator of several buffers,
+ * which run their 32-byte stripes in lock step.  A lane is refilled from
+ * the queue as soon as its buffer runs out of stripes, the remaining
+ * (<32 byte) tail and the final avalanche are done by the scalar code, so
+ * results are bit-identical to XXH64().
+ *
+ * Engines are "scalar" and "avx512" (16 lanes, native vpmullq), avx512 is
+ * selected at startup when the CPU has AVX-512DQ.  There is no AVX2 engine,
+ * AVX2 lacks a 64-bit multiply and the synthesized one is slower than the
+ * scalar code.
+ */
+
+static U64 XXH64_finishLanes(const U64 v[4], const BYTE* p, const BYTE* bEnd, size_t len)
+{
+    U64 h64;
+
+    h64 = XXH_rotl64(v[0], 1) + XXH_rotl64(v[1], 7) + XXH_rotl64(v[2], 12) + XXH_rotl64(v[3], 18);
+    h64 = XXH64_mergeRound(h64, v[0]);
+    h64 = XXH64_mergeRound(h64, v[1]);
+    h64 = XXH64_mergeRound(h64, v[2]);
+    h64 = XXH64_mergeRound(h64, v[3]);
+    h64 += (U64) len;
+
+    while (p+8<=bEnd) {
+        U64 const k1 = XXH64_round(0, XXH_readLE64(p, XXH_littleEndian));
+        h64 ^= k1;
+        h64  = XXH_rotl64(h64,27) * PRIME64_1 + PRIME64_4;
+        p+=8;
+    }
+
+    if (p+4<=bEnd) {
+        h64 ^= (U64)(XXH_readLE32(p, XXH_littleEndian)) * PRIME64_1;
+        h64 = XXH_rotl64(h64, 23) * PRIME64_2 + PRIME64_3;
+        p+=4;
+    }
+
+    while (p<bEnd) {
+        h64 ^= (*p) * PRIME64_5;
+        h64 = XXH_rotl64(h64, 11) * PRIME64_1;
+        p++;
+    }
+
+    h64 ^= h64 >> 33;
+    h64 *= PRIME64_2;
+    h64 ^= h64 >> 29;
+    h64 *= PRIME64_3;
+    h64 ^= h64 >> 32;
+
+    return h64;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_KERNEL)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define XXH_MB_MAXLANES 16
+
+/* The AVX-512 version runs 16 lanes as two interleaved groups of 8, to
+ * cover the latency of vpmullq.  Each lane's 32-byte stripe is loaded and
+ * the 8x4 words of a group are transposed into its 4 accumulator vectors. */
+__attribute__((target("avx512f,avx512dq")))
+static void XXH64_stripes_avx512(U64 acc[4][XXH_MB_MAXLANES], const BYTE** p, size_t stripes)
+{
+    const __m512i idx02 = _mm512_setr_epi64(0, 1, 8, 9, 4, 5, 12, 13);
+    const __m512i idx13 = _mm512_setr_epi64(2, 3, 10, 11, 6, 7, 14, 15);
+    const __m512i prime1 = _mm512_set1_epi64(PRIME64_1);
+    const __m512i prime2 = _mm512_set1_epi64(PRIME64_2);
+    __m512i v[2][4], in[4], z[4], lo[2], hi[2];
+    size_t off = 0;
+    int g, i, k;
+
+    for (g = 0; g < 2; g++)
+        for (k = 0; k < 4; k++)
+            v[g][k] = _mm512_loadu_si512((const void*)&acc[k][g * 8]);
+    while (stripes--) {
+        for (g = 0; g < 2; g++) {
+            const BYTE* const* const gp = p + g * 8;
+
+            /* z[i] = lane i stripe | lane i+4 stripe */
+            for (i = 0; i < 4; i++) {
+                z[i] = _mm512_inserti64x4(
+                    _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i*)(gp[i] + off))),
+                    _mm256_loadu_si256((const __m256i*)(gp[i + 4] + off)), 1);
+            }
+            lo[0] = _mm512_unpacklo_epi64(z[0], z[1]);
+            hi[0] = _mm512_unpackhi_epi64(z[0], z[1]);
+            lo[1] = _mm512_unpacklo_epi64(z[2], z[3]);
+            hi[1] = _mm512_unpackhi_epi64(z[2], z[3]);
+            in[0] = _mm512_permutex2var_epi64(lo[0], idx02, lo[1]);
+            in[1] = _mm512_permutex2var_epi64(hi[0], idx02, hi[1]);
+            in[2] = _mm512_permutex2var_epi64(lo[0], idx13, lo[1]);
+            in[3] = _mm512_permutex2var_epi64(hi[0], idx13, hi[1]);
+            for (k = 0; k < 4; k++) {
+                v[g][k] = _mm512_add_epi64(v[g][k], _mm512_mullo_epi64(in[k], prime2));
+                v[g][k] = _mm512_rol_epi64(v[g][k], 31);
+                v[g][k] = _mm512_mullo_epi64(v[g][k], prime1);
+            }
+        }
+        off += 32;
+    }
+    for (g = 0; g < 2; g++)
+        for (k = 0; k < 4; k++)
+            _mm512_storeu_si512((void*)&acc[k][g * 8], v[g][k]);
+    for (i = 0; i < 16; i++)
+        p[i] += off;
+}
+
+typedef void (*XXH64_stripes_f)(U64 acc[4][XXH_MB_MAXLANES], const BYTE** p, size_t stripes);
+
+static XXH64_stripes_f XXH64_stripes;
+static int XXH64_lanes;
+static const char* XXH64_engine = "scalar";
+
+static int XXH_cpuHas(const char* isa)
+{
+    unsigned eax, ebx, ecx, edx;
+    unsigned xcr0;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+        return 0;
+    if ((ecx & bit_OSXSAVE) == 0 || (ecx & bit_AVX) == 0)
+        return 0;
+    __asm __volatile("xgetbv" : "=a" (xcr0), "=d" (edx) : "c" (0));
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) == 0)
+        return 0;
+    if (strcmp(isa, "avx512") == 0)     /* YMM, opmask and ZMM state */
+        return (xcr0 & 0xE6) == 0xE6 && (ebx & bit_AVX512F) && (ebx & bit_AVX512DQ);
+    return 0;
+}
+
+XXH_PUBLIC_API int XXH64_selectEngine(const char* name)
+{
+    if (name == NULL) {
+        if (XXH64_selectEngine("avx512") == 0)
+            return 0;
+        name = "scalar";
+    }
+    if (strcmp(name, "scalar") == 0) {
+        XXH64_stripes = NULL;
+        XXH64_lanes = 1;
+        XXH64_engine = "scalar";
+    } else if (strcmp(name, "avx512") == 0 && XXH_cpuHas(name)) {
+        XXH64_stripes = XXH64_stripes_avx512;
+        XXH64_lanes = 16;
+        XXH64_engine = "avx512";
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void XXH64_initEngine(void) __attribute__((constructor));
+static void XXH64_initEngine(void)
+{
+    XXH64_selectEngine(NULL);
+}
+
+static size_t XXH64_verifyLanes(const XXH64_verify_t* jobs, size_t count, unsigned long long seed, unsigned char* bad)
+{
+    U64 acc[4][XXH_MB_MAXLANES];
+    U64 v[4];
+    const BYTE* p[XXH_MB_MAXLANES];
+    const XXH64_verify_t* lane[XXH_MB_MAXLANES];
+    size_t left[XXH_MB_MAXLANES];
+    size_t next = 0;
+    size_t nbad = 0;
+    size_t n;
+    int nlanes = XXH64_lanes;
+    int active;
+    int i, j, k;
+
+    for (i = 0; i < nlanes; i++)
+        lane[i] = NULL;
+
+    for (;;) {
+        /* refill idle lanes, short buffers go straight to XXH64() */
+        active = 0;
+        for (i = 0; i < nlanes; i++) {
+            while (lane[i] == NULL && next < count) {
+                const XXH64_verify_t* job = &jobs[next];
+                if (job->length < 32) {
+                    int const b = XXH64(job->input, job->length, seed) != job->expected;
+                    if (bad) bad[next] = b;
+                    nbad += b;
+                } else {
+                    lane[i] = job;
+                    p[i] = (const BYTE*)job->input;
+                    left[i] = job->length / 32;
+                    acc[0][i] = seed + PRIME64_1 + PRIME64_2;
+                    acc[1][i] = seed + PRIME64_2;
+                    acc[2][i] = seed + 0;
+                    acc[3][i] = seed - PRIME64_1;
+                }
+                next++;
+            }
+            if (lane[i]) active++;
+        }
+        if (active == 0)
+            break;
+
+        /* idle lanes shadow an active one, their result is unused */
+        n = (size_t)-1;
+        for (i = 0; i < nlanes; i++)
+            if (lane[i] && left[i] < n) n = left[i];
+        for (i = 0; i < nlanes; i++) {
+            if (lane[i]) continue;
+            for (j = 0; lane[j] == NULL; j++) ;
+            p[i] = p[j];
+        }
+        XXH64_stripes(acc, p, n);
+
+        for (i = 0; i < nlanes; i++) {
+            const XXH64_verify_t* job = lane[i];
+            const BYTE* const bStart = job ? (const BYTE*)job->input : NULL;
+            int b;
+
+            if (job == NULL) continue;
+            left[i] -= n;
+            if (left[i]) continue;
+            for (k = 0; k < 4; k++)
+                v[k] = acc[k][i];
+            b = XXH64_finishLanes(v, p[i], bStart + job->length, job->length) != job->expected;
+            if (bad) bad[job - jobs] = b;
+            nbad += b;
+            lane[i] = NULL;
+        }
+    }
+    return nbad;
+}
+
+#else
+
+XXH_PUBLIC_API int XXH64_selectEngine(const char* name)
+{
+    if (name == NULL || strcmp(name, "scalar") == 0)
+        return 0;
+    return -1;
+}
+
+#endif
+
+/* Verify count buffers against their expected XXH64 hash, all computed
+ * with the same seed.  Returns the number of mismatches, if bad is not
+ * NULL bad[i] is set to 1 for a mismatching jobs[i] and to 0 otherwise. */
+XXH_PUBLIC_API size_t XXH64_verifyBatch(const XXH64_verify_t* jobs, size_t count, unsigned long long seed, unsigned char* bad)
+{
+    size_t nbad = 0;
+    size_t i;
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_KERNEL)
+    if (XXH64_stripes != NULL && count > 1)
+        return XXH64_verifyLanes(jobs, count, seed, bad);
+#endif
+    for (i = 0; i < count; i++) {
+        int const b = XXH64(jobs[i].input, jobs[i].length, seed) != jobs[i].expected;
+        if (bad) bad[i] = b;
+        nbad += b;
+    }
+    return nbad;
+}
+
+XXH_PUBLIC_API const char* XXH64_engineName(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_KERNEL)
+    return XXH64_engine;
+#else
+    return "scalar";
+#endif
+}
+
+
 
 /* **************************************************
 *  Advanced Hash Functions
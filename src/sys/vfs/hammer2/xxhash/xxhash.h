@@ -137,6 +137,9 @@ regular symbol name will be automatically translated by this header.
 #  define XXH64_update XXH_NAME2(XXH_NAMESPACE, XXH64_update)
 #  define XXH32_digest XXH_NAME2(XXH_NAMESPACE, XXH32_digest)
 #  define XXH64_digest XXH_NAME2(XXH_NAMESPACE, XXH64_digest)
+#  define XXH64_verifyBatch XXH_NAME2(XXH_NAMESPACE, XXH64_verifyBatch)
+#  define XXH64_selectEngine XXH_NAME2(XXH_NAMESPACE, XXH64_selectEngine)
+#  define XXH64_engineName XXH_NAME2(XXH_NAMESPACE, XXH64_engineName)
 #endif
 
 
@@ -172,6 +175,30 @@ XXH64() :
 */
 
 
+/* ****************************
+*  Batch Verification
+******************************/
+typedef struct {
+    const void*  input;
+    size_t       length;
+    XXH64_hash_t expected;
+} XXH64_verify_t;
+
+XXH_PUBLIC_API size_t XXH64_verifyBatch(const XXH64_verify_t* jobs, size_t count, unsigned long long seed, unsigned char* bad);
+XXH_PUBLIC_API int XXH64_selectEngine(const char* name);
+XXH_PUBLIC_API const char* XXH64_engineName(void);
+
+/*!
+XXH64_verifyBatch() :
+    Compare the XXH64() of each of "count" buffers with its "expected" value.
+    Returns the number of mismatches.  If "bad" is not NULL, bad[i] is set to 1 when jobs[i] mismatches and to 0 otherwise.
+    Independent buffers are hashed several at a time with SIMD (AVX-512) when the CPU supports it, the result is identical to calling XXH64().
+XXH64_selectEngine() :
+    Force the engine used by XXH64_verifyBatch(), "scalar" or "avx512", or the best available with NULL.
+    Returns 0 on success, -1 if the CPU does not support it.
+*/
+
+
 /* ****************************
 *  Streaming Hash Functions
 ******************************/
@@ -168,17 +168,13 @@ read_media(FILE *fp, const hammer2_blockref_t *bref, size_t *media_bytes)
 		return (NULL);
 	}
 
-	if (fseek(fp, io_base, SEEK_SET) == -1) {
-		warnx("hammer2: failed to seek media");
-		return (NULL);
-	}
 	media = read_buf(fp, io_base, io_bytes);
 	if (media == NULL) {
 		warnx("hammer2: failed to read media");
 		return (NULL);
 	}
 	if (boff)
-		memcpy(media, (char *)media + boff, bytes);
+		memmove(media, (char *)media + boff, bytes);
 
 	return (media);
 }